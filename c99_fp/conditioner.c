@@ -0,0 +1,210 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "detector.h"
+#include "conditioner.h"
+
+
+/* Declarations */
+
+void
+conditioner_init(
+        Conditioner* c,
+        uint8_t tooth_dists[const],
+        const size_t num_tooth_tips
+        );
+
+bool
+conditioner_push(
+        Conditioner* c,
+        const uint32_t timer_register,
+        ConditionedPeriod* const out
+        );
+
+void
+conditioner_interrupt(
+        uint32_t timer_register,
+        Conditioner* c,
+        Detector* d
+        );
+
+void
+conditioner_remember(
+        Conditioner* c,
+        const uint32_t period
+        );
+
+
+/* Definitions */
+
+/* void conditioner_init - set up a conditioner for a tooth pattern
+ *
+ * arguments: Conditioner* c          - the conditioner
+ *            uint8_t tooth_dists[]   - the tooth distances, as given to detector_init
+ *            size_t num_tooth_tips   - number of them
+ * returns: nothing
+ * side-effects: modifies *c
+ *
+ * The median could be the period of the shortest or of the longest tooth
+ * distance, so the believable range around it has to stretch by their ratio
+ * either way, then by the slack for speed changes. The long end stretches
+ * twice as far again, for a missed tooth, which the detector can make sense
+ * of and shouldn't be discounted.
+ */
+void
+conditioner_init(
+        Conditioner* c,
+        uint8_t tooth_dists[const],
+        const size_t num_tooth_tips
+        )
+{
+    uint8_t shortest = tooth_dists[0];
+    uint8_t longest = tooth_dists[0];
+
+    for (size_t i = 1; i < num_tooth_tips; i++)
+    {
+        if (tooth_dists[i] < shortest)
+            shortest = tooth_dists[i];
+        if (tooth_dists[i] > longest)
+            longest = tooth_dists[i];
+    }
+
+    float span = (float)longest / (float)shortest * CONDITIONER_DEFAULT_SLACK;
+
+    c->window_head = 0;
+    c->window_fill = 0;
+    c->median = 0;
+    c->pending = 0;
+    c->pending_count = 0;
+    c->low = 1 / span;
+    c->high = 2 * span;
+    c->glitch_share = CONDITIONER_DEFAULT_GLITCH_SHARE;
+    c->outlier_weight = CONDITIONER_DEFAULT_OUTLIER_WEIGHT;
+    c->passed = 0;
+    c->glitches = 0;
+    c->outliers = 0;
+
+    return;
+}
+
+/* bool conditioner_push - condition a period
+ *
+ * arguments: Conditioner* c          - the conditioner
+ *            uint32_t timer_register - the period that just ended
+ *            ConditionedPeriod* out  - where to put the period to pass on
+ * returns: false if the period was a glitch and there's nothing to pass on yet
+ * side-effects: modifies *c, and *out if it returns true
+ *
+ * A run of glitches adds up until it's long enough not to be one, so a burst
+ * of noise that happens to span a whole tooth still comes out as one period.
+ */
+bool
+conditioner_push(
+        Conditioner* c,
+        const uint32_t timer_register,
+        ConditionedPeriod* const out
+        )
+{
+    uint32_t period = c->pending + timer_register;
+
+    if (c->window_fill == CONDITIONER_MEDIAN_LEN
+        && (float)period < c->glitch_share * c->low * (float)c->median)
+    {
+        c->pending = period;
+        if (c->pending_count < UINT8_MAX)
+            c->pending_count++;
+        c->glitches++;
+        return false;
+    }
+
+    out->period = period;
+    out->weight = 1.0;
+    out->flags = (c->pending_count > 0) ? CONDITIONER_MERGED : 0;
+    out->glitches = c->pending_count;
+    c->pending = 0;
+    c->pending_count = 0;
+
+    if (c->window_fill == CONDITIONER_MEDIAN_LEN)
+    {
+        if ((float)period < c->low * (float)c->median)
+            out->flags |= CONDITIONER_SHORT;
+        else if ((float)period > c->high * (float)c->median)
+            out->flags |= CONDITIONER_LONG;
+
+        if (out->flags & (CONDITIONER_SHORT | CONDITIONER_LONG))
+        {
+            out->weight = c->outlier_weight;
+            c->outliers++;
+        }
+    }
+
+    /* Outliers go into the median too, or a real change of speed would be
+     * flagged for ever; it takes a majority of them to move it. */
+    conditioner_remember(c, period);
+    c->passed++;
+
+    return true;
+}
+
+/* void conditioner_interrupt - condition a period and hand it to the detector
+ *
+ * arguments: uint32_t timer_register - the period that just ended
+ *            Conditioner* c          - the conditioner
+ *            Detector* d             - the detector to hand it to
+ * returns: nothing
+ * side-effects: modifies *c, and d unless the period was a glitch
+ */
+void
+conditioner_interrupt(
+        uint32_t timer_register,
+        Conditioner* c,
+        Detector* d
+        )
+{
+    ConditionedPeriod out;
+
+    if (conditioner_push(c, timer_register, &out))
+        detector_interrupt_weighted(out.period, out.weight, d);
+
+    return;
+}
+
+/* void conditioner_remember - add a period to the median's window
+ *
+ * arguments: Conditioner* c   - the conditioner
+ *            uint32_t period  - a period just passed on
+ * returns: nothing
+ * side-effects: modifies c->window and c->median
+ *
+ * Sorting a copy of CONDITIONER_MEDIAN_LEN periods is a handful of compares,
+ * and far cheaper than the update it might save.
+ */
+void
+conditioner_remember(
+        Conditioner* c,
+        const uint32_t period
+        )
+{
+    uint32_t sorted[CONDITIONER_MEDIAN_LEN];
+
+    c->window[c->window_head] = period;
+    c->window_head = (c->window_head + 1 == CONDITIONER_MEDIAN_LEN) ? 0 : c->window_head + 1;
+    if (c->window_fill < CONDITIONER_MEDIAN_LEN)
+        c->window_fill++;
+    if (c->window_fill < CONDITIONER_MEDIAN_LEN)
+        return;
+
+    for (size_t i = 0; i < CONDITIONER_MEDIAN_LEN; i++)
+    {
+        uint32_t x = c->window[i];
+        size_t j = i;
+
+        for (; j > 0 && sorted[j - 1] > x; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = x;
+    }
+    c->median = sorted[CONDITIONER_MEDIAN_LEN / 2];
+
+    return;
+}
@@ -0,0 +1,83 @@
+/* An input stage ahead of the detector that cleans up periods before they
+ * cost a belief update.
+ *
+ * Two kinds of junk get through a real trigger input:
+ *
+ *   - glitches: a noise pulse splits a period in two, one part far too short
+ *     to be a tooth at any believable speed (523 ticks among 400000s). The
+ *     short part is held back and added to the next period, so the detector
+ *     sees the period the glitch split, and never runs an update for it.
+ *   - outliers: periods further from the last few than the tooth pattern and
+ *     any believable acceleration allow. They still go to the detector, since
+ *     the wheel did move, but flagged and with a lower weight (see
+ *     detector_interrupt_weighted).
+ *
+ * Both are judged against the median of the last CONDITIONER_MEDIAN_LEN
+ * periods passed on, which one bad period can't drag around; until there are
+ * that many, periods are passed on as they are. Each period costs O(1). */
+
+/* Periods the median is taken over */
+#define CONDITIONER_MEDIAN_LEN 5
+
+/* Speed change allowed over the median's periods, as a ratio */
+#define CONDITIONER_DEFAULT_SLACK 1.5
+
+/* Share of the shortest believable period below which a pulse is a glitch */
+#define CONDITIONER_DEFAULT_GLITCH_SHARE 0.25
+
+/* Weight of a period flagged as an outlier */
+#define CONDITIONER_DEFAULT_OUTLIER_WEIGHT 0.25
+
+/* Flags on a conditioned period */
+#define CONDITIONER_MERGED 0x01     /* glitches were merged into it */
+#define CONDITIONER_SHORT  0x02     /* shorter than the median allows */
+#define CONDITIONER_LONG   0x04     /* longer than the median allows, even for a missed tooth */
+
+/* A period as passed on to the detector */
+typedef struct {
+    uint32_t period;            // ticks, including any glitches merged into it
+    float    weight;            // confidence in it, for detector_interrupt_weighted
+    uint8_t  flags;             // CONDITIONER_*
+    uint8_t  glitches;          // glitch pulses merged into it, saturating
+} ConditionedPeriod;
+
+typedef struct {
+    uint32_t window[CONDITIONER_MEDIAN_LEN];    // the last periods passed on, as a ring
+    uint8_t  window_head;       // where the next one goes
+    uint8_t  window_fill;       // how many there are, up to CONDITIONER_MEDIAN_LEN
+    uint32_t median;            // of window, once it's full
+
+    uint32_t pending;           // ticks of glitches not merged into a period yet
+    uint8_t  pending_count;     // how many glitches, saturating
+
+    float    low;               // shortest believable period, as a share of the median
+    float    high;              // longest, allowing for one missed tooth
+    float    glitch_share;      // CONDITIONER_DEFAULT_GLITCH_SHARE unless changed
+    float    outlier_weight;    // CONDITIONER_DEFAULT_OUTLIER_WEIGHT unless changed
+
+    uint64_t passed;            // periods passed on
+    uint64_t glitches;          // pulses merged away
+    uint64_t outliers;          // periods flagged CONDITIONER_SHORT or CONDITIONER_LONG
+} Conditioner;
+
+
+/* Set up a conditioner for a tooth pattern */
+void
+conditioner_init(
+        Conditioner* c,
+        uint8_t tooth_dists[const],
+        const size_t num_tooth_tips);
+
+/* Condition a period; returns false if it was a glitch, held back to merge into the next */
+bool
+conditioner_push(
+        Conditioner* c,
+        const uint32_t timer_register,
+        ConditionedPeriod* const out);
+
+/* Condition a period and hand whatever comes out to the detector */
+void
+conditioner_interrupt(
+        uint32_t timer_register,
+        Conditioner* c,
+        Detector* d);
@@ -30,11 +30,15 @@ void debug_print_detector(const Detector* const d)
 #ifdef DEBUG
     printf("Detector <%lx>\n", (uintptr_t)d);
     if (d->has_sync) {
-        printf("  has sync on tooth %hhu\n", d->current_tooth);
+        printf("  has sync on tooth %u\n", (unsigned)d->current_tooth);
         printf("  confidence level %2.3f\n", d->confidence);
     }
     debug_print_tooth_map(d->tooth_dists, d->num_tooth_tips, "\ttooth_dists", "%hhu");
     debug_print_prob_dist_f(d->tooth_prob, d->num_tooth_tips, "\ttooth_prob", "%2.3f");
+    printf("\tinterrupts %" PRIu64 ", full/fast updates %" PRIu64 "/%" PRIu64
+           ", accel rejects %" PRIu64 ", sync acquired/lost %" PRIu64 "/%" PRIu64 "\n",
+           d->counters.interrupts, d->counters.full_updates, d->counters.fast_updates,
+           d->counters.accel_rejects, d->counters.sync_acquired, d->counters.sync_lost);
 #endif
 }
 
@@ -49,10 +53,10 @@ void debug_print_prob_dist_f(
 #ifdef DEBUG
     printf("%s = [", name);
     printf(spec, dist[0]);
-    for (uint8_t i = 1; i < num_bins; i++)
+    for (size_t i = 1; i < num_bins; i++)
     {
         printf(", ");
-        printf(spec, dist[i]*100);
+        printf(spec, dist[i]);
     }
     printf("]\n");
 #endif
@@ -68,7 +72,7 @@ void debug_print_tooth_map(
 #ifdef DEBUG
     printf("%s = [", name);
     printf(spec, map[0]);
-    for (uint8_t i = 1; i < num_bins; i++)
+    for (size_t i = 1; i < num_bins; i++)
     {
         printf(", ");
         printf(spec, map[i]);
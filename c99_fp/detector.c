@@ -6,9 +6,11 @@
 #include <stddef.h>
 
 #include "detector.h"
+#include "trace.h"
 
-#ifdef DEBUG
-#include "debug_print.h"
+#ifdef DETECTOR_PARALLEL
+#include <pthread.h>
+#include "parallel.h"
 #endif
 
 
@@ -16,6 +18,21 @@
 
 #define PI 3.14159265359
 
+/* Pattern signatures quantize each period ratio to half an octave, which is
+ * coarse enough to swallow ordinary tooth-to-tooth jitter but still tells a
+ * gap (2:1) apart from a regular tooth (1:1). */
+#define SIG_STEPS_PER_OCTAVE 2
+#define SIG_SYMBOL_BITS      4
+#define SIG_SYMBOL_LIMIT     7  /* symbols are clamped to +/- this, then offset to be non-zero */
+#define SIG_HASH_MULT        2654435761u
+
+/* Share of the belief replaced by a uniform one before replaying the history */
+#define DETECTOR_RELOC_FLATTEN 0.5
+
+/* A synced period this far from the one the tooth distances predict (half an
+ * octave, halfway to a whole missing tooth) counts as a sensor error */
+#define RATE_MISS_RATIO 1.41421356f
+
 
 /* Declarations */
 
@@ -23,28 +40,246 @@ void
 make_uniform_prob_dist(size_t n, float* a);
 
 void
+make_uniform_stats(
+        const size_t n,
+        DetectorStats* const stats
+        );
+
+bool
 detector_init(
         Detector* d,
         uint8_t tooth_dists[],
         size_t num_tooth_tips,
-        uint8_t num_tooth_posns,
+        size_t num_tooth_posns,
         float tooth_prob[],
         uint32_t sample_rate,
         float max_accel,
         float error_rate
         );
 
+void
+detector_init_history(
+        Detector* d,
+        uint32_t history[const],
+        const size_t history_size
+        );
+
+void
+detector_set_trace(
+        Detector* d,
+        struct TraceRing* r
+        );
+
+void
+detector_init_tooth_stats(
+        Detector* d,
+        DetectorToothStats tooth_stats[const]
+        );
+
+void
+detector_set_error_adaptation(
+        Detector* d,
+        const float rate_floor,
+        const float rate_ceiling,
+        const float alpha
+        );
+
+bool
+detector_init_cycle(
+        Detector* d,
+        float cycle_prob[const],
+        const detector_index_t cam_tooth
+        );
+
+void
+detector_cam_edge(Detector* d);
+
+void
+detector_init_angle(
+        Detector* d,
+        float tooth_angle[const]
+        );
+
+void
+detector_set_edge_time(
+        Detector* d,
+        const uint32_t timer_at_edge
+        );
+
+bool
+detector_init_sig_index(
+        Detector* d,
+        DetectorSigEntry sig_index[const],
+        const size_t sig_index_size,
+        const uint8_t sig_window
+        );
+
+bool
+detector_init_lik_lut(
+        Detector* d,
+        float lik_lut[const],
+        const uint8_t max_classes,
+        uint8_t lik_class[const],
+        const float ratio_sigma
+        );
+
+void
+detector_set_sync_thresholds(
+        Detector* d,
+        const float false_sync_prob,
+        const float miss_prob
+        );
+
+void
+detector_export_prior(
+        const Detector* const d,
+        uint8_t saved[]
+        );
+
+void
+detector_import_prior(
+        Detector* d,
+        uint8_t saved[const],
+        const float trust
+        );
+
+float
+detector_prior_trust(
+        const float age,
+        const float half_life
+        );
+
 void
 detector_interrupt(
         uint32_t timer_register,
         Detector* d
         );
 
+void
+detector_interrupt_weighted(
+        uint32_t timer_register,
+        const float weight,
+        Detector* d
+        );
+
+void
+detector_process_batch(
+        Detector* d,
+        uint32_t timers[const],
+        const size_t count
+        );
+
+uint32_t
+sig_symbol(
+        const uint32_t t0,
+        const uint32_t t1
+        );
+
+DetectorSigEntry*
+sig_index_slot(
+        DetectorSigEntry sig_index[const],
+        const size_t sig_index_size,
+        const uint32_t signature
+        );
+
+void
+make_peaked_prob_dist(
+        const size_t n,
+        const size_t peak,
+        const float error_rate,
+        float a[]
+        );
+
+void
+make_peaked_stats(
+        const size_t n,
+        const size_t peak,
+        const float error_rate,
+        DetectorStats* const stats
+        );
+
+float
+fast_log2f(const float x);
+
+float
+fast_exp2f(const float x);
+
+void
+sync_test_belief(Detector* d);
+
+void
+update_belief(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer
+        );
+
+void
+update_cycle_belief(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer
+        );
+
+bool
+detector_likelihood(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer,
+        float likelihood[]
+        );
+
+void
+temper_likelihood(
+        float likelihood[],
+        const size_t num_tooth_tips,
+        const float weight
+        );
+
+void
+apply_cam_evidence(Detector* d);
+
+void
+cycle_from_crank(
+        Detector* d,
+        const float phase1_prob
+        );
+
+void
+crank_from_cycle(
+        Detector* d,
+        float cycle[const]
+        );
+
+void
+update_track(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer
+        );
+
+bool
+update_sync(Detector* d);
+
+void
+detector_relocalize(Detector* d);
+
+void
+detector_drop_sync(Detector* d);
+
+int32_t
+detector_log2_ratio_q(
+        const uint32_t t0,
+        const uint32_t t1,
+        const uint8_t  steps_per_octave
+        );
+
 void
 detector_move(
         float* prior,
         size_t num_tooth_tips,
-        float error_rate,
+        float miss_rate,
+        float extra_rate,
         float* posterior
         );
 
@@ -53,13 +288,99 @@ detector_locate(
         float prior[const],
         uint8_t tooth_dists[const],
         const size_t num_tooth_tips,
-        const uint8_t num_tooth_posns,
+        const detector_index_t num_tooth_posns,
         const float max_accel,
         const uint32_t timer_value,
         const uint32_t prev_timer,
         const uint32_t ticks_per_sec,
         const float error_rate,
-        float posterior[]
+        float posterior[],
+        DetectorStats* const stats
+        );
+
+void
+detector_locate_lut(
+        float prior[const],
+        float lik_lut[const],
+        uint8_t lik_class[const],
+        const size_t num_tooth_tips,
+        const int32_t ratio_q,
+        float posterior[],
+        DetectorStats* const stats
+        );
+
+void
+detector_get_stats(
+        const Detector* const d,
+        DetectorStats* const stats
+        );
+
+void
+detector_snapshot(
+        const Detector* const d,
+        DetectorSnapshot* const snapshot
+        );
+
+void
+detector_get_counters(
+        const Detector* const d,
+        DetectorCounters* const counters
+        );
+
+bool
+detector_get_tooth_stats(
+        const Detector* const d,
+        const detector_index_t tooth,
+        float* const mean,
+        float* const variance
+        );
+
+void
+update_tooth_stats(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer
+        );
+
+void
+update_error_rates(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer
+        );
+
+void
+update_motion(
+        Detector* d,
+        const uint32_t timer
+        );
+
+void
+publish_motion(
+        Detector* d,
+        const uint32_t period
+        );
+
+float
+detector_angle_at(
+        const Detector* const d,
+        const uint32_t timer_now
+        );
+
+uint32_t
+detector_time_of_angle(
+        const Detector* const d,
+        const float angle
+        );
+
+void
+publish_snapshot(Detector* d);
+
+bool
+read_snapshot_slot(
+        const Detector* const d,
+        const uint32_t slot,
+        DetectorSnapshot* const snapshot
         );
 
 float
@@ -87,16 +408,34 @@ normalize_dist(
         float normalized[]
         );
 
+void
+normalize_dist_stats(
+        float posterior[const],
+        const size_t num_tooth_tips,
+        float normalized[],
+        DetectorStats* const stats
+        );
+
 void
 detector_find_max_prob(
         float prob_dist[const],
         size_t num_tooth_tips,
         float* const max_prob,
-        uint8_t* const max_bin
+        detector_index_t* const max_bin
+        );
+
+void
+detector_find_top2_prob(
+        float prob_dist[const],
+        const size_t num_tooth_tips,
+        float* const max_prob,
+        detector_index_t* const max_bin,
+        float* const second_prob,
+        detector_index_t* const second_bin
         );
 
 size_t count_tooth_posns(
-        uint8_t num_tooth_tips,
+        size_t num_tooth_tips,
         uint8_t tooth_dists[const]
         );
 
@@ -104,247 +443,1898 @@ size_t count_tooth_posns(
 /* Definitions */
 
 
-/* void detector_init - initialize a Detector struct
+/* bool detector_init - initialize a Detector struct
  *
  * arguments:    (too many to bother listing)
- * returns:      nothing
+ * returns:      false, leaving *d alone, if there are no teeth or more tooth
+ *               positions than a detector_index_t can count
  * side-effects: modifies *d
  */
-void
+bool
 detector_init(
         Detector* d,
         uint8_t tooth_dists[const],
         const size_t num_tooth_tips,
-        const uint8_t num_tooth_posns,
+        const size_t num_tooth_posns,
         float tooth_prob[const],
         const uint32_t sample_rate,
         const float max_accel,
         const float error_rate)
 {
+    if (num_tooth_tips == 0 || num_tooth_posns == 0 || num_tooth_posns > DETECTOR_INDEX_MAX)
+        return false;
+
     d->tooth_dists = tooth_dists;
     d->ticks_per_sec = sample_rate;
     d->num_tooth_tips = num_tooth_tips;
-    d->num_tooth_posns = num_tooth_posns;
+    d->num_tooth_posns = (detector_index_t)num_tooth_posns;
     d->tooth_prob = tooth_prob;
     d->max_accel = max_accel;
     d->error_rate = error_rate;
+    d->configured_error_rate = error_rate;
+    d->miss_rate = error_rate / 2;
+    d->extra_rate = error_rate / 2;
+    d->rate_alpha = 0.0;
     d->has_sync = false;
+    d->phase = false;
+    d->has_cycle_sync = false;
     d->confidence = 0.0;
+    d->current_tooth = 0;
+    d->previous_timer = 0;
+    d->period_weight = 1.0;
 
-    make_uniform_prob_dist(num_tooth_tips, d->tooth_prob);
+    d->sig_index = NULL;
+    d->sig_index_size = 0;
+    d->sig_window = 0;
+    d->sig_fill = 0;
+    d->sig_history = 0;
+    d->sig_seeded = false;
 
-    return;
+    d->lik_lut = NULL;
+    d->lik_class = NULL;
+    d->lik_num_classes = 0;
+
+    d->history = NULL;
+    d->history_size = 0;
+    d->history_head = 0;
+    d->history_count = 0;
+
+    detector_set_sync_thresholds(d, DETECTOR_DEFAULT_FALSE_SYNC_PROB, DETECTOR_DEFAULT_MISS_PROB);
+
+    make_uniform_prob_dist(num_tooth_tips, d->tooth_prob);
+    make_uniform_stats(num_tooth_tips, &(d->stats));
+
+    d->tooth_angle = NULL;
+    d->rad_per_posn = 2.0 * PI / (float)num_tooth_posns;
+    d->secs_per_tick = 1.0 / (float)sample_rate;
+    d->velocity = 0.0;
+    d->angular_accel = 0.0;
+    d->edge_time = 0;
+    d->motion_latest = 0;
+    publish_motion(d, 0);
+
+    d->snapshot_seq[0] = 0;
+    d->snapshot_seq[1] = 0;
+    d->snapshot_latest = 0;
+    publish_snapshot(d);
+
+    d->trace = NULL;
+    d->team = NULL;
+
+    d->counters = (DetectorCounters){ 0 };
+    d->tooth_stats = NULL;
+
+    d->cycle_prob = NULL;
+    d->cam_tooth = 0;
+    d->cam_pending = false;
+    d->phase_confidence = 0.5;
+
+    return true;
 }
 
-/* void detector_interrupt - execute a localization loop on the detector
+/* void detector_set_sync_thresholds - set the error probabilities of the sync decision
  *
- * arguments: uint32_t timer_register - value of the timer register
- *            Detetor* d              - the detector we're operating on
+ * arguments: Detector* d           - the detector to configure
+ *            float false_sync_prob - acceptable probability of declaring sync on the wrong tooth
+ *            float miss_prob       - acceptable probability of keeping sync we should have dropped
  * returns: nothing
  * side-effects: modifies d
+ *
+ * Sync is decided by a sequential probability ratio test. We accumulate the
+ * log-likelihood ratio of the leading hypothesis against the runner-up and
+ * stop as soon as it crosses one of Wald's thresholds:
+ *
+ *   accept = ln((1 - miss) / false_sync)    reject = ln(miss / (1 - false_sync))
+ *
+ * For given error probabilities, no other test decides in fewer teeth on
+ * average. The gap between the two thresholds is also our hysteresis: once
+ * synced, it takes several implausible teeth in a row, not just one, to walk
+ * the ratio down to the reject threshold.
+ *
+ * A synced detector stays synced, with its score at the new accept
+ * threshold, as if it had just acquired; otherwise the score starts over.
  */
 void
-detector_interrupt(
-        uint32_t timer_register,
-        Detector* d)
+detector_set_sync_thresholds(
+        Detector* d,
+        const float false_sync_prob,
+        const float miss_prob
+        )
 {
-    uint32_t timer = timer_register;
-    float prob_dist_tmp[d->num_tooth_tips];
-    float prediction_accel;
-    uint8_t previous_tooth = d->current_tooth;
-
-    detector_move(
-            d->tooth_prob,
-            d->num_tooth_tips,
-            d->error_rate,
-            prob_dist_tmp
-            );
-
-    detector_locate(
-            prob_dist_tmp,
-            d->tooth_dists,
-            d->num_tooth_tips,
-            d->num_tooth_posns,
-            d->max_accel,
-            timer,
-            d->previous_timer,
-            d->ticks_per_sec,
-            d->error_rate,
-            d->tooth_prob
-            );
-
-    detector_find_max_prob(
-            d->tooth_prob,
-            d->num_tooth_tips,
-            &(d->confidence),
-            &(d->current_tooth)
-            );
-
-    prediction_accel = detector_calc_accel(
-                                        d->ticks_per_sec,
-                                        d->num_tooth_posns,
-                                        d->previous_timer,
-                                        d->tooth_dists[previous_tooth],
-                                        timer,
-                                        d->tooth_dists[d->current_tooth]
-                                        );
-    d->last_acceleration = prediction_accel;
-
-    float fw_dist_rads = 2.0 * PI * (d->tooth_dists[d->current_tooth] / d->num_tooth_posns);
-    float timer_secs = timer / d->ticks_per_sec;
-    d->velocity = fw_dist_rads / timer_secs;
-
-    if (d->confidence > 0.98) /* FIXME magic number */
-    {
-        d->has_sync = true;
-    }
-    else
-    {
-
-    /* Confidence may have decayed due to many move()s, but the localization
-     * result is still correct, so we check the result for error and unset
-     * has_sync if we get something that's unlikely. */
-        if (fabsf(prediction_accel) > d->max_accel)
-            d->has_sync = false;
-    }
+    d->sync_accept = logf((1 - miss_prob) / false_sync_prob);
+    d->sync_reject = logf(miss_prob / (1 - false_sync_prob));
+    d->sync_llr = d->has_sync ? d->sync_accept : 0.0;
 
-    d->previous_timer = timer;
+    /* From the configured error_rate, not the learned one: the acceleration
+     * check disagrees with a correct track at real accelerations too, not
+     * just at sensor errors (see detector_set_error_adaptation) */
+    d->sync_step = logf((1 - d->configured_error_rate) / d->configured_error_rate);
 
     return;
 }
 
-
-
-
-/* void detector_locate - localize the probability distribution
+/* void detector_init_history - keep a ring of recent periods for relocalizing after sync loss
  *
- * arguments:    (too many to list)
- * returns:      nothing
- * side-effects: modifies data at *posterior
+ * arguments: Detector* d        - an initialized detector
+ *            uint32_t history[] - storage for the ring
+ *            size_t history_size - number of periods to keep
+ * returns: nothing
+ * side-effects: modifies d
  *
- * This function calculates a posterior probability distribution, given input
- * variable prior and the provided sensor (timing) data.
+ * Replaying the ring costs history_size full updates, all at once, when sync
+ * is lost. A revolution or two of periods is about right: enough to pass a
+ * distinctive tooth or two, and no more.
  */
-
 void
-detector_locate(
-        float prior[const],
-        uint8_t tooth_dists[const],
-        const size_t num_tooth_tips,
-        const uint8_t num_tooth_posns,
-        const float max_accel,
-        const uint32_t timer_value,
-        const uint32_t prev_timer,
-        const uint32_t ticks_per_sec,
-        const float error_rate,
-        float posterior[]
+detector_init_history(
+        Detector* d,
+        uint32_t history[const],
+        const size_t history_size
         )
 {
+    d->history = (history_size > 0) ? history : NULL;
+    d->history_size = history_size;
+    d->history_head = 0;
+    d->history_count = 0;
 
-    float prob_storage[num_tooth_tips];
-    float accel[num_tooth_tips]; /* scratch space */
-
-#ifdef DEBUG
-    debug_print_prob_dist_f(prior, num_tooth_tips, "detector_locate() :prior", "%2.1f");
-#endif
+    return;
+}
 
-    /* Unroll this loop a tiny bit to avoid doing math to work around around
+/* void detector_set_trace - record what the detector does into a trace ring
+ *
+ * arguments: Detector* d   - an initialized detector
+ *            TraceRing* r  - an initialized trace ring, or NULL to stop tracing
+ * returns: nothing
+ * side-effects: modifies d
+ *
+ * Every detector_interrupt then records the period, the belief after each
+ * phase (if the ring's belief_mode asks for it) and the sync decision.
+ */
+void
+detector_set_trace(
+        Detector* d,
+        struct TraceRing* r
+        )
+{
+    d->trace = r;
+    return;
+}
+
+/* void detector_init_tooth_stats - keep streaming statistics of the period at each tooth
+ *
+ * arguments: Detector* d                     - an initialized detector
+ *            DetectorToothStats tooth_stats[] - storage for num_tooth_tips entries, or NULL to stop
+ * returns: nothing
+ * side-effects: modifies d and the data at *tooth_stats
+ *
+ * While we have sync, each period is divided by the one before it and by the
+ * ratio of the two teeth's distances, so that a perfectly placed tooth on a
+ * steadily turning engine scores 1.0 whatever the speed. A tooth whose mean
+ * wanders from 1.0 is misplaced (or its edge is being detected late), and a
+ * tooth whose variance grows is a sensor or wiring problem in the making.
+ */
+void
+detector_init_tooth_stats(
+        Detector* d,
+        DetectorToothStats tooth_stats[const]
+        )
+{
+    d->tooth_stats = tooth_stats;
+    if (tooth_stats == NULL)
+        return;
+
+    for (size_t i = 0; i < d->num_tooth_tips; i++)
+        tooth_stats[i] = (DetectorToothStats){ 0 };
+
+    return;
+}
+
+/* void detector_set_error_adaptation - learn the miss and extra-edge rates while synced
+ *
+ * arguments: Detector* d        - an initialized detector
+ *            float rate_floor   - lowest either rate may go
+ *            float rate_ceiling - highest either rate may go
+ *            float alpha        - weight of each synced tooth in the estimate, in (0, 1); 0 stops learning
+ * returns: nothing
+ * side-effects: modifies d
+ *
+ * While we have sync we know which tooth each period should have ended at,
+ * and so how long it should have been relative to the one before. A period
+ * half an octave or more too long means an edge went missing; one that much
+ * too short means an extra edge split a period. Each rate is an exponential
+ * moving average of its kind of disagreement, starting from half of the
+ * configured error_rate each, and their sum replaces error_rate in
+ * detector_move and prob_of_move.
+ *
+ * Two things stay on the configured error_rate: the floor of the likelihood
+ * table, which is built once, and the sync decision's step, because the
+ * acceleration check also fails at real accelerations on a perfectly clean
+ * sensor, and a learned rate near zero would make every one of those cost us
+ * sync.
+ *
+ * The floor is what keeps a long run on a clean sensor from convincing us
+ * errors never happen, after which one glitch could shift the belief for
+ * good. 1/alpha is roughly the number of teeth the estimate averages over; a
+ * few revolutions' worth is about right.
+ */
+void
+detector_set_error_adaptation(
+        Detector* d,
+        const float rate_floor,
+        const float rate_ceiling,
+        const float alpha
+        )
+{
+    d->rate_floor = rate_floor;
+    d->rate_ceiling = (rate_ceiling > rate_floor) ? rate_ceiling : rate_floor;
+    d->rate_alpha = (alpha > 0 && alpha < 1) ? alpha : 0.0;
+
+    return;
+}
+
+/* bool detector_init_cycle - track engine phase from a cam input
+ *
+ * arguments: Detector* d         - an initialized detector
+ *            float cycle_prob[]  - storage for 2 * num_tooth_tips probabilities
+ *            detector_index_t cam_tooth - the tooth whose period the cam edge falls in
+ * returns: true if phase is now tracked, false if cam_tooth isn't on the wheel
+ * side-effects: modifies d and the data at *cycle_prob
+ *
+ * A four-stroke cycle is two crank revolutions, and the crank wheel alone
+ * can't tell them apart. With a cam input, the belief is kept over both:
+ * cycle_prob[i] for tooth i in the revolution the cam edge falls in (phase 0),
+ * cycle_prob[n + i] for tooth i in the other (phase 1). Going round the cycle
+ * is just going round this ring of 2n bins, so the move step is the usual one.
+ *
+ * The crank likelihood only depends on the tooth, not the phase, so it's still
+ * computed once per tooth and applied to both halves; the cam evidence only
+ * singles out one bin (see apply_cam_evidence). A belief twice the size costs
+ * a few more multiply-adds per tooth, not twice the work. tooth_prob stays the
+ * crank-only belief, and everything that works on it works as before.
+ *
+ * Pick a cam_tooth whose period the cam edge falls well inside of, not near
+ * either end; the cam sensor's timing against the crank drifts a little with
+ * speed.
+ */
+bool
+detector_init_cycle(
+        Detector* d,
+        float cycle_prob[const],
+        const detector_index_t cam_tooth
+        )
+{
+    d->cycle_prob = NULL;
+
+    if (cycle_prob == NULL || cam_tooth >= d->num_tooth_tips)
+        return false;
+
+    d->cycle_prob = cycle_prob;
+    d->cam_tooth = cam_tooth;
+    d->cam_pending = false;
+    cycle_from_crank(d, 0.5);
+
+    return true;
+}
+
+/* void detector_cam_edge - note a cam edge
+ *
+ * arguments: Detector* d - a detector tracking phase (see detector_init_cycle)
+ * returns: nothing
+ * side-effects: modifies d->cam_pending
+ *
+ * Call this from the cam input's interrupt. All it does is set a flag, which
+ * the next detector_interrupt takes as evidence about the period ending then.
+ */
+void
+detector_cam_edge(Detector* d)
+{
+    __atomic_store_n(&(d->cam_pending), true, __ATOMIC_RELAXED);
+    return;
+}
+
+/* void detector_init_angle - build the tooth angle table
+ *
+ * arguments: Detector* d          - an initialized detector
+ *            float tooth_angle[]  - storage for num_tooth_tips angles
+ * returns: nothing
+ * side-effects: modifies d and the data at *tooth_angle
+ *
+ * Without the table, detector_angle_at and detector_time_of_angle still work,
+ * but measure angle from the last tooth rather than from tooth 0.
+ */
+void
+detector_init_angle(
+        Detector* d,
+        float tooth_angle[const]
+        )
+{
+    float angle = 0.0;
+
+    /* tooth_dists[i] is the distance covered by the period ending at tooth i */
+    tooth_angle[0] = 0.0;
+    for (size_t i = 1; i < d->num_tooth_tips; i++)
+    {
+        angle += d->rad_per_posn * d->tooth_dists[i];
+        tooth_angle[i] = angle;
+    }
+
+    d->tooth_angle = tooth_angle;
+
+    return;
+}
+
+/* void detector_set_edge_time - tie the detector's clock to the caller's timer
+ *
+ * arguments: Detector* d            - an initialized detector
+ *            uint32_t timer_at_edge - the timer value captured at the tooth just passed to detector_interrupt
+ * returns: nothing
+ * side-effects: modifies d
+ *
+ * detector_interrupt is only given periods, so on its own the detector keeps
+ * time as the sum of the periods since the first tooth. Call this once, with
+ * the capture value of any tooth, and from then on the angle queries take and
+ * return values of the same free-running timer the periods were measured
+ * with. Both wrap around at 2^32 together.
+ */
+void
+detector_set_edge_time(
+        Detector* d,
+        const uint32_t timer_at_edge
+        )
+{
+    d->edge_time = timer_at_edge;
+    publish_motion(d, d->previous_timer);
+
+    return;
+}
+
+/* bool detector_init_sig_index - build the pattern-signature index for the wheel
+ *
+ * arguments: Detector* d                 - an initialized detector
+ *            DetectorSigEntry sig_index[] - storage for the hash table
+ *            size_t sig_index_size       - number of slots; must be a power of two, at least 2 * num_tooth_tips
+ *            uint8_t sig_window          - number of consecutive period ratios (k) per signature
+ * returns: true if the index was built, false if the arguments can't be used
+ * side-effects: modifies d and the data at *sig_index
+ *
+ * Every window of k consecutive tooth-to-tooth period ratios on the wheel is
+ * quantized into a signature and hashed, so that once the last k observed
+ * ratios match a signature belonging to exactly one position, we know where
+ * we are without waiting for the Bayesian filter to climb out of the uniform
+ * prior. On a 36-1 wheel with k = 1, for instance, the ratios around the gap
+ * are unique, so position is known on the second tooth after the gap.
+ */
+bool
+detector_init_sig_index(
+        Detector* d,
+        DetectorSigEntry sig_index[const],
+        const size_t sig_index_size,
+        const uint8_t sig_window
+        )
+{
+    d->sig_index = NULL;
+
+    if (sig_window == 0 || sig_window > DETECTOR_SIG_MAX_WINDOW)
+        return false;
+    if (sig_index_size < 2 * d->num_tooth_tips || (sig_index_size & (sig_index_size - 1)) != 0)
+        return false;
+
+    for (size_t i = 0; i < sig_index_size; i++)
+        sig_index[i].count = 0;
+
+    for (size_t i = 0; i < d->num_tooth_tips; i++)
+    {
+        uint32_t signature = 0;
+
+        /* the window ends at tooth i, oldest ratio first */
+        for (size_t w = sig_window; w > 0; w--)
+        {
+            size_t t1 = (i + d->num_tooth_tips * sig_window - (w - 1)) % d->num_tooth_tips;
+            size_t t0 = (t1 + d->num_tooth_tips - 1) % d->num_tooth_tips;
+            signature = (signature << SIG_SYMBOL_BITS)
+                        | sig_symbol(d->tooth_dists[t0], d->tooth_dists[t1]);
+        }
+
+        DetectorSigEntry* slot = sig_index_slot(sig_index, sig_index_size, signature);
+        if (slot->count == 0)
+        {
+            slot->signature = signature;
+            slot->tooth = i;
+        }
+        if (slot->count < UINT8_MAX)
+            slot->count++;
+    }
+
+    d->sig_index = sig_index;
+    d->sig_index_size = sig_index_size;
+    d->sig_window = sig_window;
+    d->sig_fill = 0;
+    d->sig_history = 0;
+
+    return true;
+}
+
+/* bool detector_init_lik_lut - build the quantized-ratio likelihood table
+ *
+ * arguments: Detector* d          - an initialized detector
+ *            float lik_lut[]      - storage for max_classes * DETECTOR_LIK_BINS likelihoods
+ *            uint8_t max_classes  - number of rows lik_lut has room for, at least 1; as a
+ *                                   uint8_t, it keeps every class index within lik_class's
+ *            uint8_t lik_class[]  - storage for num_tooth_tips class indices
+ *            float ratio_sigma    - standard deviation of period-ratio noise, in octaves
+ * returns: true if the table was built, false if max_classes is 0, ratio_sigma
+ *          isn't positive, or the wheel has more distinct tooth-distance ratios
+ *          than max_classes
+ * side-effects: modifies d and the data at *lik_lut and *lik_class
+ *
+ * The step model in prob_of_move only asks whether the implied acceleration is
+ * believable, so every plausible bin scores the same. Here each bin is scored
+ * by how close the observed period ratio is to the one expected at that tooth:
+ *
+ *   L = error_rate + (1 - error_rate) * exp(-(log2(observed / expected) / sigma)^2 / 2)
+ *
+ * Bins only differ by their expected ratio, and a wheel only has a handful of
+ * those (a 60-2 has three), so we tabulate L per distinct expected ratio over
+ * the quantized observed ratio. The per-bin cost is then a single table read.
+ * Leaving the error_rate floor in place keeps a bad reading from zeroing out
+ * the right answer, just as in the step model.
+ */
+bool
+detector_init_lik_lut(
+        Detector* d,
+        float lik_lut[const],
+        const uint8_t max_classes,
+        uint8_t lik_class[const],
+        const float ratio_sigma
+        )
+{
+    d->lik_lut = NULL;
+
+    if (max_classes == 0 || !(ratio_sigma > 0))
+        return false;
+
+    int32_t class_q[max_classes];
+    uint8_t num_classes = 0;
+
+    for (size_t i = 0; i < d->num_tooth_tips; i++)
+    {
+        size_t prev = (i + d->num_tooth_tips - 1) % d->num_tooth_tips;
+        int32_t q = detector_log2_ratio_q(d->tooth_dists[prev], d->tooth_dists[i], DETECTOR_LIK_STEPS_PER_OCTAVE);
+        uint8_t c = 0;
+
+        while (c < num_classes && class_q[c] != q)
+            c++;
+        if (c == num_classes)
+        {
+            if (num_classes == max_classes)
+                return false;
+            class_q[num_classes++] = q;
+        }
+        lik_class[i] = c;
+    }
+
+    for (uint8_t c = 0; c < num_classes; c++)
+    {
+        for (int32_t j = 0; j < DETECTOR_LIK_BINS; j++)
+        {
+            float z = (float)(j - DETECTOR_LIK_BINS / 2 - class_q[c])
+                      / ((float)DETECTOR_LIK_STEPS_PER_OCTAVE * ratio_sigma);
+            lik_lut[c * DETECTOR_LIK_BINS + j] = d->error_rate + (1 - d->error_rate) * expf(-0.5f * z * z);
+        }
+    }
+
+    d->lik_lut = lik_lut;
+    d->lik_class = lik_class;
+    d->lik_num_classes = num_classes;
+
+    return true;
+}
+
+/* void detector_export_prior - save a compact copy of the belief
+ *
+ * arguments: Detector* d     - the detector
+ *            uint8_t saved[] - storage for num_tooth_tips bytes
+ * returns: nothing
+ * side-effects: modifies the data at *saved
+ *
+ * Each bin is stored as a byte, scaled so the most likely tooth is 255. That's
+ * plenty of resolution for a starting guess, and it's small enough to stash
+ * in a few bytes of EEPROM or backup RAM when the engine stops.
+ *
+ * If we have sync, only the tooth we're tracking is saved. Between the
+ * distinctive teeth the belief diffuses with every move(), even though the
+ * sync test is still happy with the track, and a save of that smeared-out
+ * belief would throw away most of what we know.
+ */
+void
+detector_export_prior(
+        const Detector* const d,
+        uint8_t saved[]
+        )
+{
+    float scale = (d->stats.top_prob > 0) ? 255.0 / d->stats.top_prob : 0.0;
+
+    if (d->has_sync)    /* see above */
+        scale = 0.0;
+
+    for (size_t i = 0; i < d->num_tooth_tips; i++)
+        saved[i] = (uint8_t)(d->tooth_prob[i] * scale + 0.5f);
+
+    if (d->has_sync)
+        saved[d->current_tooth] = 255;
+
+    return;
+}
+
+/* void detector_import_prior - start from a saved belief instead of a uniform one
+ *
+ * arguments: Detector* d     - an initialized detector
+ *            uint8_t saved[] - num_tooth_tips bytes from detector_export_prior
+ *            float trust     - in [0, 1], clamped; 0 ignores saved entirely, 1 takes it as is
+ * returns: nothing
+ * side-effects: modifies d
+ *
+ * The saved belief is blended with the uniform one as
+ *
+ *   prior = trust * saved + (1 - trust) * uniform
+ *
+ * so a stale or dubious save only tilts the odds instead of pinning us to the
+ * wrong tooth. Call this after detector_init.
+ */
+void
+detector_import_prior(
+        Detector* d,
+        uint8_t saved[const],
+        const float trust
+        )
+{
+    float blended[d->num_tooth_tips];
+    float sum = 0.0;
+    float t = (trust > 0) ? ((trust < 1) ? trust : 1) : 0;     /* and NaN ignores saved */
+
+    for (size_t i = 0; i < d->num_tooth_tips; i++)
+        sum += saved[i];
+
+    if (sum == 0)       /* nothing worth keeping */
+        return;
+
+    float saved_scale = t / sum;
+    float uniform = (1 - t) / (float)d->num_tooth_tips;
+
+    for (size_t i = 0; i < d->num_tooth_tips; i++)
+        blended[i] = saved[i] * saved_scale + uniform;
+
+    normalize_dist_stats(blended, d->num_tooth_tips, d->tooth_prob, &(d->stats));
+    d->current_tooth = d->stats.top_bin;
+    d->confidence = d->stats.top_prob;
+    if (d->cycle_prob != NULL)
+        cycle_from_crank(d, 0.5);   /* we don't save phase; the cam will tell us soon enough */
+
+    /* A trusted save from a synced stop can be enough to call it sync now,
+     * and from then on every tooth is checked against the track as usual. */
+    sync_test_belief(d);
+    publish_snapshot(d);
+
+    return;
+}
+
+/* float detector_prior_trust - how much to trust a saved belief of a given age
+ *
+ * arguments: float age       - time since the belief was saved
+ *            float half_life - age at which the belief is worth half as much, in the same units
+ * returns: trust in [0, 1], for detector_import_prior
+ * side-effects: none
+ *
+ * Engines sit still when stopped, but someone may turn one over by hand (or
+ * a battery swap may leave the save from some other stop), so confidence in
+ * the saved position decays exponentially with age.
+ */
+float
+detector_prior_trust(
+        const float age,
+        const float half_life)
+{
+    if (age <= 0)
+        return 1.0;
+    if (half_life <= 0)
+        return 0.0;
+
+    return exp2f(-age / half_life);
+}
+
+/* void update_track - advance the belief and the tooth we're tracking by one period
+ *
+ * arguments: Detector* d         - the detector we're operating on
+ *            uint32_t timer      - the period that just ended
+ *            uint32_t prev_timer - the period before it, or 0 if there wasn't one
+ * returns: nothing
+ * side-effects: modifies d->tooth_prob, d->stats, d->current_tooth,
+ *               d->confidence and d->last_acceleration
+ */
+void
+update_track(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer)
+{
+    detector_index_t previous_tooth = d->current_tooth;
+
+    update_belief(d, timer, prev_timer);
+
+    d->confidence = d->stats.top_prob;
+    d->current_tooth = d->stats.top_bin;
+
+    d->last_acceleration = detector_calc_accel(
+                                        d->ticks_per_sec,
+                                        d->num_tooth_posns,
+                                        prev_timer,
+                                        d->tooth_dists[previous_tooth],
+                                        timer,
+                                        d->tooth_dists[d->current_tooth]
+                                        );
+    return;
+}
+
+/* bool update_sync - make the sync decision for the latest period
+ *
+ * arguments: Detector* d - the detector, after update_track
+ * returns: true if we just lost sync
+ * side-effects: modifies d->has_sync, d->sync_llr and d->sig_seeded
+ */
+bool
+update_sync(Detector* d)
+{
+    if (!d->has_sync && !d->sig_seeded)
+    {
+        sync_test_belief(d);
+        return false;
+    }
+
+    /* Confidence may have decayed due to many move()s, but the localization
+     * result is still correct, so we keep score of whether each tooth is
+     * consistent with the one before it. Each plausible tooth is evidence
+     * for our track, each implausible one against, at the odds our error
+     * rate gives. The score is capped at the accept threshold so a long
+     * run of good teeth doesn't make us deaf to a real loss later.
+     *
+     * That score alone can't notice a track that has slipped a tooth: the
+     * slipped track still sees mostly plausible teeth, and only the gap
+     * tells on it, once a revolution. So an implausible tooth costs us
+     * sync outright unless the belief itself is decisive about where we
+     * are, which is the rule we had before the score. */
+    if (fabsf(d->last_acceleration) > d->max_accel)
+    {
+        d->sync_llr -= d->period_weight * d->sync_step;
+        d->counters.accel_rejects++;
+
+        float belief_llr = (d->stats.second_prob > 0)
+                           ? logf(d->stats.top_prob / d->stats.second_prob)
+                           : d->sync_accept;
+        if (d->has_sync && d->period_weight >= 1 && belief_llr < d->sync_accept)
+            d->sync_llr = d->sync_reject;
+    }
+    else
+        d->sync_llr += d->period_weight * d->sync_step;
+
+    /* A seeded belief looks certain from the start, so it can't be judged
+     * on its own shape; it gets sync once the track has scored enough, or
+     * goes back to the belief test if the track falls apart. */
+    if (!d->has_sync)
+    {
+        if (d->sync_llr >= d->sync_accept)
+        {
+            d->has_sync = true;
+            d->counters.sync_acquired++;
+            d->sync_llr = d->sync_accept;
+            d->sig_seeded = false;
+        }
+        else if (d->sync_llr <= d->sync_reject)
+        {
+            d->sync_llr = 0.0;
+            d->sig_seeded = false;
+        }
+        return false;
+    }
+
+    if (d->sync_llr > d->sync_accept)
+        d->sync_llr = d->sync_accept;
+
+    if (d->sync_llr <= d->sync_reject)
+    {
+        d->has_sync = false;
+        d->counters.sync_lost++;
+        return true;
+    }
+
+    return false;
+}
+
+/* void update_belief - move the belief one tooth and localize it against a period
+ *
+ * arguments: Detector* d         - the detector we're operating on
+ *            uint32_t timer      - the period that just ended
+ *            uint32_t prev_timer - the period before it, or 0 if there wasn't one
+ * returns: nothing
+ * side-effects: modifies d->tooth_prob and d->stats
+ */
+void
+update_belief(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer)
+{
+    if (d->cycle_prob != NULL)
+    {
+        update_cycle_belief(d, timer, prev_timer);
+        return;
+    }
+
+#if defined(DETECTOR_PARALLEL) && !defined(SOFTMAX)
+    if (d->team != NULL && d->num_tooth_tips >= d->team->min_bins && d->period_weight >= 1)
+    {
+        parallel_update_belief(d->team, timer, prev_timer);
+
+        if (d->lik_lut == NULL)
+            d->counters.full_updates++;
+        else if (prev_timer != 0)
+            d->counters.fast_updates++;
+
+        if (d->trace != NULL)
+        {
+            trace_belief(d->trace, TRACE_BELIEF_MOVE, d->team->moved, d->num_tooth_tips);
+            trace_belief(d->trace, TRACE_BELIEF_LOCATE, d->tooth_prob, d->num_tooth_tips);
+        }
+        return;
+    }
+#endif
+
+    float prob_dist_tmp[d->num_tooth_tips];
+
+    detector_move(
+            d->tooth_prob,
+            d->num_tooth_tips,
+            d->miss_rate,
+            d->extra_rate,
+            prob_dist_tmp
+            );
+
+    if (d->trace != NULL)
+        trace_belief(d->trace, TRACE_BELIEF_MOVE, prob_dist_tmp, d->num_tooth_tips);
+
+    if (d->period_weight < 1)   /* see detector_interrupt_weighted */
+    {
+        float likelihood[d->num_tooth_tips];
+
+        if (detector_likelihood(d, timer, prev_timer, likelihood))
+        {
+            temper_likelihood(likelihood, d->num_tooth_tips, d->period_weight);
+            for (size_t i = 0; i < d->num_tooth_tips; i++)
+                prob_dist_tmp[i] *= likelihood[i];
+        }
+        normalize_dist_stats(prob_dist_tmp, d->num_tooth_tips, d->tooth_prob, &(d->stats));
+    }
+    else if (d->lik_lut == NULL)
+    {
+        detector_locate(
+                prob_dist_tmp,
+                d->tooth_dists,
+                d->num_tooth_tips,
+                d->num_tooth_posns,
+                d->max_accel,
+                timer,
+                prev_timer,
+                d->ticks_per_sec,
+                d->error_rate,
+                d->tooth_prob,
+                &(d->stats)
+                );
+        d->counters.full_updates++;
+    }
+    else if (prev_timer != 0)
+    {
+        detector_locate_lut(
+                prob_dist_tmp,
+                d->lik_lut,
+                d->lik_class,
+                d->num_tooth_tips,
+                detector_log2_ratio_q(prev_timer, timer, DETECTOR_LIK_STEPS_PER_OCTAVE),
+                d->tooth_prob,
+                &(d->stats)
+                );
+        d->counters.fast_updates++;
+    }
+    else    /* no ratio to go on yet */
+    {
+        normalize_dist_stats(prob_dist_tmp, d->num_tooth_tips, d->tooth_prob, &(d->stats));
+    }
+
+    if (d->trace != NULL)
+        trace_belief(d->trace, TRACE_BELIEF_LOCATE, d->tooth_prob, d->num_tooth_tips);
+
+    return;
+}
+
+/* void update_cycle_belief - update_belief, over both revolutions of the engine cycle
+ *
+ * arguments: Detector* d         - the detector we're operating on
+ *            uint32_t timer      - the period that just ended
+ *            uint32_t prev_timer - the period before it, or 0 if there wasn't one
+ * returns: nothing
+ * side-effects: modifies d->cycle_prob, d->tooth_prob, d->stats and the phase fields of d
+ */
+void
+update_cycle_belief(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer)
+{
+    size_t n = d->num_tooth_tips;
+    float cycle_tmp[2 * n];
+    float likelihood[n];
+
+    detector_move(
+            d->cycle_prob,
+            2 * n,
+            d->miss_rate,
+            d->extra_rate,
+            cycle_tmp
+            );
+
+    if (d->trace != NULL)
+    {
+        for (size_t i = 0; i < n; i++)
+            likelihood[i] = cycle_tmp[i] + cycle_tmp[n + i];
+        trace_belief(d->trace, TRACE_BELIEF_MOVE, likelihood, n);
+    }
+
+    if (detector_likelihood(d, timer, prev_timer, likelihood))
+    {
+        if (d->period_weight < 1)
+            temper_likelihood(likelihood, n, d->period_weight);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            cycle_tmp[i]     *= likelihood[i];
+            cycle_tmp[n + i] *= likelihood[i];
+        }
+    }
+
+    crank_from_cycle(d, cycle_tmp);
+
+    if (d->trace != NULL)
+        trace_belief(d->trace, TRACE_BELIEF_LOCATE, d->tooth_prob, n);
+
+    return;
+}
+
+/* bool detector_likelihood - the likelihood of a period at each tooth
+ *
+ * arguments: Detector* d         - the detector we're operating on
+ *            uint32_t timer      - the period that just ended
+ *            uint32_t prev_timer - the period before it, or 0 if there wasn't one
+ *            float likelihood[]  - storage for num_tooth_tips likelihoods
+ * returns: false if there's nothing to go on yet, and likelihood[] wasn't written
+ * side-effects: modifies the data at *likelihood and d->counters
+ *
+ * The same scores detector_locate and detector_locate_lut multiply the prior
+ * by, unnormalized, for callers that need to apply them to more than one bin
+ * per tooth.
+ */
+bool
+detector_likelihood(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer,
+        float likelihood[]
+        )
+{
+    size_t n = d->num_tooth_tips;
+
+    if (d->lik_lut == NULL)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            float accel = detector_calc_accel(
+                                d->ticks_per_sec,
+                                d->num_tooth_posns,
+                                prev_timer,
+                                d->tooth_dists[(i + n - 1) % n],
+                                timer,
+                                d->tooth_dists[i]
+                                );
+            likelihood[i] = prob_of_move(1.0, d->max_accel, accel, d->error_rate);
+        }
+        d->counters.full_updates++;
+        return true;
+    }
+
+    if (prev_timer == 0)
+        return false;
+
+    int32_t j = detector_log2_ratio_q(prev_timer, timer, DETECTOR_LIK_STEPS_PER_OCTAVE)
+                + DETECTOR_LIK_BINS / 2;
+
+    if (j < 0)                  /* as in detector_locate_lut */
+        j = 0;
+    if (j >= DETECTOR_LIK_BINS)
+        j = DETECTOR_LIK_BINS - 1;
+
+    const float* column = &(d->lik_lut[j]);
+
+    for (size_t i = 0; i < n; i++)
+        likelihood[i] = column[d->lik_class[i] * DETECTOR_LIK_BINS];
+    d->counters.fast_updates++;
+
+    return true;
+}
+
+/* void temper_likelihood - weaken a likelihood by how sure we are of the period
+ *
+ * arguments: float likelihood[]      - likelihoods from detector_likelihood
+ *            size_t num_tooth_tips   - number of them
+ *            float weight            - confidence in the period, in [0, 1]
+ * returns: nothing
+ * side-effects: modifies the data at *likelihood
+ *
+ * Raising each likelihood to the weight keeps their order but pulls them
+ * toward each other: at 1 they're as they were, at 0 they're all 1 and the
+ * period says nothing. Each power is exp2(weight * log2(likelihood)), which
+ * only costs the fast approximations.
+ */
+void
+temper_likelihood(
+        float likelihood[],
+        const size_t num_tooth_tips,
+        const float weight
+        )
+{
+    for (size_t i = 0; i < num_tooth_tips; i++)
+        likelihood[i] = fast_exp2f(weight * fast_log2f(likelihood[i]));
+
+    return;
+}
+
+/* void apply_cam_evidence - fold the presence or absence of a cam edge into the belief
+ *
+ * arguments: Detector* d - a detector tracking phase, before the period that just ended is applied
+ * returns: nothing
+ * side-effects: modifies d->cycle_prob, leaving it unnormalized, and clears d->cam_pending
+ *
+ * The cam edge is expected in exactly one bin's worth of the cycle: the period
+ * ending at cam_tooth in phase 0. Every other bin expects no edge. Whether or
+ * not there was one, every bin but that one gets the same likelihood, so up
+ * to normalization (which the next update does anyway) only that bin needs to
+ * be touched, by the odds the error rate gives.
+ *
+ * The belief still refers to the tooth before the period that just ended, so
+ * the bin to touch is the one before cam_tooth, in whichever phase that is.
+ */
+void
+apply_cam_evidence(Detector* d)
+{
+    size_t n = d->num_tooth_tips;
+    size_t bin = (d->cam_tooth + 2 * n - 1) % (2 * n);
+    bool cam = __atomic_exchange_n(&(d->cam_pending), false, __ATOMIC_RELAXED);
+    float odds = (1 - d->error_rate) / d->error_rate;
+
+    d->cycle_prob[bin] *= cam ? odds : 1 / odds;
+
+    return;
+}
+
+/* void cycle_from_crank - rebuild the cycle belief from the crank belief and a phase
+ *
+ * arguments: Detector* d       - a detector tracking phase
+ *            float phase1_prob - probability that we're in phase 1
+ * returns: nothing
+ * side-effects: modifies d->cycle_prob and the phase fields of d
+ *
+ * For when something other than the filter has just rewritten tooth_prob, such
+ * as the signature index or a warm start. Neither knows anything about phase.
+ */
+void
+cycle_from_crank(
+        Detector* d,
+        const float phase1_prob
+        )
+{
+    size_t n = d->num_tooth_tips;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        d->cycle_prob[i]     = (1 - phase1_prob) * d->tooth_prob[i];
+        d->cycle_prob[n + i] = phase1_prob * d->tooth_prob[i];
+    }
+
+    d->phase = phase1_prob > 0.5;
+    d->phase_confidence = d->phase ? phase1_prob : 1 - phase1_prob;
+    d->has_cycle_sync = d->has_cycle_sync && d->has_sync;
+
+    return;
+}
+
+/* void crank_from_cycle - normalize a cycle belief and take its crank and phase marginals
+ *
+ * arguments: Detector* d    - a detector tracking phase
+ *            float cycle[]  - unnormalized belief over 2 * num_tooth_tips bins
+ * returns: nothing
+ * side-effects: modifies d->cycle_prob, d->tooth_prob, d->stats and the phase fields of d
+ */
+void
+crank_from_cycle(
+        Detector* d,
+        float cycle[const]
+        )
+{
+    size_t n = d->num_tooth_tips;
+    float marginal[n];
+    float phase1 = 0.0;
+    float total = 0.0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        marginal[i] = cycle[i] + cycle[n + i];
+        phase1 += cycle[n + i];
+        total += marginal[i];
+    }
+
+    normalize_dist_stats(marginal, n, d->tooth_prob, &(d->stats));
+
+    if (total == 0)       /* as in normalize_dist_stats */
+        total = FLT_MAX;
+
+    float scale = 1.0 / total;
+    for (size_t i = 0; i < 2 * n; i++)
+        d->cycle_prob[i] = cycle[i] * scale;
+
+    phase1 *= scale;
+    d->phase = phase1 > 0.5;
+    d->phase_confidence = d->phase ? phase1 : 1 - phase1;
+
+    return;
+}
+
+/* void detector_relocalize - rebuild the belief from the period history
+ *
+ * arguments: Detector* d - the detector we're operating on
+ * returns: nothing
+ * side-effects: modifies d
+ *
+ * When we lose sync, the periods that made us lose it are already in the
+ * history ring, along with the ones before them. Rather than wait for fresh
+ * teeth to pull the belief toward the right tooth, we wind the belief back to
+ * the oldest period we still have, flatten it (it's just been shown to be
+ * suspect), and replay the whole history through the filter and the sync
+ * decision in one go. By the time we return the belief reflects everything
+ * we've seen, and if that's enough to call sync again, we have it.
+ */
+void
+detector_relocalize(Detector* d)
+{
+    size_t n = d->num_tooth_tips;
+    float rewound[n];
+
+    if (d->history == NULL || d->history_count < 2)
+        return;
+
+    size_t oldest = (d->history_head + d->history_size - d->history_count) % d->history_size;
+    size_t rewind = (d->history_count - 1) % n;
+    float uniform = DETECTOR_RELOC_FLATTEN / (float)n;
+
+    /* Assume the belief moved one tooth per period; anything else is what
+     * the flattening is for. */
+    if (d->cycle_prob == NULL)
+    {
+        for (size_t i = 0; i < n; i++)
+            rewound[i] = (1 - DETECTOR_RELOC_FLATTEN) * d->tooth_prob[(i + rewind) % n] + uniform;
+        for (size_t i = 0; i < n; i++)
+            d->tooth_prob[i] = rewound[i];
+    }
+    else
+    {
+        /* The cam edges aren't in the history, so only flatten within each
+         * phase, or we'd throw away what they told us. */
+        float cycle[2 * n];
+        size_t cycle_rewind = (d->history_count - 1) % (2 * n);
+        float phase1 = 0.0;
+
+        for (size_t i = 0; i < 2 * n; i++)
+            cycle[i] = d->cycle_prob[(i + cycle_rewind) % (2 * n)];
+        for (size_t i = n; i < 2 * n; i++)
+            phase1 += cycle[i];
+        for (size_t i = 0; i < n; i++)
+        {
+            cycle[i]     = (1 - DETECTOR_RELOC_FLATTEN) * cycle[i]     + (1 - phase1) * uniform;
+            cycle[n + i] = (1 - DETECTOR_RELOC_FLATTEN) * cycle[n + i] + phase1 * uniform;
+        }
+        crank_from_cycle(d, cycle);
+    }
+
+    d->current_tooth = (d->current_tooth + n - rewind) % n;
+    d->has_sync = false;
+    d->counters.relocalizations++;
+
+    /* The replayed periods were traced the first time round. The history
+     * doesn't keep their weights, so they're all taken at face value. */
+    struct TraceRing* trace = d->trace;
+    float weight = d->period_weight;
+    if (trace != NULL)
+        trace_record(trace, TRACE_RELOCALIZE, 0, NULL, 0);
+    d->trace = NULL;
+    d->period_weight = 1.0;
+
+    for (size_t k = 1; k < d->history_count; k++)
+    {
+        size_t j = (oldest + k) % d->history_size;
+        size_t j_prev = (j + d->history_size - 1) % d->history_size;
+
+        update_track(d, d->history[j], d->history[j_prev]);
+        update_sync(d);
+    }
+
+    d->trace = trace;
+    d->period_weight = weight;
+
+    return;
+}
+
+/* void detector_drop_sync - give up sync after a gap in the periods
+ *
+ * arguments: Detector* d - the detector we're operating on
+ * returns: nothing
+ * side-effects: modifies d, and publishes its new state
+ *
+ * For callers that know periods went missing, e.g. a pipeline that overran,
+ * so the next period can't be compared with the last one we saw. The belief
+ * is kept as the prior to earn sync back from, but every ratio, signature
+ * and history period from before the gap is forgotten, since none of them
+ * can be strung together with what comes after it.
+ */
+void
+detector_drop_sync(Detector* d)
+{
+    if (d->has_sync)
+        d->counters.sync_lost++;
+    d->has_sync = false;
+    d->has_cycle_sync = false;
+    d->sync_llr = 0.0;
+
+    d->previous_timer = 0;
+    d->sig_fill = 0;
+    d->sig_history = 0;
+    d->sig_seeded = false;
+    d->history_head = 0;
+    d->history_count = 0;
+
+    publish_motion(d, 0);
+    publish_snapshot(d);
+
+    return;
+}
+
+/* void detector_interrupt - execute a localization loop on the detector
+ *
+ * arguments: uint32_t timer_register - value of the timer register
+ *            Detetor* d              - the detector we're operating on
+ * returns: nothing
+ * side-effects: modifies d
+ */
+void
+detector_interrupt(
+        uint32_t timer_register,
+        Detector* d)
+{
+    uint32_t timer = timer_register;
+    bool seeded = false;
+
+    d->counters.interrupts++;
+
+    if (d->trace != NULL)
+    {
+        d->trace->timer = timer;
+        trace_record(d->trace, TRACE_PERIOD, 0, NULL, 0);
+    }
+
+    if (d->history != NULL)
+    {
+        d->history[d->history_head] = timer;
+        d->history_head = (d->history_head + 1) % d->history_size;
+        if (d->history_count < d->history_size)
+            d->history_count++;
+    }
+
+    if (d->cycle_prob != NULL)
+        apply_cam_evidence(d);
+
+    update_track(d, timer, d->previous_timer);
+
+    /* Until we have sync, check whether the last few period ratios identify
+     * a single position on the wheel. If they do, and the belief isn't
+     * already at least that sure of it, throw away the (probably still rather
+     * flat) belief and start over from a sharply peaked one. That peak is a
+     * guess, not evidence: sync is earned by tracking it from here, starting
+     * from an even score unless this just confirms the seed we're tracking. */
+    if (d->sig_index != NULL && d->previous_timer != 0)
+    {
+        uint32_t mask = (d->sig_window == DETECTOR_SIG_MAX_WINDOW)
+                        ? UINT32_MAX
+                        : (1u << (SIG_SYMBOL_BITS * d->sig_window)) - 1;
+
+        d->sig_history = ((d->sig_history << SIG_SYMBOL_BITS) | sig_symbol(d->previous_timer, timer)) & mask;
+        if (d->sig_fill < d->sig_window)
+            d->sig_fill++;
+
+        if (!d->has_sync && d->sig_fill == d->sig_window)
+        {
+            DetectorSigEntry* slot = sig_index_slot(d->sig_index, d->sig_index_size, d->sig_history);
+            if (slot->count == 1 && d->tooth_prob[slot->tooth] < 1.0 - d->error_rate)
+            {
+                if (!d->sig_seeded || slot->tooth != d->current_tooth)
+                    d->sync_llr = 0.0;
+                d->sig_seeded = true;
+                seeded = true;
+
+                make_peaked_prob_dist(d->num_tooth_tips, slot->tooth, d->error_rate, d->tooth_prob);
+                make_peaked_stats(d->num_tooth_tips, slot->tooth, d->error_rate, &(d->stats));
+                if (d->cycle_prob != NULL)
+                    cycle_from_crank(d, d->phase ? d->phase_confidence : 1 - d->phase_confidence);
+                d->current_tooth = slot->tooth;
+                d->confidence = d->stats.top_prob;
+            }
+        }
+    }
+
+    /* This period's track was scored against the belief the seed replaced */
+    if (!seeded && update_sync(d))
+        detector_relocalize(d);
+    else if (d->has_sync)
+    {
+        if (d->tooth_stats != NULL)
+            update_tooth_stats(d, timer, d->previous_timer);
+        if (d->rate_alpha > 0)
+            update_error_rates(d, timer, d->previous_timer);
+    }
+
+    /* Phase is decided on the same terms as sync, but only counts once we
+     * know which tooth we're on. */
+    d->has_cycle_sync = d->has_sync && d->cycle_prob != NULL
+                        && logf(d->phase_confidence / (1 - d->phase_confidence)) >= d->sync_accept;
+
+    update_motion(d, timer);
+
+    if (d->trace != NULL)
+    {
+        TraceDecision decision = {
+            d->last_acceleration,
+            d->sync_llr,
+            d->confidence,
+            d->current_tooth,
+            d->has_sync,
+            { 0 }
+        };
+        trace_record(d->trace, TRACE_DECISION, 0, &decision, sizeof(decision));
+    }
+
+    d->previous_timer = timer;
+
+    publish_snapshot(d);
+
+    return;
+}
+
+
+/* void update_tooth_stats - fold a synced period into its tooth's statistics
+ *
+ * arguments: Detector* d         - the detector, synced on the tooth the period ended at
+ *            uint32_t timer      - the period that just ended
+ *            uint32_t prev_timer - the period before it, or 0 if there wasn't one
+ * returns: nothing
+ * side-effects: modifies d->tooth_stats[d->current_tooth]
+ *
+ * Welford's update, which needs neither the samples nor a sum of squares
+ * that would lose all its precision in a float after a few hours.
+ */
+void
+update_tooth_stats(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer)
+{
+    if (prev_timer == 0)
+        return;
+
+    detector_index_t tooth = d->current_tooth;
+    detector_index_t previous_tooth = (tooth + d->num_tooth_tips - 1) % d->num_tooth_tips;
+    float x = ((float)timer * d->tooth_dists[previous_tooth])
+              / ((float)prev_timer * d->tooth_dists[tooth]);
+
+    DetectorToothStats* s = &(d->tooth_stats[tooth]);
+    s->count++;
+    float delta = x - s->mean;
+    s->mean += delta / (float)s->count;
+    s->m2 += delta * (x - s->mean);
+
+    return;
+}
+
+/* void update_error_rates - fold a synced tooth into the learned miss and extra-edge rates
+ *
+ * arguments: Detector* d         - the detector, synced on the tooth the period ended at
+ *            uint32_t timer      - the period that just ended
+ *            uint32_t prev_timer - the period before it, or 0 if there wasn't one
+ * returns: nothing
+ * side-effects: modifies d->miss_rate, d->extra_rate and d->error_rate
+ */
+void
+update_error_rates(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer)
+{
+    if (prev_timer == 0)
+        return;
+
+    float miss = 0.0;
+    float extra = 0.0;
+
+    detector_index_t tooth = d->current_tooth;
+    detector_index_t previous_tooth = (tooth + d->num_tooth_tips - 1) % d->num_tooth_tips;
+    float ratio = ((float)timer * d->tooth_dists[previous_tooth])
+                  / ((float)prev_timer * d->tooth_dists[tooth]);
+
+    if (ratio > RATE_MISS_RATIO)
+        miss = 1.0;
+    else if (ratio < 1 / RATE_MISS_RATIO)
+        extra = 1.0;
+
+    d->miss_rate += d->rate_alpha * (miss - d->miss_rate);
+    d->extra_rate += d->rate_alpha * (extra - d->extra_rate);
+
+    d->miss_rate = fminf(fmaxf(d->miss_rate, d->rate_floor), d->rate_ceiling);
+    d->extra_rate = fminf(fmaxf(d->extra_rate, d->rate_floor), d->rate_ceiling);
+    d->error_rate = d->miss_rate + d->extra_rate;
+
+    return;
+}
+
+/* void update_motion - update the speed and acceleration estimates, and publish them for the angle queries
+ *
+ * arguments: Detector* d    - the detector, with the tooth the period ended at decided
+ *            uint32_t timer - the period that just ended
+ * returns: nothing
+ * side-effects: modifies d->velocity, d->angular_accel, d->edge_time and the published motion
+ *
+ * The mean speed over a period is its angle over its length, and is the
+ * speed at (roughly) the middle of it. Acceleration is the change in that
+ * from one period to the next, over the time between their middles. Speed at
+ * the tooth itself is then half a period's worth of acceleration on from the
+ * mean.
+ */
+void
+update_motion(
+        Detector* d,
+        const uint32_t timer)
+{
+    d->edge_time += timer;
+
+    if (timer == 0)     /* glitch; nothing to measure */
+    {
+        publish_motion(d, timer);
+        return;
+    }
+
+    float period = (float)timer * d->secs_per_tick;
+    float omega = d->rad_per_posn * d->tooth_dists[d->current_tooth] / period;
+
+    if (d->previous_timer != 0 && d->velocity > 0)
+    {
+        float prev_period = (float)d->previous_timer * d->secs_per_tick;
+        d->angular_accel = (omega - d->velocity) / (0.5f * (period + prev_period));
+    }
+    else
+        d->angular_accel = 0.0;
+
+    d->velocity = omega;
+    publish_motion(d, timer);
+
+    return;
+}
+
+/* void detector_interrupt_weighted - execute a localization loop for a doubtful period
+ *
+ * arguments: uint32_t timer_register - value of the timer register
+ *            float weight            - confidence in the period, in [0, 1]
+ *            Detector* d             - the detector we're operating on
+ * returns: nothing
+ * side-effects: modifies d
+ *
+ * For a period an input stage (see conditioner.h) has doubts about. The
+ * belief still moves a tooth, but the period's likelihood is tempered by the
+ * weight (see temper_likelihood), and while synced it only counts for or
+ * against the track by that share of a whole period's evidence. At 1 this is
+ * detector_interrupt; at 0 the period only moves the belief along.
+ */
+void
+detector_interrupt_weighted(
+        uint32_t timer_register,
+        const float weight,
+        Detector* d
+        )
+{
+    d->period_weight = (weight < 0) ? 0 : (weight > 1) ? 1 : weight;
+    detector_interrupt(timer_register, d);
+    d->period_weight = 1.0;
+
+    return;
+}
+
+/* void detector_process_batch - execute a localization loop for each of a batch of periods
+ *
+ * arguments: Detector* d       - the detector we're operating on
+ *            uint32_t timers[] - periods, oldest first
+ *            size_t count      - number of periods
+ * returns: nothing
+ * side-effects: modifies d
+ *
+ * For consumers that receive periods in bulk rather than one per interrupt,
+ * e.g. pipeline_drain.
+ */
+void
+detector_process_batch(
+        Detector* d,
+        uint32_t timers[const],
+        const size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        detector_interrupt(timers[i], d);
+
+    return;
+}
+
+
+/* void detector_locate - localize the probability distribution
+ *
+ * arguments:    (too many to list)
+ * returns:      nothing
+ * side-effects: modifies data at *posterior, and at *stats unless it is NULL
+ *
+ * This function calculates a posterior probability distribution, given input
+ * variable prior and the provided sensor (timing) data.
+ */
+
+void
+detector_locate(
+        float prior[const],
+        uint8_t tooth_dists[const],
+        const size_t num_tooth_tips,
+        const detector_index_t num_tooth_posns,
+        const float max_accel,
+        const uint32_t timer_value,
+        const uint32_t prev_timer,
+        const uint32_t ticks_per_sec,
+        const float error_rate,
+        float posterior[],
+        DetectorStats* const stats
+        )
+{
+
+    float prob_storage[num_tooth_tips];
+    float accel[num_tooth_tips]; /* scratch space */
+
+
+    /* Unroll this loop a tiny bit to avoid doing math to work around around
      * the edge of the array at every iteration. */
     accel[0] = detector_calc_accel(ticks_per_sec, num_tooth_posns, prev_timer, tooth_dists[num_tooth_tips-1], timer_value, tooth_dists[0]);
     prob_storage[0] = prob_of_move(prior[0], max_accel, accel[0], error_rate);
 
-    for (size_t i = 1; i < num_tooth_tips; i++)
-    {
-        accel[i] = detector_calc_accel(ticks_per_sec, num_tooth_posns, prev_timer, tooth_dists[i-1], timer_value, tooth_dists[i]);
-        prob_storage[i] = prob_of_move(prior[i], max_accel, accel[i], error_rate);
-    }
+    for (size_t i = 1; i < num_tooth_tips; i++)
+    {
+        accel[i] = detector_calc_accel(ticks_per_sec, num_tooth_posns, prev_timer, tooth_dists[i-1], timer_value, tooth_dists[i]);
+        prob_storage[i] = prob_of_move(prior[i], max_accel, accel[i], error_rate);
+    }
+
+
+    if (stats == NULL)
+        normalize_dist(prob_storage, num_tooth_tips, posterior);
+    else
+        normalize_dist_stats(prob_storage, num_tooth_tips, posterior, stats);
+
+
+    return;
+}
+
+/*
+ * void detector_locate_lut - localize the probability distribution using the likelihood table
+ *
+ * arguments: float prior[]          - the prior probability distribution
+ *            float lik_lut[]        - likelihood table built by detector_init_lik_lut
+ *            uint8_t lik_class[]    - ratio class of each tooth
+ *            size_t num_tooth_tips  - number of possible positions
+ *            int32_t ratio_q        - observed period ratio, from detector_log2_ratio_q
+ *                                     at DETECTOR_LIK_STEPS_PER_OCTAVE
+ *            float posterior[]      - storage for the posterior distribution
+ *            DetectorStats* stats   - where to put statistics of the posterior, or NULL
+ * returns: nothing
+ * side-effects: modifies data at *posterior and *stats
+ */
+
+void
+detector_locate_lut(
+        float prior[const],
+        float lik_lut[const],
+        uint8_t lik_class[const],
+        const size_t num_tooth_tips,
+        const int32_t ratio_q,
+        float posterior[],
+        DetectorStats* const stats
+        )
+{
+    float prob_storage[num_tooth_tips];
+    int32_t j = ratio_q + DETECTOR_LIK_BINS / 2;
+
+    /* Ratios off the end of the table are as wrong as it gets for every
+     * class, so the last column is as good as any. */
+    if (j < 0)
+        j = 0;
+    if (j >= DETECTOR_LIK_BINS)
+        j = DETECTOR_LIK_BINS - 1;
+
+    const float* column = &lik_lut[j];
+
+    for (size_t i = 0; i < num_tooth_tips; i++)
+        prob_storage[i] = prior[i] * column[lik_class[i] * DETECTOR_LIK_BINS];
+
+    if (stats == NULL)
+        normalize_dist(prob_storage, num_tooth_tips, posterior);
+    else
+        normalize_dist_stats(prob_storage, num_tooth_tips, posterior, stats);
+
+    return;
+}
+
+/*
+ * void detector_move - execute a probabalistic 1-position move in the positive direction
+ *
+ * arguments:  float prior[]         - the prior probability distribution
+ *             size_t num_tooth_tips - the number of positions (and the length of the p array)
+ *             float miss_rate       - probability the edge of the previous tooth was missed
+ *             float extra_rate      - probability the edge we saw wasn't a tooth at all
+ *             float posterior[]     - storage for the posterior distribution, apart from prior
+ * returns: nothing
+ * side-effects: modifies data at *posterior
+ *
+ * Each bin is worked out in one go from the three it can have come from. Only
+ * the first two have to wrap round to the end of the prior, so they're done
+ * on their own and the rest need no index arithmetic at all.
+ */
+
+void
+detector_move(
+        float prior[const],
+        const size_t num_tooth_tips,
+        const float miss_rate,
+        const float extra_rate,
+        float posterior[]
+        )
+{
+    const size_t n = num_tooth_tips;
+    const float hit_rate = 1 - miss_rate - extra_rate;
+
+    for (size_t i = 0; i < 2 && i < n; i++)
+    {
+        posterior[i]                            /* posterior is the sum of the probability that...   */
+         =     hit_rate * prior[(i + n - 1) % n] /* move happened and was detected                    */
+           +  miss_rate * prior[(i + n - 2) % n] /* two moves happened but only one was detected      */
+           + extra_rate * prior[i];              /* move did not happen but was detected (i.e. noise) */
+    }
+
+    for (size_t i = 2; i < n; i++)
+        posterior[i] = hit_rate * prior[i - 1] + miss_rate * prior[i - 2] + extra_rate * prior[i];
+
+    return;
+}
+
+
+/*
+ * void make_uniform_prob_dist - create a uniform discrete probability distribution
+ *
+ * arguments:    size_t n: number of bins in the distribution
+ *               float a[]: storage for the distribution
+ * returns:      nothing
+ * side-effects: modifies data at *a
+ *
+ */
+
+void
+make_uniform_prob_dist(const size_t n, float a[])
+{
+    float u = 1.0 / (float)n;
+
+    for (size_t i = 0; i < n; i++)
+        a[i] = u;
+    return;
+}
+
+
+/*
+ * void make_uniform_stats - fill in the statistics of a make_uniform_prob_dist distribution
+ *
+ * arguments:    size_t n:             number of bins in the distribution
+ *               DetectorStats* stats: where to put the statistics
+ * returns:      nothing
+ * side-effects: modifies *stats
+ */
+
+void
+make_uniform_stats(
+        const size_t n,
+        DetectorStats* const stats
+        )
+{
+    float u = 1.0 / (float)n;
+
+    stats->top_bin = 0;
+    stats->second_bin = (n > 1) ? 1 : 0;
+    stats->top_prob = u;
+    stats->second_prob = u;
+    stats->margin = 0.0;
+    stats->entropy = log2f((float)n);
+    return;
+}
+
+
+/*
+ * void sync_test_belief - run the unsynced half of the sync decision on the current belief
+ *
+ * arguments:    Detector* d - the detector, with up-to-date stats
+ * returns:      nothing
+ * side-effects: modifies d->sync_llr, and d->has_sync if we now have sync
+ *
+ * The posterior already is the accumulated evidence: the ratio of the top two
+ * bins is the product of every likelihood ratio between them since we
+ * started, so there's nothing extra to carry around.
+ */
+
+void
+sync_test_belief(Detector* d)
+{
+    d->sync_llr = (d->stats.second_prob > 0)
+                  ? logf(d->stats.top_prob / d->stats.second_prob)
+                  : d->sync_accept;
+
+    if (d->sync_llr >= d->sync_accept)
+    {
+        if (!d->has_sync)
+            d->counters.sync_acquired++;
+        d->has_sync = true;
+        d->sync_llr = d->sync_accept;
+    }
+    return;
+}
+
+
+/*
+ * void make_peaked_prob_dist - create a distribution concentrated on a single bin
+ *
+ * arguments:    size_t n:         number of bins in the distribution
+ *               size_t peak:      the bin to concentrate on
+ *               float error_rate: probability mass spread over every other bin
+ *               float a[]:        storage for the distribution
+ * returns:      nothing
+ * side-effects: modifies data at *a
+ */
+
+void
+make_peaked_prob_dist(
+        const size_t n,
+        const size_t peak,
+        const float error_rate,
+        float a[]
+        )
+{
+    float rest = (n > 1) ? error_rate / (float)(n - 1) : 0.0;
+
+    for (size_t i = 0; i < n; i++)
+        a[i] = rest;
+    a[peak] = (n > 1) ? 1.0 - error_rate : 1.0;
+    return;
+}
+
+
+/*
+ * void make_peaked_stats - fill in the statistics of a make_peaked_prob_dist distribution
+ *
+ * arguments:    size_t n:             number of bins in the distribution (at least 2)
+ *               size_t peak:          the bin the distribution is concentrated on
+ *               float error_rate:     probability mass spread over every other bin
+ *               DetectorStats* stats: where to put the statistics
+ * returns:      nothing
+ * side-effects: modifies *stats
+ */
+
+void
+make_peaked_stats(
+        const size_t n,
+        const size_t peak,
+        const float error_rate,
+        DetectorStats* const stats
+        )
+{
+    float rest = error_rate / (float)(n - 1);
+
+    stats->top_bin = peak;
+    stats->second_bin = (peak + 1) % n;
+    stats->top_prob = 1.0 - error_rate;
+    stats->second_prob = rest;
+    stats->margin = stats->top_prob - rest;
+    stats->entropy = -(stats->top_prob * fast_log2f(stats->top_prob) + error_rate * fast_log2f(rest));
+    return;
+}
+
+
+/*
+ * uint32_t sig_symbol - quantize a period ratio into a pattern-signature symbol
+ *
+ * arguments: uint32_t t0 - earlier period (or tooth distance)
+ *            uint32_t t1 - later period (or tooth distance)
+ * returns: a non-zero symbol that fits in SIG_SYMBOL_BITS
+ * side-effects: none
+ */
+
+uint32_t
+sig_symbol(
+        const uint32_t t0,
+        const uint32_t t1
+        )
+{
+    int32_t q = detector_log2_ratio_q(t0, t1, SIG_STEPS_PER_OCTAVE);
+
+    if (q > SIG_SYMBOL_LIMIT)
+        q = SIG_SYMBOL_LIMIT;
+    if (q < -SIG_SYMBOL_LIMIT)
+        q = -SIG_SYMBOL_LIMIT;
+
+    return (uint32_t)(q + SIG_SYMBOL_LIMIT + 1);
+}
+
 
-#ifdef DEBUG
-    debug_print_prob_dist_f(accel, num_tooth_tips, "detector_locate() : accel_map", "%2.1f");
-    debug_print_prob_dist_f(prob_storage, num_tooth_tips, "detector_locate() : prob_storage", "%2.1f");
-#endif
+/*
+ * DetectorSigEntry* sig_index_slot - find the slot for a signature in the index
+ *
+ * arguments: DetectorSigEntry sig_index[] - the hash table
+ *            size_t sig_index_size       - number of slots (a power of two)
+ *            uint32_t signature          - the signature to look for
+ * returns: the slot holding signature, or the empty slot where it belongs
+ * side-effects: none
+ *
+ * The table is open-addressed with linear probing. It is never more than
+ * half full, so the probe always terminates. Probing starts from the top
+ * bits of a multiplicative hash, which are the well-mixed ones; scaling by
+ * the (power of two) size and keeping the high word takes exactly those.
+ */
 
-    normalize_dist(prob_storage, num_tooth_tips, posterior);
+DetectorSigEntry*
+sig_index_slot(
+        DetectorSigEntry sig_index[const],
+        const size_t sig_index_size,
+        const uint32_t signature
+        )
+{
+    size_t mask = sig_index_size - 1;
+    uint32_t hash = signature * SIG_HASH_MULT;
+    size_t i = (size_t)(((uint64_t)hash * sig_index_size) >> 32);
 
-#ifdef DEBUG
-    debug_print_prob_dist_f(posterior, num_tooth_tips, "detector_locate() : normalized", "%2.1f");
-#endif
+    while (sig_index[i].count != 0 && sig_index[i].signature != signature)
+        i = (i + 1) & mask;
 
-    return;
+    return &sig_index[i];
 }
 
+
 /*
- * void detector_move - execute a probabalistic 1-position move in the positive direction
+ * float fast_log2f - cheap approximation of log2(x)
  *
- * arguments:  float prior[]         - the prior probability distribution
- *             size_t num_tooth_tips - the number of positions (and the length of the p array)
- *             float error_rate      - error_rate member of Detector
- *             float posterior[]     - storage for the posterior distribution
- * returns: nothing
- * side-effects: modifies data at *posterior
+ * arguments: float x - a non-negative, finite value
+ * returns: log2(x), to within about 2e-4; 0 gives about -127 rather than -inf
+ * side-effects: none
  *
+ * Pulls the exponent and mantissa straight out of the IEEE 754 bits and fits
+ * log2 over the mantissa with a quartic. That's cheap enough to run once per
+ * bin, and avoids pulling in (and paying for) libm's log on an MCU.
  */
 
-void
-detector_move(
-        float prior[const],
-        const size_t num_tooth_tips,
-        const float error_rate,
-        float posterior[]
-        )
+float
+fast_log2f(const float x)
 {
+    union { float f; uint32_t u; } bits = { x };
+    int32_t e = (int32_t)((bits.u >> 23) & 0xff) - 127;
 
-    float misses[num_tooth_tips];
-    float   hits[num_tooth_tips];
+    bits.u = (bits.u & 0x007fffff) | 0x3f800000;    /* mantissa in [1, 2) */
+    float u = bits.f - 1.0f;
 
-#ifdef DEBUG
-    debug_print_prob_dist_f(prior, num_tooth_tips, "detector_move() : prior", "%2.1f");
-#endif
-    for (size_t i = 0; i < num_tooth_tips; i++)
-    {
-        misses[i] = error_rate / 2 * prior[i];
-        hits[i]   = (1 - error_rate) * prior[i];
-    }
+    return (float)e
+        + u * (1.4385454f + u * (-0.6780715f + u * (0.3236105f + u * -0.0842731f)));
+}
 
-#ifdef DEBUG
-    debug_print_prob_dist_f(misses, num_tooth_tips, "detector_move() : misses", "%2.1f");
-    debug_print_prob_dist_f(hits, num_tooth_tips, "detector_move() : hits", "%2.1f");
-#endif
 
-    for (size_t i = 2; i < num_tooth_tips+2; i++)
-    {
-        posterior[i % num_tooth_tips]       /* posterior is the sum of the probability that...   */
-         =     hits[ (i-1)%num_tooth_tips ] /* move happened and was detected                    */
-           + misses[ (i-2)%num_tooth_tips ] /* move did not happen but was detected (i.e. noise) */
-           + misses[ i%num_tooth_tips ];    /* move happened but was not detected                */
-    }
+/*
+ * float fast_exp2f - cheap approximation of 2^x
+ *
+ * arguments: float x - a finite value below 128
+ * returns: 2^x, to within about 1e-5 of it; anything at or below -126 gives 2^-126
+ * side-effects: none
+ *
+ * fast_log2f backwards: the integer part of x goes straight into the exponent
+ * bits and a quartic fits 2^x over the fraction. There are no branches or
+ * tables, so a loop over these vectorizes (at -O3 with GCC).
+ */
 
-#ifdef DEBUG
-    debug_print_prob_dist_f(posterior, num_tooth_tips, "detector_move() : posterior", "%2.1f");
-#endif
+float
+fast_exp2f(const float x)
+{
+    union { float f; uint32_t u; } clamped = { x };
 
-    return;
+    /* Clamp to -126 on the bits: of the negative floats, the ones below -126
+     * have the larger bit patterns. A float compare here would stop a loop of
+     * these vectorizing unless the build has -fno-trapping-math. */
+    clamped.u = (clamped.u > 0xc2fc0000u) ? 0xc2fc0000u : clamped.u;
+
+    float y = clamped.f + 127.0f;       /* biased, so truncating floors it */
+    int32_t e = (int32_t)y;
+    float u = y - (float)e;             /* in [0, 1) */
+    union { uint32_t u; float f; } bits = { (uint32_t)e << 23 };
+
+    return bits.f
+        * (1.0000035f + u * (0.6929729f + u * (0.2416044f + u * (0.0517450f + u * 0.0136703f))));
 }
 
 
 /*
- * void make_uniform_prob_dist - create a uniform discrete probability distribution
+ * int32_t detector_log2_ratio_q - quantize the ratio of two periods on a log scale
  *
- * arguments:    size_t n: number of bins in the distribution
- *               float a[]: storage for the distribution
- * returns:      nothing
- * side-effects: modifies data at *a
+ * arguments: uint32_t t0               - earlier period
+ *            uint32_t t1               - later period
+ *            uint8_t steps_per_octave  - quantization steps per doubling of the ratio
+ * returns: round(log2(t1 / t0) * steps_per_octave), or 0 if either period is 0
+ * side-effects: none
  *
+ * Periods scale with the distance travelled, so at steady speed the ratio of
+ * two consecutive periods is the ratio of the two tooth distances.
  */
 
-void
-make_uniform_prob_dist(const size_t n, float a[])
+int32_t
+detector_log2_ratio_q(
+        const uint32_t t0,
+        const uint32_t t1,
+        const uint8_t  steps_per_octave
+        )
 {
-    float u = 1.0 / (float)n;
+    if (t0 == 0 || t1 == 0)
+        return 0;
 
-    for (size_t i = 0; i < n; i++)
-        a[i] = u;
-    return;
+    float q = fast_log2f((float)t1 / (float)t0) * (float)steps_per_octave;
+
+    return (int32_t)((q < 0) ? q - 0.5f : q + 0.5f);
 }
 
 
@@ -352,7 +2342,7 @@ make_uniform_prob_dist(const size_t n, float a[])
  * float detector_calc_accel  - calculate the acceleration of the engine (see note 1, above)
  *
  * arguments:    uint32_t ticks_per_sec   - position sensor sampel rate in Hz
- *               uint8_t  num_tooth_posns - number of quantized possible positions (both teeth and "gaps")
+ *               size_t   num_tooth_posns - number of quantized possible positions (both teeth and "gaps")
  *               uint32_t t?_ticks  - number of sample-rate 'ticks', passed between tooth gaps
  *               uint8_t  t?_teeth  - number of tooth positions passed during the period measured
  * returns:      acceleration of the engine from t_0 to t_1 in rads/s^2
@@ -454,43 +2444,424 @@ normalize_dist(
         )
 {
 
-#ifdef SOFTMAX
-    /* Experimental: softmax normalization is very very expensive */
     float sum = 0.0;
 
     for (size_t i = 0; i < num_tooth_tips; i++)
-        sum += expf(posterior[i]);
+        sum += posterior[i];
+
+    if (sum == 0)      /* anything is possible  */
+        sum = FLT_MAX; /* so I remain credulous */
+
+#ifdef SOFTMAX
+    /* Experimental: softmax over the log-posteriors. Their log-sum-exp is
+     * just the log of the plain sum, so there's no pass for the largest or
+     * for the exps' sum, and each bin is scaled as it's exponentiated. That
+     * makes it the linear path below, give or take the two approximations,
+     * at about four times the cost: it's here to compare against. */
+    const float log2_sum = fast_log2f(sum);
 
     for (size_t i = 0; i < num_tooth_tips; i++)
-        normalized[i] = expf(posterior[i]) / sum;
+        normalized[i] = fast_exp2f(fast_log2f(posterior[i]) - log2_sum);
 
 #else
     /* This is cheaper and works. */
-    float invsum = 0.0;
+    float invsum = 1.0 / sum;
+
+    for (size_t i = 0; i < num_tooth_tips; i++)
+        normalized[i] = posterior[i] * invsum;
+
+#endif
+    return;
+}
+
+
+/*
+ * void normalize_dist_stats - normalize the probability distribution, gathering its statistics
+ *
+ * arguments: float posterior[]       - array of posterior probabilities to normalize
+ *            size_t num_tooth_tips   - number of possible positions (at least 2)
+ *            float normalized[]      - storage for the normalized distribution
+ *            DetectorStats* stats    - where to put the statistics of the normalized distribution
+ * returns: void
+ * side-effects: modifies *normalized and *stats
+ *
+ * Same as normalize_dist, but the pass that writes each normalized bin also
+ * keeps the top two bins and sums up the entropy, so nobody needs to scan the
+ * belief again to find out how sure we are.
+ */
+
+void
+normalize_dist_stats(
+        float posterior[const],
+        const size_t num_tooth_tips,
+        float normalized[],
+        DetectorStats* const stats
+        )
+{
+    float first = -1, second = -1, entropy = 0;
+    size_t first_i = 0, second_i = 0;
+    float sum = 0.0;
 
     for (size_t i = 0; i < num_tooth_tips; i++)
-        invsum += posterior[i];
+        sum += posterior[i];
 
-    if (invsum == 0)      /* anything is possible  */
-        invsum = FLT_MAX; /* so I remain credulous */
+    if (sum == 0)      /* anything is possible  */
+        sum = FLT_MAX; /* so I remain credulous */
 
-    invsum = 1.0 / invsum;
+#ifdef SOFTMAX
+    /* Experimental: softmax over the log-posteriors, see normalize_dist. The
+     * entropy gets each bin's log2 for free. */
+    const float log2_sum = fast_log2f(sum);
+#else
+    const float invsum = 1.0 / sum;
+#endif
 
     for (size_t i = 0; i < num_tooth_tips; i++)
-        normalized[i] = posterior[i] * invsum;
+    {
+#ifdef SOFTMAX
+        float log2_p = fast_log2f(posterior[i]) - log2_sum;
+        float p = fast_exp2f(log2_p);
 
+        normalized[i] = p;
+        entropy -= p * log2_p;
+#else
+        float p = posterior[i] * invsum;
+
+        normalized[i] = p;
+        entropy -= p * fast_log2f(p);
 #endif
+
+        if (p > first)
+        {
+            second = first;
+            second_i = first_i;
+            first = p;
+            first_i = i;
+        }
+        else if (p > second)
+        {
+            second = p;
+            second_i = i;
+        }
+    }
+
+    stats->top_bin = first_i;
+    stats->second_bin = second_i;
+    stats->top_prob = first;
+    stats->second_prob = second;
+    stats->margin = first - second;
+    stats->entropy = entropy;
+
+    return;
+}
+
+
+/*
+ * void publish_motion - publish what the angle queries extrapolate from
+ *
+ * arguments: Detector* d      - the detector, just after a tooth
+ *            uint32_t period  - the period that ended at that tooth
+ * returns: nothing
+ * side-effects: modifies d->motion and d->motion_latest
+ *
+ * Everything the queries need is worked out here, once per tooth, so that
+ * each query is a handful of multiply-adds. Queries may come from an
+ * interrupt that preempts detector_interrupt, so there are two slots: this
+ * writes the one readers aren't using and then flips motion_latest. A reader
+ * can only see a torn slot if two teeth go by during a single query.
+ */
+
+void
+publish_motion(
+        Detector* d,
+        const uint32_t period
+        )
+{
+    uint32_t slot = d->motion_latest ^ 1;
+    DetectorMotion* m = &(d->motion[slot]);
+    size_t n = d->num_tooth_tips;
+    detector_index_t tooth = d->current_tooth;
+    bool phase = d->has_cycle_sync && d->phase;
+
+    m->edge_time = d->edge_time;
+    m->edge_angle = (d->tooth_angle != NULL) ? d->tooth_angle[tooth] : 0.0;
+    m->cycle_angle = d->has_cycle_sync ? 4.0 * PI : 2.0 * PI;
+    if (phase)
+        m->edge_angle += 2.0 * PI;
+    m->alpha = d->angular_accel;
+    m->edge_omega = d->velocity + 0.5f * d->angular_accel * (float)period * d->secs_per_tick;
+    m->next_span = d->rad_per_posn * d->tooth_dists[(tooth + 1) % n];
+
+    __atomic_store_n(&(d->motion_latest), slot, __ATOMIC_RELEASE);
+
+    return;
+}
+
+
+/*
+ * float detector_angle_at - crank angle at a given timer value
+ *
+ * arguments: Detector* d        - the detector
+ *            uint32_t timer_now - a timer value at or after the last tooth (see detector_set_edge_time)
+ * returns: angle in radians from tooth 0, in [0, 2 pi), or [0, 4 pi) once phase is known
+ * side-effects: none
+ *
+ * Extrapolates from the last tooth at constant acceleration, but never past
+ * the next tooth: until it arrives, we can't have got there.
+ */
+
+float
+detector_angle_at(
+        const Detector* const d,
+        const uint32_t timer_now
+        )
+{
+    const DetectorMotion* m = &(d->motion[__atomic_load_n(&(d->motion_latest), __ATOMIC_ACQUIRE)]);
+    float dt = (float)(uint32_t)(timer_now - m->edge_time) * d->secs_per_tick;
+    float travel = dt * (m->edge_omega + 0.5f * m->alpha * dt);
+
+    if (travel > m->next_span)
+        travel = m->next_span;
+    if (travel < 0)
+        travel = 0;
+
+    return m->edge_angle + travel;
+}
+
+
+/*
+ * uint32_t detector_time_of_angle - timer value at which the crank will reach an angle
+ *
+ * arguments: Detector* d - the detector
+ *            float angle - angle in radians from tooth 0, as from detector_angle_at
+ * returns: the timer value, in the same terms as detector_angle_at's timer_now
+ * side-effects: none
+ *
+ * Angles behind the last tooth are taken to be on the next time round. The
+ * further ahead the angle, the less the answer is worth, so schedulers should
+ * ask again as each tooth comes in.
+ */
+
+uint32_t
+detector_time_of_angle(
+        const Detector* const d,
+        const float angle
+        )
+{
+    const DetectorMotion* m = &(d->motion[__atomic_load_n(&(d->motion_latest), __ATOMIC_ACQUIRE)]);
+    float travel = angle - m->edge_angle;
+
+    if (travel < 0)
+        travel += m->cycle_angle;
+
+    if (m->edge_omega <= 0)     /* stopped; it'll be a while */
+        return m->edge_time - 1;
+
+    /* Solve travel = omega t + alpha t^2 / 2 for t, in the form that doesn't
+     * cancel out when alpha is small. If we're slowing down too fast to get
+     * there at all, assume we'll level off at the current speed. */
+    float disc = m->edge_omega * m->edge_omega + 2.0f * m->alpha * travel;
+    float dt = (disc > 0)
+               ? 2.0f * travel / (m->edge_omega + sqrtf(disc))
+               : travel / m->edge_omega;
+
+    return m->edge_time + (uint32_t)(dt * (float)d->ticks_per_sec);
+}
+
+
+/*
+ * void detector_get_counters - get a copy of the running counters
+ *
+ * arguments: Detector* d                - the detector
+ *            DetectorCounters* counters - where to put the copy
+ * returns: nothing
+ * side-effects: modifies the data at *counters
+ *
+ * Counters are 64 bits so they don't wrap in the life of the engine. On a
+ * 32-bit core they're not read atomically, so call this from the same
+ * context as detector_interrupt, or expect the odd torn value.
+ */
+
+void
+detector_get_counters(
+        const Detector* const d,
+        DetectorCounters* const counters
+        )
+{
+    *counters = d->counters;
+    return;
+}
+
+
+/*
+ * bool detector_get_tooth_stats - get the mean and variance of the normalized period at a tooth
+ *
+ * arguments: Detector* d     - the detector
+ *            detector_index_t tooth - the tooth
+ *            float* mean     - where to put the mean (1.0 for a perfect tooth)
+ *            float* variance - where to put the sample variance
+ * returns: false if statistics aren't being kept or there are fewer than
+ *          two samples for the tooth, true otherwise
+ * side-effects: modifies the data at *mean and *variance
+ */
+
+bool
+detector_get_tooth_stats(
+        const Detector* const d,
+        const detector_index_t tooth,
+        float* const mean,
+        float* const variance
+        )
+{
+    if (d->tooth_stats == NULL || tooth >= d->num_tooth_tips)
+        return false;
+
+    const DetectorToothStats* s = &(d->tooth_stats[tooth]);
+    if (s->count < 2)
+        return false;
+
+    *mean = s->mean;
+    *variance = s->m2 / (float)(s->count - 1);
+    return true;
+}
+
+
+/*
+ * void detector_get_stats - get the sync-quality statistics of the current belief
+ *
+ * arguments: Detector* d          - the detector
+ *            DetectorStats* stats - where to put the statistics
+ * returns: nothing
+ * side-effects: modifies *stats
+ *
+ * These are kept up to date by every detector_interrupt, so this is a copy,
+ * not a scan of the belief.
+ */
+
+void
+detector_get_stats(
+        const Detector* const d,
+        DetectorStats* const stats
+        )
+{
+    *stats = d->stats;
+    return;
+}
+
+
+/*
+ * void publish_snapshot - publish the consumer-visible state
+ *
+ * arguments: Detector* d - the detector
+ * returns: nothing
+ * side-effects: modifies d->snapshot, d->snapshot_seq and d->snapshot_latest
+ *
+ * There are two snapshot slots, each behind its own sequence lock, and we
+ * always write the one that isn't the latest. A reader that interrupts us in
+ * the middle of an update therefore always finds the other slot complete.
+ */
+
+void
+publish_snapshot(Detector* d)
+{
+    uint32_t slot = d->snapshot_latest ^ 1;
+    uint32_t seq = d->snapshot_seq[slot];
+    DetectorSnapshot* s = &(d->snapshot[slot]);
+
+    __atomic_store_n(&(d->snapshot_seq[slot]), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store(&(s->current_tooth), &(d->current_tooth), __ATOMIC_RELAXED);
+    __atomic_store(&(s->has_sync), &(d->has_sync), __ATOMIC_RELAXED);
+    __atomic_store(&(s->phase), &(d->phase), __ATOMIC_RELAXED);
+    __atomic_store(&(s->has_cycle_sync), &(d->has_cycle_sync), __ATOMIC_RELAXED);
+    __atomic_store(&(s->velocity), &(d->velocity), __ATOMIC_RELAXED);
+    __atomic_store(&(s->confidence), &(d->confidence), __ATOMIC_RELAXED);
+
+    __atomic_store_n(&(d->snapshot_seq[slot]), seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&(d->snapshot_latest), slot, __ATOMIC_RELEASE);
+
     return;
 }
 
 
+/*
+ * bool read_snapshot_slot - try to copy one snapshot slot
+ *
+ * arguments: Detector* d                - the detector
+ *            uint32_t slot              - which slot to read
+ *            DetectorSnapshot* snapshot - where to put the copy
+ * returns: true if the copy is consistent, false if the slot was written meanwhile
+ * side-effects: modifies *snapshot
+ */
+
+bool
+read_snapshot_slot(
+        const Detector* const d,
+        const uint32_t slot,
+        DetectorSnapshot* const snapshot
+        )
+{
+    const DetectorSnapshot* s = &(d->snapshot[slot]);
+    uint32_t before = __atomic_load_n(&(d->snapshot_seq[slot]), __ATOMIC_ACQUIRE);
+
+    if (before & 1)
+        return false;
+
+    __atomic_load(&(s->current_tooth), &(snapshot->current_tooth), __ATOMIC_RELAXED);
+    __atomic_load(&(s->has_sync), &(snapshot->has_sync), __ATOMIC_RELAXED);
+    __atomic_load(&(s->phase), &(snapshot->phase), __ATOMIC_RELAXED);
+    __atomic_load(&(s->has_cycle_sync), &(snapshot->has_cycle_sync), __ATOMIC_RELAXED);
+    __atomic_load(&(s->velocity), &(snapshot->velocity), __ATOMIC_RELAXED);
+    __atomic_load(&(s->confidence), &(snapshot->confidence), __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&(d->snapshot_seq[slot]), __ATOMIC_RELAXED) == before;
+}
+
+
+/*
+ * void detector_snapshot - read a consistent copy of the published state
+ *
+ * arguments: Detector* d                - the detector
+ *            DetectorSnapshot* snapshot - where to put the copy
+ * returns: nothing
+ * side-effects: modifies *snapshot
+ *
+ * Safe to call from another thread, core or interrupt context while
+ * detector_interrupt runs, and it never makes the writer wait. If the reader
+ * preempts the writer (main-loop code reading from an ISR, say) the latest
+ * complete slot can't change under it, so the first attempt succeeds. Only a
+ * reader running truly in parallel with back-to-back updates can be made to
+ * go around again.
+ */
+
+void
+detector_snapshot(
+        const Detector* const d,
+        DetectorSnapshot* const snapshot
+        )
+{
+    for (;;)
+    {
+        uint32_t latest = __atomic_load_n(&(d->snapshot_latest), __ATOMIC_ACQUIRE);
+
+        if (read_snapshot_slot(d, latest, snapshot))
+            return;
+        if (read_snapshot_slot(d, latest ^ 1, snapshot))
+            return;
+    }
+}
+
+
 /*
  * void detector_find_max_prob - find the highest probability value in the distribution
  *
  * arguments: float prob_dist[]      - probability distrubution
  *            size_t num_tooth_tips  - number of possible locations
  *            float* max_prob        - value of the highest probability bin
- *            uint8_t* max_bin       - index of the highest probability bin
+ *            detector_index_t* max_bin - index of the highest probability bin
  *  returns: nothing
  *  side-effects: modifies *max_prob and *max_bin
  */
@@ -500,7 +2871,7 @@ detector_find_max_prob(
         float prob_dist[const],
         size_t num_tooth_tips,
         float* const max_prob,
-        uint8_t* const max_bin
+        detector_index_t* const max_bin
         )
 {
     float curr_max = 0;
@@ -516,22 +2887,70 @@ detector_find_max_prob(
     }
 }
 
+/*
+ * void detector_find_top2_prob - find the two highest probability values in the distribution
+ *
+ * arguments: float prob_dist[]      - probability distrubution
+ *            size_t num_tooth_tips  - number of possible locations (at least 2)
+ *            float* max_prob        - value of the highest probability bin
+ *            detector_index_t* max_bin - index of the highest probability bin
+ *            float* second_prob     - value of the runner-up bin
+ *            detector_index_t* second_bin - index of the runner-up bin
+ *  returns: nothing
+ *  side-effects: modifies *max_prob, *max_bin, *second_prob and *second_bin
+ */
+
+void
+detector_find_top2_prob(
+        float prob_dist[const],
+        const size_t num_tooth_tips,
+        float* const max_prob,
+        detector_index_t* const max_bin,
+        float* const second_prob,
+        detector_index_t* const second_bin
+        )
+{
+    float first = -1, second = -1;
+    size_t first_i = 0, second_i = 0;
+
+    for (size_t i = 0; i < num_tooth_tips; i++)
+    {
+        if (prob_dist[i] > first)
+        {
+            second = first;
+            second_i = first_i;
+            first = prob_dist[i];
+            first_i = i;
+        }
+        else if (prob_dist[i] > second)
+        {
+            second = prob_dist[i];
+            second_i = i;
+        }
+    }
+
+    *max_prob = first;
+    *max_bin = first_i;
+    *second_prob = second;
+    *second_bin = second_i;
+}
+
 /*
  * size_t count_tooth_posns - Get the number of divisions based on the tooth map
  *
- * arguments: size_t num_tooth_tips - number of possible positions
+ * arguments: size_t num_tooth_tips - number of teeth
  *            uint8_t* tooth_dists  - distance between teeth
- * returns: uint8_t number of flywheel divisions
+ * returns: size_t number of flywheel divisions
  * side-effects: none
  */
 
 size_t
 count_tooth_posns(
-        uint8_t num_tooth_tips,
+        size_t num_tooth_tips,
         uint8_t tooth_dists[const]
         )
 {
-    uint8_t num_tooth_posns = 0;
+    size_t num_tooth_posns = 0;
 
     for (size_t i = 0; i < num_tooth_tips; i++)
         num_tooth_posns += tooth_dists[i];
@@ -1,17 +1,107 @@
 
+/* Bits in a tooth index or position count: 8 covers crank wheels, 16 or 32
+ * encoders with more than 255 positions. Set it for the whole build, e.g.
+ * -DDETECTOR_INDEX_WIDTH=16, since it changes the layout of Detector */
+#ifndef DETECTOR_INDEX_WIDTH
+#define DETECTOR_INDEX_WIDTH 8
+#endif
+
+#if DETECTOR_INDEX_WIDTH == 8
+typedef uint8_t detector_index_t;
+#define DETECTOR_INDEX_MAX UINT8_MAX
+#elif DETECTOR_INDEX_WIDTH == 16
+typedef uint16_t detector_index_t;
+#define DETECTOR_INDEX_MAX UINT16_MAX
+#elif DETECTOR_INDEX_WIDTH == 32
+typedef uint32_t detector_index_t;
+#define DETECTOR_INDEX_MAX UINT32_MAX
+#else
+#error "DETECTOR_INDEX_WIDTH must be 8, 16 or 32"
+#endif
+
+/* Largest pattern-signature window; each ratio symbol takes 4 bits of a uint32_t */
+#define DETECTOR_SIG_MAX_WINDOW 8
+
+/* The continuous likelihood model quantizes log2 period ratios into this many
+ * steps per octave, over +/- DETECTOR_LIK_RANGE_OCTAVES */
+#define DETECTOR_LIK_STEPS_PER_OCTAVE 16
+#define DETECTOR_LIK_RANGE_OCTAVES    4
+#define DETECTOR_LIK_BINS             (2 * DETECTOR_LIK_STEPS_PER_OCTAVE * DETECTOR_LIK_RANGE_OCTAVES + 1)
+
+/* Default error probabilities for the sync decision, see detector_set_sync_thresholds */
+#define DETECTOR_DEFAULT_FALSE_SYNC_PROB 0.02
+#define DETECTOR_DEFAULT_MISS_PROB       0.02
+
+/* One slot of the pattern-signature hash index */
+typedef struct {
+    uint32_t signature;         // packed ratio symbols for a window ending at `tooth`
+    detector_index_t tooth;     // tooth at which the window ends
+    detector_index_t count;     // number of wheel positions sharing this signature; 0 = empty slot
+} DetectorSigEntry;
+
+/* Sync-quality statistics of a belief, gathered while normalizing it */
+typedef struct {
+    detector_index_t top_bin;   // most likely tooth
+    detector_index_t second_bin;    // runner-up tooth
+    float   top_prob;           // probability of top_bin
+    float   second_prob;        // probability of second_bin
+    float   margin;             // top_prob - second_prob
+    float   entropy;            // Shannon entropy of the belief, in bits (0 = certain, log2(n) = clueless)
+} DetectorStats;
+
+/* Running counts of what the detector has done, see detector_get_counters */
+typedef struct {
+    uint64_t interrupts;        // periods handed to detector_interrupt
+    uint64_t sync_acquired;     // times we declared sync
+    uint64_t sync_lost;         // times we dropped it
+    uint64_t accel_rejects;     // synced teeth whose implied acceleration exceeded max_accel
+    uint64_t full_updates;      // belief updates scored by the max_accel step model (detector_locate)
+    uint64_t fast_updates;      // belief updates scored from the likelihood table (detector_locate_lut)
+    uint64_t relocalizations;   // history replays after a sync loss
+} DetectorCounters;
+
+/* Streaming statistics of the normalized period at one tooth, see detector_init_tooth_stats */
+typedef struct {
+    uint64_t count;             // number of periods seen at this tooth
+    float    mean;              // running mean
+    float    m2;                // running sum of squared deviations from the mean (Welford)
+} DetectorToothStats;
+
+/* What the angle queries extrapolate from, as of the last tooth; see detector_angle_at */
 typedef struct {
-    uint8_t current_tooth;      // = 0
+    uint32_t edge_time;         // timer value at the last tooth
+    float    edge_angle;        // angle of the last tooth, radians from tooth 0 (of phase 0, if phase is known)
+    float    edge_omega;        // angular velocity at the last tooth, rad/s
+    float    alpha;             // angular acceleration, rad/s^2
+    float    next_span;         // angle from the last tooth to the next
+    float    cycle_angle;       // angle after which edge_angle comes round again: 2 pi, or 4 pi with phase
+} DetectorMotion;
+
+/* The state consumers care about, published consistently by detector_interrupt */
+typedef struct {
+    detector_index_t current_tooth;
     bool    has_sync;
     bool    phase;
+    bool    has_cycle_sync;
+    float   velocity;
+    float   confidence;
+} DetectorSnapshot;
+
+typedef struct {
+    detector_index_t current_tooth; // = 0
+    bool    has_sync;
+    bool    phase;              // false during the crank revolution the cam edge falls in, true during the other
+    bool    has_cycle_sync;     // has_sync, and phase is known too
     float   velocity;
     float   last_acceleration;
 
     uint8_t  *tooth_dists;      // pointer to array containing tooth distances, e.g. { 2, 1, 1 }
     uint32_t ticks_per_sec;     // sample frequency of the detector's timer, in Hz
     size_t   num_tooth_tips;    // number of actual teeth on the flywheel (e.g. 59 for a 60-1 wheel)
-    uint8_t  num_tooth_posns;   // number of places where a tooth could be (e.g. 60 for a 60-1 wheel)
+    detector_index_t num_tooth_posns;   // number of places where a tooth could be (e.g. 60 for a 60-1 wheel)
 
     uint32_t previous_timer;    // assumed 32 bits here, I'll have to check the actual hardware
+    float    period_weight;     // confidence in the period being processed, see detector_interrupt_weighted
 
     float max_accel;            // Maximum acceleration in radians per second squared; this is the value
                                 //  above which an engine cannot possibly accelerate, and thus measurements
@@ -19,31 +109,176 @@ typedef struct {
 
     float *tooth_prob;          // pointer to an array containing the prior probability distribution
     float confidence;           // max(tooth_prob)
-    float error_rate;           // Used for Bayesian analysis of our input
-                                // We don't calculate error_rate dynamically - mostly because if we track it in real-time,
-                                //  it can get low enough that we never get sync again. oops. So we use an experimentally
-                                //  determined value.
-
-    uint32_t interrupt_counter; // detected_errors / interrupt_counter = error_rate
-                                // it's worth noting that at 20kHz interrupts, we can count
-                                // up to ~59 hours of run time. so reboot your engine every couple of days.
+    float error_rate;           // Used for Bayesian analysis of our input; always miss_rate + extra_rate
+                                // Tracking it in real-time used to let it get low enough that we never got sync
+                                //  again. oops. So by default it's an experimentally determined constant, and if
+                                //  it's learned (detector_set_error_adaptation) it's clamped to a floor.
+    float configured_error_rate;    // error_rate as given to detector_init, before any learning
+    float miss_rate;            // probability that a tooth went by without an edge
+    float extra_rate;           // probability of an edge without a tooth (noise)
+    float rate_floor;           // bounds on each of miss_rate and extra_rate while they're learned
+    float rate_ceiling;
+    float rate_alpha;           // weight of each synced tooth in the learned rates, or 0 to keep them fixed
+
+    DetectorCounters counters;      // what we've done since detector_init
+    DetectorToothStats *tooth_stats;    // per-tooth period statistics, num_tooth_tips of them, or NULL
+
+    DetectorSigEntry *sig_index;    // pointer to the pattern-signature hash table, or NULL if not in use
+    size_t   sig_index_size;        // number of slots in sig_index (a power of two)
+    uint8_t  sig_window;            // number of consecutive period ratios in a signature
+    uint8_t  sig_fill;              // number of observed ratios in sig_history, saturating at sig_window
+    uint32_t sig_history;           // packed symbols of the most recently observed period ratios
+    bool     sig_seeded;            // the belief was seeded from sig_index, and is still earning sync
+                                    //  by tracking (see update_sync)
+
+    float    *lik_lut;              // likelihood of each quantized period ratio, one row of DETECTOR_LIK_BINS per
+                                    //  ratio class, or NULL to use the max_accel step model (prob_of_move)
+    uint8_t  *lik_class;            // ratio class of each tooth, i.e. which lik_lut row applies to it
+    uint8_t  lik_num_classes;       // number of distinct expected period ratios on the wheel
+
+    float sync_accept;              // log-likelihood ratio at or above which we declare sync
+    float sync_reject;              // log-likelihood ratio at or below which we drop it
+    float sync_llr;                 // evidence for the current tooth over the runner-up (see detector_interrupt)
+    float sync_step;                // evidence from one tooth's acceleration check while synced
+
+    DetectorStats stats;            // statistics of tooth_prob as of the last update
+
+    uint32_t *history;              // ring of the most recent periods, or NULL if not kept
+    size_t   history_size;          // capacity of history
+    size_t   history_head;          // where the next period goes
+    size_t   history_count;         // number of periods in history
+
+    DetectorSnapshot snapshot[2];   // published state, see detector_snapshot
+    uint32_t snapshot_seq[2];       // sequence lock for each snapshot slot; odd while it's being written
+    uint32_t snapshot_latest;       // index of the slot written last
+
+    float    *cycle_prob;           // belief over (phase, tooth), 2 * num_tooth_tips of them, or NULL if there's
+                                    //  no cam input; tooth_prob is then its marginal over phase
+    detector_index_t cam_tooth;     // tooth whose period (in phase 0) the cam edge falls in
+    bool     cam_pending;           // a cam edge has arrived since the last crank tooth
+    float    phase_confidence;      // probability of phase
+
+    float    *tooth_angle;          // angle of each tooth from tooth 0, radians, or NULL (see detector_init_angle)
+    float    rad_per_posn;          // angle between adjacent tooth positions
+    float    secs_per_tick;         // 1 / ticks_per_sec
+    float    angular_accel;         // rad/s^2, from the last two periods
+    uint32_t edge_time;             // timer value at the last tooth: the sum of all periods so far, unless
+                                    //  set by detector_set_edge_time
+    DetectorMotion motion[2];       // published for the angle queries, see publish_motion
+    uint32_t motion_latest;         // index of the slot written last
+
+    struct TraceRing *trace;        // where to record what we're doing, or NULL (see trace.h)
+    struct ParallelTeam *team;      // threads sharing the belief updates, or NULL (see parallel.h)
 } Detector;
 
 /* Declarations */
 
 
-/* Initialize the detector at d */
-void
+/* Initialize the detector at d, or return false if the tooth map doesn't fit a detector_index_t */
+bool
 detector_init(
         Detector* d,
         uint8_t tooth_dists[const],
         const size_t num_tooth_tips,
-        const uint8_t num_tooth_posns,
+        const size_t num_tooth_posns,
         float tooth_prob[const],
         const uint32_t sample_rate,
         const float max_accel,
         const float error_rate);
 
+/* Keep a ring of recent periods to relocalize from when sync is lost */
+void
+detector_init_history(
+        Detector* d,
+        uint32_t history[const],
+        const size_t history_size);
+
+/* Record what the detector does into a trace ring (see trace.h), or stop if r is NULL */
+void
+detector_set_trace(
+        Detector* d,
+        struct TraceRing* r);
+
+/* Keep streaming statistics of the period at each tooth while synced */
+void
+detector_init_tooth_stats(
+        Detector* d,
+        DetectorToothStats tooth_stats[const]);
+
+/* Learn the miss and extra-edge rates while synced, within [rate_floor, rate_ceiling] */
+void
+detector_set_error_adaptation(
+        Detector* d,
+        const float rate_floor,
+        const float rate_ceiling,
+        const float alpha);
+
+/* Track engine phase from a cam input, over a belief with room for two crank revolutions */
+bool
+detector_init_cycle(
+        Detector* d,
+        float cycle_prob[const],
+        const detector_index_t cam_tooth);
+
+/* Note a cam edge, for the next crank tooth to take into account */
+void
+detector_cam_edge(Detector* d);
+
+/* Build the tooth angle table the angle queries use */
+void
+detector_init_angle(
+        Detector* d,
+        float tooth_angle[const]);
+
+/* Tie the detector's clock to the timer the angle queries are asked in */
+void
+detector_set_edge_time(
+        Detector* d,
+        const uint32_t timer_at_edge);
+
+/* Build the pattern-signature index used to seed the prior at startup */
+bool
+detector_init_sig_index(
+        Detector* d,
+        DetectorSigEntry sig_index[const],
+        const size_t sig_index_size,
+        const uint8_t sig_window);
+
+/* Build the quantized-ratio likelihood table used in place of the max_accel step model */
+bool
+detector_init_lik_lut(
+        Detector* d,
+        float lik_lut[const],
+        const uint8_t max_classes,
+        uint8_t lik_class[const],
+        const float ratio_sigma);
+
+/* Set the error probabilities the sync decision is designed for */
+void
+detector_set_sync_thresholds(
+        Detector* d,
+        const float false_sync_prob,
+        const float miss_prob);
+
+/* Save a compact copy of the belief, e.g. at engine stop */
+void
+detector_export_prior(
+        const Detector* const d,
+        uint8_t saved[]);
+
+/* Replace the belief with a saved one, blended toward uniform by how much we trust it */
+void
+detector_import_prior(
+        Detector* d,
+        uint8_t saved[const],
+        const float trust);
+
+/* How much to trust a saved belief of a given age */
+float
+detector_prior_trust(
+        const float age,
+        const float half_life);
+
 /* Execute a localization loop */
 void
 detector_interrupt(
@@ -51,12 +286,35 @@ detector_interrupt(
         Detector* d
         );
 
+/* Execute a localization loop for a period we're only partly sure of */
+void
+detector_interrupt_weighted(
+        uint32_t timer_register,
+        const float weight,
+        Detector* d);
+
+/* Execute a localization loop for each of a batch of periods */
+void
+detector_process_batch(
+        Detector* d,
+        uint32_t timers[const],
+        const size_t count);
+
+/* Rebuild the belief by replaying the period history */
+void
+detector_relocalize(Detector* d);
+
+/* Give up sync because periods went missing, e.g. after a pipeline overrun */
+void
+detector_drop_sync(Detector* d);
+
 /* Execute a probabalistic 1-position move */
 void
 detector_move(
         float prior[const],
         const size_t num_tooth_tips,
-        const float error_rate,
+        const float miss_rate,
+        const float extra_rate,
         float posterior[]);
 
 /* Perform a probabalistic localization step given sensor input */
@@ -65,13 +323,71 @@ detector_locate(
         float prior[const],
         uint8_t tooth_dists[const],
         const size_t num_tooth_tips,
-        const uint8_t num_tooth_posns,
+        const detector_index_t num_tooth_posns,
         const float max_accel,
         const uint32_t timer_value,
         const uint32_t prev_timer,
         const uint32_t ticks_per_sec,
         const float error_rate,
-        float posterior[]);
+        float posterior[],
+        DetectorStats* const stats);
+
+/* Perform a localization step using the quantized-ratio likelihood table */
+void
+detector_locate_lut(
+        float prior[const],
+        float lik_lut[const],
+        uint8_t lik_class[const],
+        const size_t num_tooth_tips,
+        const int32_t ratio_q,
+        float posterior[],
+        DetectorStats* const stats);
+
+/* The unnormalized likelihood of a period at each tooth, from whichever model d uses */
+bool
+detector_likelihood(
+        Detector* d,
+        const uint32_t timer,
+        const uint32_t prev_timer,
+        float likelihood[]);
+
+/* Read a consistent copy of the published state, from any thread or context */
+void
+detector_snapshot(
+        const Detector* const d,
+        DetectorSnapshot* const snapshot);
+
+/* Get the sync-quality statistics of the current belief */
+void
+detector_get_stats(
+        const Detector* const d,
+        DetectorStats* const stats);
+
+/* Crank angle at a given timer value, extrapolated from the last tooth */
+float
+detector_angle_at(
+        const Detector* const d,
+        const uint32_t timer_now);
+
+/* Timer value at which the crank will reach a given angle */
+uint32_t
+detector_time_of_angle(
+        const Detector* const d,
+        const float angle);
+
+/* Get a copy of the running counters */
+void
+detector_get_counters(
+        const Detector* const d,
+        DetectorCounters* const counters);
+
+/* Get the mean and variance of the normalized period at a tooth */
+bool
+detector_get_tooth_stats(
+        const Detector* const d,
+        const detector_index_t tooth,
+        float* const mean,
+        float* const variance);
 
 /* Find the bin with, and the value of, the highest probability */
 void
@@ -79,7 +395,17 @@ detector_find_max_prob(
         float prob_dist[const],
         const size_t num_tooth_tips,
         float* const max_prob,
-        uint8_t* const max_bin);
+        detector_index_t* const max_bin);
+
+/* Find the two bins with, and the values of, the highest probabilities */
+void
+detector_find_top2_prob(
+        float prob_dist[const],
+        const size_t num_tooth_tips,
+        float* const max_prob,
+        detector_index_t* const max_bin,
+        float* const second_prob,
+        detector_index_t* const second_bin);
 
 /* Calculate the acceleration between t0 and t1 in rads/s^2 */
 float
@@ -91,8 +417,19 @@ detector_calc_accel(
         const uint32_t t1_ticks,
         const uint8_t  t1_teeth);
 
+/* Quantize log2(t1 / t0) into steps_per_octave steps */
+int32_t
+detector_log2_ratio_q(
+        const uint32_t t0,
+        const uint32_t t1,
+        const uint8_t  steps_per_octave);
+
+/* Cheap approximation of log2(x), to within about 2e-4 */
+float
+fast_log2f(const float x);
+
 /* Count up the number of flywheel divisions (teeth + gaps) */
 size_t
 count_tooth_posns(
-        uint8_t num_tooth_tips,
+        size_t num_tooth_tips,
         uint8_t tooth_dists[const]);
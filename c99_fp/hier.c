@@ -0,0 +1,563 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "detector.h"
+#include "hier.h"
+
+
+/* Declarations */
+
+bool
+hier_init(
+        HierDetector* h,
+        Detector* d,
+        const size_t seg_len,
+        float seg_prob[const],
+        uint8_t seg_classes[const],
+        float win_prob[const]
+        );
+
+void
+hier_interrupt(
+        uint32_t timer_register,
+        HierDetector* h
+        );
+
+void
+hier_reset(HierDetector* h);
+
+size_t
+hier_seg_len(
+        const HierDetector* h,
+        const size_t seg
+        );
+
+bool
+hier_in_window(
+        const HierDetector* h,
+        const size_t seg
+        );
+
+void
+hier_coarse_update(
+        HierDetector* h,
+        const float column[const]
+        );
+
+void
+hier_seed(
+        HierDetector* h,
+        const size_t seg
+        );
+
+void
+hier_fine_update(
+        HierDetector* h,
+        const float column[const]
+        );
+
+void
+hier_follow(
+        HierDetector* h,
+        const size_t top
+        );
+
+void
+hier_update_sync(
+        HierDetector* h,
+        const detector_index_t previous_tooth,
+        const float top,
+        const float second,
+        const float column[const]
+        );
+
+
+/* Definitions */
+
+/*
+ * bool hier_init - set up a coarse-to-fine detector
+ *
+ * arguments: HierDetector* h       - the detector
+ *            Detector* d           - model, tooth map and error rates, set up with
+ *                                    detector_init and detector_init_lik_lut
+ *            size_t seg_len        - teeth per segment, at least 1; about
+ *                                    sqrt(num_tooth_tips) keeps both levels cheap
+ *            float seg_prob[]      - storage for 2 * HIER_NUM_SEGS(num_tooth_tips, seg_len) floats
+ *            uint8_t seg_classes[] - storage for HIER_NUM_SEGS(num_tooth_tips, seg_len) masks
+ *            float win_prob[]      - storage for 2 * HIER_WINDOW_SEGS * seg_len floats
+ * returns: false if d has no likelihood table, has too many ratio classes,
+ *          or there are fewer than HIER_WINDOW_SEGS segments
+ * side-effects: modifies *h and its storage
+ */
+bool
+hier_init(
+        HierDetector* h,
+        Detector* d,
+        const size_t seg_len,
+        float seg_prob[const],
+        uint8_t seg_classes[const],
+        float win_prob[const])
+{
+    size_t n = d->num_tooth_tips;
+
+    if (d->lik_lut == NULL || d->lik_num_classes > HIER_MAX_CLASSES || seg_len == 0
+        || HIER_NUM_SEGS(n, seg_len) < HIER_WINDOW_SEGS)
+        return false;
+
+    h->d = d;
+    h->seg_len = seg_len;
+    h->num_segs = HIER_NUM_SEGS(n, seg_len);
+    h->seg_prob = seg_prob;
+    h->seg_spare = &(seg_prob[h->num_segs]);
+    h->seg_classes = seg_classes;
+    h->seed_prob = HIER_DEFAULT_SEED_PROB;
+    h->win_prob = win_prob;
+    h->win_spare = &(win_prob[HIER_WINDOW_SEGS * seg_len]);
+
+    for (size_t s = 0; s < h->num_segs; s++)
+        seg_classes[s] = 0;
+    for (size_t i = 0; i < n; i++)
+        seg_classes[i / seg_len] |= (uint8_t)(1u << d->lik_class[i]);
+
+    h->fit_step = 0.5f * logf(d->error_rate);
+    h->sync_accept = d->sync_accept;
+    h->sync_reject = d->sync_reject;
+    h->sync_step = d->sync_step;
+    h->seeds = 0;
+    h->sync_losses = 0;
+
+    hier_reset(h);
+
+    return true;
+}
+
+/*
+ * void hier_reset - forget everything: any segment, no window
+ *
+ * arguments: HierDetector* h - the detector
+ * returns: nothing
+ * side-effects: modifies h's beliefs and results
+ */
+void
+hier_reset(HierDetector* h)
+{
+    for (size_t s = 0; s < h->num_segs; s++)
+        h->seg_prob[s] = (float)hier_seg_len(h, s) / (float)h->d->num_tooth_tips;
+
+    h->fine = false;
+    h->win_seg = 0;
+    h->win_len = 0;
+    h->fit_llr = 0.0;
+    h->previous_timer = 0;
+    h->current_tooth = 0;
+    h->has_sync = false;
+    h->velocity = 0.0;
+    h->confidence = 0.0;
+    h->sync_llr = 0.0;
+
+    return;
+}
+
+/*
+ * size_t hier_seg_len - teeth in a segment
+ *
+ * arguments: HierDetector* h - the detector
+ *            size_t seg      - the segment
+ * returns: seg_len, or what's left over for the last segment
+ * side-effects: none
+ */
+size_t
+hier_seg_len(
+        const HierDetector* h,
+        const size_t seg)
+{
+    if (seg + 1 < h->num_segs)
+        return h->seg_len;
+    return h->d->num_tooth_tips - seg * h->seg_len;
+}
+
+/*
+ * void hier_interrupt - update both levels with one period
+ *
+ * arguments: uint32_t timer_register - the period that just ended, in timer ticks
+ *            HierDetector* h         - the detector
+ * returns: nothing
+ * side-effects: modifies *h and its storage
+ *
+ * The window is placed, or moved, whenever the coarse belief is sure of a
+ * segment outside it: a wrong window still explains the periods most of the
+ * time, since most teeth look alike, so this is what catches a lock on the
+ * wrong place. It's placed after the coarse update that made its segment
+ * likely enough, and first updated on the period after, so no period is
+ * counted twice.
+ */
+void
+hier_interrupt(
+        uint32_t timer_register,
+        HierDetector* h)
+{
+    uint32_t prev_timer = h->previous_timer;
+
+    if (timer_register == 0)    /* glitch; nothing to measure */
+        return;
+
+    h->previous_timer = timer_register;
+    if (prev_timer == 0)        /* no ratio to go on yet */
+        return;
+
+    int32_t j = detector_log2_ratio_q(prev_timer, timer_register, DETECTOR_LIK_STEPS_PER_OCTAVE)
+                + DETECTOR_LIK_BINS / 2;
+
+    if (j < 0)                  /* as in detector_locate_lut */
+        j = 0;
+    if (j >= DETECTOR_LIK_BINS)
+        j = DETECTOR_LIK_BINS - 1;
+
+    const float* column = &(h->d->lik_lut[j]);
+
+    hier_coarse_update(h, column);
+
+    float top;
+    detector_index_t top_seg;
+
+    detector_find_max_prob(h->seg_prob, h->num_segs, &top, &top_seg);
+    if (top >= h->seed_prob && !hier_in_window(h, top_seg))
+    {
+        hier_seed(h, top_seg);
+        return;
+    }
+
+    if (!h->fine)
+        return;
+
+    hier_fine_update(h, column);
+    if (h->fine)
+        h->velocity = h->d->rad_per_posn * (float)h->d->tooth_dists[h->current_tooth]
+                      * (float)h->d->ticks_per_sec / (float)timer_register;
+
+    return;
+}
+
+/*
+ * bool hier_in_window - whether a segment is in the window
+ *
+ * arguments: HierDetector* h - the detector
+ *            size_t seg      - the segment
+ * returns: true if the window is in place and seg is one of its segments
+ * side-effects: none
+ */
+bool
+hier_in_window(
+        const HierDetector* h,
+        const size_t seg)
+{
+    size_t offset = (seg >= h->win_seg) ? seg - h->win_seg : seg + h->num_segs - h->win_seg;
+
+    return h->fine && offset < HIER_WINDOW_SEGS;
+}
+
+/*
+ * void hier_coarse_update - move and weigh the segment belief
+ *
+ * arguments: HierDetector* h  - the detector
+ *            float column[]   - the likelihood table's column for this period's ratio
+ * returns: nothing
+ * side-effects: modifies h->seg_prob
+ *
+ * The per-class likelihoods are looked up once; each segment then takes the
+ * best of those for the classes it holds.
+ */
+void
+hier_coarse_update(
+        HierDetector* h,
+        const float column[const])
+{
+    size_t num_segs = h->num_segs;
+    uint8_t num_classes = h->d->lik_num_classes;
+    float class_lik[HIER_MAX_CLASSES];
+    float total = 0.0;
+
+    for (uint8_t c = 0; c < num_classes; c++)
+        class_lik[c] = column[c * DETECTOR_LIK_BINS];
+
+    float leave_prev = h->seg_prob[num_segs - 1] / (float)hier_seg_len(h, num_segs - 1);
+
+    for (size_t s = 0; s < num_segs; s++)
+    {
+        float leave = h->seg_prob[s] / (float)hier_seg_len(h, s);
+        float best = 0.0;
+
+        for (uint8_t c = 0; c < num_classes; c++)
+            if ((h->seg_classes[s] & (1u << c)) && class_lik[c] > best)
+                best = class_lik[c];
+
+        h->seg_spare[s] = (h->seg_prob[s] - leave + leave_prev) * best;
+        total += h->seg_spare[s];
+        leave_prev = leave;
+    }
+
+    float* swap = h->seg_prob;
+    h->seg_prob = h->seg_spare;
+    h->seg_spare = swap;
+
+    if (!(total > 0))           /* it all underflowed; start over */
+    {
+        hier_reset(h);
+        return;
+    }
+
+    for (size_t s = 0; s < num_segs; s++)
+        h->seg_prob[s] /= total;
+
+    return;
+}
+
+/*
+ * void hier_seed - place the window around a segment
+ *
+ * arguments: HierDetector* h - the detector
+ *            size_t seg      - the segment to centre it on
+ * returns: nothing
+ * side-effects: modifies the window, h->seeds, and the sync state
+ *
+ * Each tooth starts with its segment's coarse probability shared evenly,
+ * normalized over the window. Sync survives only if the new window still
+ * holds the tooth we were synced on; otherwise it has to be earned again.
+ */
+void
+hier_seed(
+        HierDetector* h,
+        const size_t seg)
+{
+    size_t s = (seg == 0) ? h->num_segs - 1 : seg - 1;
+    size_t k = 0;
+    float total = 0.0;
+
+    h->win_seg = s;
+    for (size_t w = 0; w < HIER_WINDOW_SEGS; w++)
+    {
+        size_t len = hier_seg_len(h, s);
+        float p = h->seg_prob[s] / (float)len;
+
+        for (size_t i = 0; i < len; i++)
+            h->win_prob[k++] = p;
+        total += h->seg_prob[s];
+        s = (s + 1 == h->num_segs) ? 0 : s + 1;
+    }
+    h->win_len = k;
+
+    for (size_t i = 0; i < k; i++)
+        h->win_prob[i] /= total;
+
+    h->fine = true;
+    h->fit_llr = 0.0;
+    h->seeds++;
+
+    if (h->has_sync && !hier_in_window(h, h->current_tooth / h->seg_len))
+    {
+        h->has_sync = false;
+        h->sync_losses++;
+    }
+    if (!h->has_sync)
+        h->sync_llr = 0.0;
+
+    return;
+}
+
+/*
+ * void hier_fine_update - move and weigh the window's belief, as detector_interrupt does
+ *
+ * arguments: HierDetector* h  - the detector, with the window in place
+ *            float column[]   - the likelihood table's column for this period's ratio
+ * returns: nothing
+ * side-effects: modifies the window, results and sync state, and drops the
+ *               window if it no longer explains the periods
+ *
+ * Nothing moves into the window from outside it, and whatever moves past its
+ * end is lost; hier_follow keeps the belief in the middle so that's little.
+ * The unnormalized total is then how well the window predicted the period,
+ * which fit_llr weighs against noise as sync_llr weighs the sync decision.
+ */
+void
+hier_fine_update(
+        HierDetector* h,
+        const float column[const])
+{
+    Detector* d = h->d;
+    size_t n = d->num_tooth_tips;
+    size_t len = h->win_len;
+    const float* w = h->win_prob;
+    float* out = h->win_spare;
+    float hit = 1 - d->miss_rate - d->extra_rate;
+    size_t tooth = h->win_seg * h->seg_len;
+    float total = 0.0;
+
+    for (size_t k = 0; k < len; k++)
+    {
+        float moved = d->extra_rate * w[k];
+
+        if (k >= 1)
+            moved += hit * w[k - 1];
+        if (k >= 2)
+            moved += d->miss_rate * w[k - 2];
+
+        out[k] = moved * column[d->lik_class[tooth] * DETECTOR_LIK_BINS];
+        total += out[k];
+        tooth = (tooth + 1 == n) ? 0 : tooth + 1;
+    }
+
+    h->win_prob = out;
+    h->win_spare = (float*)w;
+
+    h->fit_llr += (total > 0) ? logf(total) - h->fit_step : h->sync_reject;
+    if (h->fit_llr > h->sync_accept)
+        h->fit_llr = h->sync_accept;
+    if (h->fit_llr <= h->sync_reject)
+    {
+        if (h->has_sync)
+            h->sync_losses++;
+        h->fine = false;
+        h->has_sync = false;
+        h->sync_llr = 0.0;
+        return;
+    }
+
+    for (size_t k = 0; k < len; k++)
+        out[k] /= total;
+
+    float top, second;
+    detector_index_t top_k, second_k;
+    detector_index_t previous_tooth = h->current_tooth;
+
+    detector_find_top2_prob(out, len, &top, &top_k, &second, &second_k);
+
+    size_t first = h->win_seg * h->seg_len + top_k;
+    h->current_tooth = (detector_index_t)((first >= n) ? first - n : first);
+    h->confidence = top;
+
+    hier_update_sync(h, previous_tooth, top, second, column);
+    if (h->fine)
+        hier_follow(h, top_k);
+
+    return;
+}
+
+/*
+ * void hier_follow - slide the window a segment if the belief has moved off its middle
+ *
+ * arguments: HierDetector* h - the detector, with the window in place
+ *            size_t top      - index in the window of the likeliest tooth
+ * returns: nothing
+ * side-effects: modifies the window
+ *
+ * The segment slid in starts empty; the one slid out is dropped.
+ */
+void
+hier_follow(
+        HierDetector* h,
+        const size_t top)
+{
+    size_t num_segs = h->num_segs;
+    size_t first_len = hier_seg_len(h, h->win_seg);
+    size_t last_seg = (h->win_seg + HIER_WINDOW_SEGS - 1) % num_segs;
+    size_t last_len = hier_seg_len(h, last_seg);
+
+    if (top >= h->win_len - last_len)
+    {
+        size_t next = (last_seg + 1 == num_segs) ? 0 : last_seg + 1;
+        size_t next_len = hier_seg_len(h, next);
+        size_t keep = h->win_len - first_len;
+
+        memmove(h->win_prob, &(h->win_prob[first_len]), keep * sizeof(float));
+        for (size_t i = 0; i < next_len; i++)
+            h->win_prob[keep + i] = 0.0;
+        h->win_len = keep + next_len;
+        h->win_seg = (h->win_seg + 1 == num_segs) ? 0 : h->win_seg + 1;
+    }
+    else if (top < first_len)
+    {
+        size_t prev = (h->win_seg == 0) ? num_segs - 1 : h->win_seg - 1;
+        size_t prev_len = hier_seg_len(h, prev);
+        size_t keep = h->win_len - last_len;
+
+        memmove(&(h->win_prob[prev_len]), h->win_prob, keep * sizeof(float));
+        for (size_t i = 0; i < prev_len; i++)
+            h->win_prob[i] = 0.0;
+        h->win_len = keep + prev_len;
+        h->win_seg = prev;
+    }
+
+    return;
+}
+
+/*
+ * void hier_update_sync - decide sync as detector_interrupt does, within the window
+ *
+ * arguments: HierDetector* h                  - the detector, updated
+ *            detector_index_t previous_tooth  - current_tooth before this period
+ *            float top, second                - the window's two highest probabilities
+ *            float column[]                   - the period's likelihood column, as for hier_fine_update
+ * returns: nothing
+ * side-effects: modifies h->has_sync, h->sync_llr and h->sync_losses, and
+ *               gives up the window if sync is lost
+ *
+ * The window can't tell a missed or extra edge from a plain tooth when every
+ * tooth in it looks alike, so a window that has slipped one still moves on by
+ * one each period. What we can see is the period that did the slipping: the
+ * tracked tooth's ratio class explains it no better than an edge error would,
+ * while some other class does. As with an implausible tooth in update_sync,
+ * that costs us sync unless the window is decisive about where we are, and
+ * sync lost leaves the coarse belief to place the window again.
+ */
+void
+hier_update_sync(
+        HierDetector* h,
+        const detector_index_t previous_tooth,
+        const float top,
+        const float second,
+        const float column[const])
+{
+    Detector* d = h->d;
+
+    if (!h->has_sync)
+    {
+        h->sync_llr = (second > 0) ? logf(top / second) : h->sync_accept;
+        if (h->sync_llr >= h->sync_accept)
+        {
+            h->has_sync = true;
+            h->sync_llr = h->sync_accept;
+        }
+        return;
+    }
+
+    size_t next = (size_t)previous_tooth + 1;
+    float tracked = column[d->lik_class[h->current_tooth] * DETECTOR_LIK_BINS];
+    float best = tracked;
+
+    for (uint8_t c = 0; c < d->lik_num_classes; c++)
+        if (column[c * DETECTOR_LIK_BINS] > best)
+            best = column[c * DETECTOR_LIK_BINS];
+
+    if (h->current_tooth == ((next == d->num_tooth_tips) ? 0 : next))
+        h->sync_llr += h->sync_step;
+    else
+        h->sync_llr -= h->sync_step;
+    if (tracked < 2 * d->error_rate * best
+        && (second > 0 && logf(top / second) < h->sync_accept))
+        h->sync_llr = h->sync_reject;
+
+    if (h->sync_llr > h->sync_accept)
+        h->sync_llr = h->sync_accept;
+    if (h->sync_llr <= h->sync_reject)
+    {
+        h->has_sync = false;
+        h->sync_llr = 0.0;
+        h->sync_losses++;
+        h->fine = false;
+    }
+
+    return;
+}
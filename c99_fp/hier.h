@@ -0,0 +1,84 @@
+/* An alternative localization engine for patterns with many teeth, such as
+ * optical encoders: coarse to fine.
+ *
+ * The grid detector updates every tooth on every period, which is fine for a
+ * crank wheel and too slow for an encoder with thousands of slots. Here the
+ * teeth are cut into segments of seg_len consecutive teeth and the belief is
+ * kept at two levels:
+ *
+ *   - coarse: one probability per segment. Each period moves a segment's
+ *     belief on to the next segment with probability 1 / its length, and
+ *     weighs it by the best likelihood any of its teeth gives the period
+ *     ratio, which only needs to know which ratio classes the segment holds.
+ *   - fine: the detector's own tooth-by-tooth model, over a window of
+ *     HIER_WINDOW_SEGS segments placed around the likeliest segment once the
+ *     coarse belief is sure enough of it. The window follows the belief as
+ *     it moves on, and is dropped if it stops explaining the periods.
+ *
+ * Both run every period, so each costs O(num_segs + seg_len) rather than
+ * O(num_tooth_tips); with seg_len near sqrt(num_tooth_tips) that's
+ * O(sqrt(num_tooth_tips)). The likelihood model, error rates and tooth map
+ * come from a Detector set up with detector_init_lik_lut, as the smoother's
+ * do; tooth counts over 255 need a wider DETECTOR_INDEX_WIDTH. */
+
+/* Segments in the fine window: the likeliest and one either side */
+#define HIER_WINDOW_SEGS 3
+
+/* Most ratio classes a segment can record; see detector_init_lik_lut */
+#define HIER_MAX_CLASSES 8
+
+/* Coarse probability of a segment at which the window is placed around it */
+#define HIER_DEFAULT_SEED_PROB 0.5
+
+/* Number of segments for a number of teeth */
+#define HIER_NUM_SEGS(num_tooth_tips, seg_len) (((num_tooth_tips) + (seg_len) - 1) / (seg_len))
+
+typedef struct {
+    detector_index_t current_tooth;
+    bool    has_sync;
+    float   velocity;           // rad/s, from the last period and current_tooth's distance
+    float   confidence;         // probability of current_tooth, within the window
+
+    Detector *d;                // model and tooth map; its own belief isn't touched
+
+    size_t   seg_len;           // teeth per segment; the last may be shorter
+    size_t   num_segs;
+    float    *seg_prob;         // coarse belief, num_segs of them
+    float    *seg_spare;        // where the next coarse update goes
+    uint8_t  *seg_classes;      // bit c set if some tooth in the segment is in ratio class c
+    float    seed_prob;         // HIER_DEFAULT_SEED_PROB unless changed
+
+    bool     fine;              // the window is in place
+    size_t   win_seg;           // first segment in the window
+    size_t   win_len;           // teeth in the window
+    float    *win_prob;         // fine belief over the window's teeth, in order from win_seg's first
+    float    *win_spare;        // where the next fine update goes
+    float    fit_llr;           // evidence that the window explains the periods, vs. noise
+    float    fit_step;          // log of the likelihood halfway between a fit and noise
+
+    uint32_t previous_timer;
+    float    sync_accept;       // log-likelihood ratios, as in Detector
+    float    sync_reject;
+    float    sync_llr;
+    float    sync_step;
+
+    uint64_t seeds;             // times the window has been placed from the coarse belief
+    uint64_t sync_losses;       // times sync was lost, including to a window placed elsewhere
+} HierDetector;
+
+
+/* Set up a coarse-to-fine detector over d's model; storage is caller-provided */
+bool
+hier_init(
+        HierDetector* h,
+        Detector* d,
+        const size_t seg_len,
+        float seg_prob[const],
+        uint8_t seg_classes[const],
+        float win_prob[const]);
+
+/* Execute a localization loop */
+void
+hier_interrupt(
+        uint32_t timer_register,
+        HierDetector* h);
@@ -9,6 +9,24 @@
 #include "test_data.h"
 #include "debug_print.h"
 
+#ifdef TELEMETRY
+#include "telemetry.h"
+#endif
+
+#ifdef TRACE
+#include "trace.h"
+#endif
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4   /* distinct tooth-distance ratios we have room for */
+#define HISTORY_LEN     64  /* periods kept for relocalizing after sync loss */
+#define TRACE_LEN       65536   /* bytes of trace to keep */
+#define RATE_FLOOR      0.005   /* bounds on the learned miss and extra-edge rates */
+#define RATE_CEILING    0.2
+#define RATE_ALPHA      0.01    /* learn the rates over ~100 teeth */
+
+
 /* Declarations */
 
 
@@ -25,12 +43,24 @@ int main()
 
     uint8_t tooth_dists[] = TEST_TOOTH_MAP;
     const size_t num_tooth_tips = sizeof(tooth_dists)/sizeof(tooth_dists[0]); /* len(tooth_dists) */
-    uint8_t num_tooth_posns = count_tooth_posns(num_tooth_tips, tooth_dists);
+    size_t num_tooth_posns = count_tooth_posns(num_tooth_tips, tooth_dists);
     float tooth_prob[num_tooth_tips];
     uint32_t sample_rate = TEST_SAMPLE_RATE;
     float max_accel = TEST_MAX_ACCEL;
     float error_rate = TEST_ERROR_RATE;
 
+    size_t sig_index_size = 1;
+    while (sig_index_size < 2 * num_tooth_tips)
+        sig_index_size <<= 1;
+    DetectorSigEntry sig_index[sig_index_size];
+
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    uint8_t lik_class[num_tooth_tips];
+
+    uint32_t history[HISTORY_LEN];
+    DetectorToothStats tooth_stats[num_tooth_tips];
+    float tooth_angle[num_tooth_tips];
+
     Detector d;
 
     detector_init(
@@ -43,12 +73,37 @@ int main()
             max_accel,
             error_rate
             );
+    detector_init_sig_index(&d, sig_index, sig_index_size, TEST_SIG_WINDOW);
+    detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+    detector_init_history(&d, history, HISTORY_LEN);
+    detector_init_tooth_stats(&d, tooth_stats);
+    detector_init_angle(&d, tooth_angle);
+    detector_set_error_adaptation(&d, RATE_FLOOR, RATE_CEILING, RATE_ALPHA);
     debug_print_detector(&d);
 
+#ifdef TRACE
+    static uint8_t trace_buf[TRACE_LEN];
+    static uint8_t trace_out[TRACE_LEN + sizeof(TraceDumpHeader)];
+    TraceRing trace;
+    trace_init(&trace, trace_buf, TRACE_LEN, TRACE_BELIEF_QUANTIZED);
+    detector_set_trace(&d, &trace);
+#endif
+
+#ifdef TELEMETRY
+    TelemetryExporter telemetry;
+    int telemetry_slot = -1;
+    if (telemetry_open(&telemetry, "/localizer", 1))
+        telemetry_slot = telemetry_add_detector(&telemetry, "main");
+#endif
+
     for (size_t i = start_tick; i < num_ticks + start_tick; i++)
     {
         timer_register = sample_engine_ticks[i];
         detector_interrupt(timer_register, &d);
+#ifdef TELEMETRY
+        if (telemetry_slot >= 0)
+            telemetry_publish(&telemetry, telemetry_slot, &d);
+#endif
         if (d.has_sync)
         {
             printf("Got sync in %lu", i);
@@ -59,5 +114,19 @@ int main()
 
     printf("\n");
 
+#ifdef TRACE
+    size_t trace_len = trace_dump(&trace, num_tooth_tips, sample_rate, trace_out, sizeof(trace_out));
+    FILE* trace_file = fopen("trace.bin", "wb");
+    if (trace_file != NULL)
+    {
+        fwrite(trace_out, 1, trace_len, trace_file);
+        fclose(trace_file);
+    }
+#endif
+
+#ifdef TELEMETRY
+    telemetry_close(&telemetry, false);     /* leave the last state for the readers */
+#endif
+
 return 0;
 }
@@ -0,0 +1,335 @@
+/* A QEMU TCG plugin that counts the instructions each function executes.
+ *
+ * usage: -plugin libinsn_count.so,syms=FILE[,start=SYM][,stop=SYM][,per=SYM] -d plugin -D LOG
+ *   syms  - the target's functions, as `nm -S --defined-only` prints them
+ *   start - count from the first time this function is entered (default mcu_bench_start)
+ *   stop  - and stop when this one is (default mcu_bench_stop)
+ *   per   - also give counts per call of this one (default detector_interrupt)
+ *
+ * Counts are each function's own instructions, not its callees'. Built by
+ * run_qemu.sh against the qemu-plugin.h of the QEMU it runs.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <qemu-plugin.h>
+
+
+/* Macros */
+
+#define NAME_LEN        64
+#define LINE_LEN        160
+#define MAX_REPORTED    25          /* functions listed, busiest first */
+
+
+/* Declarations */
+
+/* Everything but the entry points is static: QEMU exports its own symbols to
+ * plugins, and a plugin's global functions can end up bound to QEMU's. */
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
+
+typedef struct {
+    uint64_t addr;
+    uint64_t size;
+    char     name[NAME_LEN];
+    uint64_t insns;             // executed while counting
+} Function;
+
+/* A translated block, as runs of instructions in the same function */
+typedef struct {
+    size_t   num_runs;
+    struct {
+        Function* f;
+        uint32_t  insns;
+    } runs[];
+} BlockRuns;
+
+static bool load_syms(const char* path);
+static int compare_addr(const void* a, const void* b);
+static int compare_insns(const void* a, const void* b);
+static Function* find_function(uint64_t addr);
+static uint64_t find_symbol(const char* name);
+static void on_block(unsigned int vcpu_index, void* userdata);
+static void on_start(unsigned int vcpu_index, void* userdata);
+static void on_stop(unsigned int vcpu_index, void* userdata);
+static void on_per(unsigned int vcpu_index, void* userdata);
+static void on_translate(qemu_plugin_id_t id, struct qemu_plugin_tb* tb);
+static void on_atexit(qemu_plugin_id_t id, void* userdata);
+
+
+/* Variables */
+
+static Function* functions;
+static size_t num_functions;
+static Function unknown = { 0, 0, "(unknown)", 0 };
+
+static uint64_t start_addr;
+static uint64_t stop_addr;
+static uint64_t per_addr;
+static const char* per_name = "detector_interrupt";
+
+static bool counting;           // one vCPU, so no locking
+static uint64_t total;
+static uint64_t calls;          // of per_name while counting
+
+
+/* Definitions */
+
+/* Read the functions from nm's output, sorted by address */
+static bool load_syms(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    char line[LINE_LEN];
+    size_t capacity = 256;
+
+    if (f == NULL)
+        return false;
+
+    functions = malloc(capacity * sizeof(*functions));
+    num_functions = 0;
+    while (functions != NULL && fgets(line, sizeof(line), f) != NULL)
+    {
+        uint64_t addr, size;
+        char type;
+        char name[NAME_LEN];
+
+        if (sscanf(line, "%" SCNx64 " %" SCNx64 " %c %63s", &addr, &size, &type, name) != 4
+            || (type != 't' && type != 'T' && type != 'w' && type != 'W'))
+            continue;
+
+        if (num_functions == capacity)
+        {
+            Function* more = realloc(functions, 2 * capacity * sizeof(*functions));
+
+            if (more == NULL)
+            {
+                free(functions);
+                functions = NULL;
+                break;
+            }
+            functions = more;
+            capacity *= 2;
+        }
+
+        Function* fn = &functions[num_functions++];
+        fn->addr = addr & ~(uint64_t)1;     /* Thumb functions have bit 0 set */
+        fn->size = size;
+        fn->insns = 0;
+        strcpy(fn->name, name);
+    }
+    fclose(f);
+
+    if (functions == NULL)
+        return false;
+    qsort(functions, num_functions, sizeof(*functions), compare_addr);
+    return true;
+}
+
+static int compare_addr(const void* a, const void* b)
+{
+    const Function* fa = a;
+    const Function* fb = b;
+    return (fa->addr > fb->addr) - (fa->addr < fb->addr);
+}
+
+static int compare_insns(const void* a, const void* b)
+{
+    const Function* fa = *(const Function* const*)a;
+    const Function* fb = *(const Function* const*)b;
+    return (fa->insns < fb->insns) - (fa->insns > fb->insns);
+}
+
+/* The function an address is in, by binary search */
+static Function* find_function(uint64_t addr)
+{
+    size_t lo = 0;
+    size_t hi = num_functions;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (functions[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0 && addr < functions[lo - 1].addr + functions[lo - 1].size)
+        return &functions[lo - 1];
+    return &unknown;
+}
+
+/* A function's address by name, or 0 */
+static uint64_t find_symbol(const char* name)
+{
+    for (size_t i = 0; i < num_functions; i++)
+    {
+        if (strcmp(functions[i].name, name) == 0)
+            return functions[i].addr;
+    }
+    return 0;
+}
+
+static void on_block(unsigned int vcpu_index, void* userdata)
+{
+    BlockRuns* b = userdata;
+
+    (void)vcpu_index;
+    if (!counting)
+        return;
+
+    for (size_t i = 0; i < b->num_runs; i++)
+    {
+        b->runs[i].f->insns += b->runs[i].insns;
+        total += b->runs[i].insns;
+    }
+}
+
+static void on_start(unsigned int vcpu_index, void* userdata)
+{
+    (void)vcpu_index;
+    (void)userdata;
+    counting = true;
+}
+
+static void on_stop(unsigned int vcpu_index, void* userdata)
+{
+    (void)vcpu_index;
+    (void)userdata;
+    counting = false;
+}
+
+static void on_per(unsigned int vcpu_index, void* userdata)
+{
+    (void)vcpu_index;
+    (void)userdata;
+    calls += counting;
+}
+
+/* Split each block into runs by function as it's translated, once; and hook the markers */
+static void on_translate(qemu_plugin_id_t id, struct qemu_plugin_tb* tb)
+{
+    size_t n = qemu_plugin_tb_n_insns(tb);
+    BlockRuns* b = malloc(sizeof(*b) + n * sizeof(b->runs[0]));
+
+    (void)id;
+    if (b == NULL)
+        return;
+
+    b->num_runs = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        struct qemu_plugin_insn* insn = qemu_plugin_tb_get_insn(tb, i);
+        uint64_t addr = qemu_plugin_insn_vaddr(insn);
+        Function* f = find_function(addr);
+
+        if (b->num_runs > 0 && b->runs[b->num_runs - 1].f == f)
+            b->runs[b->num_runs - 1].insns++;
+        else
+        {
+            b->runs[b->num_runs].f = f;
+            b->runs[b->num_runs].insns = 1;
+            b->num_runs++;
+        }
+
+        if (addr == start_addr)
+            qemu_plugin_register_vcpu_insn_exec_cb(insn, on_start, QEMU_PLUGIN_CB_NO_REGS, NULL);
+        else if (addr == stop_addr)
+            qemu_plugin_register_vcpu_insn_exec_cb(insn, on_stop, QEMU_PLUGIN_CB_NO_REGS, NULL);
+        else if (addr == per_addr)
+            qemu_plugin_register_vcpu_insn_exec_cb(insn, on_per, QEMU_PLUGIN_CB_NO_REGS, NULL);
+    }
+
+    /* The blocks live as long as QEMU's translations of them, so this is never freed */
+    qemu_plugin_register_vcpu_tb_exec_cb(tb, on_block, QEMU_PLUGIN_CB_NO_REGS, b);
+}
+
+/* Report, busiest function first */
+static void on_atexit(qemu_plugin_id_t id, void* userdata)
+{
+    Function** order = malloc((num_functions + 1) * sizeof(*order));
+    char line[LINE_LEN];
+
+    (void)id;
+    (void)userdata;
+
+    snprintf(line, sizeof(line), "instructions %" PRIu64 "\ncalls to %s %" PRIu64 "\n",
+             total, per_name, calls);
+    qemu_plugin_outs(line);
+    if (calls > 0)
+    {
+        snprintf(line, sizeof(line), "instructions per call %.1f\n", (double)total / calls);
+        qemu_plugin_outs(line);
+    }
+    if (order == NULL)
+        return;
+
+    for (size_t i = 0; i < num_functions; i++)
+        order[i] = &functions[i];
+    order[num_functions] = &unknown;
+    qsort(order, num_functions + 1, sizeof(*order), compare_insns);
+
+    snprintf(line, sizeof(line), "\n%14s %7s %10s  %s\n", "instructions", "share", "per call", "function");
+    qemu_plugin_outs(line);
+    for (size_t i = 0; i < num_functions + 1 && i < MAX_REPORTED && order[i]->insns > 0; i++)
+    {
+        snprintf(line, sizeof(line), "%14" PRIu64 " %6.2f%% %10.1f  %s\n", order[i]->insns,
+                 total ? 100.0 * order[i]->insns / total : 0.0,
+                 calls ? (double)order[i]->insns / calls : 0.0,
+                 order[i]->name);
+        qemu_plugin_outs(line);
+    }
+
+    free(order);
+}
+
+QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t* info, int argc, char** argv)
+{
+    const char* syms = NULL;
+    const char* start_name = "mcu_bench_start";
+    const char* stop_name = "mcu_bench_stop";
+
+    (void)info;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strncmp(argv[i], "syms=", 5) == 0)
+            syms = argv[i] + 5;
+        else if (strncmp(argv[i], "start=", 6) == 0)
+            start_name = argv[i] + 6;
+        else if (strncmp(argv[i], "stop=", 5) == 0)
+            stop_name = argv[i] + 5;
+        else if (strncmp(argv[i], "per=", 4) == 0)
+            per_name = argv[i] + 4;
+        else
+        {
+            fprintf(stderr, "insn_count: unknown argument %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (syms == NULL || !load_syms(syms))
+    {
+        fprintf(stderr, "insn_count: needs syms=FILE, from nm -S --defined-only\n");
+        return -1;
+    }
+
+    start_addr = find_symbol(start_name);
+    stop_addr = find_symbol(stop_name);
+    per_addr = find_symbol(per_name);
+    if (start_addr == 0 || stop_addr == 0)
+    {
+        fprintf(stderr, "insn_count: no %s or %s in %s\n", start_name, stop_name, syms);
+        return -1;
+    }
+
+    qemu_plugin_register_vcpu_tb_trans_cb(id, on_translate);
+    qemu_plugin_register_atexit_cb(id, on_atexit, NULL);
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+/* The little a bare Cortex-M needs to run the benchmark: output and exit by
+ * semihosting, which QEMU and most debug probes implement, and a painted
+ * stack to find how deep the detector goes. See startup.c. */
+
+/* Write a string to the host's console */
+void
+mcu_puts(const char* s);
+
+/* Write a number to the host's console, in decimal */
+void
+mcu_put_u32(uint32_t x);
+
+/* Stop, and tell the host whether it went well */
+void
+mcu_exit(const bool ok);
+
+/* Paint the free stack below the caller, for mcu_stack_used */
+void
+mcu_stack_paint(void);
+
+/* Deepest the stack has gone below where mcu_stack_paint was called, in bytes */
+size_t
+mcu_stack_used(void);
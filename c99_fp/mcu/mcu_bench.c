@@ -0,0 +1,117 @@
+/* The detector on a Cortex-M, over a whole built-in dataset.
+ *
+ * Set up as main.c sets it up, but with every buffer static, so the stack it
+ * reports is the detector's own, and run over every period rather than only
+ * up to sync, so the synced path counts too. Between mcu_bench_start and
+ * mcu_bench_stop there is nothing but the loop, for insn_count.c to count
+ * the instructions of. Build and run it with run_qemu.sh.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "detector.h"
+#include "test_data.h"
+#include "mcu.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4       /* as in main.c */
+#define HISTORY_LEN     64
+#define RATE_FLOOR      0.005
+#define RATE_CEILING    0.2
+#define RATE_ALPHA      0.01
+#define SIG_INDEX_LEN   128     /* a power of two, at least twice the teeth of either dataset */
+
+#if defined(TEST_DATASET_36_1)
+#define DATASET_NAME    "36-1"
+#else
+#define DATASET_NAME    "4-1"
+#endif
+
+
+/* Declarations */
+
+void
+mcu_bench_start(void);
+
+void
+mcu_bench_stop(void);
+
+
+/* Variables */
+
+static uint8_t tooth_dists[] = TEST_TOOTH_MAP;
+
+#define NUM_TOOTH_TIPS (sizeof(tooth_dists) / sizeof(tooth_dists[0]))
+
+static float tooth_prob[NUM_TOOTH_TIPS];
+static DetectorSigEntry sig_index[SIG_INDEX_LEN];
+static float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+static uint8_t lik_class[NUM_TOOTH_TIPS];
+static uint32_t history[HISTORY_LEN];
+static DetectorToothStats tooth_stats[NUM_TOOTH_TIPS];
+static float tooth_angle[NUM_TOOTH_TIPS];
+static Detector d;
+
+
+/* Definitions */
+
+/* Markers for insn_count.c; they have to stay real calls */
+__attribute__((noinline))
+void
+mcu_bench_start(void)
+{
+    __asm__ volatile ("" ::: "memory");
+}
+
+__attribute__((noinline))
+void
+mcu_bench_stop(void)
+{
+    __asm__ volatile ("" ::: "memory");
+}
+
+int
+main(void)
+{
+    size_t synced = 0;
+
+    if (!detector_init(&d, tooth_dists, NUM_TOOTH_TIPS, count_tooth_posns(NUM_TOOTH_TIPS, tooth_dists),
+                       tooth_prob, TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE)
+        || !detector_init_sig_index(&d, sig_index, SIG_INDEX_LEN, TEST_SIG_WINDOW)
+        || !detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA))
+    {
+        mcu_puts("couldn't set up the detector\n");
+        return 1;
+    }
+    detector_init_history(&d, history, HISTORY_LEN);
+    detector_init_tooth_stats(&d, tooth_stats);
+    detector_init_angle(&d, tooth_angle);
+    detector_set_error_adaptation(&d, RATE_FLOOR, RATE_CEILING, RATE_ALPHA);
+
+    mcu_stack_paint();
+    mcu_bench_start();
+    for (size_t i = 0; i < num_sample_engine_ticks; i++)
+    {
+        detector_interrupt(sample_engine_ticks[i], &d);
+        synced += d.has_sync;
+    }
+    mcu_bench_stop();
+
+    mcu_puts("dataset " DATASET_NAME "\nperiods ");
+    mcu_put_u32((uint32_t)num_sample_engine_ticks);
+    mcu_puts("\nsynced ");
+    mcu_put_u32((uint32_t)synced);
+    mcu_puts("\nsync acquired ");
+    mcu_put_u32((uint32_t)d.counters.sync_acquired);
+    mcu_puts("\nsync lost ");
+    mcu_put_u32((uint32_t)d.counters.sync_lost);
+    mcu_puts("\nstack bytes ");
+    mcu_put_u32((uint32_t)mcu_stack_used());
+    mcu_puts("\n");
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+#!/bin/sh
+# Cross-compile the detector and mcu_bench.c for Cortex-M cores, run each
+# build under qemu-system-arm over each built-in dataset, and report the
+# instructions it executed per function, its code size and its stack use.
+#
+# usage: mcu/run_qemu.sh [-b BASELINE] [core...]
+#   core      - m0, m4f or m7 (default: all three)
+#   -b FILE   - a summary.txt from an earlier run, to compare against
+#
+# Run it from c99_fp/. Everything goes in $OUT (default mcu/out); each build's
+# full report is $OUT/<core>-<dataset>/report.txt and the one-line-per-build
+# summary is $OUT/summary.txt. Set CROSS for another toolchain prefix, QEMU
+# for another emulator, CFLAGS for other optimization, and QEMU_PLUGIN_INCLUDE
+# to the directory with QEMU's qemu-plugin.h (include/qemu in its source).
+
+set -e
+
+CROSS=${CROSS:-arm-none-eabi-}
+QEMU=${QEMU:-qemu-system-arm}
+HOSTCC=${HOSTCC:-cc}
+CFLAGS=${CFLAGS:--O2}
+OUT=${OUT:-mcu/out}
+QEMU_PLUGIN_INCLUDE=${QEMU_PLUGIN_INCLUDE:-/usr/include/qemu}
+TIMEOUT=${TIMEOUT:-600}
+
+baseline=
+if [ "$1" = "-b" ]; then
+    baseline=$2
+    shift 2
+fi
+cores=${*:-m0 m4f m7}
+
+if [ ! -f detector.c ]; then
+    echo "run this from c99_fp/" >&2
+    exit 1
+fi
+if [ ! -f "$QEMU_PLUGIN_INCLUDE/qemu-plugin.h" ]; then
+    echo "no qemu-plugin.h in $QEMU_PLUGIN_INCLUDE; set QEMU_PLUGIN_INCLUDE" >&2
+    exit 1
+fi
+
+mkdir -p "$OUT"
+plugin=$OUT/libinsn_count.so
+$HOSTCC -std=gnu99 -O2 -fPIC -shared $(pkg-config --cflags glib-2.0) -I"$QEMU_PLUGIN_INCLUDE" \
+    mcu/insn_count.c -o "$plugin"
+
+summary=$OUT/summary.txt
+printf '%-12s %14s %14s %10s\n' build "insns/period" "detector text" "stack" > "$summary"
+
+for core in $cores; do
+    case $core in
+    m0)  cpu="-mcpu=cortex-m0 -mthumb -mfloat-abi=soft"
+         machine=microbit; ld=microbit.ld ;;
+    m4f) cpu="-mcpu=cortex-m4 -mthumb -mfpu=fpv4-sp-d16 -mfloat-abi=hard"
+         machine=mps2-an386; ld=mps2.ld ;;
+    m7)  cpu="-mcpu=cortex-m7 -mthumb -mfpu=fpv5-d16 -mfloat-abi=hard"
+         machine=mps2-an500; ld=mps2.ld ;;
+    *)   echo "unknown core $core; use m0, m4f or m7" >&2
+         exit 1 ;;
+    esac
+
+    for dataset in 4_1 36_1; do
+        build=$core-$dataset
+        dir=$OUT/$build
+        mkdir -p "$dir"
+
+        # -fstack-usage leaves a .su beside each object, with each function's own frame
+        for src in detector.c trace.c test_data.c mcu/mcu_bench.c mcu/startup.c; do
+            ${CROSS}gcc -std=c99 -Wall $CFLAGS $cpu -ffunction-sections -fdata-sections \
+                -fstack-usage -DTEST_DATASET_$dataset -I. -Imcu \
+                -c "$src" -o "$dir/$(basename "$src" .c).o"
+        done
+        ${CROSS}gcc $cpu -nostartfiles --specs=nano.specs -Lmcu -T "$ld" \
+            -Wl,--gc-sections -Wl,-Map="$dir/mcu_bench.map" \
+            "$dir"/*.o -lm -o "$dir/mcu_bench.elf"
+        ${CROSS}nm -S --defined-only "$dir/mcu_bench.elf" > "$dir/mcu_bench.syms"
+
+        # A failed run still leaves what it printed
+        status=0
+        timeout "$TIMEOUT" $QEMU -M $machine -nographic -monitor none -serial none \
+            -semihosting-config enable=on,target=native \
+            -kernel "$dir/mcu_bench.elf" \
+            -plugin "$plugin,syms=$dir/mcu_bench.syms" -d plugin -D "$dir/insns.txt" \
+            > "$dir/output.txt" || status=$?
+
+        {
+            echo "== $build on $machine ($CFLAGS)"
+            if [ $status -ne 0 ]; then
+                echo "run failed ($status)"
+            fi
+            cat "$dir/output.txt"
+            echo
+            echo "-- instructions, from mcu_bench_start to mcu_bench_stop"
+            cat "$dir/insns.txt"
+            echo
+            echo "-- code size by object, then the detector's own functions"
+            ${CROSS}size "$dir"/detector.o "$dir"/trace.o "$dir/mcu_bench.elf"
+            ${CROSS}nm -S --size-sort -t d "$dir/detector.o" | awk '$3 ~ /[tT]/' | sort -k2 -rn | head -20
+            echo
+            echo "-- stack, by each function's own frame"
+            cat "$dir"/*.su | sort -t '	' -k2 -rn | head -20
+        } > "$dir/report.txt"
+        cat "$dir/report.txt"
+        echo
+
+        insns=$(awk '/^instructions per call/ { print $4 }' "$dir/insns.txt")
+        stack=$(awk '/^stack bytes/ { print $3 }' "$dir/output.txt")
+        text=$(${CROSS}size "$dir/detector.o" | awk 'NR == 2 { print $1 }')
+        printf '%-12s %14s %14s %10s\n' "$build" "${insns:-?}" "$text" "${stack:-?}" >> "$summary"
+    done
+done
+
+cat "$summary"
+
+# Flag anything that grew by more than 1% since the baseline
+if [ -n "$baseline" ]; then
+    echo
+    awk 'NR == FNR { if (FNR > 1) for (i = 2; i <= 4; i++) was[$1, i] = $i; next }
+         FNR > 1 {
+             for (i = 2; i <= 4; i++)
+                 if (($1, i) in was && was[$1, i] + 0 > 0 && $i + 0 > 1.01 * was[$1, i]) {
+                     printf "%s: %s grew from %s to %s\n", $1, name[i], was[$1, i], $i
+                     grew = 1
+                 }
+         }
+         BEGIN { name[2] = "insns/period"; name[3] = "detector text"; name[4] = "stack" }
+         END { if (!grew) print "nothing grew by more than 1% since the baseline"; exit grew }' \
+        "$baseline" "$summary"
+fi
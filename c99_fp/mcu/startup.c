@@ -0,0 +1,237 @@
+/* Reset, vectors, semihosting and stack painting for the Cortex-M benchmark.
+ *
+ * Nothing here is particular to a chip: the linker script (microbit.ld or
+ * mps2.ld) says where flash and RAM are, and everything else goes through
+ * the core's own registers or the debugger.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mcu.h"
+
+
+/* Macros */
+
+#define SYS_WRITE0          0x04        /* semihosting operations */
+#define SYS_EXIT            0x18
+#define ADP_STOPPED_EXIT    0x20026     /* reasons to give SYS_EXIT */
+#define ADP_STOPPED_ERROR   0x20023
+
+#define STACK_PAINT         0xa5a5a5a5u
+#define STACK_MARGIN        16          /* words left unpainted below the caller, for mcu_stack_paint's own frame */
+
+#define CPACR               (*(volatile uint32_t*)0xe000ed88)
+
+
+/* Declarations */
+
+extern uint32_t _sidata[];      /* from the linker script */
+extern uint32_t _sdata[];
+extern uint32_t _edata[];
+extern uint32_t _sbss[];
+extern uint32_t _ebss[];
+extern uint32_t _stack_limit[];
+extern uint32_t _stack_top[];
+
+int
+main(void);
+
+void
+mcu_reset(void);
+
+void
+mcu_fault(void);
+
+int
+mcu_semihost(
+        const int op,
+        const void* arg
+        );
+
+void
+mcu_puts(const char* s);
+
+void
+mcu_put_u32(uint32_t x);
+
+void
+mcu_exit(const bool ok);
+
+void
+mcu_stack_paint(void);
+
+size_t
+mcu_stack_used(void);
+
+
+/* Variables */
+
+static uint32_t* painted_top = _stack_limit;    /* nothing painted yet */
+
+/* The core only needs the stack and the reset handler; the faults are
+ * there so a bad access stops the run rather than hanging it. */
+__attribute__((section(".vectors"), used))
+void (* const mcu_vectors[])(void) = {
+    (void (*)(void))_stack_top,
+    mcu_reset,
+    mcu_fault,      /* NMI */
+    mcu_fault,      /* HardFault */
+    mcu_fault,      /* MemManage, not on an M0 */
+    mcu_fault,      /* BusFault, nor this */
+    mcu_fault,      /* UsageFault, nor this */
+};
+
+
+/* Definitions */
+
+/* void mcu_reset - where the core starts
+ *
+ * arguments: none
+ * returns: never
+ * side-effects: sets up .data and .bss, turns the FPU on if there is one, and runs main
+ */
+void
+mcu_reset(void)
+{
+    uint32_t* src = _sidata;
+
+    for (uint32_t* dst = _sdata; dst < _edata; dst++)
+        *dst = *src++;
+    for (uint32_t* dst = _sbss; dst < _ebss; dst++)
+        *dst = 0;
+
+#if defined(__ARM_FP)
+    CPACR |= 0xfu << 20;        /* CP10 and CP11, full access */
+    __asm__ volatile ("dsb\n\tisb" ::: "memory");
+#endif
+
+    mcu_exit(main() == 0);
+}
+
+/* void mcu_fault - every other exception
+ *
+ * arguments: none
+ * returns: never
+ * side-effects: stops the run as failed
+ */
+void
+mcu_fault(void)
+{
+    mcu_puts("fault\n");
+    mcu_exit(false);
+}
+
+/* int mcu_semihost - ask the debugger to do something
+ *
+ * arguments: int op        - the semihosting operation, SYS_*
+ *            void* arg     - its argument, usually a pointer to a block of them
+ * returns: what the debugger put in r0
+ * side-effects: whatever the operation does
+ */
+int
+mcu_semihost(
+        const int op,
+        const void* arg
+        )
+{
+    register int r0 __asm__("r0") = op;
+    register const void* r1 __asm__("r1") = arg;
+
+    __asm__ volatile ("bkpt 0xab" : "+r" (r0) : "r" (r1) : "memory");
+
+    return r0;
+}
+
+/* void mcu_puts - write a string to the host's console
+ *
+ * arguments: char* s - the string
+ * returns: nothing
+ * side-effects: output
+ */
+void
+mcu_puts(const char* s)
+{
+    mcu_semihost(SYS_WRITE0, s);
+
+    return;
+}
+
+/* void mcu_put_u32 - write a number to the host's console
+ *
+ * arguments: uint32_t x - the number
+ * returns: nothing
+ * side-effects: output
+ */
+void
+mcu_put_u32(uint32_t x)
+{
+    char digits[11];
+    char* p = &digits[10];
+
+    *p = '\0';
+    do
+    {
+        *--p = (char)('0' + x % 10);
+        x /= 10;
+    } while (x != 0);
+
+    mcu_puts(p);
+
+    return;
+}
+
+/* void mcu_exit - stop
+ *
+ * arguments: bool ok - whether the run went well
+ * returns: never
+ * side-effects: QEMU exits 0 if ok, otherwise 1
+ */
+void
+mcu_exit(const bool ok)
+{
+    /* On a 32-bit core SYS_EXIT takes the reason itself, not a block */
+    mcu_semihost(SYS_EXIT, (const void*)(uintptr_t)(ok ? ADP_STOPPED_EXIT : ADP_STOPPED_ERROR));
+
+    for (;;)
+        ;
+}
+
+/* void mcu_stack_paint - paint the free stack below the caller
+ *
+ * arguments: none
+ * returns: nothing
+ * side-effects: overwrites the stack from _stack_limit up to just below its own frame
+ *
+ * Call it at the level the code to measure will be called from; nothing it
+ * calls afterwards can go deeper without overwriting some of the paint.
+ */
+void
+mcu_stack_paint(void)
+{
+    uint32_t* top = (uint32_t*)__builtin_frame_address(0) - STACK_MARGIN;
+
+    for (uint32_t* p = _stack_limit; p < top; p++)
+        *p = STACK_PAINT;
+    painted_top = top;
+
+    return;
+}
+
+/* size_t mcu_stack_used - how deep the stack has gone since mcu_stack_paint
+ *
+ * arguments: none
+ * returns: bytes below where the paint started that have been written
+ * side-effects: none
+ */
+size_t
+mcu_stack_used(void)
+{
+    uint32_t* p = _stack_limit;
+
+    while (p < painted_top && *p == STACK_PAINT)
+        p++;
+
+    return (size_t)(painted_top - p) * sizeof(uint32_t);
+}
@@ -0,0 +1,403 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <float.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "detector.h"
+#include "parallel.h"
+
+
+/* Declarations */
+
+bool
+parallel_init(
+        ParallelTeam* t,
+        Detector* d,
+        const size_t num_threads,
+        pthread_t threads[const],
+        ParallelSlice slices[const],
+        float moved[const]
+        );
+
+void
+parallel_update_belief(
+        ParallelTeam* t,
+        const uint32_t timer,
+        const uint32_t prev_timer
+        );
+
+void
+parallel_shutdown(ParallelTeam* t);
+
+void*
+parallel_worker(void* arg);
+
+void
+parallel_barrier(ParallelTeam* t);
+
+void
+parallel_run(
+        ParallelTeam* t,
+        ParallelSlice* s
+        );
+
+void
+parallel_keep_top2(
+        ParallelSlice* s,
+        const float p,
+        const size_t i
+        );
+
+
+/* Definitions */
+
+/* bool parallel_init - start a team of threads to update a detector's belief
+ *
+ * arguments: ParallelTeam* t        - the team
+ *            Detector* d            - an initialized detector
+ *            size_t num_threads     - threads to share the work, including the calling one (at least 1)
+ *            pthread_t threads[]    - storage for num_threads - 1 thread handles
+ *            ParallelSlice slices[] - storage for num_threads slices
+ *            float moved[]          - storage for d->num_tooth_tips bins
+ * returns: true if every thread started, otherwise false and d is left alone
+ * side-effects: modifies *t and d->team, and starts num_threads - 1 threads
+ *
+ * From here on detector_interrupt shares d's belief updates out among the team
+ * while it's at least t->min_bins long, until parallel_shutdown.
+ */
+bool
+parallel_init(
+        ParallelTeam* t,
+        Detector* d,
+        const size_t num_threads,
+        pthread_t threads[const],
+        ParallelSlice slices[const],
+        float moved[const]
+        )
+{
+    size_t n = d->num_tooth_tips;
+
+    if (num_threads < 1)
+        return false;
+
+    t->d = d;
+    t->num_threads = num_threads;
+    t->min_bins = PARALLEL_DEFAULT_MIN_BINS;
+    t->threads = threads;
+    t->slices = slices;
+    t->moved = moved;
+    t->arrived = 0;
+    t->generation = 0;
+    t->job = PARALLEL_JOB_MOVE;
+
+    for (size_t k = 0; k < num_threads; k++)
+    {
+        slices[k].team = t;
+        slices[k].lo = (n * k / num_threads) & ~(size_t)(PARALLEL_SLICE_ALIGN - 1);
+    }
+    for (size_t k = 0; k + 1 < num_threads; k++)
+        slices[k].hi = slices[k + 1].lo;
+    slices[num_threads - 1].hi = n;
+
+    for (size_t k = 1; k < num_threads; k++)
+    {
+        if (pthread_create(&threads[k - 1], NULL, parallel_worker, &slices[k]) != 0)
+        {
+            /* Let the ones that did start go; they're all waiting at the
+             * barrier, which counts on all num_threads arriving, so count
+             * the ones that didn't start as there already. */
+            t->num_threads = k;
+            t->job = PARALLEL_JOB_STOP;
+            parallel_barrier(t);
+            for (size_t j = 1; j < k; j++)
+                pthread_join(threads[j - 1], NULL);
+            return false;
+        }
+    }
+
+    d->team = t;
+
+    return true;
+}
+
+/* void parallel_update_belief - move and localize the belief across the team
+ *
+ * arguments: ParallelTeam* t     - a started team
+ *            uint32_t timer      - the period that just ended
+ *            uint32_t prev_timer - the period before it, or 0 if there wasn't one
+ * returns: nothing
+ * side-effects: modifies t->moved, d->tooth_prob and d->stats, as update_belief does
+ *
+ * Call this from the thread that called parallel_init; the belief comes out
+ * the same as from update_belief, but for the order the sums are added in.
+ */
+void
+parallel_update_belief(
+        ParallelTeam* t,
+        const uint32_t timer,
+        const uint32_t prev_timer
+        )
+{
+    Detector* d = t->d;
+
+    t->timer = timer;
+    t->prev_timer = prev_timer;
+
+    if (d->lik_lut == NULL)
+        t->job = PARALLEL_JOB_STEP;
+    else if (prev_timer != 0)
+    {
+        int32_t j = detector_log2_ratio_q(prev_timer, timer, DETECTOR_LIK_STEPS_PER_OCTAVE)
+                  + DETECTOR_LIK_BINS / 2;
+
+        if (j < 0)      /* as in detector_locate_lut */
+            j = 0;
+        if (j >= DETECTOR_LIK_BINS)
+            j = DETECTOR_LIK_BINS - 1;
+
+        t->column = &(d->lik_lut[j]);
+        t->job = PARALLEL_JOB_LUT;
+    }
+    else
+        t->job = PARALLEL_JOB_MOVE;
+
+    parallel_barrier(t);        /* go */
+    parallel_run(t, &(t->slices[0]));
+
+    /* Second level of the reductions: the slices' own top two bins and entropy */
+    ParallelSlice all = { .first = -1, .second = -1, .first_i = 0, .second_i = 0 };
+    float entropy = 0.0;
+
+    for (size_t k = 0; k < t->num_threads; k++)
+    {
+        const ParallelSlice* s = &(t->slices[k]);
+
+        if (s->lo == s->hi)
+            continue;
+        parallel_keep_top2(&all, s->first, s->first_i);
+        parallel_keep_top2(&all, s->second, s->second_i);
+        entropy += s->entropy;
+    }
+
+    d->stats.top_bin = (detector_index_t)all.first_i;
+    d->stats.second_bin = (detector_index_t)all.second_i;
+    d->stats.top_prob = all.first;
+    d->stats.second_prob = all.second;
+    d->stats.margin = all.first - all.second;
+    d->stats.entropy = entropy;
+
+    return;
+}
+
+/* void parallel_shutdown - stop a team's threads
+ *
+ * arguments: ParallelTeam* t - a started team
+ * returns: nothing
+ * side-effects: joins the team's threads, and sets its detector's team back to NULL
+ */
+void
+parallel_shutdown(ParallelTeam* t)
+{
+    t->job = PARALLEL_JOB_STOP;
+    parallel_barrier(t);
+
+    for (size_t k = 1; k < t->num_threads; k++)
+        pthread_join(t->threads[k - 1], NULL);
+
+    t->d->team = NULL;
+
+    return;
+}
+
+/* void* parallel_worker - what each thread but the calling one runs
+ *
+ * arguments: void* arg - the thread's ParallelSlice
+ * returns: NULL, once told to stop
+ * side-effects: works on its slice of the belief whenever the calling thread says go
+ */
+void*
+parallel_worker(void* arg)
+{
+    ParallelSlice* s = arg;
+    ParallelTeam* t = s->team;
+
+    for (;;)
+    {
+        parallel_barrier(t);
+        if (t->job == PARALLEL_JOB_STOP)
+            return NULL;
+        parallel_run(t, s);
+    }
+}
+
+/* void parallel_barrier - wait for the rest of the team
+ *
+ * arguments: ParallelTeam* t - the team
+ * returns: once all t->num_threads threads have called it
+ * side-effects: modifies t->arrived and t->generation
+ *
+ * Whatever a thread wrote before the barrier, every thread can read after it.
+ * Waiting threads spin, and only give the core up if it's taking a while, as
+ * it will on a host with fewer cores than threads.
+ */
+void
+parallel_barrier(ParallelTeam* t)
+{
+    uint32_t generation = __atomic_load_n(&(t->generation), __ATOMIC_ACQUIRE);
+
+    if (__atomic_add_fetch(&(t->arrived), 1, __ATOMIC_ACQ_REL) == t->num_threads)
+    {
+        __atomic_store_n(&(t->arrived), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(t->generation), generation + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    for (uint32_t spins = 0; __atomic_load_n(&(t->generation), __ATOMIC_ACQUIRE) == generation; spins++)
+    {
+        if (spins >= PARALLEL_SPIN_LIMIT)
+            sched_yield();
+    }
+
+    return;
+}
+
+/* void parallel_run - one thread's part of a belief update
+ *
+ * arguments: ParallelTeam* t  - the team, with the job set
+ *            ParallelSlice* s - the thread's slice
+ * returns: once the whole team has finished the update
+ * side-effects: modifies the slice's bins of t->moved and the belief, and *s
+ */
+void
+parallel_run(
+        ParallelTeam* t,
+        ParallelSlice* s
+        )
+{
+    Detector* d = t->d;
+    const size_t n = d->num_tooth_tips;
+    const size_t lo = s->lo;
+    const size_t hi = s->hi;
+    float* prior = d->tooth_prob;
+    float* moved = t->moved;
+
+    /* Move, as detector_move; the halo is the two bins before lo, wrapped */
+    const float hit_rate = 1 - d->miss_rate - d->extra_rate;
+    const float miss_rate = d->miss_rate;
+    const float extra_rate = d->extra_rate;
+
+    for (size_t i = lo; i < hi; i++)
+    {
+        size_t i1 = (i >= 1) ? i - 1 : i + n - 1;
+        size_t i2 = (i >= 2) ? i - 2 : i + n - 2;
+
+        moved[i] = hit_rate * prior[i1] + miss_rate * prior[i2] + extra_rate * prior[i];
+    }
+
+    parallel_barrier(t);        /* nobody reads the prior from here on, so it can be overwritten */
+
+    /* Locate, as detector_locate and detector_locate_lut, into the belief */
+    float sum = 0.0;
+
+    if (t->job == PARALLEL_JOB_STEP)
+    {
+        for (size_t i = lo; i < hi; i++)
+        {
+            size_t i1 = (i >= 1) ? i - 1 : n - 1;
+            float accel = detector_calc_accel(d->ticks_per_sec, d->num_tooth_posns,
+                                              t->prev_timer, d->tooth_dists[i1],
+                                              t->timer, d->tooth_dists[i]);
+            float lik = (fabsf(accel) > d->max_accel) ? d->error_rate : 1 - d->error_rate;
+
+            prior[i] = moved[i] * lik;
+            sum += prior[i];
+        }
+    }
+    else if (t->job == PARALLEL_JOB_LUT)
+    {
+        for (size_t i = lo; i < hi; i++)
+        {
+            prior[i] = moved[i] * t->column[d->lik_class[i] * DETECTOR_LIK_BINS];
+            sum += prior[i];
+        }
+    }
+    else
+    {
+        for (size_t i = lo; i < hi; i++)
+        {
+            prior[i] = moved[i];
+            sum += prior[i];
+        }
+    }
+    s->sum = sum;
+
+    parallel_barrier(t);
+
+    /* Normalize, as normalize_dist_stats; every thread adds up the same sums
+     * in the same order, so nobody has to wait for one thread to do it */
+    float total = 0.0;
+
+    for (size_t k = 0; k < t->num_threads; k++)
+        total += t->slices[k].sum;
+
+    if (total == 0)         /* anything is possible  */
+        total = FLT_MAX;    /* so I remain credulous */
+
+    float invsum = 1.0 / total;
+    float entropy = 0.0;
+
+    s->first = -1;
+    s->second = -1;
+    s->first_i = lo;
+    s->second_i = lo;
+
+    for (size_t i = lo; i < hi; i++)
+    {
+        float p = prior[i] * invsum;
+
+        prior[i] = p;
+        entropy -= p * fast_log2f(p);
+        parallel_keep_top2(s, p, i);
+    }
+    s->entropy = entropy;
+
+    parallel_barrier(t);        /* done */
+
+    return;
+}
+
+/* void parallel_keep_top2 - offer a bin to a running top two
+ *
+ * arguments: ParallelSlice* s - the top two so far
+ *            float p          - the bin's probability
+ *            size_t i         - the bin
+ * returns: nothing
+ * side-effects: modifies s->first, s->second and their bins
+ */
+void
+parallel_keep_top2(
+        ParallelSlice* s,
+        const float p,
+        const size_t i
+        )
+{
+    if (p > s->first)
+    {
+        s->second = s->first;
+        s->second_i = s->first_i;
+        s->first = p;
+        s->first_i = i;
+    }
+    else if (p > s->second)
+    {
+        s->second = p;
+        s->second_i = i;
+    }
+
+    return;
+}
@@ -0,0 +1,92 @@
+/* A team of threads to share the grid detector's belief update, for beliefs
+ * of tens of thousands of bins on a host with cores to spare.
+ *
+ * Each thread owns a slice of the circular belief. An update runs in three
+ * phases, each ending at a barrier:
+ *
+ *   - move: each slice's bins from the prior, reading the two bins before
+ *     the slice (its halo) from whoever owns them.
+ *   - locate: each bin times its likelihood, and each slice's sum.
+ *   - normalize: every thread adds up the slice sums in the same order, so
+ *     they all get the same total, then scales its slice and keeps its own
+ *     top two bins and entropy. The calling thread merges those at the end.
+ *
+ * The threads are started once, by parallel_init, and spin at a barrier
+ * between updates instead of sleeping, so an update costs no wakeups. The
+ * calling thread is one of the team. Only detectors built with
+ * -DDETECTOR_PARALLEL use a team, and only for beliefs of at least min_bins,
+ * below which the barriers cost more than the threads save; the cycle belief
+ * and SOFTMAX builds always update serially. */
+
+/* Smallest belief worth sharing out, unless changed; see tools/parallel_bench.
+ * A serial update costs about 10 ns a bin at -O2, so 4096 bins is about 40 us.
+ * Two threads halve that and add three barriers, which leaves each barrier
+ * some 4 us before the team is no longer 1.25x faster. A barrier between
+ * spinning cores takes well under that. */
+#define PARALLEL_DEFAULT_MIN_BINS 4096
+
+/* Slices start on a multiple of this many bins, so no two threads write to one cache line */
+#define PARALLEL_SLICE_ALIGN 16
+
+/* Times a waiting thread checks the barrier before yielding the core */
+#define PARALLEL_SPIN_LIMIT 4096
+
+/* What the team is to do next */
+#define PARALLEL_JOB_STEP 0     /* update with the max_accel step model */
+#define PARALLEL_JOB_LUT  1     /* update with the likelihood table */
+#define PARALLEL_JOB_MOVE 2     /* move and normalize only; there's no ratio yet */
+#define PARALLEL_JOB_STOP 3     /* leave */
+
+struct ParallelTeam;
+
+/* One thread's slice of the belief, and what it found there */
+typedef struct {
+    struct ParallelTeam *team;
+    size_t   lo;                // first bin of the slice
+    size_t   hi;                // one past the last
+    float    sum;               // of the slice's unnormalized bins
+    float    entropy;           // the slice's share of the belief's entropy
+    float    first;             // the slice's top two bins, as in normalize_dist_stats
+    float    second;
+    size_t   first_i;
+    size_t   second_i;
+    uint8_t  pad[8];            // to a 64-byte cache line on a 64-bit host, so neighbours don't share one
+} ParallelSlice;
+
+typedef struct ParallelTeam {
+    Detector *d;                // the detector whose belief is shared out
+    size_t   num_threads;       // including the calling thread
+    size_t   min_bins;          // PARALLEL_DEFAULT_MIN_BINS unless changed
+    pthread_t *threads;         // the workers, num_threads - 1 of them
+    ParallelSlice *slices;      // num_threads of them; the calling thread has the first
+    float    *moved;            // the belief after the move, num_tooth_tips of them
+
+    uint32_t arrived;           // threads at the barrier
+    uint32_t generation;        // times everyone has got through it
+    uint8_t  job;               // PARALLEL_JOB_*
+    uint32_t timer;             // the period being applied
+    uint32_t prev_timer;
+    const float *column;        // lik_lut column of the period ratio, for PARALLEL_JOB_LUT
+} ParallelTeam;
+
+
+/* Start a team of threads to update d's belief; storage is caller-provided */
+bool
+parallel_init(
+        ParallelTeam* t,
+        Detector* d,
+        const size_t num_threads,
+        pthread_t threads[const],
+        ParallelSlice slices[const],
+        float moved[const]);
+
+/* Move and localize d's belief against a period, as update_belief does */
+void
+parallel_update_belief(
+        ParallelTeam* t,
+        const uint32_t timer,
+        const uint32_t prev_timer);
+
+/* Stop the team's threads and detach it from its detector */
+void
+parallel_shutdown(ParallelTeam* t);
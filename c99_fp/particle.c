@@ -0,0 +1,526 @@
+#include <float.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "detector.h"
+#include "particle.h"
+
+
+/* Macros */
+
+#define PI 3.14159265359
+
+/* Resample when the effective number of particles falls below this fraction of them */
+#define PARTICLE_RESAMPLE_BELOW 0.5
+
+/* Speeds the first period spreads the particles over, either side of the one it implies */
+#define PARTICLE_START_SPREAD 0.1
+
+/* Beyond these, a particle's story is too unlikely to be worth the arithmetic */
+#define PARTICLE_EDGE_CUTOFF 6.0    /* standard deviations off a tooth */
+#define PARTICLE_MAX_SKIP    3      /* missed edges in one period */
+
+
+/* Declarations */
+
+bool
+particle_init(
+        ParticleDetector* p,
+        uint8_t tooth_dists[const],
+        const size_t num_tooth_tips,
+        const detector_index_t num_tooth_posns,
+        Particle particles[const],
+        const size_t num_particles,
+        detector_index_t tooth_posn[const],
+        detector_index_t posn_tooth[const],
+        float tooth_prob[const],
+        const uint32_t sample_rate,
+        const float max_accel,
+        const float error_rate,
+        const uint32_t seed
+        );
+
+void
+particle_interrupt(
+        uint32_t timer_register,
+        ParticleDetector* p
+        );
+
+void
+particle_spread(
+        ParticleDetector* p,
+        const float dt
+        );
+
+float
+particle_propagate(
+        ParticleDetector* p,
+        Particle* q,
+        const float dt
+        );
+
+void
+particle_resample(ParticleDetector* p);
+
+void
+particle_summarize(ParticleDetector* p);
+
+void
+particle_update_sync(
+        ParticleDetector* p,
+        const detector_index_t previous_tooth
+        );
+
+float
+rng_uniform(uint32_t* state);
+
+float
+rng_gauss(uint32_t* state);
+
+
+/* Definitions */
+
+/*
+ * bool particle_init - set up a particle filter
+ *
+ * arguments: ParticleDetector* p    - the filter
+ *            uint8_t tooth_dists[]  - as for detector_init
+ *            size_t num_tooth_tips  - as for detector_init
+ *            detector_index_t num_tooth_posns - as for detector_init
+ *            Particle particles[]   - storage for 2 * num_particles particles, the
+ *                                     current set and the one resampling builds
+ *            size_t num_particles   - how many particles to run
+ *            detector_index_t tooth_posn[]  - storage for num_tooth_tips positions
+ *            detector_index_t posn_tooth[]  - storage for num_tooth_posns teeth
+ *            float tooth_prob[]     - storage for num_tooth_tips probabilities
+ *            uint32_t sample_rate   - as for detector_init
+ *            float max_accel        - as for detector_init
+ *            float error_rate       - as for detector_init
+ *            uint32_t seed          - for the random accelerations; runs with the same
+ *                                     seed and input give the same results
+ * returns: false if there are no particles, or the tooth map doesn't add up
+ * side-effects: modifies *p and its storage
+ */
+bool
+particle_init(
+        ParticleDetector* p,
+        uint8_t tooth_dists[const],
+        const size_t num_tooth_tips,
+        const detector_index_t num_tooth_posns,
+        Particle particles[const],
+        const size_t num_particles,
+        detector_index_t tooth_posn[const],
+        detector_index_t posn_tooth[const],
+        float tooth_prob[const],
+        const uint32_t sample_rate,
+        const float max_accel,
+        const float error_rate,
+        const uint32_t seed)
+{
+    if (num_particles == 0 || num_tooth_tips < 2
+        || count_tooth_posns(num_tooth_tips, tooth_dists) != num_tooth_posns)
+        return false;
+
+    p->tooth_dists = tooth_dists;
+    p->num_tooth_tips = num_tooth_tips;
+    p->num_tooth_posns = num_tooth_posns;
+    p->ticks_per_sec = sample_rate;
+    p->max_accel = max_accel;
+    p->error_rate = error_rate;
+
+    p->particles = particles;
+    p->spare = &(particles[num_particles]);
+    p->num_particles = num_particles;
+    p->tooth_posn = tooth_posn;
+    p->posn_tooth = posn_tooth;
+    p->tooth_prob = tooth_prob;
+
+    /* Tooth i ends the period covering tooth_dists[i] positions, so it's
+     * that far on from tooth i - 1; tooth 0 is at position 0. */
+    size_t posn = 0;
+    for (size_t i = 0; i < num_tooth_tips; i++)
+    {
+        if (i > 0)
+            posn += tooth_dists[i];
+        tooth_posn[i] = (detector_index_t)posn;
+    }
+    for (size_t i = 0; i < num_tooth_tips; i++)
+    {
+        size_t end = (i + 1 < num_tooth_tips) ? tooth_posn[i + 1] : num_tooth_posns;
+        for (size_t j = tooth_posn[i]; j < end; j++)
+            posn_tooth[j] = (detector_index_t)i;
+    }
+
+    p->sync_accept = logf((1 - PARTICLE_DEFAULT_MISS_PROB) / PARTICLE_DEFAULT_FALSE_SYNC_PROB);
+    p->sync_reject = logf(PARTICLE_DEFAULT_MISS_PROB / (1 - PARTICLE_DEFAULT_FALSE_SYNC_PROB));
+    p->sync_llr = 0.0;
+    p->sync_step = logf((1 - error_rate) / error_rate);
+
+    p->current_tooth = 0;
+    p->has_sync = false;
+    p->velocity = 0.0;
+    p->confidence = 0.0;
+    for (size_t i = 0; i < num_tooth_tips; i++)
+        tooth_prob[i] = 1.0 / (float)num_tooth_tips;
+
+    p->started = false;
+    p->rng = (seed != 0) ? seed : 1;
+    p->resamples = 0;
+
+    return true;
+}
+
+/*
+ * void particle_interrupt - move and weigh every particle by one period
+ *
+ * arguments: uint32_t timer_register - the period that just ended, in timer ticks
+ *            ParticleDetector* p     - the filter
+ * returns: nothing
+ * side-effects: modifies *p and its storage
+ */
+void
+particle_interrupt(
+        uint32_t timer_register,
+        ParticleDetector* p)
+{
+    detector_index_t previous_tooth = p->current_tooth;
+
+    if (timer_register == 0)    /* glitch; nothing to measure */
+        return;
+
+    float dt = (float)timer_register / (float)p->ticks_per_sec;
+
+    if (!p->started)
+    {
+        particle_spread(p, dt);
+        particle_summarize(p);
+        return;
+    }
+
+    float total = 0.0;
+    for (size_t k = 0; k < p->num_particles; k++)
+        total += particle_propagate(p, &(p->particles[k]), dt);
+
+    /* Nothing fits: start over from this period */
+    if (total == 0)
+    {
+        particle_spread(p, dt);
+        particle_summarize(p);
+        if (p->has_sync)
+        {
+            p->has_sync = false;
+            p->sync_llr = 0.0;
+        }
+        return;
+    }
+
+    float inv = 1.0 / total;
+    float sum_sq = 0.0;
+    for (size_t k = 0; k < p->num_particles; k++)
+    {
+        p->particles[k].weight *= inv;
+        sum_sq += p->particles[k].weight * p->particles[k].weight;
+    }
+
+    if (1.0 / sum_sq < PARTICLE_RESAMPLE_BELOW * (float)p->num_particles)
+        particle_resample(p);
+
+    particle_summarize(p);
+    particle_update_sync(p, previous_tooth);
+
+    return;
+}
+
+/*
+ * void particle_spread - spread the particles evenly over the teeth
+ *
+ * arguments: ParticleDetector* p - the filter
+ *            float dt            - the period that just ended, in seconds
+ * returns: nothing
+ * side-effects: modifies p->particles
+ *
+ * Each particle's speed is the one that would have covered its tooth's
+ * distance in dt, give or take PARTICLE_START_SPREAD.
+ */
+void
+particle_spread(
+        ParticleDetector* p,
+        const float dt)
+{
+    size_t n = p->num_tooth_tips;
+    float weight = 1.0 / (float)p->num_particles;
+
+    for (size_t k = 0; k < p->num_particles; k++)
+    {
+        Particle* q = &(p->particles[k]);
+        float jitter = 1 + PARTICLE_START_SPREAD * (2 * rng_uniform(&(p->rng)) - 1);
+
+        q->tooth = (detector_index_t)(k * n / p->num_particles);
+        q->angle = (float)p->tooth_posn[q->tooth];
+        q->omega = (float)p->tooth_dists[q->tooth] / dt * jitter;
+        q->weight = weight;
+    }
+    p->started = true;
+
+    return;
+}
+
+/*
+ * float particle_propagate - move a particle on by one period, and weigh it
+ *
+ * arguments: ParticleDetector* p - the filter
+ *            Particle* q         - the particle
+ *            float dt            - the period, in seconds
+ * returns: the particle's new (unnormalized) weight
+ * side-effects: modifies *q and p->rng
+ *
+ * The particle turns at its own speed plus a random acceleration. Either its
+ * edge was the first tooth past where it started, or the nearest one to
+ * where it got to, skipping teeth on the way at the cost of a missed edge
+ * each, and landing off the tooth costs a Gaussian in the distance; or the
+ * edge was noise, which could have come anywhere. Whichever is likelier is
+ * what the particle takes to have happened.
+ */
+float
+particle_propagate(
+        ParticleDetector* p,
+        Particle* q,
+        const float dt)
+{
+    size_t n = p->num_tooth_tips;
+    float posns = (float)p->num_tooth_posns;
+    float max_accel = p->max_accel * posns / (float)(2 * PI);  /* in positions per second^2 */
+    float accel = (float)PARTICLE_ACCEL_SPREAD * max_accel * rng_gauss(&(p->rng));
+
+    if (accel > max_accel)
+        accel = max_accel;
+    if (accel < -max_accel)
+        accel = -max_accel;
+
+    float target = q->angle + q->omega * dt + 0.5f * accel * dt * dt;
+    q->omega += accel * dt;
+    if (q->omega < 0)
+        q->omega = 0;
+
+    if (target >= posns)
+        target = fmodf(target, posns);
+    if (target < 0 || target >= posns)  /* a whisker either way, from rounding */
+        target = 0;
+
+    /* The last tooth at or before the target, and the first one after it.
+     * No % here: this runs for every particle, and division is slow. */
+    size_t before = p->posn_tooth[(size_t)target];
+    size_t after = (before + 1 < n) ? before + 1 : 0;
+    float r_before = target - (float)p->tooth_posn[before];
+    float r_after = (float)p->tooth_posn[after] - target;
+    size_t passed = (before >= q->tooth) ? before - q->tooth : before + n - q->tooth;
+
+    if (r_after < 0)
+        r_after += posns;
+
+    /* The edge was a tooth: the nearer of the two, unless that's where we started */
+    size_t tooth = (r_after < r_before || passed == 0) ? after : before;
+    float r = (tooth == after) ? r_after : r_before;
+    size_t skipped = ((tooth > q->tooth) ? tooth : tooth + n) - q->tooth - 1;
+    float hit = 0.0;
+
+    if (r < (float)(PARTICLE_EDGE_CUTOFF * PARTICLE_EDGE_SIGMA) && skipped <= PARTICLE_MAX_SKIP)
+    {
+        hit = (1 - p->error_rate) * expf(r * r * (float)(-0.5 / (PARTICLE_EDGE_SIGMA * PARTICLE_EDGE_SIGMA)));
+        for (size_t i = 0; i < skipped; i++)
+            hit *= p->error_rate / 2;
+    }
+
+    /* Or noise, and we've passed any teeth between without seeing them */
+    float noise = 0.0;
+
+    if (passed <= PARTICLE_MAX_SKIP)
+    {
+        noise = p->error_rate / 2;
+        for (size_t i = 0; i < passed; i++)
+            noise *= p->error_rate / 2;
+    }
+
+    if (hit >= noise)
+    {
+        q->tooth = (detector_index_t)tooth;
+        q->angle = (float)p->tooth_posn[tooth];
+        q->weight *= hit;
+    }
+    else
+    {
+        q->tooth = (detector_index_t)before;
+        q->angle = target;
+        q->weight *= noise;
+    }
+
+    return q->weight;
+}
+
+/*
+ * void particle_resample - replace the particles with an equally weighted set drawn from them
+ *
+ * arguments: ParticleDetector* p - the filter, with normalized weights
+ * returns: nothing
+ * side-effects: swaps p->particles and p->spare, and modifies p->rng
+ *
+ * Systematic resampling: one random offset, then evenly spaced picks along
+ * the cumulative weights, so each particle is copied within one of its
+ * expected number of times. The last PARTICLE_REINJECT of the new set are
+ * spread over every tooth instead, at the weighted mean speed; with only a
+ * few hundred particles, whole hypotheses otherwise die out for good.
+ */
+void
+particle_resample(ParticleDetector* p)
+{
+    size_t m = p->num_particles;
+    size_t fresh = (size_t)(PARTICLE_REINJECT * (float)m);
+    size_t kept = m - fresh;
+    float step = 1.0 / (float)kept;
+    float pick = step * rng_uniform(&(p->rng));
+    float cumulative = p->particles[0].weight;
+    float omega = 0.0;
+    size_t j = 0;
+
+    for (size_t k = 0; k < m; k++)
+        omega += p->particles[k].weight * p->particles[k].omega;
+
+    for (size_t k = 0; k < kept; k++)
+    {
+        while (pick > cumulative && j + 1 < m)
+            cumulative += p->particles[++j].weight;
+
+        p->spare[k] = p->particles[j];
+        p->spare[k].weight = 1.0 / (float)m;
+        pick += step;
+    }
+
+    for (size_t k = 0; k < fresh; k++)
+    {
+        Particle* q = &(p->spare[kept + k]);
+        q->tooth = (detector_index_t)((k * p->num_tooth_tips / fresh + (p->rng >> 8)) % p->num_tooth_tips);
+        q->angle = (float)p->tooth_posn[q->tooth];
+        q->omega = omega;
+        q->weight = 1.0 / (float)m;
+    }
+
+    Particle* swap = p->particles;
+    p->particles = p->spare;
+    p->spare = swap;
+    p->resamples++;
+
+    return;
+}
+
+/*
+ * void particle_summarize - total the particles up by tooth
+ *
+ * arguments: ParticleDetector* p - the filter, with normalized weights
+ * returns: nothing
+ * side-effects: modifies p->tooth_prob, p->current_tooth, p->confidence and p->velocity
+ */
+void
+particle_summarize(ParticleDetector* p)
+{
+    float omega = 0.0;
+
+    for (size_t i = 0; i < p->num_tooth_tips; i++)
+        p->tooth_prob[i] = 0.0;
+
+    for (size_t k = 0; k < p->num_particles; k++)
+    {
+        p->tooth_prob[p->particles[k].tooth] += p->particles[k].weight;
+        omega += p->particles[k].weight * p->particles[k].omega;
+    }
+
+    detector_find_max_prob(p->tooth_prob, p->num_tooth_tips, &(p->confidence), &(p->current_tooth));
+    p->velocity = omega * 2 * PI / (float)p->num_tooth_posns;
+
+    return;
+}
+
+/*
+ * void particle_update_sync - decide sync as detector_interrupt does
+ *
+ * arguments: ParticleDetector* p     - the filter, summarized
+ *            detector_index_t previous_tooth  - current_tooth before this period
+ * returns: nothing
+ * side-effects: modifies p->has_sync and p->sync_llr
+ *
+ * Sync is declared once the best tooth's weight outweighs the runner-up's by
+ * sync_accept. After that it's kept only while the best tooth moves on by
+ * one each period and stays clear of the runner-up.
+ */
+void
+particle_update_sync(
+        ParticleDetector* p,
+        const detector_index_t previous_tooth)
+{
+    if (!p->has_sync)
+    {
+        float top, second;
+        detector_index_t top_bin, second_bin;
+
+        detector_find_top2_prob(p->tooth_prob, p->num_tooth_tips, &top, &top_bin, &second, &second_bin);
+        p->sync_llr = (second > 0) ? logf(top / second) : p->sync_accept;
+        if (p->sync_llr >= p->sync_accept)
+        {
+            p->has_sync = true;
+            p->sync_llr = p->sync_accept;
+        }
+        return;
+    }
+
+    /* The track is only as good as the belief behind it: a top that jumps,
+     * or a runner-up within one edge error's odds of it, means we can no
+     * longer say which tooth this is, however long the track has held. */
+    float top, second;
+    detector_index_t top_bin, second_bin;
+
+    detector_find_top2_prob(p->tooth_prob, p->num_tooth_tips, &top, &top_bin, &second, &second_bin);
+    if (p->current_tooth != (previous_tooth + 1) % p->num_tooth_tips
+        || (second > 0 && logf(top / second) < p->sync_step))
+    {
+        p->has_sync = false;
+        p->sync_llr = 0.0;
+        return;
+    }
+
+    p->sync_llr += p->sync_step;
+    if (p->sync_llr > p->sync_accept)
+        p->sync_llr = p->sync_accept;
+
+    return;
+}
+
+/*
+ * float rng_uniform - a uniform random number in [0, 1), from xorshift32
+ */
+float
+rng_uniform(uint32_t* state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return (float)(x >> 8) * (1.0f / 16777216.0f);
+}
+
+/*
+ * float rng_gauss - a roughly standard normal random number
+ *
+ * The sum of four uniforms, centred and scaled: close enough for process
+ * noise, and bounded, so it never throws a particle wildly off.
+ */
+float
+rng_gauss(uint32_t* state)
+{
+    float sum = rng_uniform(state) + rng_uniform(state) + rng_uniform(state) + rng_uniform(state);
+
+    return (sum - 2.0f) * 1.7320508f;
+}
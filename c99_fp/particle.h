@@ -0,0 +1,92 @@
+/* An alternative localization engine: a particle filter over continuous
+ * crank angle and angular velocity.
+ *
+ * The grid detector keeps one probability per tooth and no speed, so every
+ * tooth's acceleration check starts from scratch with the last two periods.
+ * Here each particle is a guess at where the crank is and how fast it's
+ * turning. Every period moves each particle on by its own speed, plus a
+ * random acceleration, and weighs it by how close that lands it to a tooth,
+ * which it then sits on; or, if that's the likelier story, by the odds of
+ * the edge having been noise, in which case it carries on from wherever it
+ * got to. Particles that keep landing on teeth survive resampling, so the
+ * speed is learned along with the position.
+ *
+ * The interface follows the Detector's: caller storage, an interrupt
+ * function taking periods, and the same current_tooth / has_sync /
+ * confidence results. More particles are more accurate and proportionally
+ * slower; see tools/engine_bench.c. */
+
+/* How the particles' tooth weights decide sync, as in detector_set_sync_thresholds */
+#define PARTICLE_DEFAULT_FALSE_SYNC_PROB DETECTOR_DEFAULT_FALSE_SYNC_PROB
+#define PARTICLE_DEFAULT_MISS_PROB       DETECTOR_DEFAULT_MISS_PROB
+
+/* Spread of where an edge lands around its tooth, in tooth positions */
+#define PARTICLE_EDGE_SIGMA 0.15
+
+/* Standard deviation of the random acceleration, as a fraction of max_accel */
+#define PARTICLE_ACCEL_SPREAD 0.25
+
+/* Share of the particles each resampling spreads over all the teeth afresh,
+ * at the current speed, so a wrong lock can still be found out */
+#define PARTICLE_REINJECT 0.05
+
+typedef struct {
+    float   angle;              // tooth positions from tooth 0
+    float   omega;              // angular velocity, tooth positions per second
+    float   weight;
+    detector_index_t tooth;     // last tooth the particle passed
+} Particle;
+
+typedef struct {
+    detector_index_t current_tooth;
+    bool    has_sync;
+    float   velocity;           // weighted mean of the particles' speeds, rad/s
+    float   confidence;         // weight of the particles on current_tooth
+
+    uint8_t  *tooth_dists;      // as in Detector
+    size_t   num_tooth_tips;
+    detector_index_t num_tooth_posns;
+    uint32_t ticks_per_sec;
+    float    max_accel;         // rad/s^2
+    float    error_rate;        // probability of a missed or extra edge
+
+    Particle *particles;        // the current set
+    Particle *spare;            // where resampling puts the next one
+    size_t   num_particles;
+    detector_index_t *tooth_posn; // position of each tooth, from tooth 0
+    detector_index_t *posn_tooth; // tooth at each position, or the one before a gap
+    float    *tooth_prob;       // total particle weight on each tooth
+
+    float    sync_accept;       // log-likelihood ratios, as in Detector
+    float    sync_reject;
+    float    sync_llr;
+    float    sync_step;
+
+    bool     started;           // particles have been spread, which takes a first period
+    uint32_t rng;               // xorshift32 state
+    uint64_t resamples;         // times the set has been resampled
+} ParticleDetector;
+
+
+/* Set up a particle filter; storage is caller-provided, as for detector_init */
+bool
+particle_init(
+        ParticleDetector* p,
+        uint8_t tooth_dists[const],
+        const size_t num_tooth_tips,
+        const detector_index_t num_tooth_posns,
+        Particle particles[const],
+        const size_t num_particles,
+        detector_index_t tooth_posn[const],
+        detector_index_t posn_tooth[const],
+        float tooth_prob[const],
+        const uint32_t sample_rate,
+        const float max_accel,
+        const float error_rate,
+        const uint32_t seed);
+
+/* Execute a localization loop */
+void
+particle_interrupt(
+        uint32_t timer_register,
+        ParticleDetector* p);
@@ -0,0 +1,247 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "detector.h"
+#include "pipeline.h"
+
+
+/* Macros */
+
+/* Layout of DetectorPipeline.published: the consumer's latest tooth, the low
+ * bits of its tail at the time, and whether it had sync. One word, so the ISR
+ * can read all three without a lock. */
+#define PUB_TOOTH_MASK  0xffffu
+#define PUB_TAIL_SHIFT  16
+#define PUB_TAIL_MASK   0x7fffu
+#define PUB_SYNC        0x80000000u
+
+
+/* Declarations */
+
+bool
+pipeline_init(
+        DetectorPipeline* p,
+        Detector* d,
+        uint32_t ring[const],
+        const size_t capacity
+        );
+
+bool
+pipeline_push(
+        DetectorPipeline* p,
+        const uint32_t timer_register
+        );
+
+bool
+pipeline_predicted_tooth(
+        const DetectorPipeline* p,
+        detector_index_t* const tooth
+        );
+
+size_t
+pipeline_drain(
+        DetectorPipeline* p,
+        const size_t max_batch
+        );
+
+void
+pipeline_process(
+        DetectorPipeline* p,
+        const size_t from,
+        const size_t count
+        );
+
+
+/* Definitions */
+
+/*
+ * bool pipeline_init - set up a pipeline feeding a detector
+ *
+ * arguments: DetectorPipeline* p - the pipeline
+ *            Detector* d         - an initialized detector, with no more teeth
+ *                                  than the fast path can publish
+ *            uint32_t ring[]     - storage for queued periods
+ *            size_t capacity     - number of periods ring can hold; a power of
+ *                                  two no larger than PIPELINE_MAX_CAPACITY
+ * returns: true on success, false if capacity or the wheel can't be used
+ * side-effects: modifies *p
+ */
+
+bool
+pipeline_init(
+        DetectorPipeline* p,
+        Detector* d,
+        uint32_t ring[const],
+        const size_t capacity
+        )
+{
+    if (capacity == 0 || capacity > PIPELINE_MAX_CAPACITY || (capacity & (capacity - 1)) != 0)
+        return false;
+    if (d->num_tooth_tips > (size_t)PUB_TOOTH_MASK + 1)
+        return false;
+
+    p->ring = ring;
+    p->mask = capacity - 1;
+    p->head = 0;
+    p->tail = 0;
+    p->overruns = 0;
+    p->overruns_seen = 0;
+    p->gap_head = 0;
+    p->published = 0;
+    p->batches = 0;
+    p->processed = 0;
+    p->d = d;
+
+    return true;
+}
+
+/*
+ * bool pipeline_push - queue a period for the consumer
+ *
+ * arguments: DetectorPipeline* p      - the pipeline
+ *            uint32_t timer_register  - the period that just ended
+ * returns: true if queued, false if the ring was full and the period was dropped
+ * side-effects: modifies *p
+ *
+ * This is all the capture ISR has to do, and it takes the same handful of
+ * cycles whatever the size of the wheel. Only the ISR may call it.
+ */
+
+bool
+pipeline_push(
+        DetectorPipeline* p,
+        const uint32_t timer_register
+        )
+{
+    size_t head = p->head;
+    size_t tail = __atomic_load_n(&(p->tail), __ATOMIC_ACQUIRE);
+
+    if (head - tail > p->mask)
+    {
+        __atomic_store_n(&(p->gap_head), head, __ATOMIC_RELAXED);
+        __atomic_store_n(&(p->overruns), p->overruns + 1, __ATOMIC_RELEASE);
+        return false;
+    }
+
+    p->ring[head & p->mask] = timer_register;
+    __atomic_store_n(&(p->head), head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/*
+ * bool pipeline_predicted_tooth - predict the tooth the latest queued period ended on
+ *
+ * arguments: DetectorPipeline* p - the pipeline
+ *            detector_index_t* tooth  - where to put the prediction
+ * returns: true if the consumer had sync the last time it ran, false (and no
+ *          prediction) otherwise
+ * side-effects: modifies *tooth
+ *
+ * The consumer may be some periods behind. Assuming every period still in the
+ * ring is one tooth, the ISR can still tell where we are without waiting.
+ */
+
+bool
+pipeline_predicted_tooth(
+        const DetectorPipeline* p,
+        detector_index_t* const tooth
+        )
+{
+    uint32_t pub = __atomic_load_n(&(p->published), __ATOMIC_ACQUIRE);
+    size_t head = __atomic_load_n(&(p->head), __ATOMIC_RELAXED);
+
+    if ((pub & PUB_SYNC) == 0)
+        return false;
+
+    size_t pending = (head - (pub >> PUB_TAIL_SHIFT)) & PUB_TAIL_MASK;
+    *tooth = ((pub & PUB_TOOTH_MASK) + pending) % p->d->num_tooth_tips;
+
+    return true;
+}
+
+/*
+ * size_t pipeline_drain - run queued periods through the detector
+ *
+ * arguments: DetectorPipeline* p - the pipeline
+ *            size_t max_batch    - most periods to process in this call
+ * returns: number of periods processed
+ * side-effects: modifies *p and *p->d
+ *
+ * Only the consumer may call this. The periods are processed straight out of
+ * the ring: the producer won't touch their slots until we advance the tail.
+ */
+
+size_t
+pipeline_drain(
+        DetectorPipeline* p,
+        const size_t max_batch
+        )
+{
+    size_t head = __atomic_load_n(&(p->head), __ATOMIC_ACQUIRE);
+    size_t tail = p->tail;
+    size_t count = head - tail;
+    uint32_t overruns = __atomic_load_n(&(p->overruns), __ATOMIC_ACQUIRE);
+    size_t gap = __atomic_load_n(&(p->gap_head), __ATOMIC_RELAXED);
+
+    if (count > max_batch)
+        count = max_batch;
+    if (count == 0)
+        return 0;
+
+    /* Some periods never made it into the ring, and we've no idea how many
+     * teeth they covered. The ones queued before the gap are still good, so
+     * run those first, then start the ratios afresh and earn sync back. A
+     * gap past this batch waits for the drain that reaches it. */
+    if (overruns != p->overruns_seen && gap - tail <= count)
+    {
+        pipeline_process(p, tail, gap - tail);
+        p->overruns_seen = overruns;
+        detector_drop_sync(p->d);
+        pipeline_process(p, gap, count - (gap - tail));
+    }
+    else
+        pipeline_process(p, tail, count);
+
+    tail += count;
+    __atomic_store_n(&(p->tail), tail, __ATOMIC_RELEASE);
+
+    uint32_t pub = (p->d->current_tooth & PUB_TOOTH_MASK)
+                   | ((uint32_t)(tail & PUB_TAIL_MASK) << PUB_TAIL_SHIFT)
+                   | (p->d->has_sync ? PUB_SYNC : 0);
+    __atomic_store_n(&(p->published), pub, __ATOMIC_RELEASE);
+
+    p->batches++;
+    p->processed += count;
+
+    return count;
+}
+
+/*
+ * void pipeline_process - run a stretch of the ring through the detector
+ *
+ * arguments: DetectorPipeline* p - the pipeline
+ *            size_t from         - index of the first period, as head and tail count
+ *            size_t count        - number of periods
+ * returns: nothing
+ * side-effects: modifies *p->d
+ */
+
+void
+pipeline_process(
+        DetectorPipeline* p,
+        const size_t from,
+        const size_t count
+        )
+{
+    size_t first = from & p->mask;
+    size_t first_len = p->mask + 1 - first;
+
+    if (first_len > count)
+        first_len = count;
+
+    detector_process_batch(p->d, &(p->ring[first]), first_len);
+    detector_process_batch(p->d, p->ring, count - first_len);
+    return;
+}
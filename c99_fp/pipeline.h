@@ -0,0 +1,49 @@
+/* Split localization into a capture ISR that only queues periods, and a
+ * lower-priority consumer that runs the detector over them in batches. */
+
+/* Largest ring the fast-path bookkeeping can cope with */
+#define PIPELINE_MAX_CAPACITY 16384
+
+typedef struct {
+    uint32_t *ring;             // storage for queued periods
+    size_t   mask;              // capacity - 1, capacity being a power of two
+    size_t   head;              // periods ever pushed; written only by the producer
+    size_t   tail;              // periods ever popped; written only by the consumer
+    uint32_t overruns;          // periods dropped because the ring was full; written only by the producer
+    uint32_t overruns_seen;     // value of overruns the consumer last acted on
+    size_t   gap_head;          // head at the latest overrun, i.e. the first period after the gap; written only by the producer
+
+    uint32_t published;         // tooth/sync state for the fast path, see pipeline_drain; written only by the consumer
+
+    uint64_t batches;           // number of non-empty drains
+    uint64_t processed;         // number of periods run through the detector
+
+    Detector *d;                // the detector the consumer feeds
+} DetectorPipeline;
+
+
+/* Set up a pipeline feeding d */
+bool
+pipeline_init(
+        DetectorPipeline* p,
+        Detector* d,
+        uint32_t ring[const],
+        const size_t capacity);
+
+/* Queue a period; call from the capture ISR (the only producer) */
+bool
+pipeline_push(
+        DetectorPipeline* p,
+        const uint32_t timer_register);
+
+/* Predict the tooth the latest queued period ended on; safe to call from the ISR */
+bool
+pipeline_predicted_tooth(
+        const DetectorPipeline* p,
+        detector_index_t* const tooth);
+
+/* Run up to max_batch queued periods through the detector; call from the (only) consumer */
+size_t
+pipeline_drain(
+        DetectorPipeline* p,
+        const size_t max_batch);
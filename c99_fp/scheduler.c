@@ -0,0 +1,803 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "detector.h"
+#include "scheduler.h"
+
+
+/* Macros */
+
+#define PI 3.14159265359
+
+/* a is before b, allowing for the timer wrapping around */
+#define DEADLINE_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+
+/* Declarations */
+
+bool
+scheduler_init(
+        Scheduler* s,
+        Detector* d,
+        SchedEvent events[const],
+        const uint16_t num_events,
+        uint16_t buckets[const],
+        uint16_t heap[const],
+        detector_index_t posn_tooth[const],
+        const bool whole_cycle
+        );
+
+int32_t
+scheduler_add(
+        Scheduler* s,
+        const float angle,
+        const uint8_t channel
+        );
+
+void
+scheduler_set_angle(
+        Scheduler* s,
+        const uint16_t handle,
+        const float angle
+        );
+
+void
+scheduler_remove(
+        Scheduler* s,
+        const uint16_t handle
+        );
+
+void
+scheduler_on_tooth(Scheduler* s);
+
+size_t
+scheduler_expire(
+        Scheduler* s,
+        const uint32_t timer_now,
+        uint8_t channels[],
+        const size_t max_channels
+        );
+
+bool
+scheduler_next_deadline(
+        const Scheduler* s,
+        uint32_t* const deadline
+        );
+
+void
+place_event(
+        Scheduler* s,
+        const uint16_t e,
+        const float angle
+        );
+
+uint16_t
+bucket_of_angle(
+        const Scheduler* s,
+        const float angle
+        );
+
+int32_t
+current_bucket(const Scheduler* s);
+
+void
+bucket_push(
+        Scheduler* s,
+        const uint16_t e
+        );
+
+void
+bucket_unlink(
+        Scheduler* s,
+        const uint16_t e
+        );
+
+void
+arm_bucket(
+        Scheduler* s,
+        const uint16_t b
+        );
+
+void
+disarm_all(Scheduler* s);
+
+void
+heap_push(
+        Scheduler* s,
+        const uint16_t e
+        );
+
+void
+heap_remove(
+        Scheduler* s,
+        const uint16_t pos
+        );
+
+void
+heap_sift_up(
+        Scheduler* s,
+        uint16_t pos
+        );
+
+void
+heap_sift_down(
+        Scheduler* s,
+        uint16_t pos
+        );
+
+
+/* Definitions */
+
+/*
+ * bool scheduler_init - set up a scheduler driven by a detector
+ *
+ * arguments: Scheduler* s          - the scheduler
+ *            Detector* d           - a detector with an angle table (see detector_init_angle)
+ *            SchedEvent events[]   - storage for num_events events
+ *            uint16_t num_events   - number of events there's room for, less than SCHED_NONE
+ *            uint16_t buckets[]    - storage for num_tooth_tips bucket heads, twice that if whole_cycle
+ *            uint16_t heap[]       - storage for num_events heap entries
+ *            detector_index_t posn_tooth[]  - storage for num_tooth_posns tooth indices
+ *            bool whole_cycle      - angles are over the 4 pi engine cycle, not one crank revolution;
+ *                                    needs a detector tracking phase (see detector_init_cycle)
+ * returns: true on success, false if the detector can't support the scheduler asked for,
+ *          or it has so many teeth the buckets can't be numbered below SCHED_NONE
+ * side-effects: modifies *s and the storage handed to it
+ *
+ * Nothing is armed until the detector has sync (and, over a whole cycle,
+ * phase); events are held by angle until then.
+ */
+
+bool
+scheduler_init(
+        Scheduler* s,
+        Detector* d,
+        SchedEvent events[const],
+        const uint16_t num_events,
+        uint16_t buckets[const],
+        uint16_t heap[const],
+        detector_index_t posn_tooth[const],
+        const bool whole_cycle
+        )
+{
+    size_t num_buckets = (whole_cycle ? 2 : 1) * d->num_tooth_tips;
+
+    if (d->tooth_angle == NULL || num_events >= SCHED_NONE || num_buckets >= SCHED_NONE)
+        return false;
+    if (whole_cycle && d->cycle_prob == NULL)
+        return false;
+
+    s->d = d;
+    s->events = events;
+    s->num_events = num_events;
+    s->buckets = buckets;
+    s->num_buckets = (uint16_t)num_buckets;
+    s->heap = heap;
+    s->heap_len = 0;
+    s->posn_tooth = posn_tooth;
+    s->armed_through = -1;
+    s->cycle_angle = (whole_cycle ? 4.0 : 2.0) * PI;
+
+    for (uint16_t i = 0; i < num_events; i++)
+    {
+        events[i].state = SCHED_FREE;
+        events[i].next = i + 1;
+    }
+    if (num_events > 0)
+        events[num_events - 1].next = SCHED_NONE;
+    s->free_head = (num_events > 0) ? 0 : SCHED_NONE;
+
+    for (uint16_t b = 0; b < s->num_buckets; b++)
+        buckets[b] = SCHED_NONE;
+
+    /* tooth i sits at tooth_dists[1] + ... + tooth_dists[i] positions past tooth 0 */
+    size_t posn = 0;
+    for (size_t i = 0; i < d->num_tooth_tips; i++)
+    {
+        if (i > 0)
+            posn += d->tooth_dists[i];
+        size_t end = (i + 1 < d->num_tooth_tips) ? posn + d->tooth_dists[i + 1] : d->num_tooth_posns;
+        for (size_t p = posn; p < end && p < d->num_tooth_posns; p++)
+            posn_tooth[p] = i;
+    }
+
+    return true;
+}
+
+
+/*
+ * int32_t scheduler_add - add an event that fires every cycle
+ *
+ * arguments: Scheduler* s    - the scheduler
+ *            float angle     - angle to fire at, in [0, 2 pi), or [0, 4 pi) over a whole cycle
+ *            uint8_t channel - handed back by scheduler_expire when it fires
+ * returns: a handle for the event, or -1 if there's no room
+ * side-effects: modifies *s
+ *
+ * An event within the lookahead is armed straight away, so it can fire this
+ * time round if it's not already too late.
+ */
+
+int32_t
+scheduler_add(
+        Scheduler* s,
+        const float angle,
+        const uint8_t channel
+        )
+{
+    uint16_t e = s->free_head;
+
+    if (e == SCHED_NONE)
+        return -1;
+
+    s->free_head = s->events[e].next;
+    s->events[e].channel = channel;
+    place_event(s, e, angle);
+
+    return e;
+}
+
+
+/*
+ * void scheduler_set_angle - move an event to a new angle
+ *
+ * arguments: Scheduler* s    - the scheduler
+ *            uint16_t handle - the event, from scheduler_add
+ *            float angle     - the new angle
+ * returns: nothing
+ * side-effects: modifies *s
+ *
+ * Timing changes (advance, injector phasing) mostly move events by a degree
+ * or two at a time, so an armed event usually stays armed, with a new
+ * deadline.
+ */
+
+void
+scheduler_set_angle(
+        Scheduler* s,
+        const uint16_t handle,
+        const float angle
+        )
+{
+    SchedEvent* ev = &(s->events[handle]);
+
+    if (ev->state == SCHED_ARMED)
+        heap_remove(s, ev->heap_pos);
+    else if (ev->state == SCHED_WAITING)
+        bucket_unlink(s, handle);
+    else
+        return;
+
+    place_event(s, handle, angle);
+
+    return;
+}
+
+
+/*
+ * void scheduler_remove - stop firing an event
+ *
+ * arguments: Scheduler* s    - the scheduler
+ *            uint16_t handle - the event, from scheduler_add
+ * returns: nothing
+ * side-effects: modifies *s
+ */
+
+void
+scheduler_remove(
+        Scheduler* s,
+        const uint16_t handle
+        )
+{
+    SchedEvent* ev = &(s->events[handle]);
+
+    if (ev->state == SCHED_ARMED)
+        heap_remove(s, ev->heap_pos);
+    else if (ev->state == SCHED_WAITING)
+        bucket_unlink(s, handle);
+    else
+        return;
+
+    ev->state = SCHED_FREE;
+    ev->next = s->free_head;
+    s->free_head = handle;
+
+    return;
+}
+
+
+/*
+ * void scheduler_on_tooth - arm events coming into range, and refine armed deadlines
+ *
+ * arguments: Scheduler* s - the scheduler
+ * returns: nothing
+ * side-effects: modifies *s
+ *
+ * Call after every detector_interrupt, from the same context (or with the
+ * output timer's interrupt masked).
+ *
+ * The armed events are the ones within SCHED_LOOKAHEAD_TEETH teeth, so there
+ * are only ever a few of them, and re-estimating all their deadlines from the
+ * latest tooth and rebuilding the heap is cheap. Waiting events aren't touched
+ * at all until their bucket comes into range. Anything armed whose bucket has
+ * already gone by keeps the deadline it had, which is in the past, so it
+ * fires (late) on the next scheduler_expire rather than a whole cycle later.
+ *
+ * If the detector jumps ahead more than a tooth, every bucket it skipped is
+ * armed; if it loses sync, everything is disarmed until it gets it back.
+ */
+
+void
+scheduler_on_tooth(Scheduler* s)
+{
+    int32_t now = current_bucket(s);
+
+    if (now < 0)
+    {
+        disarm_all(s);
+        return;
+    }
+
+    uint16_t nb = s->num_buckets;
+
+    /* refine what's armed */
+    for (uint16_t i = 0; i < s->heap_len; i++)
+    {
+        SchedEvent* ev = &(s->events[s->heap[i]]);
+        uint16_t ahead = (ev->bucket + nb - (uint16_t)now) % nb;
+
+        if (ahead <= SCHED_LOOKAHEAD_TEETH)
+            ev->deadline = detector_time_of_angle(s->d, ev->angle);
+    }
+    for (uint16_t i = s->heap_len / 2; i > 0; i--)
+        heap_sift_down(s, i - 1);
+
+    /* arm what's come into range; if the detector went backwards (say, it
+     * relocalized), start over rather than arm a whole cycle's worth */
+    uint16_t last = (uint16_t)(now + SCHED_LOOKAHEAD_TEETH) % nb;
+
+    if (s->armed_through >= 0 && (last + nb - (uint16_t)s->armed_through) % nb > nb / 2)
+        disarm_all(s);
+
+    uint16_t b = (s->armed_through < 0) ? (uint16_t)now : (uint16_t)(s->armed_through + 1) % nb;
+
+    if (s->armed_through != (int32_t)last)
+    {
+        for (uint16_t k = 0; k < nb; k++)
+        {
+            arm_bucket(s, b);
+            if (b == last)
+                break;
+            b = (b + 1) % nb;
+        }
+    }
+    s->armed_through = last;
+
+    return;
+}
+
+
+/*
+ * size_t scheduler_expire - collect the events that are due
+ *
+ * arguments: Scheduler* s         - the scheduler
+ *            uint32_t timer_now   - the current timer value
+ *            uint8_t channels[]   - storage for the channels of due events, earliest first
+ *            size_t max_channels  - room in channels[]
+ * returns: the number of channels written
+ * side-effects: modifies *s and the data at *channels
+ *
+ * Call from the output timer's interrupt, then reprogram the timer from
+ * scheduler_next_deadline. Each expired event goes back into its bucket for
+ * next time round.
+ */
+
+size_t
+scheduler_expire(
+        Scheduler* s,
+        const uint32_t timer_now,
+        uint8_t channels[],
+        const size_t max_channels
+        )
+{
+    size_t count = 0;
+
+    while (count < max_channels && s->heap_len > 0)
+    {
+        uint16_t e = s->heap[0];
+        SchedEvent* ev = &(s->events[e]);
+
+        if (DEADLINE_BEFORE(timer_now, ev->deadline))
+            break;
+
+        channels[count++] = ev->channel;
+        heap_remove(s, 0);
+        ev->state = SCHED_WAITING;
+        bucket_push(s, e);
+    }
+
+    return count;
+}
+
+
+/*
+ * bool scheduler_next_deadline - get the earliest armed deadline
+ *
+ * arguments: Scheduler* s       - the scheduler
+ *            uint32_t* deadline - where to put it
+ * returns: false if nothing is armed
+ * side-effects: modifies *deadline
+ */
+
+bool
+scheduler_next_deadline(
+        const Scheduler* s,
+        uint32_t* const deadline
+        )
+{
+    if (s->heap_len == 0)
+        return false;
+
+    *deadline = s->events[s->heap[0]].deadline;
+    return true;
+}
+
+
+/*
+ * void place_event - put an event that's in neither a bucket nor the heap where it belongs
+ *
+ * arguments: Scheduler* s - the scheduler
+ *            uint16_t e   - the event
+ *            float angle  - its angle, which is wrapped into the cycle
+ * returns: nothing
+ * side-effects: modifies *s
+ *
+ * That's the heap if its bucket has already been armed this time round, or
+ * its bucket otherwise.
+ */
+
+void
+place_event(
+        Scheduler* s,
+        const uint16_t e,
+        const float angle
+        )
+{
+    SchedEvent* ev = &(s->events[e]);
+
+    ev->angle = fmodf(angle, s->cycle_angle);
+    if (ev->angle < 0)
+        ev->angle += s->cycle_angle;
+    ev->bucket = bucket_of_angle(s, ev->angle);
+
+    int32_t now = current_bucket(s);
+    if (s->armed_through >= 0 && now >= 0)
+    {
+        uint16_t nb = s->num_buckets;
+        uint16_t ahead = (ev->bucket + nb - (uint16_t)now) % nb;
+        uint16_t armed = ((uint16_t)s->armed_through + nb - (uint16_t)now) % nb;
+
+        if (ahead <= armed)
+        {
+            ev->deadline = detector_time_of_angle(s->d, ev->angle);
+            ev->state = SCHED_ARMED;
+            heap_push(s, e);
+            return;
+        }
+    }
+
+    ev->state = SCHED_WAITING;
+    bucket_push(s, e);
+
+    return;
+}
+
+
+/*
+ * uint16_t bucket_of_angle - the bucket an angle belongs in
+ *
+ * arguments: Scheduler* s - the scheduler
+ *            float angle  - angle in [0, cycle_angle)
+ * returns: the last tooth at or before angle, plus num_tooth_tips in the second revolution
+ * side-effects: none
+ */
+
+uint16_t
+bucket_of_angle(
+        const Scheduler* s,
+        const float angle
+        )
+{
+    const Detector* d = s->d;
+    float revolution = 2.0 * PI;
+    uint16_t base = 0;
+    float a = angle;
+
+    if (a >= revolution)
+    {
+        a -= revolution;
+        base = (uint16_t)d->num_tooth_tips;
+    }
+
+    size_t posn = (size_t)(a / d->rad_per_posn);
+    if (posn >= d->num_tooth_posns)
+        posn = d->num_tooth_posns - 1;
+
+    /* posn is rounded down, but the tooth there may be a hair past angle */
+    detector_index_t tooth = s->posn_tooth[posn];
+    if (d->tooth_angle[tooth] > a && tooth > 0)
+        tooth--;
+
+    return (uint16_t)(base + tooth);
+}
+
+
+/*
+ * int32_t current_bucket - the bucket the crank is in now
+ *
+ * arguments: Scheduler* s - the scheduler
+ * returns: the bucket, or -1 if the detector doesn't know well enough
+ * side-effects: none
+ */
+
+int32_t
+current_bucket(const Scheduler* s)
+{
+    const Detector* d = s->d;
+
+    if (!d->has_sync)
+        return -1;
+    if (s->num_buckets == d->num_tooth_tips)
+        return (int32_t)d->current_tooth;
+    if (!d->has_cycle_sync)
+        return -1;
+
+    return (int32_t)(d->current_tooth + (d->phase ? d->num_tooth_tips : 0));
+}
+
+
+/*
+ * void bucket_push - add an event to the front of its bucket
+ *
+ * arguments: Scheduler* s - the scheduler
+ *            uint16_t e   - the event
+ * returns: nothing
+ * side-effects: modifies *s
+ */
+
+void
+bucket_push(
+        Scheduler* s,
+        const uint16_t e
+        )
+{
+    SchedEvent* ev = &(s->events[e]);
+    uint16_t head = s->buckets[ev->bucket];
+
+    ev->prev = SCHED_NONE;
+    ev->next = head;
+    if (head != SCHED_NONE)
+        s->events[head].prev = e;
+    s->buckets[ev->bucket] = e;
+
+    return;
+}
+
+
+/*
+ * void bucket_unlink - take an event out of its bucket
+ *
+ * arguments: Scheduler* s - the scheduler
+ *            uint16_t e   - the event
+ * returns: nothing
+ * side-effects: modifies *s
+ */
+
+void
+bucket_unlink(
+        Scheduler* s,
+        const uint16_t e
+        )
+{
+    SchedEvent* ev = &(s->events[e]);
+
+    if (ev->prev != SCHED_NONE)
+        s->events[ev->prev].next = ev->next;
+    else
+        s->buckets[ev->bucket] = ev->next;
+    if (ev->next != SCHED_NONE)
+        s->events[ev->next].prev = ev->prev;
+
+    return;
+}
+
+
+/*
+ * void arm_bucket - give every event in a bucket a deadline and move it to the heap
+ *
+ * arguments: Scheduler* s - the scheduler
+ *            uint16_t b   - the bucket
+ * returns: nothing
+ * side-effects: modifies *s
+ */
+
+void
+arm_bucket(
+        Scheduler* s,
+        const uint16_t b
+        )
+{
+    uint16_t e = s->buckets[b];
+
+    s->buckets[b] = SCHED_NONE;
+    while (e != SCHED_NONE)
+    {
+        SchedEvent* ev = &(s->events[e]);
+        uint16_t next = ev->next;
+
+        ev->deadline = detector_time_of_angle(s->d, ev->angle);
+        ev->state = SCHED_ARMED;
+        heap_push(s, e);
+        e = next;
+    }
+
+    return;
+}
+
+
+/*
+ * void disarm_all - put every armed event back in its bucket
+ *
+ * arguments: Scheduler* s - the scheduler
+ * returns: nothing
+ * side-effects: modifies *s
+ */
+
+void
+disarm_all(Scheduler* s)
+{
+    while (s->heap_len > 0)
+    {
+        uint16_t e = s->heap[--(s->heap_len)];
+
+        s->events[e].state = SCHED_WAITING;
+        bucket_push(s, e);
+    }
+    s->armed_through = -1;
+
+    return;
+}
+
+
+/*
+ * void heap_push - add an armed event to the heap
+ *
+ * arguments: Scheduler* s - the scheduler
+ *            uint16_t e   - the event, with its deadline set
+ * returns: nothing
+ * side-effects: modifies *s
+ */
+
+void
+heap_push(
+        Scheduler* s,
+        const uint16_t e
+        )
+{
+    uint16_t pos = s->heap_len++;
+
+    s->heap[pos] = e;
+    s->events[e].heap_pos = pos;
+    heap_sift_up(s, pos);
+
+    return;
+}
+
+
+/*
+ * void heap_remove - take the event at a heap position out of the heap
+ *
+ * arguments: Scheduler* s - the scheduler
+ *            uint16_t pos - its position
+ * returns: nothing
+ * side-effects: modifies *s; the event itself is left for the caller to rehome
+ */
+
+void
+heap_remove(
+        Scheduler* s,
+        const uint16_t pos
+        )
+{
+    uint16_t last = --(s->heap_len);
+
+    if (pos == last)
+        return;
+
+    s->heap[pos] = s->heap[last];
+    s->events[s->heap[pos]].heap_pos = pos;
+    heap_sift_down(s, pos);
+    heap_sift_up(s, pos);
+
+    return;
+}
+
+
+/*
+ * void heap_sift_up - restore the heap order above a position
+ *
+ * arguments: Scheduler* s - the scheduler
+ *            uint16_t pos - the position whose deadline may be too early for it
+ * returns: nothing
+ * side-effects: modifies *s
+ */
+
+void
+heap_sift_up(
+        Scheduler* s,
+        uint16_t pos
+        )
+{
+    uint16_t e = s->heap[pos];
+    uint32_t deadline = s->events[e].deadline;
+
+    while (pos > 0)
+    {
+        uint16_t parent = (pos - 1) / 2;
+        uint16_t pe = s->heap[parent];
+
+        if (!DEADLINE_BEFORE(deadline, s->events[pe].deadline))
+            break;
+
+        s->heap[pos] = pe;
+        s->events[pe].heap_pos = pos;
+        pos = parent;
+    }
+    s->heap[pos] = e;
+    s->events[e].heap_pos = pos;
+
+    return;
+}
+
+
+/*
+ * void heap_sift_down - restore the heap order below a position
+ *
+ * arguments: Scheduler* s - the scheduler
+ *            uint16_t pos - the position whose deadline may be too late for it
+ * returns: nothing
+ * side-effects: modifies *s
+ */
+
+void
+heap_sift_down(
+        Scheduler* s,
+        uint16_t pos
+        )
+{
+    uint16_t e = s->heap[pos];
+    uint32_t deadline = s->events[e].deadline;
+
+    for (;;)
+    {
+        uint16_t child = 2 * pos + 1;
+
+        if (child >= s->heap_len)
+            break;
+        if (child + 1 < s->heap_len
+            && DEADLINE_BEFORE(s->events[s->heap[child + 1]].deadline, s->events[s->heap[child]].deadline))
+            child++;
+        if (!DEADLINE_BEFORE(s->events[s->heap[child]].deadline, deadline))
+            break;
+
+        s->heap[pos] = s->heap[child];
+        s->events[s->heap[pos]].heap_pos = pos;
+        pos = child;
+    }
+    s->heap[pos] = e;
+    s->events[e].heap_pos = pos;
+
+    return;
+}
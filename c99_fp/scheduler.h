@@ -0,0 +1,95 @@
+/* Fire outputs (spark, injection, knock windows) at crank angles.
+ *
+ * Events are kept by angle, in one bucket per tooth, until the crank is
+ * within SCHED_LOOKAHEAD_TEETH teeth of them. Then the detector converts
+ * their angle into a timer deadline and they move to a min-heap ordered by
+ * deadline, which the output timer's interrupt drains. Deadlines are refined
+ * on every tooth until they fire. Events repeat every cycle until removed. */
+
+/* How many teeth ahead of an event it gets a deadline */
+#define SCHED_LOOKAHEAD_TEETH 1
+
+/* End of a list of events */
+#define SCHED_NONE 0xffffu
+
+/* Event states */
+#define SCHED_FREE    0     /* slot unused */
+#define SCHED_WAITING 1     /* in a tooth bucket */
+#define SCHED_ARMED   2     /* in the heap, with a deadline */
+
+typedef struct {
+    float    angle;             // when to fire, radians from tooth 0 (see detector_angle_at)
+    uint32_t deadline;          // timer value to fire at, while armed
+    uint16_t next;              // next event in the same bucket, or in the free list
+    uint16_t prev;              // previous event in the same bucket
+    uint16_t bucket;            // tooth (plus num_tooth_tips in phase 1) just before angle; scheduler_init
+                                //  refuses detectors with more buckets than this can number
+    uint16_t heap_pos;          // index in the heap, while armed
+    uint8_t  channel;           // what to fire; handed back by scheduler_expire
+    uint8_t  state;             // SCHED_FREE, SCHED_WAITING or SCHED_ARMED
+} SchedEvent;
+
+typedef struct {
+    Detector   *d;              // the detector giving us angles and times
+    SchedEvent *events;         // event slots
+    uint16_t   num_events;      // number of slots
+    uint16_t   free_head;       // first unused slot
+    uint16_t   *buckets;        // first waiting event in each bucket
+    uint16_t   num_buckets;     // num_tooth_tips, or twice that over a whole cycle
+    uint16_t   *heap;           // armed events, by deadline
+    uint16_t   heap_len;        // number of armed events
+    detector_index_t *posn_tooth; // last tooth at or before each tooth position
+    int32_t    armed_through;   // last bucket whose events have been armed, or -1 if none
+    float      cycle_angle;     // 2 pi, or 4 pi over a whole cycle
+} Scheduler;
+
+
+/* Set up a scheduler driven by d */
+bool
+scheduler_init(
+        Scheduler* s,
+        Detector* d,
+        SchedEvent events[const],
+        const uint16_t num_events,
+        uint16_t buckets[const],
+        uint16_t heap[const],
+        detector_index_t posn_tooth[const],
+        const bool whole_cycle);
+
+/* Add an event firing channel at angle every cycle; returns its handle, or -1 if full */
+int32_t
+scheduler_add(
+        Scheduler* s,
+        const float angle,
+        const uint8_t channel);
+
+/* Move an event to a new angle */
+void
+scheduler_set_angle(
+        Scheduler* s,
+        const uint16_t handle,
+        const float angle);
+
+/* Stop firing an event */
+void
+scheduler_remove(
+        Scheduler* s,
+        const uint16_t handle);
+
+/* Arm and refine deadlines; call after each detector_interrupt */
+void
+scheduler_on_tooth(Scheduler* s);
+
+/* Collect the channels of events due by timer_now; returns how many */
+size_t
+scheduler_expire(
+        Scheduler* s,
+        const uint32_t timer_now,
+        uint8_t channels[],
+        const size_t max_channels);
+
+/* Get the earliest armed deadline, to program the output timer with */
+bool
+scheduler_next_deadline(
+        const Scheduler* s,
+        uint32_t* const deadline);
@@ -0,0 +1,63 @@
+/* Wire format between tools/localizerd and its clients.
+ *
+ * Every message is a ServiceFrame followed by len bytes of payload, len a
+ * multiple of 4 so the periods in a SERVICE_PERIODS frame can be used where
+ * they were read. Everything is in the host's byte order, since both ends are
+ * on the same machine, over a UNIX-domain stream socket.
+ *
+ * A client opens a named detector with SERVICE_OPEN, creating it if nobody
+ * has yet, and then streams SERVICE_PERIODS frames. The daemon answers each
+ * frame it took with a SERVICE_STATE, in order, or with a SERVICE_ERROR. An
+ * instance outlives its client, and the next client to open it by name
+ * carries on where the last left off unless it asks for a reset. Only one
+ * client at a time can have an instance open. */
+
+#define SERVICE_VERSION        1
+#define SERVICE_NAME_LEN       16
+#define SERVICE_MAX_PAYLOAD    65532        /* largest multiple of 4 that fits in len */
+#define SERVICE_MAX_PERIODS    (SERVICE_MAX_PAYLOAD / 4)
+#define SERVICE_DEFAULT_PATH   "/tmp/localizer.sock"
+
+/* Frame types */
+#define SERVICE_OPEN           1    /* client: ServiceOpen, then num_tooth_tips tooth distances, padded to 4 */
+#define SERVICE_PERIODS        2    /* client: len / 4 uint32_t periods, for detector_process_batch */
+#define SERVICE_STATE          3    /* daemon: ServiceState, after the frame it answers */
+#define SERVICE_ERROR          4    /* daemon: uint32_t SERVICE_ERR_* */
+
+/* ServiceOpen flags */
+#define SERVICE_OPEN_RESET     0x01 /* start the instance's belief over, if it already exists */
+
+/* Errors */
+#define SERVICE_ERR_FRAME      1    /* malformed frame; the daemon hangs up */
+#define SERVICE_ERR_NOT_OPEN   2    /* periods before a successful SERVICE_OPEN */
+#define SERVICE_ERR_BUSY       3    /* another client has the instance open */
+#define SERVICE_ERR_MISMATCH   4    /* the instance exists with another tooth pattern */
+#define SERVICE_ERR_CONFIG     5    /* the detector wouldn't take the configuration */
+#define SERVICE_ERR_FULL       6    /* no room for another instance */
+
+typedef struct {
+    uint16_t type;              // SERVICE_*
+    uint16_t len;               // payload bytes following, a multiple of 4
+} ServiceFrame;
+
+typedef struct {
+    uint16_t version;           // SERVICE_VERSION
+    uint16_t num_tooth_tips;    // tooth distances following this
+    char     name[SERVICE_NAME_LEN];    // NUL-terminated unless all 16 are used
+    uint32_t sample_rate;       // as for detector_init
+    float    max_accel;
+    float    error_rate;
+    float    ratio_sigma;       // for detector_init_lik_lut, or 0 for the max_accel step model
+    uint8_t  sig_window;        // for detector_init_sig_index, or 0 for none
+    uint8_t  flags;             // SERVICE_OPEN_*
+    uint16_t reserved;
+} ServiceOpen;
+
+typedef struct {
+    uint32_t periods;           // handed to the instance since it was created or reset
+    uint32_t current_tooth;
+    uint8_t  has_sync;
+    uint8_t  reserved[3];
+    float    confidence;
+    uint32_t sync_lost;         // times, since it was created or reset
+} ServiceState;
@@ -0,0 +1,443 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "detector.h"
+#include "smoother.h"
+
+
+/* Macros */
+
+/* How the Viterbi path got to a tooth from the tooth before, as in detector_move */
+#define SMOOTH_STEP_HIT   0     /* one tooth on, as expected */
+#define SMOOTH_STEP_MISS  1     /* two teeth on: an edge went missing */
+#define SMOOTH_STEP_EXTRA 2     /* no move: the edge was noise */
+
+
+/* Declarations */
+
+bool
+smoother_init(
+        Smoother* s,
+        Detector* d,
+        float checkpoints[const],
+        const size_t num_checkpoints,
+        float block[const],
+        uint8_t steps[const],
+        const size_t block_len
+        );
+
+bool
+smoother_run(
+        Smoother* s,
+        uint32_t periods[const],
+        const size_t count,
+        detector_index_t label[],
+        uint8_t flags[],
+        float label_prob[]
+        );
+
+void
+smooth_likelihood(
+        Smoother* s,
+        uint32_t periods[const],
+        const size_t t,
+        float likelihood[]
+        );
+
+void
+smooth_forward(
+        const Smoother* s,
+        float likelihood[const],
+        float alpha[],
+        float delta[],
+        uint8_t steps[]
+        );
+
+void
+smooth_backward(
+        const Smoother* s,
+        float likelihood[const],
+        float beta[]
+        );
+
+void
+scale_to_sum(
+        float a[],
+        const size_t n
+        );
+
+void
+scale_to_max(
+        float a[],
+        const size_t n
+        );
+
+
+/* Definitions */
+
+/*
+ * bool smoother_init - set up a smoother
+ *
+ * arguments: Smoother* s            - the smoother
+ *            Detector* d            - an initialized detector, whose tooth map, error
+ *                                     rates and likelihood model are used
+ *            float checkpoints[]    - storage for 2 * num_checkpoints * num_tooth_tips floats
+ *            size_t num_checkpoints - number of blocks a log can span
+ *            float block[]          - storage for block_len * num_tooth_tips floats
+ *            uint8_t steps[]        - storage for block_len * num_tooth_tips back-pointers
+ *            size_t block_len       - samples per block
+ * returns: false if the sizes can't be used
+ * side-effects: modifies *s
+ */
+bool
+smoother_init(
+        Smoother* s,
+        Detector* d,
+        float checkpoints[const],
+        const size_t num_checkpoints,
+        float block[const],
+        uint8_t steps[const],
+        const size_t block_len)
+{
+    if (d->num_tooth_tips < 2 || num_checkpoints == 0 || block_len == 0)
+        return false;
+
+    s->d = d;
+    s->checkpoints = checkpoints;
+    s->num_checkpoints = num_checkpoints;
+    s->block = block;
+    s->steps = steps;
+    s->block_len = block_len;
+    s->unsure_below = SMOOTHER_DEFAULT_UNSURE;
+
+    return true;
+}
+
+/*
+ * bool smoother_run - label every period in a log
+ *
+ * arguments: Smoother* s        - the smoother
+ *            uint32_t periods[] - the log, as handed to detector_interrupt
+ *            size_t count       - number of periods in it
+ *            detector_index_t label[]  - storage for count labels: the tooth each period ended on
+ *            uint8_t flags[]    - storage for count sets of SMOOTHER_* flags
+ *            float label_prob[] - storage for count smoothed probabilities of the
+ *                                 labels, or NULL if they're not wanted
+ * returns: false if the log is longer than the smoother has room for
+ * side-effects: modifies the data at label, flags and label_prob, and s's storage
+ *
+ * The forward pass runs the filter the live detector runs (move, then weigh by
+ * the likelihood), alongside the Viterbi recursion, which is the same with
+ * sums replaced by maxima. Both are saved at the start of every block. The
+ * backward pass then goes through the blocks last to first, recomputing each
+ * one's filtered beliefs and back-pointers from its checkpoint, combining
+ * them with the backward messages into smoothed beliefs, and following the
+ * back-pointers from the end of the best path.
+ *
+ * Everything is rescaled at every step rather than kept in logs: only the
+ * shape of each belief matters, and the model never gives a likelihood of 0.
+ */
+bool
+smoother_run(
+        Smoother* s,
+        uint32_t periods[const],
+        const size_t count,
+        detector_index_t label[],
+        uint8_t flags[],
+        float label_prob[])
+{
+    size_t n = s->d->num_tooth_tips;
+    size_t len = s->block_len;
+
+    if (count == 0)
+        return true;
+    if (count > s->num_checkpoints * len)
+        return false;
+
+    float alpha[n];             /* filtered belief */
+    float delta[n];             /* score of the best path to each tooth */
+    float beta[n];              /* backward message */
+    float likelihood[n];
+
+    /* Scoring the log again isn't something the detector did */
+    DetectorCounters counters = s->d->counters;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        alpha[i] = 1.0 / (float)n;
+        delta[i] = 1.0;
+    }
+
+    for (size_t t = 0; t < count; t++)
+    {
+        if (t % len == 0)
+        {
+            float* checkpoint = &(s->checkpoints[2 * n * (t / len)]);
+            for (size_t i = 0; i < n; i++)
+            {
+                checkpoint[i] = alpha[i];
+                checkpoint[n + i] = delta[i];
+            }
+        }
+
+        smooth_likelihood(s, periods, t, likelihood);
+        smooth_forward(s, likelihood, alpha, delta, NULL);
+    }
+
+    size_t tooth = 0;
+    for (size_t i = 1; i < n; i++)
+        if (delta[i] > delta[tooth])
+            tooth = i;
+
+    for (size_t i = 0; i < n; i++)
+        beta[i] = 1.0;
+
+    for (size_t b = (count - 1) / len + 1; b-- > 0; )
+    {
+        size_t start = b * len;
+        size_t end = (start + len < count) ? start + len : count;
+        const float* checkpoint = &(s->checkpoints[2 * n * b]);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            alpha[i] = checkpoint[i];
+            delta[i] = checkpoint[n + i];
+        }
+
+        for (size_t t = start; t < end; t++)
+        {
+            float* filtered = &(s->block[n * (t - start)]);
+
+            smooth_likelihood(s, periods, t, likelihood);
+            smooth_forward(s, likelihood, alpha, delta, &(s->steps[n * (t - start)]));
+            for (size_t i = 0; i < n; i++)
+                filtered[i] = alpha[i];
+        }
+
+        for (size_t t = end; t-- > start; )
+        {
+            const float* filtered = &(s->block[n * (t - start)]);
+            float total = 0.0;
+            float best = 0.0;
+            size_t best_tooth = 0;
+
+            for (size_t i = 0; i < n; i++)
+            {
+                float p = filtered[i] * beta[i];
+                total += p;
+                if (p > best)
+                {
+                    best = p;
+                    best_tooth = i;
+                }
+            }
+
+            float prob = (total > 0) ? filtered[tooth] * beta[tooth] / total : 0.0;
+            uint8_t step = s->steps[n * (t - start) + tooth];
+            uint8_t f = 0;
+
+            if (step == SMOOTH_STEP_MISS)
+                f |= SMOOTHER_MISSED;
+            else if (step == SMOOTH_STEP_EXTRA)
+                f |= SMOOTHER_EXTRA;
+            if (prob < s->unsure_below)
+                f |= SMOOTHER_UNSURE;
+            if (best_tooth != tooth)
+                f |= SMOOTHER_DISAGREE;
+
+            label[t] = (detector_index_t)tooth;
+            flags[t] = f;
+            if (label_prob != NULL)
+                label_prob[t] = prob;
+
+            /* Back to the tooth before, and the message from here back to it */
+            tooth = (tooth + n - ((step == SMOOTH_STEP_HIT) ? 1 : (step == SMOOTH_STEP_MISS) ? 2 : 0)) % n;
+
+            smooth_likelihood(s, periods, t, likelihood);
+            smooth_backward(s, likelihood, beta);
+        }
+    }
+
+    s->d->counters = counters;
+
+    return true;
+}
+
+/*
+ * void smooth_likelihood - the likelihood of one period of the log at each tooth
+ *
+ * arguments: Smoother* s          - the smoother
+ *            uint32_t periods[]   - the log
+ *            size_t t             - which period
+ *            float likelihood[]   - storage for num_tooth_tips likelihoods
+ * returns: nothing
+ * side-effects: modifies the data at likelihood, and the model's counters
+ */
+void
+smooth_likelihood(
+        Smoother* s,
+        uint32_t periods[const],
+        const size_t t,
+        float likelihood[])
+{
+    uint32_t prev = (t > 0) ? periods[t - 1] : 0;
+
+    if (!detector_likelihood(s->d, periods[t], prev, likelihood))
+    {
+        for (size_t i = 0; i < s->d->num_tooth_tips; i++)
+            likelihood[i] = 1.0;    /* nothing to go on yet */
+    }
+
+    return;
+}
+
+/*
+ * void smooth_forward - advance the filter and the Viterbi recursion by one period
+ *
+ * arguments: Smoother* s        - the smoother
+ *            float likelihood[] - the period's likelihood at each tooth
+ *            float alpha[]      - the filtered belief, updated in place
+ *            float delta[]      - the best-path scores, updated in place
+ *            uint8_t steps[]    - storage for the SMOOTH_STEP_* each tooth's best path
+ *                                 arrived by, or NULL
+ * returns: nothing
+ * side-effects: modifies the data at alpha, delta and steps
+ */
+void
+smooth_forward(
+        const Smoother* s,
+        float likelihood[const],
+        float alpha[],
+        float delta[],
+        uint8_t steps[])
+{
+    size_t n = s->d->num_tooth_tips;
+    float miss = s->d->miss_rate;
+    float extra = s->d->extra_rate;
+    float hit = 1 - miss - extra;
+    float moved[n];
+
+    detector_move(alpha, n, miss, extra, moved);
+    for (size_t i = 0; i < n; i++)
+        alpha[i] = moved[i] * likelihood[i];
+    scale_to_sum(alpha, n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        float from_hit   = hit   * delta[(i + n - 1) % n];
+        float from_miss  = miss  * delta[(i + n - 2) % n];
+        float from_extra = extra * delta[i];
+        uint8_t step = SMOOTH_STEP_HIT;
+        float best = from_hit;
+
+        if (from_miss > best)
+        {
+            best = from_miss;
+            step = SMOOTH_STEP_MISS;
+        }
+        if (from_extra > best)
+        {
+            best = from_extra;
+            step = SMOOTH_STEP_EXTRA;
+        }
+
+        moved[i] = best * likelihood[i];
+        if (steps != NULL)
+            steps[i] = step;
+    }
+    for (size_t i = 0; i < n; i++)
+        delta[i] = moved[i];
+    scale_to_max(delta, n);
+
+    return;
+}
+
+/*
+ * void smooth_backward - carry the backward message back over one period
+ *
+ * arguments: Smoother* s        - the smoother
+ *            float likelihood[] - the period's likelihood at each tooth
+ *            float beta[]       - the message into the tooth the period ended on,
+ *                                 replaced with the one into the tooth before
+ * returns: nothing
+ * side-effects: modifies the data at beta
+ *
+ * detector_move, transposed: each tooth collects from where it could go next.
+ */
+void
+smooth_backward(
+        const Smoother* s,
+        float likelihood[const],
+        float beta[])
+{
+    size_t n = s->d->num_tooth_tips;
+    float miss = s->d->miss_rate;
+    float extra = s->d->extra_rate;
+    float hit = 1 - miss - extra;
+    float weighted[n];
+
+    for (size_t i = 0; i < n; i++)
+        weighted[i] = likelihood[i] * beta[i];
+
+    for (size_t i = 0; i < n; i++)
+        beta[i] = hit * weighted[(i + 1) % n] + miss * weighted[(i + 2) % n] + extra * weighted[i];
+    scale_to_sum(beta, n);
+
+    return;
+}
+
+/*
+ * void scale_to_sum - scale an array to sum to 1, or make it uniform if it's all 0
+ */
+void
+scale_to_sum(
+        float a[],
+        const size_t n)
+{
+    float total = 0.0;
+
+    for (size_t i = 0; i < n; i++)
+        total += a[i];
+
+    if (total == 0)
+    {
+        for (size_t i = 0; i < n; i++)
+            a[i] = 1.0 / (float)n;
+        return;
+    }
+
+    float inv = 1.0 / total;
+    for (size_t i = 0; i < n; i++)
+        a[i] *= inv;
+
+    return;
+}
+
+/*
+ * void scale_to_max - scale an array so its largest element is 1, or make it all 1 if it's all 0
+ */
+void
+scale_to_max(
+        float a[],
+        const size_t n)
+{
+    float top = 0.0;
+
+    for (size_t i = 0; i < n; i++)
+        if (a[i] > top)
+            top = a[i];
+
+    if (top == 0)
+    {
+        for (size_t i = 0; i < n; i++)
+            a[i] = 1.0;
+        return;
+    }
+
+    float inv = 1.0 / top;
+    for (size_t i = 0; i < n; i++)
+        a[i] *= inv;
+
+    return;
+}
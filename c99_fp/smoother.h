@@ -0,0 +1,59 @@
+/* Offline labelling of a whole log of periods, for post-mortem analysis.
+ *
+ * The live detector only ever sees the past. Given a complete log, this uses
+ * the same model (detector_move for the teeth going by, detector_likelihood
+ * for the periods) to find the tooth every period most likely ended on:
+ * forward-backward smoothing gives each sample's belief in the light of the
+ * whole log, and a Viterbi decode gives the single most likely sequence of
+ * teeth. The labels come from the Viterbi path, and each sample is flagged
+ * where the path needed a missed or extra edge to explain the log, or where
+ * the smoothed belief doesn't back it up.
+ *
+ * Memory is bounded by checkpointing: the forward pass keeps its state only
+ * at the start of each block of block_len samples, and the backward pass
+ * recomputes one block at a time from its checkpoint. A log of up to
+ * num_checkpoints * block_len samples takes about
+ * (2 * num_checkpoints + block_len) * num_tooth_tips floats, so choosing both
+ * near sqrt(count) keeps it small. The crank wheel only; cam phase isn't
+ * modelled. */
+
+/* Sample flags */
+#define SMOOTHER_MISSED   0x01      /* the path skips a tooth here: an edge went missing */
+#define SMOOTHER_EXTRA    0x02      /* the path stays put here: the edge was noise */
+#define SMOOTHER_UNSURE   0x04      /* the smoothed probability of the label is below unsure_below */
+#define SMOOTHER_DISAGREE 0x08      /* the smoothed belief's best tooth isn't the label */
+
+/* Default for Smoother.unsure_below */
+#define SMOOTHER_DEFAULT_UNSURE 0.5
+
+typedef struct {
+    Detector *d;                // the model: tooth map, error rates and likelihood; its belief isn't touched
+    float    *checkpoints;      // filtered belief and Viterbi scores at the start of each block, 2 * n per block
+    size_t   num_checkpoints;   // number of blocks there's room for
+    float    *block;            // filtered beliefs across one block, n per sample
+    uint8_t  *steps;            // Viterbi back-pointers across one block, n per sample
+    size_t   block_len;         // samples per block
+    float    unsure_below;      // smoothed probability under which a label is flagged SMOOTHER_UNSURE
+} Smoother;
+
+
+/* Set up a smoother using d's model, with storage for logs of up to num_checkpoints * block_len samples */
+bool
+smoother_init(
+        Smoother* s,
+        Detector* d,
+        float checkpoints[const],
+        const size_t num_checkpoints,
+        float block[const],
+        uint8_t steps[const],
+        const size_t block_len);
+
+/* Label every period in a log with a tooth, flags and the smoothed probability of that tooth */
+bool
+smoother_run(
+        Smoother* s,
+        uint32_t periods[const],
+        const size_t count,
+        detector_index_t label[],
+        uint8_t flags[],
+        float label_prob[]);
@@ -0,0 +1,455 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "detector.h"
+#include "speedgrid.h"
+
+
+/* Macros */
+
+#define PI 3.14159265359
+
+
+/* Declarations */
+
+bool
+speedgrid_init(
+        SpeedGrid* g,
+        uint8_t tooth_dists[const],
+        const size_t num_tooth_tips,
+        const detector_index_t num_tooth_posns,
+        float cells[const],
+        const size_t num_speeds,
+        float lik[const],
+        int8_t tooth_q[const],
+        float tooth_prob[const],
+        float speed_prob[const],
+        const uint32_t sample_rate,
+        const uint32_t min_period,
+        const uint8_t steps_per_octave,
+        const float ratio_sigma,
+        const float error_rate
+        );
+
+void
+speedgrid_interrupt(
+        uint32_t timer_register,
+        SpeedGrid* g
+        );
+
+void
+speedgrid_reset(SpeedGrid* g);
+
+const float*
+speedgrid_lik_slice(
+        const SpeedGrid* g,
+        int32_t k
+        );
+
+float
+speedgrid_row(
+        const float* restrict extra_row,
+        const float* restrict hit_row,
+        const float* restrict miss_row,
+        const float* restrict hit_lik,
+        const float* restrict miss_lik,
+        float* restrict out,
+        float* restrict speed_prob,
+        const size_t num_speeds,
+        const size_t stride,
+        const float extra,
+        const float hit,
+        const float miss,
+        const float keep,
+        const float drift,
+        const float least
+        );
+
+void
+speedgrid_update_sync(
+        SpeedGrid* g,
+        const detector_index_t previous_tooth
+        );
+
+
+/* Definitions */
+
+/*
+ * bool speedgrid_init - set up a speed grid
+ *
+ * arguments: SpeedGrid* g             - the grid
+ *            uint8_t tooth_dists[]    - as for detector_init
+ *            size_t num_tooth_tips    - as for detector_init
+ *            detector_index_t num_tooth_posns  - as for detector_init
+ *            float cells[]            - storage for 2 * num_tooth_tips * SPEEDGRID_STRIDE(num_speeds)
+ *                                       floats, the belief and the one each update builds
+ *            size_t num_speeds        - speed bins, at least 3
+ *            float lik[]              - storage for SPEEDGRID_LIK_LEN(num_speeds) floats
+ *            int8_t tooth_q[]         - storage for 2 * num_tooth_tips values
+ *            float tooth_prob[]       - storage for num_tooth_tips probabilities
+ *            float speed_prob[]       - storage for num_speeds probabilities
+ *            uint32_t sample_rate     - as for detector_init
+ *            uint32_t min_period      - timer ticks per tooth position at the fastest speed
+ *                                       bin; the slowest is num_speeds / steps_per_octave
+ *                                       octaves slower
+ *            uint8_t steps_per_octave - speed bins per doubling of the period
+ *            float ratio_sigma        - spread of a period around what its speed bin expects,
+ *                                       in octaves, as for detector_init_lik_lut
+ *            float error_rate         - as for detector_init
+ * returns: false if the sizes or the spread can't be used
+ * side-effects: modifies *g and its storage
+ */
+bool
+speedgrid_init(
+        SpeedGrid* g,
+        uint8_t tooth_dists[const],
+        const size_t num_tooth_tips,
+        const detector_index_t num_tooth_posns,
+        float cells[const],
+        const size_t num_speeds,
+        float lik[const],
+        int8_t tooth_q[const],
+        float tooth_prob[const],
+        float speed_prob[const],
+        const uint32_t sample_rate,
+        const uint32_t min_period,
+        const uint8_t steps_per_octave,
+        const float ratio_sigma,
+        const float error_rate)
+{
+    float sigma_steps = ratio_sigma * (float)steps_per_octave;
+
+    if (num_tooth_tips < 2 || num_speeds < 3 || min_period == 0 || steps_per_octave == 0
+        || count_tooth_posns(num_tooth_tips, tooth_dists) != num_tooth_posns
+        || 4 * sigma_steps > SPEEDGRID_LIK_MARGIN)
+        return false;
+
+    g->tooth_dists = tooth_dists;
+    g->num_tooth_tips = num_tooth_tips;
+    g->num_tooth_posns = num_tooth_posns;
+    g->ticks_per_sec = sample_rate;
+    g->error_rate = error_rate;
+
+    g->num_speeds = num_speeds;
+    g->stride = SPEEDGRID_STRIDE(num_speeds);
+    g->cells = cells;
+    g->spare = &(cells[num_tooth_tips * g->stride]);
+    g->min_period = min_period;
+    g->steps_per_octave = steps_per_octave;
+    g->diffuse = SPEEDGRID_DEFAULT_DIFFUSE;
+    g->least = fmaxf(SPEEDGRID_DEFAULT_RELOCATE / (float)num_speeds, SPEEDGRID_CELL_FLOOR);
+
+    g->lik = lik;
+    g->tooth_q = tooth_q;
+    g->tooth_prob = tooth_prob;
+    g->speed_prob = speed_prob;
+
+    /* A hit covers the tooth's own distance; a missed edge that and the one before */
+    for (size_t i = 0; i < num_tooth_tips; i++)
+    {
+        size_t before = (i >= 1) ? i - 1 : num_tooth_tips - 1;
+        tooth_q[i] = (int8_t)detector_log2_ratio_q(1, tooth_dists[i], steps_per_octave);
+        tooth_q[num_tooth_tips + i] = (int8_t)detector_log2_ratio_q(
+                                          1, (uint32_t)tooth_dists[i] + tooth_dists[before], steps_per_octave);
+    }
+
+    /* Stored reversed, so a row's speed bins read it forwards: the period is
+     * longer than bin s expects by (q - s) steps, which is lik[half - q + s]. */
+    g->lik_half = (int32_t)(num_speeds + SPEEDGRID_LIK_MARGIN);
+    for (int32_t j = 0; j < (int32_t)SPEEDGRID_LIK_LEN(num_speeds); j++)
+    {
+        float z = (float)(g->lik_half - j) / sigma_steps;
+        lik[j] = error_rate + (1 - error_rate) * expf(-0.5f * z * z);
+    }
+
+    g->sync_accept = logf((1 - DETECTOR_DEFAULT_MISS_PROB) / DETECTOR_DEFAULT_FALSE_SYNC_PROB);
+    g->sync_reject = logf(DETECTOR_DEFAULT_MISS_PROB / (1 - DETECTOR_DEFAULT_FALSE_SYNC_PROB));
+    g->sync_step = logf((1 - error_rate) / error_rate);
+
+    speedgrid_reset(g);
+
+    return true;
+}
+
+/*
+ * void speedgrid_reset - forget everything: any tooth, any speed
+ *
+ * arguments: SpeedGrid* g - the grid
+ * returns: nothing
+ * side-effects: modifies g's belief, marginals and results
+ */
+void
+speedgrid_reset(SpeedGrid* g)
+{
+    size_t n = g->num_tooth_tips;
+    float p = 1.0 / (float)(n * g->num_speeds);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        float* row = &(g->cells[i * g->stride]);
+        for (size_t s = 0; s < g->stride; s++)
+            row[s] = (s < g->num_speeds) ? p : 0.0;
+        g->tooth_prob[i] = 1.0 / (float)n;
+    }
+    for (size_t s = 0; s < g->num_speeds; s++)
+        g->speed_prob[s] = 1.0 / (float)g->num_speeds;
+
+    g->norm = 1.0;
+    g->current_tooth = 0;
+    g->has_sync = false;
+    g->confidence = 1.0 / (float)n;
+    g->velocity = 0.0;
+    g->sync_llr = 0.0;
+
+    return;
+}
+
+/*
+ * void speedgrid_interrupt - update the grid with one period
+ *
+ * arguments: uint32_t timer_register - the period that just ended, in timer ticks
+ *            SpeedGrid* g            - the grid
+ * returns: nothing
+ * side-effects: modifies *g and its storage
+ *
+ * One pass over the teeth; each output row is built from the three input
+ * rows it can have come from (see speedgrid_row), so the pass touches the
+ * belief once. The cells aren't normalized: the total is carried in g->norm
+ * and folded into the next update's move weights instead.
+ */
+void
+speedgrid_interrupt(
+        uint32_t timer_register,
+        SpeedGrid* g)
+{
+    size_t n = g->num_tooth_tips;
+    size_t stride = g->stride;
+    detector_index_t previous_tooth = g->current_tooth;
+
+    if (timer_register == 0)    /* glitch; nothing to measure */
+        return;
+
+    int32_t q = detector_log2_ratio_q(g->min_period, timer_register, g->steps_per_octave);
+    float miss = g->error_rate / 2 * g->norm;
+    float extra = g->error_rate / 2 * g->error_rate * g->norm;   /* noise: any period, so the floor */
+    float hit = (1 - g->error_rate) * g->norm;
+    float keep = 1 - 2 * g->diffuse;
+    float total = 0.0;
+
+    for (size_t s = 0; s < g->num_speeds; s++)
+        g->speed_prob[s] = 0.0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t i1 = (i >= 1) ? i - 1 : i + n - 1;
+        size_t i2 = (i >= 2) ? i - 2 : i + n - 2;
+
+        g->tooth_prob[i] = speedgrid_row(
+                                &(g->cells[i * stride]),
+                                &(g->cells[i1 * stride]),
+                                &(g->cells[i2 * stride]),
+                                speedgrid_lik_slice(g, q - g->tooth_q[i]),
+                                speedgrid_lik_slice(g, q - g->tooth_q[n + i]),
+                                &(g->spare[i * stride]),
+                                g->speed_prob,
+                                g->num_speeds,
+                                stride,
+                                extra,
+                                hit,
+                                miss,
+                                keep,
+                                g->diffuse,
+                                g->least
+                                );
+        total += g->tooth_prob[i];
+    }
+
+    float* swap = g->cells;
+    g->cells = g->spare;
+    g->spare = swap;
+
+    if (!(total > 0))           /* nothing fits, or it all underflowed */
+    {
+        speedgrid_reset(g);
+        return;
+    }
+
+    g->norm = 1.0 / total;
+    for (size_t i = 0; i < n; i++)
+        g->tooth_prob[i] *= g->norm;
+
+    size_t best_speed = 0;
+    for (size_t s = 0; s < g->num_speeds; s++)
+    {
+        g->speed_prob[s] *= g->norm;
+        if (g->speed_prob[s] > g->speed_prob[best_speed])
+            best_speed = s;
+    }
+
+    detector_find_max_prob(g->tooth_prob, n, &(g->confidence), &(g->current_tooth));
+    g->velocity = (float)(2 * PI) / (float)g->num_tooth_posns * (float)g->ticks_per_sec
+                  / ((float)g->min_period * exp2f((float)best_speed / (float)g->steps_per_octave));
+
+    speedgrid_update_sync(g, previous_tooth);
+
+    return;
+}
+
+/*
+ * const float* speedgrid_lik_slice - the likelihood table as seen by one row
+ *
+ * arguments: SpeedGrid* g - the grid
+ *            int32_t k    - how many steps longer the period is than speed bin 0 expects
+ *                           of the distance in question
+ * returns: the likelihood of the period at each speed bin, num_speeds long
+ * side-effects: none
+ *
+ * Periods far outside the speed range are clamped to the end of the table,
+ * which is the error_rate floor by then.
+ */
+const float*
+speedgrid_lik_slice(
+        const SpeedGrid* g,
+        int32_t k)
+{
+    int32_t k_min = (int32_t)g->num_speeds - 1 - g->lik_half;   /* keeps the slice inside lik */
+
+    if (k > g->lik_half)
+        k = g->lik_half;
+    if (k < k_min)
+        k = k_min;
+
+    return &(g->lik[g->lik_half - k]);
+}
+
+/*
+ * float speedgrid_row - build one tooth's row of the next belief
+ *
+ * arguments: float extra_row[] - this tooth's row, for an extra edge (no move)
+ *            float hit_row[]   - the tooth before's row, for a normal move
+ *            float miss_row[]  - the tooth two before's row, for a missed edge
+ *            float hit_lik[]   - the likelihood of the period at each speed bin, for a normal move
+ *            float miss_lik[]  - the same for a missed edge, which covers two distances
+ *            float out[]       - where the new row goes
+ *            float speed_prob[] - the speed marginal, which this row's belief is added to
+ *            size_t num_speeds - speed bins in a row
+ *            size_t stride     - floats in a row, padding included
+ *            float extra, hit, miss - move weights, as in detector_move, with any
+ *                                likelihood that doesn't depend on speed folded in
+ *            float keep, drift - share of each speed bin staying put, and going to each neighbour
+ *            float least       - least a cell keeps
+ * returns: the sum of the new row
+ * side-effects: modifies the data at out and speed_prob
+ *
+ * Each move is weighed by the period before the speed drifts, which is the
+ * drift from this period to the next. The speed band reflects at the ends,
+ * so no belief is lost off them. No cell drops below the floor, which
+ * doubles as a standing chance that the belief is wrong altogether: the
+ * moves only ever spread it a tooth or two, so without it a lock on the
+ * wrong tooth after a sudden change of speed would never be undone. The
+ * floor is in the scale of a normalized belief, which is what the move
+ * weights (see g->norm) put the rows in.
+ *
+ * Every loop is over contiguous floats with no dependence between
+ * iterations, for the vectorizer; the sum is kept in SPEEDGRID_BLOCK lanes
+ * for the same reason.
+ */
+float
+speedgrid_row(
+        const float* restrict extra_row,
+        const float* restrict hit_row,
+        const float* restrict miss_row,
+        const float* restrict hit_lik,
+        const float* restrict miss_lik,
+        float* restrict out,
+        float* restrict speed_prob,
+        const size_t num_speeds,
+        const size_t stride,
+        const float extra,
+        const float hit,
+        const float miss,
+        const float keep,
+        const float drift,
+        const float least)
+{
+    float moved[stride];
+    float lanes[SPEEDGRID_BLOCK] = { 0 };
+    size_t last = num_speeds - 1;
+
+    if (num_speeds < 3)         /* speedgrid_init doesn't allow it; this tells the compiler so */
+        return 0.0;
+
+    for (size_t s = 0; s < num_speeds; s++)
+        moved[s] = hit * hit_row[s] * hit_lik[s] + miss * miss_row[s] * miss_lik[s] + extra * extra_row[s];
+
+    out[0] = fmaxf((keep + drift) * moved[0] + drift * moved[1], least);
+    for (size_t s = 1; s < last; s++)
+        out[s] = fmaxf(keep * moved[s] + drift * (moved[s - 1] + moved[s + 1]), least);
+    out[last] = fmaxf((keep + drift) * moved[last] + drift * moved[last - 1], least);
+    for (size_t s = num_speeds; s < stride; s++)
+        out[s] = 0.0;
+
+    for (size_t s = 0; s < num_speeds; s++)
+        speed_prob[s] += out[s];
+
+    for (size_t b = 0; b < stride; b += SPEEDGRID_BLOCK)
+        for (size_t l = 0; l < SPEEDGRID_BLOCK; l++)
+            lanes[l] += out[b + l];
+
+    float sum = 0.0;
+    for (size_t l = 0; l < SPEEDGRID_BLOCK; l++)
+        sum += lanes[l];
+
+    return sum;
+}
+
+/*
+ * void speedgrid_update_sync - decide sync as detector_interrupt does
+ *
+ * arguments: SpeedGrid* g           - the grid, updated
+ *            detector_index_t previous_tooth - current_tooth before this period
+ * returns: nothing
+ * side-effects: modifies g->has_sync and g->sync_llr
+ */
+void
+speedgrid_update_sync(
+        SpeedGrid* g,
+        const detector_index_t previous_tooth)
+{
+    if (!g->has_sync)
+    {
+        float top, second;
+        detector_index_t top_bin, second_bin;
+
+        detector_find_top2_prob(g->tooth_prob, g->num_tooth_tips, &top, &top_bin, &second, &second_bin);
+        g->sync_llr = (second > 0) ? logf(top / second) : g->sync_accept;
+        if (g->sync_llr >= g->sync_accept)
+        {
+            g->has_sync = true;
+            g->sync_llr = g->sync_accept;
+        }
+        return;
+    }
+
+    /* Same rule as particle_update_sync: the grid rarely doubts itself
+     * once synced, so a slipped track shows up as a jump or a near tie. */
+    float top, second;
+    detector_index_t top_bin, second_bin;
+
+    detector_find_top2_prob(g->tooth_prob, g->num_tooth_tips, &top, &top_bin, &second, &second_bin);
+    if (g->current_tooth != (previous_tooth + 1) % g->num_tooth_tips
+        || (second > 0 && logf(top / second) < g->sync_step))
+    {
+        g->has_sync = false;
+        g->sync_llr = 0.0;
+        return;
+    }
+
+    g->sync_llr += g->sync_step;
+    if (g->sync_llr > g->sync_accept)
+        g->sync_llr = g->sync_accept;
+
+    return;
+}
@@ -0,0 +1,107 @@
+/* An alternative localization engine: a grid over tooth position and speed.
+ *
+ * detector_locate judges each period against only the one before it, so a
+ * single noisy period throws the acceleration check. This grid instead keeps
+ * a belief over (tooth, speed bin), with speed bins spaced evenly in log
+ * period. Each period:
+ *
+ *   - moves every speed's belief on a tooth, as detector_move does, weighing
+ *     each move by how well the period fits the distance it covers at that
+ *     speed, from a table indexed by quantized log period (an extra edge
+ *     fits any period equally badly);
+ *   - lets speed drift to the neighbouring bins (a band of three).
+ *
+ * Speed is learned over many teeth, so one odd period costs one bad
+ * likelihood rather than two bad accelerations.
+ *
+ * The cells are laid out tooth-major, each tooth's speeds contiguous and
+ * padded to SPEEDGRID_BLOCK floats. All three steps then run along
+ * contiguous rows, a tooth at a time, over at most three rows of input: the
+ * moves become row sums, each likelihood a slice of the table, and the speed
+ * band a short stencil, all in plain loops the compiler can vectorize. */
+
+/* Rows are padded to a multiple of this many floats */
+#define SPEEDGRID_BLOCK 8
+
+/* Row length for a number of speed bins */
+#define SPEEDGRID_STRIDE(num_speeds) (((num_speeds) + SPEEDGRID_BLOCK - 1) / SPEEDGRID_BLOCK * SPEEDGRID_BLOCK)
+
+/* Quantization steps either side of the speed range the likelihood table covers */
+#define SPEEDGRID_LIK_MARGIN 16
+
+/* Length of the likelihood table for a number of speed bins; rows read a
+ * whole stride of it, padding included */
+#define SPEEDGRID_LIK_LEN(num_speeds) (2 * ((num_speeds) + SPEEDGRID_LIK_MARGIN) + SPEEDGRID_BLOCK)
+
+/* Least belief each tooth keeps, spread over its speed bins, so that a wrong
+ * lock can still be found out; see speedgrid_row. Well under the sync
+ * thresholds' odds, or sync would never be declared */
+#define SPEEDGRID_DEFAULT_RELOCATE 1.5e-3
+
+/* Least belief a cell keeps whatever the above. Cells at speeds far from the
+ * real one would otherwise sink into subnormal floats, which many FPUs take a
+ * slow path for */
+#define SPEEDGRID_CELL_FLOOR 1e-20f
+
+/* Share of each speed bin's belief that drifts to each neighbour, per period */
+#define SPEEDGRID_DEFAULT_DIFFUSE 0.15
+
+typedef struct {
+    detector_index_t current_tooth;
+    bool    has_sync;
+    float   velocity;           // speed of the likeliest speed bin, rad/s
+    float   confidence;         // probability of current_tooth
+
+    uint8_t  *tooth_dists;      // as in Detector
+    size_t   num_tooth_tips;
+    detector_index_t num_tooth_posns;
+    uint32_t ticks_per_sec;
+    float    error_rate;
+
+    float    *cells;            // num_tooth_tips rows of stride floats
+    float    *spare;            // where the next update goes
+    size_t   num_speeds;        // speed bins in a row
+    size_t   stride;            // SPEEDGRID_STRIDE(num_speeds)
+    uint32_t min_period;        // timer ticks per tooth position in speed bin 0, the fastest
+    uint8_t  steps_per_octave;  // speed bins, and likelihood table steps, per doubling of the period
+    float    diffuse;           // SPEEDGRID_DEFAULT_DIFFUSE unless changed
+    float    least;             // least a cell keeps, from SPEEDGRID_DEFAULT_RELOCATE
+    float    norm;              // what the cells should be multiplied by to sum to 1; folded into the next update
+
+    float    *lik;              // likelihood of each quantized log period difference, reversed
+    int32_t  lik_half;          // index in lik of a difference of 0
+    int8_t   *tooth_q;          // quantized log2 of each tooth's distance
+    float    *tooth_prob;       // marginal belief over teeth
+    float    *speed_prob;       // marginal belief over speed bins
+
+    float    sync_accept;       // log-likelihood ratios, as in Detector
+    float    sync_reject;
+    float    sync_llr;
+    float    sync_step;
+} SpeedGrid;
+
+
+/* Set up a speed grid; storage is caller-provided, as for detector_init */
+bool
+speedgrid_init(
+        SpeedGrid* g,
+        uint8_t tooth_dists[const],
+        const size_t num_tooth_tips,
+        const detector_index_t num_tooth_posns,
+        float cells[const],
+        const size_t num_speeds,
+        float lik[const],
+        int8_t tooth_q[const],
+        float tooth_prob[const],
+        float speed_prob[const],
+        const uint32_t sample_rate,
+        const uint32_t min_period,
+        const uint8_t steps_per_octave,
+        const float ratio_sigma,
+        const float error_rate);
+
+/* Execute a localization loop */
+void
+speedgrid_interrupt(
+        uint32_t timer_register,
+        SpeedGrid* g);
@@ -0,0 +1,218 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "detector.h"
+#include "telemetry.h"
+
+
+/* Declarations */
+
+bool
+telemetry_open(
+        TelemetryExporter* t,
+        const char* shm_name,
+        const uint32_t num_slots
+        );
+
+int
+telemetry_add_detector(
+        TelemetryExporter* t,
+        const char* name
+        );
+
+void
+telemetry_publish(
+        TelemetryExporter* t,
+        const int slot,
+        const Detector* const d
+        );
+
+void
+telemetry_close(
+        TelemetryExporter* t,
+        const bool unlink_segment
+        );
+
+
+/* Definitions */
+
+/*
+ * bool telemetry_open - create the shared-memory segment and map it
+ *
+ * arguments: TelemetryExporter* t - the exporter
+ *            char* shm_name       - POSIX shared-memory name, e.g. "/localizer"
+ *            uint32_t num_slots   - most detectors this segment can hold
+ * returns: true on success, false if the segment couldn't be created or mapped
+ * side-effects: modifies *t, creates the named segment
+ *
+ * This is the only place the exporter allocates anything, and it happens
+ * once, up front. The header is written last, so a reader that attaches
+ * early sees a bad magic number rather than half-initialized slots.
+ *
+ * A segment left by an earlier run is unlinked rather than resized: readers
+ * may still have it mapped, and shrinking it under them would fault them.
+ * They keep the old one, frozen, until they reattach.
+ */
+
+bool
+telemetry_open(
+        TelemetryExporter* t,
+        const char* shm_name,
+        const uint32_t num_slots
+        )
+{
+    size_t size = sizeof(TelemetryHeader) + (size_t)num_slots * sizeof(TelemetrySlot);
+    int fd;
+
+    t->header = NULL;
+    t->slots = NULL;
+
+    shm_unlink(shm_name);
+    fd = shm_open(shm_name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return false;
+
+    if (ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    memset(base, 0, size);
+
+    t->header = base;
+    t->slots = (TelemetrySlot*)((char*)base + sizeof(TelemetryHeader));
+    t->size = size;
+    strncpy(t->shm_name, shm_name, sizeof(t->shm_name) - 1);
+    t->shm_name[sizeof(t->shm_name) - 1] = '\0';
+
+    t->header->version = TELEMETRY_VERSION;
+    t->header->header_size = sizeof(TelemetryHeader);
+    t->header->slot_size = sizeof(TelemetrySlot);
+    t->header->num_slots = num_slots;
+    __atomic_store_n(&(t->header->magic), TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/*
+ * int telemetry_add_detector - claim a slot for a detector
+ *
+ * arguments: TelemetryExporter* t - the exporter
+ *            char* name           - name observers will know the detector by
+ * returns: the slot index to pass to telemetry_publish, or -1 if the segment is full
+ * side-effects: modifies the segment
+ */
+
+int
+telemetry_add_detector(
+        TelemetryExporter* t,
+        const char* name
+        )
+{
+    for (uint32_t i = 0; i < t->header->num_slots; i++)
+    {
+        TelemetrySlot* s = &(t->slots[i]);
+
+        if (s->name[0] != '\0')
+            continue;
+
+        __atomic_store_n(&(s->seq), s->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        strncpy(s->name, name, TELEMETRY_NAME_LEN - 1);
+        s->name[TELEMETRY_NAME_LEN - 1] = '\0';
+        __atomic_store_n(&(s->seq), s->seq + 1, __ATOMIC_RELEASE);
+
+        return (int)i;
+    }
+
+    return -1;
+}
+
+/*
+ * void telemetry_publish - publish a detector's current state
+ *
+ * arguments: TelemetryExporter* t - the exporter
+ *            int slot             - from telemetry_add_detector
+ *            Detector* d          - the detector to publish
+ * returns: nothing
+ * side-effects: modifies the segment
+ *
+ * Costs one pass over the belief and never waits on readers, so it can be
+ * called on every tooth. Beliefs with more than TELEMETRY_BELIEF_BINS bins
+ * are summed into that many groups, which keeps a peak a peak.
+ */
+
+void
+telemetry_publish(
+        TelemetryExporter* t,
+        const int slot,
+        const Detector* const d
+        )
+{
+    TelemetrySlot* s = &(t->slots[slot]);
+    size_t n = d->num_tooth_tips;
+    size_t len = (n < TELEMETRY_BELIEF_BINS) ? n : TELEMETRY_BELIEF_BINS;
+    uint32_t seq = s->seq;
+
+    __atomic_store_n(&(s->seq), seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    s->updates++;
+    s->num_tooth_tips = (uint32_t)n;
+    s->belief_len = (uint16_t)len;
+    s->current_tooth = d->current_tooth;
+    s->has_sync = d->has_sync;
+    s->confidence = d->confidence;
+    s->velocity = d->velocity;
+
+    for (size_t j = 0; j < len; j++)
+        s->belief[j] = 0.0;
+    for (size_t i = 0; i < n; i++)
+        s->belief[i * len / n] += d->tooth_prob[i];
+
+    __atomic_store_n(&(s->seq), seq + 2, __ATOMIC_RELEASE);
+
+    return;
+}
+
+/*
+ * void telemetry_close - unmap the segment
+ *
+ * arguments: TelemetryExporter* t   - the exporter
+ *            bool unlink_segment    - also remove the named segment
+ * returns: nothing
+ * side-effects: modifies *t; readers that are still attached keep their mapping
+ */
+
+void
+telemetry_close(
+        TelemetryExporter* t,
+        const bool unlink_segment
+        )
+{
+    if (t->header == NULL)
+        return;
+
+    munmap(t->header, t->size);
+    if (unlink_segment)
+        shm_unlink(t->shm_name);
+
+    t->header = NULL;
+    t->slots = NULL;
+
+    return;
+}
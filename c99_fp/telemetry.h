@@ -0,0 +1,66 @@
+/* Live detector state in POSIX shared memory, for any number of observers.
+ *
+ * The segment starts with a TelemetryHeader, followed by num_slots
+ * TelemetrySlots, one per exported detector. Each slot is guarded by its own
+ * sequence lock: readers copy it, and retry if seq was odd or changed. */
+
+#define TELEMETRY_MAGIC        0x434f4c4du  /* "MLOC" */
+#define TELEMETRY_VERSION      2
+#define TELEMETRY_NAME_LEN     16
+#define TELEMETRY_BELIEF_BINS  64           /* beliefs with more bins are downsampled to this */
+
+typedef struct {
+    uint32_t magic;             // TELEMETRY_MAGIC
+    uint16_t version;           // TELEMETRY_VERSION; readers should refuse anything else
+    uint16_t header_size;       // sizeof(TelemetryHeader)
+    uint32_t slot_size;         // sizeof(TelemetrySlot)
+    uint32_t num_slots;         // number of slots following the header
+} TelemetryHeader;
+
+typedef struct {
+    uint32_t seq;               // sequence lock; odd while the slot is being written
+    char     name[TELEMETRY_NAME_LEN];  // NUL-terminated; empty if the slot is unused
+    uint32_t updates;           // number of times this slot has been published
+    uint32_t num_tooth_tips;    // bins in the detector's belief
+    uint32_t current_tooth;
+    uint16_t belief_len;        // bins in belief[], at most TELEMETRY_BELIEF_BINS
+    uint8_t  has_sync;
+    uint8_t  reserved;
+    float    confidence;
+    float    velocity;
+    float    belief[TELEMETRY_BELIEF_BINS];     // tooth_prob, summed into belief_len equal-ish groups
+} TelemetrySlot;
+
+typedef struct {
+    TelemetryHeader *header;    // the mapped segment
+    TelemetrySlot   *slots;     // the slots just past the header
+    size_t          size;       // size of the mapping
+    char            shm_name[64];
+} TelemetryExporter;
+
+
+/* Create (or replace) the shared-memory segment and map it */
+bool
+telemetry_open(
+        TelemetryExporter* t,
+        const char* shm_name,
+        const uint32_t num_slots);
+
+/* Claim a slot for a detector, returning its index or -1 if none are free */
+int
+telemetry_add_detector(
+        TelemetryExporter* t,
+        const char* name);
+
+/* Publish a detector's current state into its slot */
+void
+telemetry_publish(
+        TelemetryExporter* t,
+        const int slot,
+        const Detector* const d);
+
+/* Unmap the segment, and remove it if unlink_segment is set */
+void
+telemetry_close(
+        TelemetryExporter* t,
+        const bool unlink_segment);
@@ -8,16 +8,21 @@
 const uint32_t TEST_SAMPLE_RATE = 200000000; /* 200MHz */
 const float    TEST_MAX_ACCEL   = 3600.0;    /* rad/s^2 */
 const float    TEST_ERROR_RATE  = 0.07;
+const uint8_t  TEST_SIG_WINDOW  = 1;       /* every ratio on a 4-1 wheel is unique */
+const float    TEST_RATIO_SIGMA = 0.1;     /* octaves */
+const uint32_t TEST_MIN_PERIOD  = 100;     /* ticks per tooth position at the fastest speed worth tracking */
 
 #elif defined(TEST_DATASET_36_1)
 const uint32_t TEST_SAMPLE_RATE = 200000000; /* 200MHz */
 const float    TEST_MAX_ACCEL   = 3600.0; /* rad/s^2 */
 const float    TEST_ERROR_RATE  = 0.07;
+const uint8_t  TEST_SIG_WINDOW  = 2;      /* one noisy ratio shouldn't be enough to seed */
+const float    TEST_RATIO_SIGMA = 0.15;   /* octaves; cranking speed wobbles a lot */
+const uint32_t TEST_MIN_PERIOD  = 100000; /* ticks per tooth position: 0.5 ms, about 3300 rpm */
 
 #endif
 
 #ifdef TEST_DATASET_4_1
-const size_t num_sample_engine_ticks = 218;
 const uint32_t sample_engine_ticks[] = {800, 400, 400, 800, 400, 400, 800, 400,
      400, 800, 400, 400, 800, 400, 400, 800, 400, 400, 800, 400, 400, 800, 400,
      400, 800, 400, 400, 800, 400, 400, 800, 400, 400, 800, 400, 400, 800, 400,
@@ -33,6 +38,7 @@ const uint32_t sample_engine_ticks[] = {800, 400, 400, 800, 400, 400, 800, 400,
      400, 800, 400, 400, 800, 400, 400, 800, 400, 400, 800, 400, 400, 800, 400, 
      400, 800, 400, 400, 800, 400, 400, 800, 400, 400, 800, 400, 400, 800, 400, 
      400, 800, 400, 400, 800, 400, 400, 800, 400, 400, 800, 400, 400, 800, 400};
+const size_t num_sample_engine_ticks = sizeof(sample_engine_ticks) / sizeof(sample_engine_ticks[0]);
 #endif
 
 
@@ -40,7 +46,6 @@ const uint32_t sample_engine_ticks[] = {800, 400, 400, 800, 400, 400, 800, 400,
  * don't expect it to act like a well-behaved system.
  */
 #ifdef TEST_DATASET_36_1
-const size_t num_sample_engine_ticks = 21483;
 const uint32_t sample_engine_ticks[] = {
 3254803, 19692130, 345629, 2826490, 2295374, 430373, 2760754, 3023064, 2948774, 2626430, 
 153648, 2765189, 410573, 3053002, 2662546, 2331648, 4398134, 2370931, 2740003, 2612808, 
@@ -1668,4 +1673,5 @@ const uint32_t sample_engine_ticks[] = {
 267854, 269438, 268330, 268963, 268013, 270389, 268171, 265954, 263578, 265795, 
 266112, 265162, 266429, 263102, 264528, 267062, 263578, 523
 };
+const size_t num_sample_engine_ticks = sizeof(sample_engine_ticks) / sizeof(sample_engine_ticks[0]);
 #endif
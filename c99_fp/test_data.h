@@ -17,6 +17,9 @@
 extern const uint32_t TEST_SAMPLE_RATE;
 extern const float    TEST_MAX_ACCEL;
 extern const float    TEST_ERROR_RATE;
+extern const uint8_t  TEST_SIG_WINDOW;
+extern const float    TEST_RATIO_SIGMA;
+extern const uint32_t TEST_MIN_PERIOD;
 
 extern const size_t   num_sample_engine_ticks;
 extern const uint32_t sample_engine_ticks[];
@@ -0,0 +1,492 @@
+/* Tune the detector's parameters over a corpus of logs, without recompiling.
+ *
+ * usage: autotune [-j threads] [-s starts] [-w weight] [periods.txt ...]
+ *   -j threads - evaluations to run at once (default: one per core online)
+ *   -s starts  - cold starts per log (default 64)
+ *   -w weight  - cost of false sync, in teeth of sync latency per percent (default 10)
+ *   periods.txt - logs of periods, whitespace separated, as smooth_log reads;
+ *                 with none the built-in test dataset is used
+ *
+ * Every log has to be of the tooth pattern and timer rate of the dataset this
+ * is built with, so build one per engine family. The logs are read once and
+ * labelled once by the offline smoother (see smoother.h), and every
+ * evaluation on every thread shares them.
+ *
+ * It searches error_rate, max_accel and the sync decision's false_sync_prob
+ * (see detector_set_sync_thresholds). A grid comes first, and then
+ * coordinate refinement from the best grid point. Refinement tries a step
+ * up and a step down on each parameter at once, takes the best that
+ * improves, and halves the steps (in log terms) when none does.
+ *
+ * One start per log would say little about sync latency, so each setting
+ * starts a fresh detector at evenly spaced points in every log and runs it
+ * for up to HORIZON periods. The cost is the mean number of teeth to first
+ * sync over those starts, plus weight times the percentage of synced periods
+ * that were false. Only periods with a sure smoother label are judged: one is
+ * false if the tooth we're synced on isn't the label's, or if we lost a sync
+ * that was on the label's tooth and the label goes on as expected. Losing a
+ * sync the labels say was wrong, or across a period they aren't sure of,
+ * costs nothing. A start that never syncs costs the whole horizon.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "detector.h"
+#include "smoother.h"
+#include "test_data.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4       /* as in main.c */
+#define HISTORY_LEN     64
+#define RATE_FLOOR      0.005
+#define RATE_CEILING    0.2
+#define RATE_ALPHA      0.01
+#define NUM_PARAMS      3
+#define HORIZON         256     /* periods each start runs for */
+#define REFINE_STEP     1.414   /* first refinement step, as a factor: about half a grid step */
+#define REFINE_MIN_STEP 1.01    /* stop refining below this */
+#define REFINE_MAX_ROUNDS 40
+#define TOP_GRID        5       /* grid points to show */
+
+
+/* Declarations */
+
+typedef struct {
+    float    value[NUM_PARAMS]; // error_rate, max_accel, false_sync_prob
+} TuneParams;
+
+typedef struct {
+    const char *name;
+    uint32_t *periods;
+    size_t   count;
+    detector_index_t *label;    // the smoother's tooth for each period
+    uint8_t  *flags;            // SMOOTHER_* for each period
+} TuneLog;
+
+typedef struct {
+    TuneParams p;
+    double   cost;
+    double   sync_teeth;        // mean teeth to first sync, over every start
+    uint64_t synced;            // synced periods at a sure label, over every start
+    uint64_t false_syncs;       // ... on the wrong tooth, and right syncs lost for nothing
+    size_t   never_synced;      // starts without sync inside HORIZON
+    uint64_t periods;           // run through the detector
+} TuneResult;
+
+typedef struct {
+    const TuneLog *logs;        // shared, read-only, by every thread
+    size_t   num_logs;
+    uint8_t  *tooth_dists;
+    size_t   num_tooth_tips;
+    size_t   num_starts;        // per log
+    float    weight;
+    size_t   num_threads;
+    TuneResult *batch;          // the evaluations to share out
+    size_t   batch_len;
+    size_t   next;              // next one to claim, atomically
+    uint64_t evaluations;
+    uint64_t periods;
+} Tuner;
+
+static const char* const param_names[NUM_PARAMS] = { "error_rate", "max_accel", "false_sync_prob" };
+static const float param_min[NUM_PARAMS] = { 0.001, 10.0, 0.0001 };
+static const float param_max[NUM_PARAMS] = { 0.45, 1e6, 0.4 };
+
+double now_seconds(void);
+uint32_t* read_periods(FILE* f, size_t* count);
+bool label_log(TuneLog* log, uint8_t* tooth_dists, size_t n);
+void evaluate(const Tuner* t, TuneResult* r, Detector* d, float* tooth_prob, float* lik_lut,
+              uint8_t* lik_class, DetectorSigEntry* sig_index, size_t sig_index_size, uint32_t* history);
+void* worker(void* arg);
+void run_batch(Tuner* t, TuneResult* batch, size_t count);
+int compare_cost(const void* a, const void* b);
+void print_result(const char* what, const TuneResult* r);
+
+
+/* Definitions */
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* as in smooth_log.c */
+uint32_t* read_periods(FILE* f, size_t* count)
+{
+    size_t cap = 4096, n = 0;
+    uint32_t* periods = malloc(cap * sizeof(*periods));
+    unsigned long v;
+
+    while (periods != NULL && fscanf(f, "%lu", &v) == 1)
+    {
+        if (n == cap)
+        {
+            cap *= 2;
+            uint32_t* grown = realloc(periods, cap * sizeof(*periods));
+            if (grown == NULL)
+            {
+                free(periods);
+                return NULL;
+            }
+            periods = grown;
+        }
+        periods[n++] = (uint32_t)v;
+    }
+
+    *count = n;
+    return periods;
+}
+
+/* Label a log with the smoother, using the dataset's own parameters */
+bool label_log(TuneLog* log, uint8_t* tooth_dists, size_t n)
+{
+    size_t block_len = (size_t)ceil(sqrt((double)log->count));
+    size_t num_checkpoints = (log->count + block_len - 1) / block_len;
+    float* checkpoints = malloc(2 * num_checkpoints * n * sizeof(float));
+    float* block = malloc(block_len * n * sizeof(float));
+    uint8_t* steps = malloc(block_len * n);
+    float tooth_prob[n];
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    uint8_t lik_class[n];
+    Detector d;
+    Smoother s;
+    bool ok;
+
+    log->label = malloc(log->count * sizeof(*log->label));
+    log->flags = malloc(log->count);
+
+    detector_init(&d, tooth_dists, n, count_tooth_posns(n, tooth_dists), tooth_prob,
+                  TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE);
+    detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+
+    ok = checkpoints != NULL && block != NULL && steps != NULL && log->label != NULL && log->flags != NULL
+        && smoother_init(&s, &d, checkpoints, num_checkpoints, block, steps, block_len)
+        && smoother_run(&s, log->periods, log->count, log->label, log->flags, NULL);
+
+    free(checkpoints);
+    free(block);
+    free(steps);
+    return ok;
+}
+
+/* Score one setting over every log, set up as main.c sets the detector up */
+void evaluate(const Tuner* t, TuneResult* r, Detector* d, float* tooth_prob, float* lik_lut,
+              uint8_t* lik_class, DetectorSigEntry* sig_index, size_t sig_index_size, uint32_t* history)
+{
+    const size_t n = t->num_tooth_tips;
+    double teeth = 0.0;
+    size_t starts = 0;
+
+    r->synced = 0;
+    r->false_syncs = 0;
+    r->never_synced = 0;
+    r->periods = 0;
+
+    for (size_t k = 0; k < t->num_logs; k++)
+    {
+        const TuneLog* log = &(t->logs[k]);
+
+        for (size_t j = 0; j < t->num_starts; j++)
+        {
+            size_t start = log->count * j / t->num_starts;
+            size_t end = (log->count - start > HORIZON) ? start + HORIZON : log->count;
+            size_t first_sync = end - start;
+            bool was_right = false;     /* synced on a sure label's tooth after the last period */
+
+            if (j > 0 && start == log->count * (j - 1) / t->num_starts)
+                continue;       /* a log shorter than the starts asked for */
+
+            detector_init(d, t->tooth_dists, n, count_tooth_posns(n, t->tooth_dists), tooth_prob,
+                          TEST_SAMPLE_RATE, r->p.value[1], r->p.value[0]);
+            detector_init_sig_index(d, sig_index, sig_index_size, TEST_SIG_WINDOW);
+            detector_init_lik_lut(d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+            detector_init_history(d, history, HISTORY_LEN);
+            detector_set_error_adaptation(d, RATE_FLOOR, RATE_CEILING, RATE_ALPHA);
+            detector_set_sync_thresholds(d, r->p.value[2], DETECTOR_DEFAULT_MISS_PROB);
+
+            for (size_t i = start; i < end; i++)
+            {
+                detector_interrupt(log->periods[i], d);
+
+                bool sure = !(log->flags[i] & (SMOOTHER_UNSURE | SMOOTHER_DISAGREE));
+
+                if (d->has_sync && first_sync == end - start)
+                    first_sync = i + 1 - start;
+
+                if (sure && d->has_sync)
+                {
+                    r->synced++;
+                    if (d->current_tooth != log->label[i])
+                        r->false_syncs++;
+                }
+                else if (sure && was_right && log->label[i] == (log->label[i - 1] + 1) % n)
+                {
+                    r->synced++;
+                    r->false_syncs++;   /* right, and nothing the labels saw to lose it over */
+                }
+                was_right = sure && d->has_sync && d->current_tooth == log->label[i];
+            }
+
+            teeth += first_sync;
+            r->never_synced += !d->counters.sync_acquired;
+            starts++;
+            r->periods += end - start;
+        }
+    }
+
+    r->sync_teeth = teeth / starts;
+    r->cost = r->sync_teeth
+            + t->weight * (r->synced ? 100.0 * r->false_syncs / r->synced : 0.0);
+}
+
+/* Claim and evaluate settings from the batch until there are none left */
+void* worker(void* arg)
+{
+    Tuner* t = arg;
+    const size_t n = t->num_tooth_tips;
+    size_t sig_index_size = 1;
+    while (sig_index_size < 2 * n)
+        sig_index_size <<= 1;
+    float tooth_prob[n];
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    uint8_t lik_class[n];
+    DetectorSigEntry sig_index[sig_index_size];
+    uint32_t history[HISTORY_LEN];
+    Detector d;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&(t->next), 1, __ATOMIC_RELAXED)) < t->batch_len)
+        evaluate(t, &(t->batch[i]), &d, tooth_prob, lik_lut, lik_class, sig_index, sig_index_size, history);
+
+    return NULL;
+}
+
+/* Evaluate a batch of settings across the threads, the calling one included */
+void run_batch(Tuner* t, TuneResult* batch, size_t count)
+{
+    pthread_t threads[t->num_threads];
+    size_t started = 0;
+
+    t->batch = batch;
+    t->batch_len = count;
+    t->next = 0;
+
+    while (started + 1 < t->num_threads && started + 1 < count
+           && pthread_create(&threads[started], NULL, worker, t) == 0)
+        started++;
+    worker(t);
+    for (size_t k = 0; k < started; k++)
+        pthread_join(threads[k], NULL);
+
+    t->evaluations += count;
+    for (size_t i = 0; i < count; i++)
+        t->periods += batch[i].periods;
+}
+
+int compare_cost(const void* a, const void* b)
+{
+    const TuneResult* ra = a;
+    const TuneResult* rb = b;
+    return (ra->cost > rb->cost) - (ra->cost < rb->cost);
+}
+
+void print_result(const char* what, const TuneResult* r)
+{
+    printf("%-10s %10.4f %10.0f %10.4f %10.1f %6" PRIu64 "/%-6" PRIu64 " %6zu %10.1f\n", what,
+           r->p.value[0], r->p.value[1], r->p.value[2], r->sync_teeth,
+           r->false_syncs, r->synced, r->never_synced, r->cost);
+}
+
+int main(int argc, char** argv)
+{
+    static const float grid[NUM_PARAMS][7] = {
+        { 0.01, 0.02, 0.04, 0.07, 0.1, 0.15, 0.25 },
+        { 450, 900, 1800, 3600, 7200, 14400, 28800 },
+        { 0.001, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2 },
+    };
+    const size_t grid_len = 7;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = online > 0 ? (int)online : 1;
+    int num_starts = 64;
+    float weight = 10.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:s:w:")) != -1)
+    {
+        if (opt == 'j')
+            num_threads = atoi(optarg);
+        else if (opt == 's')
+            num_starts = atoi(optarg);
+        else if (opt == 'w')
+            weight = (float)atof(optarg);
+        else
+            num_threads = 0;
+    }
+    if (num_threads < 1 || num_starts < 1 || !(weight >= 0))
+    {
+        fprintf(stderr, "usage: autotune [-j threads] [-s starts] [-w weight] [periods.txt ...]\n");
+        return 1;
+    }
+
+    uint8_t tooth_dists[] = TEST_TOOTH_MAP;
+    const size_t n = sizeof(tooth_dists) / sizeof(tooth_dists[0]);
+    size_t num_logs = (optind < argc) ? (size_t)(argc - optind) : 1;
+    TuneLog* logs = calloc(num_logs, sizeof(*logs));
+
+    if (logs == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    /* Read and label every log once; the evaluations only ever read them */
+    double t0 = now_seconds();
+    for (size_t k = 0; k < num_logs; k++)
+    {
+        TuneLog* log = &logs[k];
+
+        if (optind < argc)
+        {
+            FILE* f = fopen(argv[optind + k], "r");
+            if (f == NULL)
+            {
+                perror(argv[optind + k]);
+                return 1;
+            }
+            log->name = argv[optind + k];
+            log->periods = read_periods(f, &(log->count));
+            fclose(f);
+        }
+        else
+        {
+            log->name = "built-in";
+            log->count = num_sample_engine_ticks;
+            log->periods = malloc(log->count * sizeof(uint32_t));
+            if (log->periods != NULL)
+                memcpy(log->periods, sample_engine_ticks, log->count * sizeof(uint32_t));
+        }
+
+        if (log->periods == NULL || log->count == 0 || !label_log(log, tooth_dists, n))
+        {
+            fprintf(stderr, "couldn't read and label %s\n", log->name);
+            return 1;
+        }
+    }
+
+    Tuner t = {
+        .logs = logs, .num_logs = num_logs, .tooth_dists = tooth_dists, .num_tooth_tips = n,
+        .num_starts = (size_t)num_starts, .weight = weight, .num_threads = (size_t)num_threads,
+    };
+    size_t total_periods = 0;
+    for (size_t k = 0; k < num_logs; k++)
+        total_periods += logs[k].count;
+
+    printf("%zu logs, %zu periods, labelled in %.2f s; %d starts per log; %d threads on %ld cores\n\n",
+           num_logs, total_periods, now_seconds() - t0, num_starts, num_threads, online);
+    printf("%-10s %10s %10s %10s %10s %13s %6s %10s\n", "", param_names[0], param_names[1], "false_sync",
+           "sync teeth", "false/synced", "never", "cost");
+
+    TuneResult baseline = { .p = { { TEST_ERROR_RATE, TEST_MAX_ACCEL, DETECTOR_DEFAULT_FALSE_SYNC_PROB } } };
+
+    t0 = now_seconds();
+    run_batch(&t, &baseline, 1);
+    print_result("baseline", &baseline);
+
+    /* The grid */
+    const size_t grid_points = grid_len * grid_len * grid_len;
+    TuneResult* results = malloc(grid_points * sizeof(*results));
+
+    if (results == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < grid_points; i++)
+    {
+        results[i].p.value[0] = grid[0][i % grid_len];
+        results[i].p.value[1] = grid[1][(i / grid_len) % grid_len];
+        results[i].p.value[2] = grid[2][i / (grid_len * grid_len)];
+    }
+    run_batch(&t, results, grid_points);
+    qsort(results, grid_points, sizeof(*results), compare_cost);
+    for (size_t i = 0; i < TOP_GRID; i++)
+        print_result(i == 0 ? "grid" : "", &results[i]);
+
+    /* Coordinate refinement from the best of the grid */
+    TuneResult best = results[0];
+    TuneResult step[2 * NUM_PARAMS];
+    float factor[NUM_PARAMS] = { REFINE_STEP, REFINE_STEP, REFINE_STEP };
+
+    for (int round = 0; round < REFINE_MAX_ROUNDS; round++)
+    {
+        size_t count = 0;
+
+        for (size_t j = 0; j < NUM_PARAMS; j++)
+        {
+            if (factor[j] < REFINE_MIN_STEP)
+                continue;
+            for (int dir = -1; dir <= 1; dir += 2)
+            {
+                float v = best.p.value[j] * (dir > 0 ? factor[j] : 1 / factor[j]);
+
+                if (v < param_min[j] || v > param_max[j])
+                    continue;
+                step[count] = best;
+                step[count].p.value[j] = v;
+                count++;
+            }
+        }
+        if (count == 0)
+            break;
+
+        run_batch(&t, step, count);
+        qsort(step, count, sizeof(*step), compare_cost);
+
+        if (step[0].cost < best.cost)
+        {
+            best = step[0];
+            print_result("refined", &best);
+        }
+        else
+        {
+            for (size_t j = 0; j < NUM_PARAMS; j++)
+                factor[j] = sqrtf(factor[j]);
+        }
+    }
+
+    double elapsed = now_seconds() - t0;
+
+    printf("\n");
+    print_result("best", &best);
+    printf("\n%" PRIu64 " evaluations in %.2f s, %.1f ms each, %.0f periods/s\n",
+           t.evaluations, elapsed, 1e3 * elapsed / t.evaluations,
+           t.periods / elapsed);
+    printf("\nfor test_data.c:\n");
+    printf("const float    TEST_MAX_ACCEL   = %.0f;\n", best.p.value[1]);
+    printf("const float    TEST_ERROR_RATE  = %.4f;\n", best.p.value[0]);
+    printf("and detector_set_sync_thresholds(d, %.4f, DETECTOR_DEFAULT_MISS_PROB)\n", best.p.value[2]);
+
+    for (size_t k = 0; k < num_logs; k++)
+    {
+        free(logs[k].periods);
+        free(logs[k].label);
+        free(logs[k].flags);
+    }
+    free(logs);
+    free(results);
+    return 0;
+}
@@ -0,0 +1,241 @@
+/* What the input conditioner saves the detector on a log with glitches in it.
+ *
+ * usage: condition_bench [glitch_rate [seed]]
+ *   glitch_rate - probability of a noise pulse in each period (default 0.01)
+ *   seed        - for where the pulses go (default 12345)
+ *
+ * Noise pulses of 0.05% to 0.5% of a period (523 ticks in 400000 is about
+ * 0.13%) are cut from the start or the end of periods of the built-in
+ * dataset, as a glitchy input would. The detector runs over the glitchy log
+ * with and without the conditioner (see conditioner.h), scored against the
+ * offline smoother's labels for the clean log (see smoother.h). For each run this reports the belief updates it took, the
+ * times it lost sync, the share of real teeth it had sync for, how often it
+ * agreed with the smoother there, and the host time per pulse. The dataset
+ * already has runs of zero-length periods where the capture dropped out,
+ * which the conditioner merges away even with no pulses added.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "detector.h"
+#include "conditioner.h"
+#include "smoother.h"
+#include "test_data.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4       /* as in main.c */
+#define GLITCH_MIN      0.0005  /* of the period the pulse is cut from */
+#define GLITCH_MAX      0.005
+
+
+/* Declarations */
+
+typedef struct {
+    uint32_t *pulses;           // the glitchy log
+    int32_t  *real;             // index into the clean log of the tooth each pulse ends at, or -1 for a glitch
+    size_t   count;
+} GlitchLog;
+
+typedef struct {
+    uint64_t updates;           // periods the detector ran
+    uint64_t sync_lost;
+    size_t   synced;            // real teeth with sync
+    size_t   agreed;            // of those, teeth where the tooth matched the reference
+    double   ns_per_pulse;
+} ConditionResult;
+
+double now_seconds(void);
+double uniform(uint32_t* rng);
+bool make_glitch_log(GlitchLog* g, const uint32_t* periods, size_t count, double rate, uint32_t seed);
+void setup(Detector* d, uint8_t* tooth_dists, size_t n, float* tooth_prob, float* lik_lut, uint8_t* lik_class);
+void run(const GlitchLog* g, bool condition, const detector_index_t* reference, uint8_t* tooth_dists, size_t n, ConditionResult* r);
+void report(const char* name, size_t real_count, const ConditionResult* r);
+
+
+/* Definitions */
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* xorshift32, as in particle.c, scaled to [0, 1) */
+double uniform(uint32_t* rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 17;
+    *rng ^= *rng << 5;
+    return (*rng >> 8) * (1.0 / 16777216.0);
+}
+
+bool make_glitch_log(GlitchLog* g, const uint32_t* periods, size_t count, double rate, uint32_t seed)
+{
+    uint32_t rng = seed;
+
+    g->pulses = malloc(2 * count * sizeof(*g->pulses));
+    g->real = malloc(2 * count * sizeof(*g->real));
+    if (g->pulses == NULL || g->real == NULL)
+        return false;
+
+    g->count = 0;
+    for (size_t t = 0; t < count; t++)
+    {
+        if (uniform(&rng) < rate)
+        {
+            double share = GLITCH_MIN + uniform(&rng) * (GLITCH_MAX - GLITCH_MIN);
+            uint32_t width = (uint32_t)(share * periods[t]) + 1;
+            bool at_start = uniform(&rng) < 0.5;
+
+            if (width < periods[t])
+            {
+                g->pulses[g->count] = at_start ? width : periods[t] - width;
+                g->real[g->count] = -1;
+                g->count++;
+                g->pulses[g->count] = at_start ? periods[t] - width : width;
+                g->real[g->count] = (int32_t)t;
+                g->count++;
+                continue;
+            }
+        }
+        g->pulses[g->count] = periods[t];
+        g->real[g->count] = (int32_t)t;
+        g->count++;
+    }
+
+    return true;
+}
+
+void setup(Detector* d, uint8_t* tooth_dists, size_t n, float* tooth_prob, float* lik_lut, uint8_t* lik_class)
+{
+    detector_init(d, tooth_dists, n, count_tooth_posns(n, tooth_dists), tooth_prob,
+                  TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE);
+    detector_init_lik_lut(d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+}
+
+void run(const GlitchLog* g, bool condition, const detector_index_t* reference, uint8_t* tooth_dists, size_t n, ConditionResult* r)
+{
+    float tooth_prob[n];
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    uint8_t lik_class[n];
+    Detector d;
+    Conditioner c;
+    double elapsed = 0.0;
+
+    setup(&d, tooth_dists, n, tooth_prob, lik_lut, lik_class);
+    conditioner_init(&c, tooth_dists, n);
+
+    *r = (ConditionResult){ 0, 0, 0, 0, 0.0 };
+    for (size_t i = 0; i < g->count; i++)
+    {
+        double t0 = now_seconds();
+        if (condition)
+            conditioner_interrupt(g->pulses[i], &c, &d);
+        else
+            detector_interrupt(g->pulses[i], &d);
+        elapsed += now_seconds() - t0;
+
+        if (g->real[i] < 0 || !d.has_sync)
+            continue;
+        r->synced++;
+        if (reference[g->real[i]] == d.current_tooth)
+            r->agreed++;
+    }
+
+    r->updates = d.counters.interrupts;
+    r->sync_lost = d.counters.sync_lost;
+    r->ns_per_pulse = elapsed * 1e9 / g->count;
+}
+
+void report(const char* name, size_t real_count, const ConditionResult* r)
+{
+    printf("%-14s %10" PRIu64 " %10" PRIu64 " %8.1f%% %8.1f%% %10.0f\n", name, r->updates, r->sync_lost,
+           100.0 * r->synced / real_count,
+           r->synced ? 100.0 * r->agreed / r->synced : 0.0,
+           r->ns_per_pulse);
+}
+
+int main(int argc, char** argv)
+{
+    double rate = (argc > 1) ? atof(argv[1]) : 0.01;
+    uint32_t seed = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 0) : 12345;
+
+    if (!(rate >= 0 && rate < 1) || seed == 0)
+    {
+        fprintf(stderr, "usage: condition_bench [glitch_rate [seed]]\n");
+        return 1;
+    }
+
+    uint8_t tooth_dists[] = TEST_TOOTH_MAP;
+    const size_t n = sizeof(tooth_dists) / sizeof(tooth_dists[0]);
+    const size_t count = num_sample_engine_ticks;
+    uint32_t* periods = malloc(count * sizeof(*periods));
+    detector_index_t* reference = malloc(count * sizeof(*reference));
+    uint8_t* flags = malloc(count);
+    size_t zeros = 0;
+    GlitchLog g;
+
+    if (periods == NULL || reference == NULL || flags == NULL || !make_glitch_log(&g, sample_engine_ticks, count, rate, seed))
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memcpy(periods, sample_engine_ticks, count * sizeof(*periods));
+    for (size_t t = 0; t < count; t++)
+        zeros += (periods[t] == 0);
+
+    /* Reference labels for the clean log, as in engine_bench */
+    {
+        float tooth_prob[n];
+        float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+        uint8_t lik_class[n];
+        size_t block_len = (size_t)ceil(sqrt((double)count));
+        size_t num_checkpoints = (count + block_len - 1) / block_len;
+        float* checkpoints = malloc(2 * num_checkpoints * n * sizeof(float));
+        float* block = malloc(block_len * n * sizeof(float));
+        uint8_t* steps = malloc(block_len * n);
+        Detector d;
+        Smoother s;
+
+        setup(&d, tooth_dists, n, tooth_prob, lik_lut, lik_class);
+        if (checkpoints == NULL || block == NULL || steps == NULL
+            || !smoother_init(&s, &d, checkpoints, num_checkpoints, block, steps, block_len)
+            || !smoother_run(&s, periods, count, reference, flags, NULL))
+        {
+            fprintf(stderr, "couldn't label the log\n");
+            return 1;
+        }
+        free(checkpoints);
+        free(block);
+        free(steps);
+    }
+
+    ConditionResult r;
+
+    printf("%zu periods (%zu of them zero), %zu noise pulses added, smoother's labels as reference\n\n",
+           count, zeros, g.count - count);
+    printf("%-14s %10s %10s %9s %9s %10s\n", "input", "updates", "sync lost", "synced", "agree", "ns/pulse");
+
+    run(&g, false, reference, tooth_dists, n, &r);
+    report("raw", count, &r);
+    run(&g, true, reference, tooth_dists, n, &r);
+    report("conditioned", count, &r);
+
+    free(periods);
+    free(reference);
+    free(flags);
+    free(g.pulses);
+    free(g.real);
+    return 0;
+}
@@ -0,0 +1,276 @@
+/* How the grid and coarse-to-fine detectors scale with encoder resolution.
+ *
+ * usage: encoder_bench [revolutions [error_rate]]
+ *   revolutions - revolutions simulated per encoder (default 4)
+ *   error_rate  - probability of a missed or extra edge per tooth (default 0.0005)
+ *
+ * Each encoder has num_posns slots with one left empty as an index mark, and
+ * turns at a steady speed with a little jitter on every period. Missed edges
+ * merge two periods; extra edges split one at a random point. The true tooth
+ * after every period is known, so each detector is scored against it. The
+ * grid's time per period grows with the number of teeth; the coarse-to-fine
+ * detector's, with segments of about sqrt(teeth), no faster than its square
+ * root, for the same agreement while synced.
+ *
+ * Encoders of more than 255 positions need a wider index:
+ *   cc -std=c99 -O2 -I. -DDETECTOR_INDEX_WIDTH=16 tools/encoder_bench.c hier.c detector.c trace.c -lm
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "detector.h"
+#include "hier.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4
+#define SAMPLE_RATE     200000000   /* 200MHz, as in test_data.c */
+#define RPM             1000
+#define JITTER          0.005       /* standard deviation of each period, as a fraction */
+#define RATIO_SIGMA     0.05        /* octaves */
+#define MAX_ACCEL       1e6         /* rad/s^2; edge jitter at these rates looks like a lot */
+#define SEED            12345
+
+
+/* Declarations */
+
+typedef struct {
+    uint8_t  *tooth_dists;
+    size_t   num_tooth_tips;
+    detector_index_t num_tooth_posns;
+    uint32_t *periods;
+    detector_index_t *truth;    // tooth after each period, or the tooth before an extra edge
+    size_t   count;
+} EncoderLog;
+
+typedef struct {
+    size_t   first_sync;
+    size_t   synced;
+    size_t   agreed;
+    double   ns_per_period;
+} EncoderResult;
+
+double now_seconds(void);
+double uniform(uint32_t* rng);
+double gaussian(uint32_t* rng);
+bool simulate(EncoderLog* log, size_t num_posns, size_t revolutions, float error_rate);
+void tally(EncoderResult* r, const EncoderLog* log, size_t t, bool has_sync, detector_index_t tooth);
+void bench_grid(const EncoderLog* log, float error_rate, EncoderResult* r);
+bool bench_hier(const EncoderLog* log, float error_rate, EncoderResult* r);
+void report(const char* name, size_t num_posns, const EncoderLog* log, const EncoderResult* r);
+
+
+/* Definitions */
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* xorshift32, as in particle.c, scaled to [0, 1) */
+double uniform(uint32_t* rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 17;
+    *rng ^= *rng << 5;
+    return (*rng >> 8) * (1.0 / 16777216.0);
+}
+
+double gaussian(uint32_t* rng)
+{
+    double u = uniform(rng) + 1e-12;
+    return sqrt(-2.0 * log(u)) * cos(2 * 3.14159265358979 * uniform(rng));
+}
+
+/* Fill a log for an encoder of num_posns slots, one of them empty */
+bool simulate(EncoderLog* log, size_t num_posns, size_t revolutions, float error_rate)
+{
+    size_t n = num_posns - 1;
+    size_t max_count = 2 * n * revolutions;
+    double ticks_per_posn = (double)SAMPLE_RATE * 60.0 / RPM / (double)num_posns;
+    uint32_t rng = SEED;
+
+    if (num_posns > DETECTOR_INDEX_MAX)
+        return false;
+
+    log->tooth_dists = malloc(n);
+    log->periods = malloc(max_count * sizeof(*log->periods));
+    log->truth = malloc(max_count * sizeof(*log->truth));
+    if (log->tooth_dists == NULL || log->periods == NULL || log->truth == NULL)
+        return false;
+
+    for (size_t i = 0; i < n; i++)
+        log->tooth_dists[i] = 1;
+    log->tooth_dists[0] = 2;   /* the empty slot is just before tooth 0 */
+    log->num_tooth_tips = n;
+    log->num_tooth_posns = (detector_index_t)count_tooth_posns(n, log->tooth_dists);
+
+    size_t count = 0;
+    double carried = 0.0;       /* ticks of a missed edge's period, added to the next */
+
+    for (size_t t = 0; t < n * revolutions; t++)
+    {
+        size_t tooth = (t + 1) % n;
+        double period = ticks_per_posn * log->tooth_dists[tooth] * (1.0 + JITTER * gaussian(&rng));
+        double u = uniform(&rng);
+
+        if (u < error_rate / 2)             /* missed: this edge never arrives */
+        {
+            carried += period;
+            continue;
+        }
+        if (u < error_rate)                 /* extra: a spurious edge part way through */
+        {
+            double split = uniform(&rng) * period;
+            log->periods[count] = (uint32_t)(carried + split);
+            log->truth[count] = (detector_index_t)(t % n);
+            count++;
+            carried = 0.0;
+            period -= split;
+        }
+        log->periods[count] = (uint32_t)(carried + period);
+        log->truth[count] = (detector_index_t)tooth;
+        count++;
+        carried = 0.0;
+    }
+    log->count = count;
+
+    return true;
+}
+
+void tally(EncoderResult* r, const EncoderLog* log, size_t t, bool has_sync, detector_index_t tooth)
+{
+    if (!has_sync)
+        return;
+    if (r->synced == 0)
+        r->first_sync = t;
+    r->synced++;
+    if (tooth == log->truth[t])
+        r->agreed++;
+}
+
+void bench_grid(const EncoderLog* log, float error_rate, EncoderResult* r)
+{
+    size_t n = log->num_tooth_tips;
+    float* tooth_prob = malloc(n * sizeof(float));
+    uint8_t* lik_class = malloc(n);
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    Detector d;
+    double elapsed = 0.0;
+
+    detector_init(&d, log->tooth_dists, n, log->num_tooth_posns, tooth_prob,
+                  SAMPLE_RATE, MAX_ACCEL, error_rate);
+    detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, RATIO_SIGMA);
+
+    *r = (EncoderResult){ log->count, 0, 0, 0.0 };
+    for (size_t t = 0; t < log->count; t++)
+    {
+        double t0 = now_seconds();
+        detector_interrupt(log->periods[t], &d);
+        elapsed += now_seconds() - t0;
+        tally(r, log, t, d.has_sync, d.current_tooth);
+    }
+    r->ns_per_period = elapsed * 1e9 / log->count;
+
+    free(tooth_prob);
+    free(lik_class);
+}
+
+bool bench_hier(const EncoderLog* log, float error_rate, EncoderResult* r)
+{
+    size_t n = log->num_tooth_tips;
+    size_t seg_len = (size_t)ceil(sqrt((double)n));
+    size_t num_segs = HIER_NUM_SEGS(n, seg_len);
+    float* tooth_prob = malloc(n * sizeof(float));
+    uint8_t* lik_class = malloc(n);
+    float* seg_prob = malloc(2 * num_segs * sizeof(float));
+    uint8_t* seg_classes = malloc(num_segs);
+    float* win_prob = malloc(2 * HIER_WINDOW_SEGS * seg_len * sizeof(float));
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    Detector d;
+    HierDetector h;
+    double elapsed = 0.0;
+    bool ok = false;
+
+    detector_init(&d, log->tooth_dists, n, log->num_tooth_posns, tooth_prob,
+                  SAMPLE_RATE, MAX_ACCEL, error_rate);
+    detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, RATIO_SIGMA);
+
+    if (hier_init(&h, &d, seg_len, seg_prob, seg_classes, win_prob))
+    {
+        *r = (EncoderResult){ log->count, 0, 0, 0.0 };
+        for (size_t t = 0; t < log->count; t++)
+        {
+            double t0 = now_seconds();
+            hier_interrupt(log->periods[t], &h);
+            elapsed += now_seconds() - t0;
+            tally(r, log, t, h.has_sync, h.current_tooth);
+        }
+        r->ns_per_period = elapsed * 1e9 / log->count;
+        ok = true;
+    }
+
+    free(tooth_prob);
+    free(lik_class);
+    free(seg_prob);
+    free(seg_classes);
+    free(win_prob);
+    return ok;
+}
+
+void report(const char* name, size_t num_posns, const EncoderLog* log, const EncoderResult* r)
+{
+    printf("%8zu  %-12s %10zu %8.1f%% %8.1f%% %10.0f\n", num_posns, name, r->first_sync,
+           100.0 * r->synced / log->count,
+           r->synced ? 100.0 * r->agreed / r->synced : 0.0,
+           r->ns_per_period);
+}
+
+int main(int argc, char** argv)
+{
+    static const size_t resolutions[] = { 60, 250, 1000, 4000 };
+    int revolutions = (argc > 1) ? atoi(argv[1]) : 4;
+    float error_rate = (argc > 2) ? (float)atof(argv[2]) : 0.0005f;
+
+    if (revolutions < 1 || !(error_rate > 0 && error_rate < 1))
+    {
+        fprintf(stderr, "usage: encoder_bench [revolutions [error_rate]]\n");
+        return 1;
+    }
+
+    printf("%d revolutions at %d rpm, error rate %g, true teeth as reference\n\n", revolutions, RPM, error_rate);
+    printf("%8s  %-12s %10s %9s %9s %10s\n", "slots", "engine", "first sync", "synced", "agree", "ns/period");
+
+    for (size_t i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); i++)
+    {
+        EncoderLog log;
+        EncoderResult r;
+
+        if (!simulate(&log, resolutions[i], (size_t)revolutions, error_rate))
+        {
+            printf("%8zu  (needs a wider DETECTOR_INDEX_WIDTH)\n", resolutions[i]);
+            continue;
+        }
+
+        bench_grid(&log, error_rate, &r);
+        report("grid", resolutions[i], &log, &r);
+        if (bench_hier(&log, error_rate, &r))
+            report("coarse-fine", resolutions[i], &log, &r);
+
+        free(log.tooth_dists);
+        free(log.periods);
+        free(log.truth);
+    }
+
+    return 0;
+}
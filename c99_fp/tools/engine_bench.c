@@ -0,0 +1,298 @@
+/* Compare the localization engines on the built-in dataset.
+ *
+ * usage: engine_bench [repeats]
+ *   repeats - times to run each engine over the log, for steadier timings (default 5)
+ *
+ * Each engine runs over the whole log: the grid detector, the coarse-to-fine
+ * detector with segments of about sqrt(teeth), the speed grid at two
+ * resolutions (speed bins x octaves per bin) and the particle filter at
+ * several sizes. The reference labels come from the offline smoother (see
+ * smoother.h), which sees the whole log at once; only the periods it is sure
+ * of, where neither UNSURE nor DISAGREE is flagged, count as a reference. For
+ * each engine this reports how many periods it took to first get sync, the
+ * share of periods it had sync for, how often its tooth matched the
+ * reference while it had sync, and the host time per period.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "detector.h"
+#include "hier.h"
+#include "particle.h"
+#include "smoother.h"
+#include "speedgrid.h"
+#include "test_data.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4       /* as in main.c */
+#define MAX_PARTICLES   4096
+#define PARTICLE_SEED   12345
+#define MAX_SPEEDS      64
+
+
+/* Declarations */
+
+typedef struct {
+    size_t   first_sync;        // period sync was first declared at, or the log length if never
+    size_t   synced;            // periods with sync
+    size_t   judged;            // of those, periods the smoother was sure of
+    size_t   agreed;            // of those, periods whose tooth matched the reference
+    double   ns_per_period;
+} BenchResult;
+
+typedef struct {
+    uint8_t  *tooth_dists;
+    size_t   num_tooth_tips;
+    detector_index_t num_tooth_posns;
+    const uint32_t *periods;
+    size_t   count;
+    const detector_index_t *reference; // smoother labels
+    const uint8_t *flags;       // SMOOTHER_* for each label
+} BenchLog;
+
+double now_seconds(void);
+void tally(BenchResult* r, const BenchLog* log, size_t t, bool has_sync, detector_index_t tooth);
+void bench_grid(const BenchLog* log, bool lut, int repeats, BenchResult* r);
+void bench_particles(const BenchLog* log, size_t num_particles, int repeats, BenchResult* r);
+void bench_speedgrid(const BenchLog* log, size_t num_speeds, uint8_t steps_per_octave, int repeats, BenchResult* r);
+bool bench_hier(const BenchLog* log, size_t seg_len, int repeats, BenchResult* r);
+void report(const char* name, const BenchLog* log, const BenchResult* r);
+
+
+/* Definitions */
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void tally(BenchResult* r, const BenchLog* log, size_t t, bool has_sync, detector_index_t tooth)
+{
+    if (!has_sync)
+        return;
+    if (r->synced == 0)
+        r->first_sync = t;
+    r->synced++;
+    if (log->flags[t] & (SMOOTHER_UNSURE | SMOOTHER_DISAGREE))
+        return;
+    r->judged++;
+    if (tooth == log->reference[t])
+        r->agreed++;
+}
+
+void bench_grid(const BenchLog* log, bool lut, int repeats, BenchResult* r)
+{
+    float tooth_prob[log->num_tooth_tips];
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    uint8_t lik_class[log->num_tooth_tips];
+    double elapsed = 0.0;
+
+    for (int rep = 0; rep < repeats; rep++)
+    {
+        Detector d;
+        detector_init(&d, log->tooth_dists, log->num_tooth_tips, log->num_tooth_posns, tooth_prob,
+                      TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE);
+        if (lut)
+            detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+
+        *r = (BenchResult){ log->count, 0, 0, 0, 0.0 };
+        for (size_t t = 0; t < log->count; t++)
+        {
+            double t0 = now_seconds();
+            detector_interrupt(log->periods[t], &d);
+            elapsed += now_seconds() - t0;
+            tally(r, log, t, d.has_sync, d.current_tooth);
+        }
+    }
+    r->ns_per_period = elapsed * 1e9 / ((double)repeats * log->count);
+}
+
+void bench_particles(const BenchLog* log, size_t num_particles, int repeats, BenchResult* r)
+{
+    static Particle particles[2 * MAX_PARTICLES];
+    detector_index_t tooth_posn[log->num_tooth_tips];
+    detector_index_t posn_tooth[log->num_tooth_posns];
+    float tooth_prob[log->num_tooth_tips];
+    double elapsed = 0.0;
+
+    for (int rep = 0; rep < repeats; rep++)
+    {
+        ParticleDetector p;
+        particle_init(&p, log->tooth_dists, log->num_tooth_tips, log->num_tooth_posns,
+                      particles, num_particles, tooth_posn, posn_tooth, tooth_prob,
+                      TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE, PARTICLE_SEED);
+
+        *r = (BenchResult){ log->count, 0, 0, 0, 0.0 };
+        for (size_t t = 0; t < log->count; t++)
+        {
+            double t0 = now_seconds();
+            particle_interrupt(log->periods[t], &p);
+            elapsed += now_seconds() - t0;
+            tally(r, log, t, p.has_sync, p.current_tooth);
+        }
+    }
+    r->ns_per_period = elapsed * 1e9 / ((double)repeats * log->count);
+}
+
+void bench_speedgrid(const BenchLog* log, size_t num_speeds, uint8_t steps_per_octave, int repeats, BenchResult* r)
+{
+    static float cells[2 * 255 * SPEEDGRID_STRIDE(MAX_SPEEDS)];
+    float lik[SPEEDGRID_LIK_LEN(MAX_SPEEDS)];
+    int8_t tooth_q[2 * log->num_tooth_tips];
+    float tooth_prob[log->num_tooth_tips];
+    float speed_prob[MAX_SPEEDS];
+    double elapsed = 0.0;
+
+    for (int rep = 0; rep < repeats; rep++)
+    {
+        SpeedGrid g;
+        speedgrid_init(&g, log->tooth_dists, log->num_tooth_tips, log->num_tooth_posns,
+                       cells, num_speeds, lik, tooth_q, tooth_prob, speed_prob,
+                       TEST_SAMPLE_RATE, TEST_MIN_PERIOD, steps_per_octave, TEST_RATIO_SIGMA, TEST_ERROR_RATE);
+
+        *r = (BenchResult){ log->count, 0, 0, 0, 0.0 };
+        for (size_t t = 0; t < log->count; t++)
+        {
+            double t0 = now_seconds();
+            speedgrid_interrupt(log->periods[t], &g);
+            elapsed += now_seconds() - t0;
+            tally(r, log, t, g.has_sync, g.current_tooth);
+        }
+    }
+    r->ns_per_period = elapsed * 1e9 / ((double)repeats * log->count);
+}
+
+bool bench_hier(const BenchLog* log, size_t seg_len, int repeats, BenchResult* r)
+{
+    size_t num_segs = HIER_NUM_SEGS(log->num_tooth_tips, seg_len);
+    float tooth_prob[log->num_tooth_tips];
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    uint8_t lik_class[log->num_tooth_tips];
+    float seg_prob[2 * num_segs];
+    uint8_t seg_classes[num_segs];
+    float win_prob[2 * HIER_WINDOW_SEGS * seg_len];
+    double elapsed = 0.0;
+
+    for (int rep = 0; rep < repeats; rep++)
+    {
+        Detector d;
+        HierDetector h;
+        detector_init(&d, log->tooth_dists, log->num_tooth_tips, log->num_tooth_posns, tooth_prob,
+                      TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE);
+        detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+        if (!hier_init(&h, &d, seg_len, seg_prob, seg_classes, win_prob))
+            return false;
+
+        *r = (BenchResult){ log->count, 0, 0, 0, 0.0 };
+        for (size_t t = 0; t < log->count; t++)
+        {
+            double t0 = now_seconds();
+            hier_interrupt(log->periods[t], &h);
+            elapsed += now_seconds() - t0;
+            tally(r, log, t, h.has_sync, h.current_tooth);
+        }
+    }
+    r->ns_per_period = elapsed * 1e9 / ((double)repeats * log->count);
+    return true;
+}
+
+void report(const char* name, const BenchLog* log, const BenchResult* r)
+{
+    printf("%-22s %10zu %8.1f%% %8.1f%% %10.0f\n", name, r->first_sync,
+           100.0 * r->synced / log->count,
+           r->judged ? 100.0 * r->agreed / r->judged : 0.0,
+           r->ns_per_period);
+}
+
+int main(int argc, char** argv)
+{
+    int repeats = (argc > 1) ? atoi(argv[1]) : 5;
+    if (repeats < 1)
+        repeats = 1;
+
+    uint8_t tooth_dists[] = TEST_TOOTH_MAP;
+    const size_t num_tooth_tips = sizeof(tooth_dists) / sizeof(tooth_dists[0]);
+    detector_index_t num_tooth_posns = count_tooth_posns(num_tooth_tips, tooth_dists);
+    size_t count = num_sample_engine_ticks;
+    uint32_t* periods = malloc(count * sizeof(*periods));
+    detector_index_t* reference = malloc(count * sizeof(*reference));
+    uint8_t* flags = malloc(count);
+
+    if (periods == NULL || reference == NULL || flags == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memcpy(periods, sample_engine_ticks, count * sizeof(*periods));
+
+    /* Reference labels, from the smoother over the likelihood-table model */
+    {
+        float tooth_prob[num_tooth_tips];
+        float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+        uint8_t lik_class[num_tooth_tips];
+        size_t block_len = (size_t)ceil(sqrt((double)count));
+        size_t num_checkpoints = (count + block_len - 1) / block_len;
+        float* checkpoints = malloc(2 * num_checkpoints * num_tooth_tips * sizeof(float));
+        float* block = malloc(block_len * num_tooth_tips * sizeof(float));
+        uint8_t* steps = malloc(block_len * num_tooth_tips);
+        Detector d;
+        Smoother s;
+
+        detector_init(&d, tooth_dists, num_tooth_tips, num_tooth_posns, tooth_prob,
+                      TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE);
+        detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+        if (checkpoints == NULL || block == NULL || steps == NULL
+            || !smoother_init(&s, &d, checkpoints, num_checkpoints, block, steps, block_len)
+            || !smoother_run(&s, periods, count, reference, flags, NULL))
+        {
+            fprintf(stderr, "couldn't label the log\n");
+            return 1;
+        }
+        free(checkpoints);
+        free(block);
+        free(steps);
+    }
+
+    BenchLog log = { tooth_dists, num_tooth_tips, num_tooth_posns, periods, count, reference, flags };
+    BenchResult r;
+    char name[32];
+
+    printf("%zu periods, %zu-tooth wheel, the smoother's sure labels as reference\n\n", count, num_tooth_tips);
+    printf("%-22s %10s %9s %9s %10s\n", "engine", "first sync", "synced", "agree", "ns/period");
+
+    bench_grid(&log, false, repeats, &r);
+    report("grid, step model", &log, &r);
+    bench_grid(&log, true, repeats, &r);
+    report("grid, likelihood table", &log, &r);
+
+    size_t seg_len = (size_t)ceil(sqrt((double)num_tooth_tips));
+    snprintf(name, sizeof(name), "coarse-fine, %zu/seg", seg_len);
+    if (bench_hier(&log, seg_len, repeats, &r))
+        report(name, &log, &r);
+
+    bench_speedgrid(&log, 32, 4, repeats, &r);
+    report("speed grid, 32 x 1/4", &log, &r);
+    bench_speedgrid(&log, 64, 8, repeats, &r);
+    report("speed grid, 64 x 1/8", &log, &r);
+
+    for (size_t m = 64; m <= MAX_PARTICLES; m *= 4)
+    {
+        bench_particles(&log, m, repeats, &r);
+        snprintf(name, sizeof(name), "particles, %zu", m);
+        report(name, &log, &r);
+    }
+
+    return 0;
+}
@@ -0,0 +1,303 @@
+/* Load-test localizerd with synthetic clients.
+ *
+ * usage: localizer_load [socket_path [clients [periods [batch]]]]
+ *   socket_path - where localizerd listens (default SERVICE_DEFAULT_PATH)
+ *   clients     - concurrent clients, each with its own instance (default 8)
+ *   periods     - periods each client streams, the built-in dataset over and over (default 100000)
+ *   batch       - periods per frame (default 64)
+ *
+ * Each client opens "load-<n>" with a reset, then sends its periods a frame
+ * at a time, waiting for each answer before sending the next. Every answer
+ * is checked against a plain run of the same periods in this process, and
+ * the round trips are timed. This reports the daemon's throughput across all
+ * clients, the round-trip percentiles, and any answer that disagreed.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "detector.h"
+#include "service.h"
+#include "test_data.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4       /* as in localizerd.c */
+#define HISTORY_LEN     64
+
+
+/* Declarations */
+
+typedef struct {
+    int      id;
+    const char* path;
+    size_t   periods;
+    size_t   batch;
+    const detector_index_t *ref_tooth;  // tooth after each period in the reference run
+    const bool *ref_sync;               // sync after each period in the reference run
+    double   *rtt_us;           // round trip of each frame
+    size_t   frames;
+    size_t   done;              // periods the daemon says it has taken
+    size_t   mismatches;        // answers that disagreed with the reference
+    bool     ok;                // false if it couldn't talk to the daemon
+} LoadClient;
+
+double now_seconds(void);
+int compare_double(const void* a, const void* b);
+bool send_all(int fd, const void* buf, size_t len);
+bool recv_all(int fd, void* buf, size_t len);
+bool exchange(int fd, uint16_t type, const void* payload, uint16_t len, ServiceState* s, double* rtt_us);
+void* client(void* arg);
+
+
+/* Definitions */
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+bool send_all(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = buf;
+
+    while (len > 0)
+    {
+        ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+        p += sent;
+        len -= (size_t)sent;
+    }
+    return true;
+}
+
+bool recv_all(int fd, void* buf, size_t len)
+{
+    uint8_t* p = buf;
+
+    while (len > 0)
+    {
+        ssize_t got = read(fd, p, len);
+        if (got <= 0)
+            return false;
+        p += got;
+        len -= (size_t)got;
+    }
+    return true;
+}
+
+/* Send a frame, header and payload in one write, and wait for its SERVICE_STATE */
+bool exchange(int fd, uint16_t type, const void* payload, uint16_t len, ServiceState* s, double* rtt_us)
+{
+    uint32_t frame[(sizeof(ServiceFrame) + SERVICE_MAX_PAYLOAD) / 4];
+    ServiceFrame f = { type, len };
+    uint32_t error;
+
+    memcpy(frame, &f, sizeof(f));
+    memcpy((uint8_t*)frame + sizeof(f), payload, len);
+
+    double t0 = now_seconds();
+    if (!send_all(fd, frame, sizeof(f) + len) || !recv_all(fd, &f, sizeof(f)))
+        return false;
+
+    if (f.type == SERVICE_STATE && f.len == sizeof(*s))
+    {
+        if (!recv_all(fd, s, sizeof(*s)))
+            return false;
+        *rtt_us = (now_seconds() - t0) * 1e6;
+        return true;
+    }
+
+    if (f.type == SERVICE_ERROR && f.len == sizeof(error) && recv_all(fd, &error, sizeof(error)))
+        fprintf(stderr, "localizerd said error %" PRIu32 "\n", error);
+    return false;
+}
+
+void* client(void* arg)
+{
+    LoadClient* lc = arg;
+    uint8_t tooth_dists[] = TEST_TOOTH_MAP;
+    const size_t n = sizeof(tooth_dists) / sizeof(tooth_dists[0]);
+    uint32_t open[(sizeof(ServiceOpen) + sizeof(tooth_dists) + 3) / 4] = { 0 };
+    ServiceOpen config = {
+        .version = SERVICE_VERSION,
+        .num_tooth_tips = (uint16_t)n,
+        .sample_rate = TEST_SAMPLE_RATE,
+        .max_accel = TEST_MAX_ACCEL,
+        .error_rate = TEST_ERROR_RATE,
+        .ratio_sigma = TEST_RATIO_SIGMA,
+        .sig_window = TEST_SIG_WINDOW,
+        .flags = SERVICE_OPEN_RESET,
+    };
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    uint32_t* periods = malloc(lc->batch * sizeof(uint32_t));
+    ServiceState s;
+    double rtt;
+
+    snprintf(config.name, SERVICE_NAME_LEN, "load-%d", lc->id);
+    memcpy(open, &config, sizeof(config));
+    memcpy((uint8_t*)open + sizeof(config), tooth_dists, n);
+    strncpy(addr.sun_path, lc->path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    lc->ok = periods != NULL && fd >= 0
+        && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0
+        && exchange(fd, SERVICE_OPEN, open, sizeof(open), &s, &rtt);
+
+    for (size_t start = 0; lc->ok && start < lc->periods; start += lc->batch)
+    {
+        size_t count = (lc->periods - start < lc->batch) ? lc->periods - start : lc->batch;
+
+        for (size_t k = 0; k < count; k++)
+            periods[k] = sample_engine_ticks[(start + k) % num_sample_engine_ticks];
+
+        lc->ok = exchange(fd, SERVICE_PERIODS, periods, (uint16_t)(count * sizeof(uint32_t)),
+                          &s, &(lc->rtt_us[lc->frames]));
+        if (!lc->ok)
+            break;
+        lc->frames++;
+        lc->done = s.periods;
+
+        size_t last = start + count - 1;
+        if (s.periods != last + 1 || s.has_sync != lc->ref_sync[last]
+            || (s.has_sync && s.current_tooth != lc->ref_tooth[last]))
+            lc->mismatches++;
+    }
+
+    if (fd >= 0)
+        close(fd);
+    free(periods);
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = (argc > 1) ? argv[1] : SERVICE_DEFAULT_PATH;
+    int num_clients = (argc > 2) ? atoi(argv[2]) : 8;
+    long num_periods = (argc > 3) ? atol(argv[3]) : 100000;
+    long batch = (argc > 4) ? atol(argv[4]) : 64;
+
+    if (num_clients < 1 || num_periods < 1 || batch < 1 || batch > SERVICE_MAX_PERIODS)
+    {
+        fprintf(stderr, "usage: localizer_load [socket_path [clients [periods [batch]]]]\n");
+        return 1;
+    }
+
+    const size_t periods = (size_t)num_periods;
+    const size_t frames = (periods + (size_t)batch - 1) / (size_t)batch;
+    detector_index_t* ref_tooth = malloc(periods * sizeof(*ref_tooth));
+    bool* ref_sync = malloc(periods * sizeof(*ref_sync));
+    LoadClient* clients = calloc((size_t)num_clients, sizeof(*clients));
+    pthread_t* threads = malloc((size_t)num_clients * sizeof(*threads));
+    double* rtt_us = malloc((size_t)num_clients * frames * sizeof(*rtt_us));
+
+    if (ref_tooth == NULL || ref_sync == NULL || clients == NULL || threads == NULL || rtt_us == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    /* The reference run, set up as localizerd sets up an instance */
+    {
+        uint8_t tooth_dists[] = TEST_TOOTH_MAP;
+        const size_t n = sizeof(tooth_dists) / sizeof(tooth_dists[0]);
+        float tooth_prob[n];
+        float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+        uint8_t lik_class[n];
+        uint32_t history[HISTORY_LEN];
+        size_t sig_index_size = 1;
+        while (sig_index_size < 2 * n)
+            sig_index_size <<= 1;
+        DetectorSigEntry sig_index[sig_index_size];
+        Detector d;
+
+        detector_init(&d, tooth_dists, n, count_tooth_posns(n, tooth_dists), tooth_prob,
+                      TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE);
+        detector_init_sig_index(&d, sig_index, sig_index_size, TEST_SIG_WINDOW);
+        detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+        detector_init_history(&d, history, HISTORY_LEN);
+
+        for (size_t i = 0; i < periods; i++)
+        {
+            detector_interrupt(sample_engine_ticks[i % num_sample_engine_ticks], &d);
+            ref_tooth[i] = d.current_tooth;
+            ref_sync[i] = d.has_sync;
+        }
+    }
+
+    double t0 = now_seconds();
+    for (int i = 0; i < num_clients; i++)
+    {
+        clients[i] = (LoadClient){
+            .id = i, .path = path, .periods = periods, .batch = (size_t)batch,
+            .ref_tooth = ref_tooth, .ref_sync = ref_sync, .rtt_us = &rtt_us[(size_t)i * frames],
+        };
+        if (pthread_create(&threads[i], NULL, client, &clients[i]) != 0)
+        {
+            fprintf(stderr, "couldn't start client %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < num_clients; i++)
+        pthread_join(threads[i], NULL);
+    double elapsed = now_seconds() - t0;
+
+    /* Gather the round trips into one sorted run, for the percentiles */
+    size_t total_frames = 0;
+    size_t total_done = 0;
+    size_t mismatches = 0;
+    bool ok = true;
+
+    for (int i = 0; i < num_clients; i++)
+    {
+        memmove(&rtt_us[total_frames], clients[i].rtt_us, clients[i].frames * sizeof(*rtt_us));
+        total_frames += clients[i].frames;
+        total_done += clients[i].done;
+        mismatches += clients[i].mismatches;
+        if (!clients[i].ok)
+        {
+            fprintf(stderr, "client %d failed after %zu frames\n", i, clients[i].frames);
+            ok = false;
+        }
+    }
+    qsort(rtt_us, total_frames, sizeof(*rtt_us), compare_double);
+
+    printf("%d clients, %zu periods each in frames of %ld, over %s\n",
+           num_clients, periods, batch, path);
+    if (total_frames > 0)
+    {
+        printf("%.0f periods/s, %.0f frames/s\n", total_done / elapsed, total_frames / elapsed);
+        printf("round trip us: p50 %.1f, p99 %.1f, max %.1f\n",
+               rtt_us[total_frames / 2], rtt_us[total_frames * 99 / 100], rtt_us[total_frames - 1]);
+    }
+    printf("%zu answers disagreed with the reference\n", mismatches);
+
+    free(ref_tooth);
+    free(ref_sync);
+    free(clients);
+    free(threads);
+    free(rtt_us);
+    return (ok && mismatches == 0) ? 0 : 1;
+}
@@ -0,0 +1,572 @@
+/* Host many named detectors in one process, for clients on a UNIX socket.
+ *
+ * usage: localizerd [socket_path [max_instances]]
+ *   socket_path   - where to listen (default SERVICE_DEFAULT_PATH)
+ *   max_instances - most named detectors to keep at once (default 64)
+ *
+ * Clients speak the framing in service.h. One thread serves everyone from
+ * an epoll loop: each time a client is readable it gets one read of up to
+ * IN_LEN bytes, every whole frame in it goes through detector_process_batch,
+ * and the answers go back in one write. A client that stops reading its
+ * answers stops being read from, rather than holding up the rest. SIGINT or
+ * SIGTERM stops the daemon, which then prints what each instance did.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "detector.h"
+#include "service.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4       /* as in main.c */
+#define HISTORY_LEN     64
+#define IN_LEN          (2 * (sizeof(ServiceFrame) + SERVICE_MAX_PAYLOAD))  /* room for a whole frame behind a partial one */
+#define OUT_LEN         16384
+#define REPLY_MAX       (sizeof(ServiceFrame) + sizeof(ServiceState))
+#define MAX_EVENTS      64
+
+
+/* Declarations */
+
+typedef struct {
+    char     name[SERVICE_NAME_LEN + 1];
+    ServiceOpen config;
+    uint8_t  *tooth_dists;
+    float    *tooth_prob;
+    float    *lik_lut;
+    uint8_t  *lik_class;
+    DetectorSigEntry *sig_index;
+    size_t   sig_index_size;
+    uint32_t history[HISTORY_LEN];
+    Detector d;
+    bool     open;              // a client has it
+} Instance;
+
+typedef struct {
+    int      fd;
+    Instance *inst;             // what it has open, or NULL
+    uint32_t in[IN_LEN / 4];    // words, so the periods in it are aligned
+    size_t   in_len;            // bytes
+    uint8_t  out[OUT_LEN];
+    size_t   out_len;
+    size_t   out_sent;
+    uint32_t events;            // what epoll is watching for
+} Client;
+
+typedef struct {
+    uint64_t clients;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t frames;
+    uint64_t periods;
+} ServiceCounters;
+
+void on_signal(int sig);
+Instance* find_instance(const char* name);
+Instance* new_instance(const ServiceOpen* config, const uint8_t* tooth_dists);
+bool setup_instance(Instance* inst);
+void free_instance(Instance* inst);
+void reply(Client* c, uint16_t type, const void* payload, uint16_t len);
+void reply_error(Client* c, uint32_t code);
+void reply_state(Client* c);
+bool handle_open(Client* c, const uint8_t* payload, uint16_t len);
+bool handle_frame(Client* c, const ServiceFrame* f, uint8_t* payload);
+bool frame_ready(const Client* c);
+bool serve(Client* c);
+bool flush(Client* c);
+bool pump(Client* c);
+void watch(Client* c);
+void drop(Client* c);
+
+
+/* Variables */
+
+static volatile sig_atomic_t stop;
+static int epoll_fd;
+static Instance** instances;
+static size_t max_instances;
+static ServiceCounters counters;
+
+
+/* Definitions */
+
+void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+Instance* find_instance(const char* name)
+{
+    for (size_t i = 0; i < max_instances; i++)
+    {
+        if (instances[i] != NULL && strcmp(instances[i]->name, name) == 0)
+            return instances[i];
+    }
+    return NULL;
+}
+
+/* Make room for a detector and set it up, or NULL if there's no room or it won't take the config */
+Instance* new_instance(const ServiceOpen* config, const uint8_t* tooth_dists)
+{
+    size_t n = config->num_tooth_tips;
+    size_t slot = 0;
+
+    while (slot < max_instances && instances[slot] != NULL)
+        slot++;
+    if (slot == max_instances)
+        return NULL;
+
+    Instance* inst = calloc(1, sizeof(*inst));
+    if (inst == NULL)
+        return NULL;
+
+    inst->sig_index_size = 1;
+    while (inst->sig_index_size < 2 * n)
+        inst->sig_index_size <<= 1;
+
+    memcpy(inst->name, config->name, SERVICE_NAME_LEN);
+    inst->config = *config;
+    inst->tooth_dists = malloc(n);
+    inst->tooth_prob = malloc(n * sizeof(float));
+    inst->lik_lut = malloc(LIK_MAX_CLASSES * DETECTOR_LIK_BINS * sizeof(float));
+    inst->lik_class = malloc(n);
+    inst->sig_index = malloc(inst->sig_index_size * sizeof(DetectorSigEntry));
+
+    if (inst->tooth_dists == NULL || inst->tooth_prob == NULL || inst->lik_lut == NULL
+        || inst->lik_class == NULL || inst->sig_index == NULL)
+    {
+        free_instance(inst);
+        return NULL;
+    }
+    memcpy(inst->tooth_dists, tooth_dists, n);
+
+    if (!setup_instance(inst))
+    {
+        free_instance(inst);
+        return NULL;
+    }
+
+    instances[slot] = inst;
+    return inst;
+}
+
+/* Start an instance's detector from scratch, from its config */
+bool setup_instance(Instance* inst)
+{
+    const ServiceOpen* config = &(inst->config);
+    size_t n = config->num_tooth_tips;
+    Detector* d = &(inst->d);
+
+    if (!detector_init(d, inst->tooth_dists, n, count_tooth_posns(n, inst->tooth_dists), inst->tooth_prob,
+                       config->sample_rate, config->max_accel, config->error_rate))
+        return false;
+    if (config->sig_window > 0
+        && !detector_init_sig_index(d, inst->sig_index, inst->sig_index_size, config->sig_window))
+        return false;
+    if (config->ratio_sigma > 0
+        && !detector_init_lik_lut(d, inst->lik_lut, LIK_MAX_CLASSES, inst->lik_class, config->ratio_sigma))
+        return false;
+    detector_init_history(d, inst->history, HISTORY_LEN);
+
+    return true;
+}
+
+void free_instance(Instance* inst)
+{
+    free(inst->tooth_dists);
+    free(inst->tooth_prob);
+    free(inst->lik_lut);
+    free(inst->lik_class);
+    free(inst->sig_index);
+    free(inst);
+}
+
+/* Queue a frame for the client; serve leaves room for REPLY_MAX */
+void reply(Client* c, uint16_t type, const void* payload, uint16_t len)
+{
+    ServiceFrame f = { type, len };
+
+    memcpy(&(c->out[c->out_len]), &f, sizeof(f));
+    memcpy(&(c->out[c->out_len + sizeof(f)]), payload, len);
+    c->out_len += sizeof(f) + len;
+}
+
+void reply_error(Client* c, uint32_t code)
+{
+    reply(c, SERVICE_ERROR, &code, sizeof(code));
+}
+
+void reply_state(Client* c)
+{
+    const Detector* d = &(c->inst->d);
+    ServiceState s = {
+        .periods = (uint32_t)d->counters.interrupts,
+        .current_tooth = d->current_tooth,
+        .has_sync = d->has_sync,
+        .confidence = d->confidence,
+        .sync_lost = (uint32_t)d->counters.sync_lost,
+    };
+
+    reply(c, SERVICE_STATE, &s, sizeof(s));
+}
+
+/* Open, create or reset the named instance; false to hang up */
+bool handle_open(Client* c, const uint8_t* payload, uint16_t len)
+{
+    ServiceOpen config;
+
+    if (len < sizeof(config))
+        return false;
+    memcpy(&config, payload, sizeof(config));
+
+    const uint8_t* tooth_dists = payload + sizeof(config);
+    size_t n = config.num_tooth_tips;
+
+    if (n == 0 || sizeof(config) + n > len)
+        return false;
+
+    size_t num_posns = 0;
+    for (size_t i = 0; i < n; i++)
+        num_posns += tooth_dists[i];
+
+    if (config.version != SERVICE_VERSION || num_posns == 0 || num_posns > DETECTOR_INDEX_MAX
+        || config.sig_window > DETECTOR_SIG_MAX_WINDOW)
+    {
+        reply_error(c, SERVICE_ERR_CONFIG);
+        return true;
+    }
+
+    /* Let go of whatever it had open, even if this fails */
+    if (c->inst != NULL)
+    {
+        c->inst->open = false;
+        c->inst = NULL;
+    }
+
+    char name[SERVICE_NAME_LEN + 1] = { 0 };
+    memcpy(name, config.name, SERVICE_NAME_LEN);
+
+    Instance* inst = find_instance(name);
+
+    if (inst == NULL)
+    {
+        inst = new_instance(&config, tooth_dists);
+        if (inst == NULL)
+        {
+            reply_error(c, SERVICE_ERR_FULL);
+            return true;
+        }
+    }
+    else if (inst->open)
+    {
+        reply_error(c, SERVICE_ERR_BUSY);
+        return true;
+    }
+    else if (inst->config.num_tooth_tips != n || memcmp(inst->tooth_dists, tooth_dists, n) != 0)
+    {
+        reply_error(c, SERVICE_ERR_MISMATCH);
+        return true;
+    }
+    else if (config.flags & SERVICE_OPEN_RESET)
+    {
+        ServiceOpen was = inst->config;
+
+        inst->config = config;
+        if (!setup_instance(inst))
+        {
+            inst->config = was;
+            setup_instance(inst);
+            reply_error(c, SERVICE_ERR_CONFIG);
+            return true;
+        }
+    }
+
+    inst->open = true;
+    c->inst = inst;
+    reply_state(c);
+
+    return true;
+}
+
+/* Act on one whole frame; false to hang up */
+bool handle_frame(Client* c, const ServiceFrame* f, uint8_t* payload)
+{
+    counters.frames++;
+
+    if (f->type == SERVICE_OPEN)
+    {
+        if (handle_open(c, payload, f->len))
+            return true;
+    }
+    else if (f->type == SERVICE_PERIODS)
+    {
+        if (c->inst == NULL)
+        {
+            reply_error(c, SERVICE_ERR_NOT_OPEN);
+            return true;
+        }
+
+        size_t count = f->len / sizeof(uint32_t);
+
+        detector_process_batch(&(c->inst->d), (uint32_t*)payload, count);
+        counters.periods += count;
+        reply_state(c);
+        return true;
+    }
+
+    reply_error(c, SERVICE_ERR_FRAME);
+    return false;
+}
+
+bool frame_ready(const Client* c)
+{
+    ServiceFrame f;
+
+    if (c->in_len < sizeof(f))
+        return false;
+    memcpy(&f, c->in, sizeof(f));
+    return c->in_len >= sizeof(f) + f.len;
+}
+
+/* Handle every whole frame read so far that there's room to answer; false to hang up */
+bool serve(Client* c)
+{
+    uint8_t* in = (uint8_t*)c->in;
+    size_t at = 0;
+    bool ok = true;
+
+    while (ok && c->in_len - at >= sizeof(ServiceFrame) && c->out_len + REPLY_MAX <= OUT_LEN)
+    {
+        ServiceFrame f;
+
+        memcpy(&f, &in[at], sizeof(f));
+        if (f.len % 4 != 0)
+        {
+            reply_error(c, SERVICE_ERR_FRAME);
+            ok = false;
+        }
+        else if (c->in_len - at < sizeof(f) + f.len)
+            break;
+        else
+        {
+            ok = handle_frame(c, &f, &in[at + sizeof(f)]);
+            at += sizeof(f) + f.len;
+        }
+    }
+
+    /* Frames are whole words, so what's left still starts on one */
+    memmove(in, &in[at], c->in_len - at);
+    c->in_len -= at;
+
+    return ok;
+}
+
+/* Send what it can of the answers; false if the client's gone */
+bool flush(Client* c)
+{
+    if (c->out_sent == c->out_len)
+        return true;
+
+    ssize_t sent = send(c->fd, &(c->out[c->out_sent]), c->out_len - c->out_sent, MSG_NOSIGNAL);
+
+    counters.writes++;
+    if (sent < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+
+    c->out_sent += (size_t)sent;
+    if (c->out_sent == c->out_len)
+    {
+        c->out_sent = 0;
+        c->out_len = 0;
+    }
+    return true;
+}
+
+/* Serve and flush until it's out of whole frames or the client isn't taking answers */
+bool pump(Client* c)
+{
+    for (;;)
+    {
+        bool ok = serve(c);
+
+        if (!flush(c) || !ok)
+            return false;
+        if (c->out_len > 0 || !frame_ready(c))
+            return true;
+    }
+}
+
+/* Watch for input while there's room for it, and for output while answers are waiting */
+void watch(Client* c)
+{
+    uint32_t events = 0;
+
+    if (c->in_len < IN_LEN)
+        events |= EPOLLIN;
+    if (c->out_len > 0)
+        events |= EPOLLOUT;
+
+    if (events != c->events)
+    {
+        struct epoll_event ev = { .events = events, .data.ptr = c };
+
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+}
+
+void drop(Client* c)
+{
+    if (c->inst != NULL)
+        c->inst->open = false;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = (argc > 1) ? argv[1] : SERVICE_DEFAULT_PATH;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event events[MAX_EVENTS];
+    struct sigaction sa = { .sa_handler = on_signal };
+
+    max_instances = (argc > 2) ? (size_t)atoi(argv[2]) : 64;
+    if (max_instances < 1 || strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "usage: localizerd [socket_path [max_instances]]\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    instances = calloc(max_instances, sizeof(*instances));
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    unlink(path);               /* a stale socket from a run that didn't clean up */
+    if (instances == NULL || listen_fd < 0
+        || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(listen_fd, SOMAXCONN) != 0
+        || fcntl(listen_fd, F_SETFL, O_NONBLOCK) != 0)
+    {
+        perror("localizerd: couldn't listen");
+        return 1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };     /* NULL is the listener */
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0)
+    {
+        perror("localizerd: epoll");
+        return 1;
+    }
+
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    printf("listening on %s\n", path);
+    fflush(stdout);
+
+    while (!stop)
+    {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("localizerd: epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            Client* c = events[i].data.ptr;
+
+            if (c == NULL)
+            {
+                int fd;
+
+                while ((fd = accept(listen_fd, NULL, NULL)) >= 0)
+                {
+                    c = malloc(sizeof(*c));
+                    ev = (struct epoll_event){ .events = EPOLLIN };
+                    if (c == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+                    {
+                        free(c);
+                        close(fd);
+                        continue;
+                    }
+                    *c = (Client){ .fd = fd, .events = EPOLLIN };
+                    ev.data.ptr = c;
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+                    {
+                        free(c);
+                        close(fd);
+                        continue;
+                    }
+                    counters.clients++;
+                }
+                continue;
+            }
+
+            bool ok = true;
+
+            if (events[i].events & EPOLLOUT)
+                ok = pump(c);
+
+            if (ok && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && c->in_len < IN_LEN)
+            {
+                ssize_t got = read(c->fd, (uint8_t*)c->in + c->in_len, IN_LEN - c->in_len);
+
+                counters.reads++;
+                if (got > 0)
+                {
+                    c->in_len += (size_t)got;
+                    ok = pump(c);
+                }
+                else if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                    ok = false;
+            }
+
+            if (ok)
+                watch(c);
+            else
+                drop(c);
+        }
+    }
+
+    printf("\n%" PRIu64 " clients, %" PRIu64 " frames, %" PRIu64 " periods, %.1f periods per read, %" PRIu64 " writes\n",
+           counters.clients, counters.frames, counters.periods,
+           counters.reads ? (double)counters.periods / counters.reads : 0.0, counters.writes);
+    for (size_t i = 0; i < max_instances; i++)
+    {
+        const Instance* inst = instances[i];
+
+        if (inst == NULL)
+            continue;
+        printf("%-*s %10" PRIu64 " periods, %-7s on tooth %3u, sync lost %" PRIu64 " times\n",
+               SERVICE_NAME_LEN, inst->name, inst->d.counters.interrupts,
+               inst->d.has_sync ? "sync" : "no sync", (unsigned)inst->d.current_tooth,
+               inst->d.counters.sync_lost);
+    }
+
+    close(listen_fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,210 @@
+/* Where a thread team starts paying for itself on the grid detector.
+ *
+ * usage: parallel_bench [threads [periods]]
+ *   threads - threads in the team, including the calling one (default: one per core online)
+ *   periods - periods run through each belief size (default 200)
+ *
+ * For each belief size, one detector updates serially and another shares its
+ * updates out among a team (see parallel.h), over the same simulated encoder
+ * periods. This reports each one's time per period, the largest difference
+ * between their beliefs and whether their sync decisions ever differed. Set
+ * ParallelTeam.min_bins to the smallest size with a speedup worth having.
+ *
+ * The serial update and each thread's share of a team's run the same passes
+ * over the belief, so any speedup is the threads'. Run it with one thread to
+ * see what the barriers alone cost.
+ *
+ * Beliefs of more than 65535 bins need 32-bit indices:
+ *   cc -std=c99 -O2 -I. -DDETECTOR_PARALLEL -DDETECTOR_INDEX_WIDTH=32 tools/parallel_bench.c parallel.c detector.c trace.c -lm -lpthread
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "detector.h"
+#include "parallel.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4
+#define SAMPLE_RATE     200000000   /* 200MHz, as in test_data.c */
+#define RPM             100
+#define JITTER          0.005       /* standard deviation of each period, as a fraction */
+#define RATIO_SIGMA     0.05        /* octaves */
+#define MAX_ACCEL       1e6
+#define ERROR_RATE      0.001
+#define SEED            12345
+#define WORTH_HAVING    1.25        /* least speedup we'd take a team for; timings wander by a few percent */
+
+
+/* Declarations */
+
+typedef struct {
+    double   serial_ns;         // per period
+    double   parallel_ns;
+    float    max_diff;          // largest difference between the two beliefs, after any period
+    size_t   disagreements;     // periods after which current_tooth or has_sync differed
+} ParallelResult;
+
+double now_seconds(void);
+double uniform(uint32_t* rng);
+bool bench_size(size_t n, size_t num_threads, size_t num_periods, ParallelResult* r);
+
+
+/* Definitions */
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* xorshift32, as in particle.c, scaled to [0, 1) */
+double uniform(uint32_t* rng)
+{
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 17;
+    *rng ^= *rng << 5;
+    return (*rng >> 8) * (1.0 / 16777216.0);
+}
+
+/* Run a serial and a parallel detector over n teeth, one of them with a gap before it */
+bool bench_size(size_t n, size_t num_threads, size_t num_periods, ParallelResult* r)
+{
+    uint8_t* tooth_dists = malloc(n);
+    float* serial_prob = malloc(n * sizeof(float));
+    float* parallel_prob = malloc(n * sizeof(float));
+    uint8_t* lik_class = malloc(n);
+    float* moved = malloc(n * sizeof(float));
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    ParallelSlice* slices = malloc(num_threads * sizeof(ParallelSlice));
+    float lik_lut[2][LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    Detector serial, parallel;
+    ParallelTeam team;
+    uint32_t rng = SEED;
+    bool ok = false;
+
+    if (tooth_dists != NULL && serial_prob != NULL && parallel_prob != NULL && lik_class != NULL
+        && moved != NULL && threads != NULL && slices != NULL)
+    {
+        for (size_t i = 0; i < n; i++)
+            tooth_dists[i] = 1;
+        tooth_dists[0] = 2;
+        size_t num_tooth_posns = count_tooth_posns(n, tooth_dists);
+
+        ok = detector_init(&serial, tooth_dists, n, num_tooth_posns, serial_prob, SAMPLE_RATE, MAX_ACCEL, ERROR_RATE)
+            && detector_init(&parallel, tooth_dists, n, num_tooth_posns, parallel_prob, SAMPLE_RATE, MAX_ACCEL, ERROR_RATE);
+        if (ok)
+        {
+            detector_init_lik_lut(&serial, lik_lut[0], LIK_MAX_CLASSES, lik_class, RATIO_SIGMA);
+            detector_init_lik_lut(&parallel, lik_lut[1], LIK_MAX_CLASSES, lik_class, RATIO_SIGMA);
+            ok = parallel_init(&team, &parallel, num_threads, threads, slices, moved);
+        }
+    }
+
+    if (ok)
+    {
+        double ticks_per_posn = (double)SAMPLE_RATE * 60.0 / RPM / (double)serial.num_tooth_posns;
+
+        team.min_bins = 0;      /* always, so there's something to compare */
+        *r = (ParallelResult){ 0.0, 0.0, 0.0, 0 };
+
+        /* Start a little before the gap, so both get sync part way through */
+        for (size_t t = 0; t < num_periods; t++)
+        {
+            size_t tooth = (n - num_periods / 2 + t) % n;
+            double jitter = 1.0 + JITTER * (2.0 * uniform(&rng) - 1.0) * 1.7320508;
+            uint32_t period = (uint32_t)(ticks_per_posn * tooth_dists[tooth] * jitter);
+
+            double t0 = now_seconds();
+            detector_interrupt(period, &serial);
+            double t1 = now_seconds();
+            detector_interrupt(period, &parallel);
+            double t2 = now_seconds();
+
+            r->serial_ns += (t1 - t0) * 1e9;
+            r->parallel_ns += (t2 - t1) * 1e9;
+
+            for (size_t i = 0; i < n; i++)
+            {
+                float diff = fabsf(serial_prob[i] - parallel_prob[i]);
+                if (diff > r->max_diff)
+                    r->max_diff = diff;
+            }
+            if (serial.has_sync != parallel.has_sync
+                || (serial.has_sync && serial.current_tooth != parallel.current_tooth))
+                r->disagreements++;
+        }
+        r->serial_ns /= num_periods;
+        r->parallel_ns /= num_periods;
+
+        parallel_shutdown(&team);
+    }
+
+    free(tooth_dists);
+    free(serial_prob);
+    free(parallel_prob);
+    free(lik_class);
+    free(moved);
+    free(threads);
+    free(slices);
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    static const size_t sizes[] = { 1024, 4096, 16384, 65536, 131072 };
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = (argc > 1) ? atoi(argv[1]) : (online > 1 ? (int)online : 2);
+    int num_periods = (argc > 2) ? atoi(argv[2]) : 200;
+    size_t pays = 0;
+
+    if (num_threads < 1 || num_periods < 2)
+    {
+        fprintf(stderr, "usage: parallel_bench [threads [periods]]\n");
+        return 1;
+    }
+
+    printf("%d threads on %ld cores, %d periods per size\n\n", num_threads, online, num_periods);
+    printf("%8s %12s %12s %8s %10s %10s\n", "bins", "serial ns", "parallel ns", "speedup", "max diff", "disagree");
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        ParallelResult r;
+
+        if (sizes[i] >= DETECTOR_INDEX_MAX)
+        {
+            printf("%8zu  (needs a wider DETECTOR_INDEX_WIDTH)\n", sizes[i]);
+            continue;
+        }
+        if (!bench_size(sizes[i], (size_t)num_threads, (size_t)num_periods, &r))
+        {
+            fprintf(stderr, "couldn't set up %zu bins\n", sizes[i]);
+            return 1;
+        }
+
+        printf("%8zu %12.0f %12.0f %7.2fx %10.2g %10zu\n", sizes[i], r.serial_ns, r.parallel_ns,
+               r.serial_ns / r.parallel_ns, r.max_diff, r.disagreements);
+        if (pays == 0 && r.serial_ns >= WORTH_HAVING * r.parallel_ns)
+            pays = sizes[i];
+    }
+
+    if (pays != 0)
+        printf("\nthe team is %.2fx faster from %zu bins (PARALLEL_DEFAULT_MIN_BINS is %d)\n",
+               WORTH_HAVING, pays, PARALLEL_DEFAULT_MIN_BINS);
+    else
+        printf("\nthe team is never %.2fx faster here (PARALLEL_DEFAULT_MIN_BINS is %d)\n",
+               WORTH_HAVING, PARALLEL_DEFAULT_MIN_BINS);
+
+    return 0;
+}
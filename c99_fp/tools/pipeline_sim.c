@@ -0,0 +1,215 @@
+/* Host simulation of the split ISR/consumer pipeline.
+ *
+ * A producer thread stands in for the capture ISR: it replays the test data
+ * against a simulated timer, pushing each period into the ring and asking for
+ * the fast-path tooth prediction straight after. A consumer thread drains the
+ * ring in batches. Afterwards we check the result against a plain
+ * single-threaded run over the same data: wherever both had sync at the end
+ * of a drain they must agree on the tooth, and without overruns the final
+ * state must match too.
+ *
+ * usage: pipeline_sim [speedup [capacity [max_batch]]]
+ *   speedup   - how many times faster than real time to replay (default 100)
+ *   capacity  - ring capacity, a power of two (default 64)
+ *   max_batch - most periods per drain (default 16)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "detector.h"
+#include "pipeline.h"
+#include "test_data.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4
+
+
+/* Declarations */
+
+typedef struct {
+    DetectorPipeline *p;
+    double   ns_per_tick;       // simulated timer period, already divided by the speedup
+    detector_index_t *ref_tooth; // tooth after each period in the reference run
+    bool     *ref_sync;         // sync after each period in the reference run
+    uint64_t predicted;         // fast-path predictions made while the reference had sync
+    uint64_t predicted_ok;      // ... that matched the reference
+    uint64_t push_ns_max;       // longest push + prediction, i.e. our stand-in ISR
+    uint64_t push_ns_total;
+    size_t   *log_index;        // index in the log of each period pushed, by head
+    uint64_t checked;           // drains that ended with both us and the reference synced
+    uint64_t checked_ok;        // ... on the same tooth
+    size_t   max_batch;         // most periods per drain
+    bool     done;              // set by the producer once everything is pushed
+} SimState;
+
+void* producer(void* arg);
+void* consumer(void* arg);
+uint64_t now_ns(void);
+void setup_detector(Detector* d, uint8_t tooth_dists[], size_t num_tooth_tips, float tooth_prob[],
+                    float lik_lut[], uint8_t lik_class[]);
+
+
+/* Definitions */
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void setup_detector(Detector* d, uint8_t tooth_dists[], size_t num_tooth_tips, float tooth_prob[],
+                    float lik_lut[], uint8_t lik_class[])
+{
+    detector_init(d, tooth_dists, num_tooth_tips, count_tooth_posns(num_tooth_tips, tooth_dists),
+                  tooth_prob, TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE);
+    detector_init_lik_lut(d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+}
+
+/* Stand-in for the capture ISR: wait out each period on the simulated timer, then push it */
+void* producer(void* arg)
+{
+    SimState* s = arg;
+    uint64_t deadline = now_ns();
+
+    for (size_t i = 0; i < num_sample_engine_ticks; i++)
+    {
+        /* Sleep rather than spin, so the consumer gets the CPU on a single core host */
+        deadline += (uint64_t)(sample_engine_ticks[i] * s->ns_per_tick);
+        struct timespec ts = { (time_t)(deadline / 1000000000u), (long)(deadline % 1000000000u) };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+        uint64_t t0 = now_ns();
+        detector_index_t tooth;
+        s->log_index[s->p->head] = i;   /* before the push publishes it */
+        pipeline_push(s->p, sample_engine_ticks[i]);
+        bool have = pipeline_predicted_tooth(s->p, &tooth);
+        uint64_t dt = now_ns() - t0;
+
+        s->push_ns_total += dt;
+        if (dt > s->push_ns_max)
+            s->push_ns_max = dt;
+
+        if (have && s->ref_sync[i])
+        {
+            s->predicted++;
+            if (tooth == s->ref_tooth[i])
+                s->predicted_ok++;
+        }
+    }
+
+    __atomic_store_n(&(s->done), true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void* consumer(void* arg)
+{
+    SimState* s = arg;
+
+    for (;;)
+    {
+        bool done = __atomic_load_n(&(s->done), __ATOMIC_ACQUIRE);   /* before draining, so nothing pushed before it is missed */
+
+        if (pipeline_drain(s->p, s->max_batch) == 0)
+        {
+            if (done)
+                break;
+            sched_yield();
+            continue;
+        }
+
+        /* Dropped periods don't shift the log under us, so whatever the
+         * overruns, a synced tooth must be the one the reference had */
+        size_t i = s->log_index[s->p->tail - 1];
+        if (s->p->d->has_sync && s->ref_sync[i])
+        {
+            s->checked++;
+            if (s->p->d->current_tooth == s->ref_tooth[i])
+                s->checked_ok++;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    double speedup = (argc > 1) ? atof(argv[1]) : 100.0;
+    size_t capacity = (argc > 2) ? (size_t)atol(argv[2]) : 64;
+    size_t max_batch = (argc > 3) ? (size_t)atol(argv[3]) : 16;
+
+    uint8_t tooth_dists[] = TEST_TOOTH_MAP;
+    const size_t num_tooth_tips = sizeof(tooth_dists)/sizeof(tooth_dists[0]);
+    float tooth_prob[num_tooth_tips];
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    uint8_t lik_class[num_tooth_tips];
+    uint32_t *ring = malloc(capacity * sizeof(uint32_t));
+    detector_index_t *ref_tooth = malloc(num_sample_engine_ticks * sizeof(*ref_tooth));
+    bool *ref_sync = malloc(num_sample_engine_ticks * sizeof(bool));
+    size_t *log_index = malloc(num_sample_engine_ticks * sizeof(*log_index));
+
+    Detector d;
+    DetectorPipeline p;
+
+    /* Reference: the detector run straight from the "ISR" */
+    setup_detector(&d, tooth_dists, num_tooth_tips, tooth_prob, lik_lut, lik_class);
+    for (size_t i = 0; i < num_sample_engine_ticks; i++)
+    {
+        detector_interrupt(sample_engine_ticks[i], &d);
+        ref_tooth[i] = d.current_tooth;
+        ref_sync[i] = d.has_sync;
+    }
+    detector_index_t ref_final_tooth = d.current_tooth;
+    bool ref_final_sync = d.has_sync;
+
+    setup_detector(&d, tooth_dists, num_tooth_tips, tooth_prob, lik_lut, lik_class);
+    if (!pipeline_init(&p, &d, ring, capacity))
+    {
+        fprintf(stderr, "capacity must be a power of two no larger than %d, and the wheel fit the fast path\n",
+                PIPELINE_MAX_CAPACITY);
+        return 1;
+    }
+
+    SimState s = { &p, 1e9 / TEST_SAMPLE_RATE / speedup, ref_tooth, ref_sync, 0, 0, 0, 0, log_index, 0, 0,
+                   max_batch, false };
+    pthread_t prod, cons;
+
+    pthread_create(&cons, NULL, consumer, &s);
+    pthread_create(&prod, NULL, producer, &s);
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+
+    printf("periods:            %zu\n", num_sample_engine_ticks);
+    printf("processed:          %" PRIu64 " in %" PRIu64 " batches (%.2f per batch)\n",
+           p.processed, p.batches, p.batches ? (double)p.processed / p.batches : 0.0);
+    printf("overruns:           %" PRIu32 "\n", p.overruns);
+    printf("ISR push+predict:   mean %.0f ns, max %" PRIu64 " ns\n",
+           (double)s.push_ns_total / num_sample_engine_ticks, s.push_ns_max);
+    printf("fast-path accuracy: %" PRIu64 " / %" PRIu64 " predictions matched the reference\n",
+           s.predicted_ok, s.predicted);
+    printf("drain accuracy:     %" PRIu64 " / %" PRIu64 " synced drains matched the reference\n",
+           s.checked_ok, s.checked);
+    printf("final state:        tooth %u sync %d (reference: tooth %u sync %d)\n",
+           d.current_tooth, d.has_sync, ref_final_tooth, ref_final_sync);
+
+    free(ring);
+    free(ref_tooth);
+    free(ref_sync);
+    free(log_index);
+
+    /* Dropped periods may leave us still earning sync back at the end, so
+     * with overruns we go by the drains alone */
+    bool ok = s.checked_ok == s.checked
+              && (p.overruns > 0 || (d.current_tooth == ref_final_tooth && d.has_sync == ref_final_sync));
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,233 @@
+/* Host simulation of the angle-domain scheduler against a known engine.
+ *
+ * The engine's crank angle is a closed-form function of time: a base speed,
+ * a steady acceleration and a once-per-revolution wobble. Tooth edges are
+ * found by solving for the time each tooth's angle is reached, and fed to the
+ * detector as periods of a simulated timer. Events are fired at their
+ * deadlines, and each firing is compared with the time the engine actually
+ * reached the event's angle.
+ *
+ * usage: sched_sim [rpm [accel [wobble [events]]]]
+ *   rpm    - starting engine speed (default 3000)
+ *   accel  - steady acceleration, rpm per second (default 2000)
+ *   wobble - once-per-revolution speed variation, fraction of speed (default 0.02)
+ *   events - number of evenly spaced events per revolution (default 4)
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "detector.h"
+#include "scheduler.h"
+#include "test_data.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4
+#define MAX_EVENTS      64
+#define NUM_TEETH_SIM   20000   /* teeth to simulate */
+#define TWO_PI          6.283185307179586
+
+
+/* Declarations */
+
+typedef struct {
+    double omega0;              // rad/s at t = 0
+    double alpha;               // rad/s^2
+    double wobble;              // amplitude of the once-per-revolution speed wobble, rad/s
+} Engine;
+
+double engine_angle(const Engine* e, double t);
+double engine_time_of_angle(const Engine* e, double angle, double t_guess);
+uint64_t now_ns(void);
+
+
+/* Definitions */
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Crank angle at time t. The wobble is in time rather than angle, which
+ * is near enough once per revolution for a test and keeps this integrable. */
+double engine_angle(const Engine* e, double t)
+{
+    double w = e->omega0 > 0 ? e->omega0 : 1.0;
+    return e->omega0 * t + 0.5 * e->alpha * t * t + e->wobble / w * (1.0 - cos(w * t));
+}
+
+/* Time at which the engine reaches an angle, by Newton's method from a guess
+ * not far before it */
+double engine_time_of_angle(const Engine* e, double angle, double t_guess)
+{
+    double t = t_guess;
+    double w = e->omega0 > 0 ? e->omega0 : 1.0;
+
+    for (int i = 0; i < 50; i++)
+    {
+        double err = engine_angle(e, t) - angle;
+        double omega = e->omega0 + e->alpha * t + e->wobble * sin(w * t);
+        double step = err / omega;
+        t -= step;
+        if (fabs(step) < 1e-12)
+            break;
+    }
+    return t;
+}
+
+int main(int argc, char** argv)
+{
+    double rpm = (argc > 1) ? atof(argv[1]) : 3000.0;
+    double accel_rpm = (argc > 2) ? atof(argv[2]) : 2000.0;
+    double wobble = (argc > 3) ? atof(argv[3]) : 0.02;
+    int num_events = (argc > 4) ? atoi(argv[4]) : 4;
+
+    if (rpm <= 0 || wobble < 0 || wobble >= 1)
+    {
+        fprintf(stderr, "rpm must be positive and wobble between 0 and 1\n");
+        return 1;
+    }
+    if (num_events < 1 || num_events > MAX_EVENTS)
+    {
+        fprintf(stderr, "events must be between 1 and %d\n", MAX_EVENTS);
+        return 1;
+    }
+
+    Engine engine = {
+        rpm * TWO_PI / 60.0,
+        accel_rpm * TWO_PI / 60.0,
+        wobble * rpm * TWO_PI / 60.0
+    };
+
+    uint8_t tooth_dists[] = TEST_TOOTH_MAP;
+    const size_t num_tooth_tips = sizeof(tooth_dists) / sizeof(tooth_dists[0]);
+    size_t num_tooth_posns = count_tooth_posns(num_tooth_tips, tooth_dists);
+    float tooth_prob[num_tooth_tips];
+    float tooth_angle[num_tooth_tips];
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    uint8_t lik_class[num_tooth_tips];
+    double f = (double)TEST_SAMPLE_RATE;
+
+    Detector d;
+    detector_init(&d, tooth_dists, num_tooth_tips, num_tooth_posns, tooth_prob,
+                  TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE);
+    detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+    detector_init_angle(&d, tooth_angle);
+
+    SchedEvent events[MAX_EVENTS];
+    uint16_t buckets[num_tooth_tips];
+    uint16_t heap[MAX_EVENTS];
+    detector_index_t posn_tooth[num_tooth_posns];
+    Scheduler s;
+
+    if (!scheduler_init(&s, &d, events, MAX_EVENTS, buckets, heap, posn_tooth, false))
+    {
+        fprintf(stderr, "scheduler_init failed\n");
+        return 1;
+    }
+
+    /* Offset the events from the teeth, so they fall between them */
+    double event_angle[MAX_EVENTS];
+    for (int i = 0; i < num_events; i++)
+    {
+        event_angle[i] = fmod(TWO_PI * i / num_events + 0.37 * TWO_PI / num_tooth_posns, TWO_PI);
+        scheduler_add(&s, (float)event_angle[i], (uint8_t)i);
+    }
+
+    uint32_t timer_base = 0xfff00000u;     /* wraps early on, on purpose */
+    bool clock_tied = false;
+    double t_prev = 0.0;
+    uint32_t capture_prev = timer_base;
+    uint64_t ticks_prev = 0;            /* capture_prev, unwrapped */
+    size_t teeth = 0;
+    uint64_t fired = 0;
+    double err_sum = 0, err_sq = 0, err_max = 0;
+    uint64_t tooth_ns_max = 0, tooth_ns_total = 0, expire_ns_max = 0, expire_ns_total = 0, expires = 0;
+
+    for (size_t k = 1; k <= NUM_TEETH_SIM; k++)
+    {
+        /* stop a decelerating engine before it turns backwards */
+        if (engine.omega0 + engine.alpha * t_prev <= 2.0 * engine.wobble)
+        {
+            printf("engine stalled after %zu teeth\n", teeth);
+            break;
+        }
+
+        size_t tooth = k % num_tooth_tips;
+        double angle = TWO_PI * (double)(k / num_tooth_tips) + (tooth ? tooth_angle[tooth] : 0.0);
+        double t = engine_time_of_angle(&engine, angle, t_prev);
+        uint32_t capture = timer_base + (uint32_t)llround(t * f);
+
+        /* fire whatever's due before this tooth, at its deadline */
+        uint32_t deadline;
+        while (scheduler_next_deadline(&s, &deadline) && (int32_t)(deadline - capture) < 0)
+        {
+            uint8_t channels[MAX_EVENTS];
+            uint64_t t0 = now_ns();
+            size_t n = scheduler_expire(&s, deadline, channels, MAX_EVENTS);
+            uint64_t dt = now_ns() - t0;
+
+            expire_ns_total += dt;
+            expire_ns_max = dt > expire_ns_max ? dt : expire_ns_max;
+            expires++;
+
+            /* deadlines are near the last capture; unwrap against it */
+            double t_fire = (double)(ticks_prev + (uint64_t)(int64_t)(int32_t)(deadline - capture_prev)) / f;
+            for (size_t i = 0; i < n; i++)
+            {
+                /* the crossing of the event's angle closest to the firing */
+                double rev = floor((engine_angle(&engine, t_fire) - event_angle[channels[i]]) / TWO_PI + 0.5);
+                double t_true = engine_time_of_angle(&engine, rev * TWO_PI + event_angle[channels[i]], t_fire);
+                double err = (t_fire - t_true) * 1e6;
+
+                fired++;
+                err_sum += err;
+                err_sq += err * err;
+                err_max = fabs(err) > err_max ? fabs(err) : err_max;
+            }
+        }
+
+        uint64_t t0 = now_ns();
+        detector_interrupt(capture - capture_prev, &d);
+        if (!clock_tied && d.has_sync)
+        {
+            detector_set_edge_time(&d, capture);
+            clock_tied = true;
+        }
+        scheduler_on_tooth(&s);
+        uint64_t dt = now_ns() - t0;
+
+        tooth_ns_total += dt;
+        tooth_ns_max = dt > tooth_ns_max ? dt : tooth_ns_max;
+        t_prev = t;
+        teeth++;
+        ticks_prev += capture - capture_prev;
+        capture_prev = capture;
+    }
+
+    double mean = fired ? err_sum / fired : 0.0;
+    double jitter = fired ? sqrt(err_sq / fired - mean * mean) : 0.0;
+    double end_rpm = (engine.omega0 + engine.alpha * t_prev) * 60.0 / TWO_PI;
+
+    printf("%zu-tooth wheel, %.0f to %.0f rpm over %.2f s, %d events per revolution\n",
+           num_tooth_tips, rpm, end_rpm, t_prev, num_events);
+    printf("fired:              %" PRIu64 "%s\n", fired, d.has_sync ? "" : " (no sync at the end)");
+    printf("timing error:       mean %+.3f us, jitter (sd) %.3f us, worst %.3f us\n", mean, jitter, err_max);
+    printf("  in crank angle:   worst %.4f deg at %.0f rpm\n", err_max * 1e-6 * end_rpm * 6.0, end_rpm);
+    printf("host cost per tooth (detector + scheduler): mean %.0f ns, worst %" PRIu64 " ns\n",
+           teeth ? (double)tooth_ns_total / teeth : 0.0, tooth_ns_max);
+    printf("host cost per expiry:                        mean %.0f ns, worst %" PRIu64 " ns\n",
+           expires ? (double)expire_ns_total / expires : 0.0, expire_ns_max);
+
+    return 0;
+}
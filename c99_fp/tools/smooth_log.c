@@ -0,0 +1,187 @@
+/* Label a whole log of periods offline with the smoother (see smoother.h).
+ *
+ * usage: smooth_log [periods.txt|- [block_len]]
+ *   periods.txt - periods as handed to detector_interrupt, whitespace
+ *                 separated; - reads stdin, and with no file the built-in
+ *                 test dataset is used
+ *   block_len   - samples per checkpointed block (default sqrt of the log length)
+ *
+ * Writes one CSV line per period: its label, the smoothed probability of it,
+ * the anomaly flags, and what the live detector made of the same period, for
+ * comparison. A summary goes to stderr.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "detector.h"
+#include "smoother.h"
+#include "test_data.h"
+
+
+/* Macros */
+
+#define LIK_MAX_CLASSES 4   /* as in main.c */
+
+
+/* Declarations */
+
+uint32_t* read_periods(FILE* f, size_t* count);
+double now_seconds(void);
+
+
+/* Definitions */
+
+uint32_t* read_periods(FILE* f, size_t* count)
+{
+    size_t cap = 4096, n = 0;
+    uint32_t* periods = malloc(cap * sizeof(*periods));
+    unsigned long v;
+
+    while (periods != NULL && fscanf(f, "%lu", &v) == 1)
+    {
+        if (n == cap)
+        {
+            cap *= 2;
+            uint32_t* grown = realloc(periods, cap * sizeof(*periods));
+            if (grown == NULL)
+            {
+                free(periods);
+                return NULL;
+            }
+            periods = grown;
+        }
+        periods[n++] = (uint32_t)v;
+    }
+
+    *count = n;
+    return periods;
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv)
+{
+    uint32_t* periods;
+    size_t count;
+
+    if (argc > 1)
+    {
+        FILE* f = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "r");
+        if (f == NULL)
+        {
+            perror(argv[1]);
+            return 1;
+        }
+        periods = read_periods(f, &count);
+        if (f != stdin)
+            fclose(f);
+    }
+    else
+    {
+        count = num_sample_engine_ticks;
+        periods = malloc(count * sizeof(*periods));
+        if (periods != NULL)
+            memcpy(periods, sample_engine_ticks, count * sizeof(*periods));
+    }
+
+    if (periods == NULL || count == 0)
+    {
+        fprintf(stderr, "no periods to smooth\n");
+        return 1;
+    }
+
+    size_t block_len = (argc > 2) ? (size_t)atol(argv[2]) : (size_t)ceil(sqrt((double)count));
+    if (block_len == 0)
+        block_len = 1;
+    size_t num_checkpoints = (count + block_len - 1) / block_len;
+
+    uint8_t tooth_dists[] = TEST_TOOTH_MAP;
+    const size_t num_tooth_tips = sizeof(tooth_dists) / sizeof(tooth_dists[0]);
+    size_t num_tooth_posns = count_tooth_posns(num_tooth_tips, tooth_dists);
+    float tooth_prob[num_tooth_tips];
+    float lik_lut[LIK_MAX_CLASSES * DETECTOR_LIK_BINS];
+    uint8_t lik_class[num_tooth_tips];
+
+    Detector d;
+    detector_init(&d, tooth_dists, num_tooth_tips, num_tooth_posns, tooth_prob,
+                  TEST_SAMPLE_RATE, TEST_MAX_ACCEL, TEST_ERROR_RATE);
+    detector_init_lik_lut(&d, lik_lut, LIK_MAX_CLASSES, lik_class, TEST_RATIO_SIGMA);
+
+    float* checkpoints = malloc(2 * num_checkpoints * num_tooth_tips * sizeof(float));
+    float* block = malloc(block_len * num_tooth_tips * sizeof(float));
+    uint8_t* steps = malloc(block_len * num_tooth_tips);
+    detector_index_t* label = malloc(count * sizeof(*label));
+    uint8_t* flags = malloc(count);
+    float* label_prob = malloc(count * sizeof(float));
+
+    if (checkpoints == NULL || block == NULL || steps == NULL || label == NULL || flags == NULL || label_prob == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    Smoother s;
+    if (!smoother_init(&s, &d, checkpoints, num_checkpoints, block, steps, block_len))
+    {
+        fprintf(stderr, "smoother_init failed\n");
+        return 1;
+    }
+
+    double t0 = now_seconds();
+    smoother_run(&s, periods, count, label, flags, label_prob);
+    double elapsed = now_seconds() - t0;
+
+    /* The live detector, over the same log, from the same model */
+    size_t flagged[4] = { 0 }, anomalies = 0, synced = 0, agreed = 0;
+
+    printf("sample,period,tooth,prob,flags,online_tooth,online_sync\n");
+    for (size_t t = 0; t < count; t++)
+    {
+        detector_interrupt(periods[t], &d);
+
+        for (size_t b = 0; b < 4; b++)
+            if (flags[t] & (1u << b))
+                flagged[b]++;
+        if (flags[t] != 0)
+            anomalies++;
+        if (d.has_sync)
+        {
+            synced++;
+            if (d.current_tooth == label[t])
+                agreed++;
+        }
+
+        printf("%zu,%" PRIu32 ",%u,%.4f,%s%s%s%s,%u,%d\n",
+               t, periods[t], label[t], label_prob[t],
+               (flags[t] & SMOOTHER_MISSED)   ? "M" : "",
+               (flags[t] & SMOOTHER_EXTRA)    ? "E" : "",
+               (flags[t] & SMOOTHER_UNSURE)   ? "U" : "",
+               (flags[t] & SMOOTHER_DISAGREE) ? "D" : "",
+               d.current_tooth, d.has_sync);
+    }
+
+    size_t bytes = (2 * num_checkpoints + block_len) * num_tooth_tips * sizeof(float) + block_len * num_tooth_tips;
+    size_t naive = count * num_tooth_tips * (2 * sizeof(float) + 1);
+
+    fprintf(stderr, "%zu periods, %zu-tooth wheel, %zu blocks of %zu\n", count, num_tooth_tips, num_checkpoints, block_len);
+    fprintf(stderr, "smoothed in %.3f s (%.0f ns per period), working memory %zu bytes (%zu without checkpointing)\n",
+            elapsed, elapsed * 1e9 / count, bytes, naive);
+    fprintf(stderr, "anomalies: %zu (missed %zu, extra %zu, unsure %zu, disagree %zu)\n",
+            anomalies, flagged[0], flagged[1], flagged[2], flagged[3]);
+    fprintf(stderr, "live detector agreed on %zu of the %zu periods it had sync for\n", agreed, synced);
+
+    return 0;
+}
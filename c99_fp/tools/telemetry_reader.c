@@ -0,0 +1,135 @@
+/* Attach to a detector telemetry segment and print what's in it.
+ *
+ * usage: telemetry_reader [shm_name [interval_ms [count]]]
+ *   shm_name    - segment to attach to (default /localizer)
+ *   interval_ms - time between dumps (default 100)
+ *   count       - number of dumps, 0 for forever (default 0)
+ *
+ * The reader maps the segment read-only and never writes to it, so the
+ * producer doesn't know or care how many of these are running. A slot that
+ * stays mid-update, because its producer died while writing it, is reported
+ * as stale rather than waited on.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "detector.h"
+#include "telemetry.h"
+
+
+/* Macros */
+
+#define READ_RETRIES 1000       /* attempts at a slot before calling it stale */
+
+
+/* Declarations */
+
+bool read_slot(const TelemetrySlot* s, TelemetrySlot* copy);
+void print_slot(const TelemetrySlot* s);
+
+
+/* Definitions */
+
+/* Copy a slot under its sequence lock; false if it's mid-update, try again */
+bool read_slot(const TelemetrySlot* s, TelemetrySlot* copy)
+{
+    uint32_t before = __atomic_load_n(&(s->seq), __ATOMIC_ACQUIRE);
+
+    if (before & 1)
+        return false;
+
+    memcpy(copy, s, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&(s->seq), __ATOMIC_RELAXED) == before;
+}
+
+void print_slot(const TelemetrySlot* s)
+{
+    static const char shades[] = " .:-=+*#%@";
+
+    printf("%-*s #%-8" PRIu32 " tooth %3" PRIu32 "/%-3" PRIu32 " %-7s conf %.3f vel %8.2f rad/s |",
+           TELEMETRY_NAME_LEN, s->name, s->updates, s->current_tooth, s->num_tooth_tips,
+           s->has_sync ? "sync" : "no sync", s->confidence, s->velocity);
+
+    /* one character per downsampled bin, darker is more likely */
+    for (uint16_t i = 0; i < s->belief_len && i < TELEMETRY_BELIEF_BINS; i++)
+    {
+        float p = s->belief[i];
+        int shade = (int)(p * (sizeof(shades) - 2) + 0.5f);
+        if (shade < 0)
+            shade = 0;
+        if (shade > (int)sizeof(shades) - 2)
+            shade = sizeof(shades) - 2;
+        putchar(shades[shade]);
+    }
+    printf("|\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* shm_name = (argc > 1) ? argv[1] : "/localizer";
+    long interval_ms = (argc > 2) ? atol(argv[2]) : 100;
+    long count = (argc > 3) ? atol(argv[3]) : 0;
+    struct stat st;
+
+    int fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TelemetryHeader))
+    {
+        fprintf(stderr, "can't open telemetry segment %s\n", shm_name);
+        return 1;
+    }
+
+    const void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    const TelemetryHeader* h = base;
+    if (__atomic_load_n(&(h->magic), __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC
+            || h->version != TELEMETRY_VERSION
+            || h->slot_size != sizeof(TelemetrySlot)
+            || h->header_size + (size_t)h->num_slots * h->slot_size > (size_t)st.st_size)
+    {
+        fprintf(stderr, "%s isn't a version %d telemetry segment\n", shm_name, TELEMETRY_VERSION);
+        return 1;
+    }
+
+    const TelemetrySlot* slots = (const TelemetrySlot*)((const char*)base + h->header_size);
+    struct timespec pause = { interval_ms / 1000, (interval_ms % 1000) * 1000000L };
+
+    for (long n = 0; count == 0 || n < count; n++)
+    {
+        for (uint32_t i = 0; i < h->num_slots; i++)
+        {
+            TelemetrySlot copy;
+            int tries = 0;
+
+            while (!read_slot(&slots[i], &copy) && ++tries < READ_RETRIES)
+                ;
+            if (tries == READ_RETRIES)
+                printf("slot %" PRIu32 " stale, stuck mid-update\n", i);
+            else if (copy.name[0] != '\0')
+                print_slot(&copy);
+        }
+        printf("\n");
+        fflush(stdout);
+        nanosleep(&pause, NULL);
+    }
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+/* Decode a trace dump (see trace.h) into CSV or a heatmap.
+ *
+ * usage: trace_decode dump.bin [csv|heatmap [last_seconds]]
+ *   csv          - one line per record (the default)
+ *   heatmap      - a PGM image of the belief after each localization, one
+ *                  row per tooth event, one column per bin, darker is likelier
+ *   last_seconds - only decode the last this-many seconds of the dump
+ *
+ * Records carry periods, not absolute times, so time is reconstructed by
+ * adding up the periods from the start of the dump.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+
+/* Declarations */
+
+const char* type_name(uint8_t type);
+float belief_bin(const uint8_t* payload, uint8_t flags, size_t i);
+
+
+/* Definitions */
+
+const char* type_name(uint8_t type)
+{
+    switch (type)
+    {
+        case TRACE_PERIOD:        return "period";
+        case TRACE_BELIEF_MOVE:   return "belief_move";
+        case TRACE_BELIEF_LOCATE: return "belief_locate";
+        case TRACE_DECISION:      return "decision";
+        case TRACE_RELOCALIZE:    return "relocalize";
+        default:                  return "unknown";
+    }
+}
+
+float belief_bin(const uint8_t* payload, uint8_t flags, size_t i)
+{
+    float p;
+
+    if (flags & TRACE_FLAG_QUANTIZED)
+        return payload[i] / 255.0f;
+
+    memcpy(&p, &payload[i * sizeof(float)], sizeof(p));
+    return p;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s dump.bin [csv|heatmap [last_seconds]]\n", argv[0]);
+        return 1;
+    }
+
+    bool heatmap = (argc > 2) && strcmp(argv[2], "heatmap") == 0;
+    double last_seconds = (argc > 3) ? atof(argv[3]) : 0.0;
+
+    FILE* f = fopen(argv[1], "rb");
+    if (f == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    TraceDumpHeader h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC || h.version != TRACE_VERSION)
+    {
+        fprintf(stderr, "%s isn't a version %d trace dump from a machine of this byte order\n",
+                argv[1], TRACE_VERSION);
+        return 1;
+    }
+
+    uint8_t* records = malloc(h.length);
+    if (records == NULL || fread(records, 1, h.length, f) != h.length)
+    {
+        fprintf(stderr, "%s is truncated\n", argv[1]);
+        return 1;
+    }
+    fclose(f);
+
+    /* First pass: total time covered, to find where the last N seconds start */
+    uint64_t total_ticks = 0;
+    size_t rows = 0;
+    for (size_t pos = 0; pos + sizeof(TraceRecordHeader) <= h.length; )
+    {
+        TraceRecordHeader r;
+        memcpy(&r, &records[pos], sizeof(r));
+        if (r.type == TRACE_PERIOD)
+            total_ticks += r.timer;
+        pos += sizeof(r) + r.len;
+    }
+
+    uint64_t start_ticks = 0;
+    if (last_seconds > 0 && last_seconds * h.ticks_per_sec < total_ticks)
+        start_ticks = total_ticks - (uint64_t)(last_seconds * h.ticks_per_sec);
+
+    /* Heatmaps need the row count up front for the PGM header */
+    if (heatmap)
+    {
+        uint64_t ticks = 0;
+        for (size_t pos = 0; pos + sizeof(TraceRecordHeader) <= h.length; )
+        {
+            TraceRecordHeader r;
+            memcpy(&r, &records[pos], sizeof(r));
+            if (r.type == TRACE_PERIOD)
+                ticks += r.timer;
+            if (r.type == TRACE_BELIEF_LOCATE && ticks >= start_ticks)
+                rows++;
+            pos += sizeof(r) + r.len;
+        }
+        printf("P2\n# belief after localization, one row per tooth\n%" PRIu32 " %zu\n255\n", h.num_tooth_tips, rows);
+    }
+    else
+    {
+        printf("# %" PRIu32 " records dropped before this dump\n", h.dropped);
+        printf("time_s,type,period,tooth,has_sync,confidence,sync_llr,acceleration,belief...\n");
+    }
+
+    uint64_t ticks = 0;
+    for (size_t pos = 0; pos + sizeof(TraceRecordHeader) <= h.length; )
+    {
+        TraceRecordHeader r;
+        memcpy(&r, &records[pos], sizeof(r));
+        const uint8_t* payload = &records[pos + sizeof(r)];
+        size_t bins = (r.flags & TRACE_FLAG_QUANTIZED) ? r.len : r.len / sizeof(float);
+        pos += sizeof(r) + r.len;
+
+        if (r.type == TRACE_PERIOD)
+            ticks += r.timer;
+        if (ticks < start_ticks)
+            continue;
+
+        if (heatmap)
+        {
+            if (r.type != TRACE_BELIEF_LOCATE)
+                continue;
+            for (size_t i = 0; i < bins; i++)
+                printf("%d ", 255 - (int)(belief_bin(payload, r.flags, i) * 255.0f + 0.5f));
+            printf("\n");
+            continue;
+        }
+
+        printf("%.6f,%s,%" PRIu32, (double)ticks / h.ticks_per_sec, type_name(r.type), r.timer);
+
+        if (r.type == TRACE_DECISION && r.len >= sizeof(TraceDecision))
+        {
+            TraceDecision dec;
+            memcpy(&dec, payload, sizeof(dec));
+            printf(",%" PRIu32 ",%u,%f,%f,%f", dec.current_tooth, dec.has_sync, dec.confidence,
+                   dec.sync_llr, dec.acceleration);
+        }
+        else if (r.type == TRACE_BELIEF_MOVE || r.type == TRACE_BELIEF_LOCATE)
+        {
+            printf(",,,,,");
+            for (size_t i = 0; i < bins; i++)
+                printf(",%f", belief_bin(payload, r.flags, i));
+        }
+        printf("\n");
+    }
+
+    free(records);
+    return 0;
+}
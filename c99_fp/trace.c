@@ -0,0 +1,262 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "trace.h"
+
+
+/* Declarations */
+
+void
+trace_init(
+        TraceRing* r,
+        uint8_t buf[const],
+        const size_t size,
+        const uint8_t belief_mode
+        );
+
+void
+trace_record(
+        TraceRing* r,
+        const uint8_t type,
+        const uint8_t flags,
+        const void* payload,
+        const size_t len
+        );
+
+void
+trace_belief(
+        TraceRing* r,
+        const uint8_t type,
+        float belief[const],
+        const size_t num_bins
+        );
+
+size_t
+trace_dump(
+        const TraceRing* r,
+        const uint32_t num_tooth_tips,
+        const uint32_t ticks_per_sec,
+        uint8_t out[],
+        const size_t out_size
+        );
+
+void
+ring_write(
+        TraceRing* r,
+        const void* data,
+        const size_t len
+        );
+
+void
+ring_read(
+        const TraceRing* r,
+        const size_t pos,
+        void* data,
+        const size_t len
+        );
+
+
+/* Definitions */
+
+/*
+ * void trace_init - set up a trace ring
+ *
+ * arguments: TraceRing* r         - the ring
+ *            uint8_t buf[]        - storage for records
+ *            size_t size          - bytes in buf
+ *            uint8_t belief_mode  - TRACE_BELIEF_NONE, _QUANTIZED or _FULL
+ * returns: nothing
+ * side-effects: modifies *r
+ *
+ * A quantized belief costs one byte per bin instead of four, which for a
+ * 36-1 wheel is the difference between ~50 and ~150 bytes per tooth.
+ */
+
+void
+trace_init(
+        TraceRing* r,
+        uint8_t buf[const],
+        const size_t size,
+        const uint8_t belief_mode
+        )
+{
+    r->buf = buf;
+    r->size = size;
+    r->head = 0;
+    r->tail = 0;
+    r->dropped = 0;
+    r->timer = 0;
+    r->belief_mode = belief_mode;
+
+    return;
+}
+
+/*
+ * void ring_write - copy bytes in at the head, wrapping as needed
+ */
+
+void
+ring_write(
+        TraceRing* r,
+        const void* data,
+        const size_t len
+        )
+{
+    size_t at = r->head % r->size;
+    size_t first = (len < r->size - at) ? len : r->size - at;
+
+    memcpy(&(r->buf[at]), data, first);
+    memcpy(r->buf, (const uint8_t*)data + first, len - first);
+    r->head += len;
+
+    return;
+}
+
+/*
+ * void ring_read - copy bytes out from an absolute position, wrapping as needed
+ */
+
+void
+ring_read(
+        const TraceRing* r,
+        const size_t pos,
+        void* data,
+        const size_t len
+        )
+{
+    size_t at = pos % r->size;
+    size_t first = (len < r->size - at) ? len : r->size - at;
+
+    memcpy(data, &(r->buf[at]), first);
+    memcpy((uint8_t*)data + first, r->buf, len - first);
+
+    return;
+}
+
+/*
+ * void trace_record - append a record
+ *
+ * arguments: TraceRing* r   - the ring
+ *            uint8_t type   - TRACE_* record type
+ *            uint8_t flags  - TRACE_FLAG_* bits
+ *            void* payload  - record payload
+ *            size_t len     - bytes of payload
+ * returns: nothing
+ * side-effects: modifies *r, dropping the oldest records if there's no room
+ *
+ * Records too big to ever fit, in the ring or in a header's len, are dropped
+ * on the floor (and counted).
+ */
+
+void
+trace_record(
+        TraceRing* r,
+        const uint8_t type,
+        const uint8_t flags,
+        const void* payload,
+        const size_t len
+        )
+{
+    TraceRecordHeader h = { type, flags, (uint16_t)len, r->timer };
+    size_t total = sizeof(h) + len;
+
+    if (len > UINT16_MAX || total > r->size)
+    {
+        r->dropped++;
+        return;
+    }
+
+    while (r->head + total - r->tail > r->size)
+    {
+        TraceRecordHeader oldest;
+        ring_read(r, r->tail, &oldest, sizeof(oldest));
+        r->tail += sizeof(oldest) + oldest.len;
+        r->dropped++;
+    }
+
+    ring_write(r, &h, sizeof(h));
+    ring_write(r, payload, len);
+
+    return;
+}
+
+/*
+ * void trace_belief - append a belief record
+ *
+ * arguments: TraceRing* r     - the ring
+ *            uint8_t type     - TRACE_BELIEF_MOVE or TRACE_BELIEF_LOCATE
+ *            float belief[]   - the belief
+ *            size_t num_bins  - number of bins in it
+ * returns: nothing
+ * side-effects: modifies *r
+ */
+
+void
+trace_belief(
+        TraceRing* r,
+        const uint8_t type,
+        float belief[const],
+        const size_t num_bins
+        )
+{
+    if (r->belief_mode == TRACE_BELIEF_FULL)
+    {
+        trace_record(r, type, 0, belief, num_bins * sizeof(float));
+    }
+    else if (r->belief_mode == TRACE_BELIEF_QUANTIZED)
+    {
+        uint8_t q[num_bins];
+
+        for (size_t i = 0; i < num_bins; i++)
+            q[i] = (uint8_t)(belief[i] * 255.0f + 0.5f);
+        trace_record(r, type, TRACE_FLAG_QUANTIZED, q, num_bins);
+    }
+
+    return;
+}
+
+/*
+ * size_t trace_dump - copy out a dump of the ring
+ *
+ * arguments: TraceRing* r             - the ring
+ *            uint32_t num_tooth_tips  - for the decoder's benefit
+ *            uint32_t ticks_per_sec   - ditto, so it can work in seconds
+ *            uint8_t out[]            - where to put the dump
+ *            size_t out_size          - bytes available at out
+ * returns: bytes written, or 0 if out is too small to hold the whole dump
+ * side-effects: modifies the data at *out
+ *
+ * The dump is a TraceDumpHeader followed by the records, oldest first. The
+ * ring itself is left alone, so tracing can carry on afterwards.
+ */
+
+size_t
+trace_dump(
+        const TraceRing* r,
+        const uint32_t num_tooth_tips,
+        const uint32_t ticks_per_sec,
+        uint8_t out[],
+        const size_t out_size
+        )
+{
+    TraceDumpHeader h;
+    size_t length = r->head - r->tail;
+
+    if (out_size < sizeof(h) + length)
+        return 0;
+
+    h.magic = TRACE_MAGIC;
+    h.version = TRACE_VERSION;
+    h.reserved = 0;
+    h.num_tooth_tips = num_tooth_tips;
+    h.ticks_per_sec = ticks_per_sec;
+    h.dropped = r->dropped;
+    h.length = length;
+
+    memcpy(out, &h, sizeof(h));
+    ring_read(r, r->tail, &(out[sizeof(h)]), length);
+
+    return sizeof(h) + length;
+}
@@ -0,0 +1,97 @@
+/* Low-overhead binary tracing into a fixed-size ring buffer.
+ *
+ * Records are appended back to back, each a TraceRecordHeader followed by
+ * `len` bytes of payload. When the ring is full the oldest records are
+ * dropped to make room, so it always holds the most recent history. Dump it
+ * with trace_dump and turn the dump into CSV or a heatmap offline with
+ * tools/trace_decode. */
+
+#define TRACE_MAGIC    0x52544c4du  /* "MLTR" in the dumping machine's byte order */
+#define TRACE_VERSION  2
+
+/* Record types */
+#define TRACE_PERIOD        1       /* timer value handed to detector_interrupt; no payload */
+#define TRACE_BELIEF_MOVE   2       /* belief after detector_move */
+#define TRACE_BELIEF_LOCATE 3       /* belief after localization */
+#define TRACE_DECISION      4       /* TraceDecision payload */
+#define TRACE_RELOCALIZE    5       /* history replayed after sync loss; no payload */
+
+/* Record flags */
+#define TRACE_FLAG_QUANTIZED 0x01   /* belief payload is one byte per bin, p * 255, not floats */
+
+/* How much of the belief to record */
+#define TRACE_BELIEF_NONE      0
+#define TRACE_BELIEF_QUANTIZED 1
+#define TRACE_BELIEF_FULL      2
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  flags;
+    uint16_t len;               // payload bytes following this header
+    uint32_t timer;             // the period being processed when the record was made
+} TraceRecordHeader;
+
+typedef struct {
+    float    acceleration;      // Detector.last_acceleration
+    float    sync_llr;          // Detector.sync_llr
+    float    confidence;
+    uint32_t current_tooth;
+    uint8_t  has_sync;
+    uint8_t  reserved[3];
+} TraceDecision;
+
+/* Start of a dump, followed by the records oldest first */
+typedef struct {
+    uint32_t magic;             // TRACE_MAGIC
+    uint16_t version;           // TRACE_VERSION
+    uint16_t reserved;
+    uint32_t num_tooth_tips;
+    uint32_t ticks_per_sec;
+    uint32_t dropped;           // records overwritten, or too big to record, before the dump
+    uint32_t length;            // bytes of records following this header
+} TraceDumpHeader;
+
+typedef struct TraceRing {
+    uint8_t  *buf;              // storage for records
+    size_t   size;              // bytes in buf
+    size_t   head;              // total bytes ever written; head % size is where the next one goes
+    size_t   tail;              // total bytes ever dropped; tail % size is the oldest record
+    uint32_t dropped;           // number of records dropped to make room, or too big to record
+    uint32_t timer;             // period currently being processed, stamped on every record
+    uint8_t  belief_mode;       // TRACE_BELIEF_*
+} TraceRing;
+
+
+/* Set up a trace ring in caller-provided storage */
+void
+trace_init(
+        TraceRing* r,
+        uint8_t buf[const],
+        const size_t size,
+        const uint8_t belief_mode);
+
+/* Append a record */
+void
+trace_record(
+        TraceRing* r,
+        const uint8_t type,
+        const uint8_t flags,
+        const void* payload,
+        const size_t len);
+
+/* Append a belief record, quantized or not according to the ring's belief_mode */
+void
+trace_belief(
+        TraceRing* r,
+        const uint8_t type,
+        float belief[const],
+        const size_t num_bins);
+
+/* Copy out a dump of the ring, oldest record first */
+size_t
+trace_dump(
+        const TraceRing* r,
+        const uint32_t num_tooth_tips,
+        const uint32_t ticks_per_sec,
+        uint8_t out[],
+        const size_t out_size);